@@ -0,0 +1,78 @@
+#pragma once
+
+#include "BHand/BHand.h"
+
+// Motion numbers of the BHand library the program is linked with.
+//
+// include/BHand/BHand.h declares the Windows libraries (lib/BHand/*.lib, *.dll).
+// The Linux libBHand.so in lib/BHand/LinuxGraspingLibrary_AllegroHand.tar is an
+// older BHand: it has no gravity compensation, MOVE_OBJ or FINGERTIP_MOVING,
+// and numbers the other motions without GRAVITY_COMP. The program keeps the
+// numbering of include/BHand/BHand.h everywhere (keys, rPanelManipulator,
+// telemetry, captures) and translates it when it hands a motion to BHand.
+// On Linux, gravity compensation runs BHand's NONE and the whole gravity
+// term comes from Gravity.h.
+
+// eMotionType of the Linux libBHand.so, as the header in the tar declares it
+enum eLinuxMotionType
+{
+	eLinuxMotionType_NONE,
+	eLinuxMotionType_HOME,
+	eLinuxMotionType_READY,
+	eLinuxMotionType_PRE_SHAPE,
+	eLinuxMotionType_GRASP_3,
+	eLinuxMotionType_GRASP_4,
+	eLinuxMotionType_PINCH_IT,
+	eLinuxMotionType_PINCH_MT,
+	eLinuxMotionType_OBJECT_MOVING,
+	eLinuxMotionType_ENVELOP,
+	eLinuxMotionType_JOINT_PD,
+	NUMBER_OF_LINUX_MOTION_TYPE
+};
+
+#define BHAND_STATIC_CHECK(name, cond)	typedef char name[(cond) ? 1 : -1]
+
+// include/BHand/BHand.h must be the in-tree header. Extracting the Linux tar
+// into include/ replaces it with one whose numbers differ (see README).
+BHAND_STATIC_CHECK(BHandHeaderIsInTree, NUMBER_OF_MOTION_TYPE == 14 && eMotionType_GRAVITY_COMP == 3);
+// The motions both libraries have keep their order; only GRAVITY_COMP is
+// inserted, and the three the Linux library lacks follow JOINT_PD.
+BHAND_STATIC_CHECK(BHandMotionsBeforeGravityAgree,
+	eMotionType_NONE == (int)eLinuxMotionType_NONE && eMotionType_HOME == (int)eLinuxMotionType_HOME &&
+	eMotionType_READY == (int)eLinuxMotionType_READY);
+BHAND_STATIC_CHECK(BHandMotionsAfterGravityAgree,
+	eMotionType_PRE_SHAPE == eLinuxMotionType_PRE_SHAPE+1 && eMotionType_GRASP_3 == eLinuxMotionType_GRASP_3+1 &&
+	eMotionType_GRASP_4 == eLinuxMotionType_GRASP_4+1 && eMotionType_PINCH_IT == eLinuxMotionType_PINCH_IT+1 &&
+	eMotionType_PINCH_MT == eLinuxMotionType_PINCH_MT+1 && eMotionType_OBJECT_MOVING == eLinuxMotionType_OBJECT_MOVING+1 &&
+	eMotionType_ENVELOP == eLinuxMotionType_ENVELOP+1 && eMotionType_JOINT_PD == eLinuxMotionType_JOINT_PD+1 &&
+	eMotionType_MOVE_OBJ == NUMBER_OF_LINUX_MOTION_TYPE+1);
+
+#ifdef _WIN32
+#define BHAND_GRAVITY_COMP	1 // BHand's GRAVITY_COMP holds the fingers on an upright palm
+#else
+#define BHAND_GRAVITY_COMP	0 // the Linux library has none
+#endif
+
+// eMotionType of include/BHand/BHand.h -> the number the linked library takes
+inline int BHandMotionType(int motionType)
+{
+#ifdef _WIN32
+	return motionType;
+#else
+	switch (motionType)
+	{
+	case eMotionType_NONE:           return eLinuxMotionType_NONE;
+	case eMotionType_HOME:           return eLinuxMotionType_HOME;
+	case eMotionType_READY:          return eLinuxMotionType_READY;
+	case eMotionType_PRE_SHAPE:      return eLinuxMotionType_PRE_SHAPE;
+	case eMotionType_GRASP_3:        return eLinuxMotionType_GRASP_3;
+	case eMotionType_GRASP_4:        return eLinuxMotionType_GRASP_4;
+	case eMotionType_PINCH_IT:       return eLinuxMotionType_PINCH_IT;
+	case eMotionType_PINCH_MT:       return eLinuxMotionType_PINCH_MT;
+	case eMotionType_OBJECT_MOVING:  return eLinuxMotionType_OBJECT_MOVING;
+	case eMotionType_ENVELOP:        return eLinuxMotionType_ENVELOP;
+	case eMotionType_JOINT_PD:       return eLinuxMotionType_JOINT_PD;
+	}
+	return eLinuxMotionType_NONE; // GRAVITY_COMP (Gravity.h adds it), MOVE_OBJ, FINGERTIP_MOVING
+#endif
+}
@@ -0,0 +1,693 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "canAPI.h"
+#include "canCodec.h"
+#include "HighResTimer.h"
+#include "JointConversion.h"
+#include "KinematicsBatch.h"
+#include "Gravity.h"
+#include "BHand/BHand.h"
+#include "BHandMotion.h"
+#include "Benchmark.h"
+
+#define BENCH_FRAMES	1024  // frames in the input buffer, cycled through
+#define BENCH_TIME		0.5   // sec, shortest run of each case
+
+// Calls run(n) with growing n until it takes BENCH_TIME and returns nsec per
+// operation. run() returns a checksum of its results so the compiler cannot
+// drop the work; it is the same for every call with the same n.
+static double TimeCase(unsigned int (*run)(int n), unsigned int* checksum)
+{
+	double t0, t;
+	int n = BENCH_FRAMES;
+
+	*checksum = run(BENCH_FRAMES); // warm up the caches
+	for (;;)
+	{
+		t0 = GetHighResTime();
+		run(n);
+		t = GetHighResTime() - t0;
+		if (t >= BENCH_TIME || n >= (1 << 30) / 2)
+			break;
+		n *= 2;
+	}
+	return t * 1e9 / n;
+}
+
+static void PrintHeader(const char* title, const char* before, const char* after)
+{
+	printf("%-24s %11s  %11s\n", title, before, after);
+}
+
+static void PrintCase(const char* name, unsigned int (*before)(int), unsigned int (*after)(int))
+{
+	unsigned int sumBefore, sumAfter;
+	double nsBefore = TimeCase(before, &sumBefore);
+	double nsAfter = TimeCase(after, &sumAfter);
+
+	printf("  %-22s %8.2f ns  %8.2f ns  %5.2fx  %s\n", name, nsBefore, nsAfter,
+		(nsAfter > 0.0 ? nsBefore / nsAfter : 0.0), (sumBefore == sumAfter ? "ok" : "RESULTS DIFFER"));
+}
+
+// Largest deviation from the double precision model the runs since the last
+// reset saw. The model cases check every configuration in their first pass.
+static double benchError;
+
+static void PrintModelCase(const char* name, unsigned int (*before)(int), unsigned int (*after)(int),
+	double tolerance, double scale, const char* unit)
+{
+	unsigned int sumBefore, sumAfter;
+	double nsBefore, nsAfter, errBefore, errAfter;
+
+	benchError = 0.0;
+	nsBefore = TimeCase(before, &sumBefore);
+	errBefore = benchError;
+	benchError = 0.0;
+	nsAfter = TimeCase(after, &sumAfter);
+	errAfter = benchError;
+
+	printf("  %-22s %8.2f ns  %8.2f ns  %5.2fx  %s, max error %.3f / %.3f %s\n", name, nsBefore, nsAfter,
+		(nsAfter > 0.0 ? nsBefore / nsAfter : 0.0), (errBefore < tolerance && errAfter < tolerance ? "ok" : "RESULTS DIFFER"),
+		errBefore * scale, errAfter * scale, unit);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Frame codec (canCodec.h) against the shift-and-switch code it replaced
+
+// Traffic of a control cycle: four encoder frames, the AHRS pose and
+// acceleration, and now and then a QUERY_ID reply.
+static can_msg rxFrames[BENCH_FRAMES];
+static short txPwm[BENCH_FRAMES][4];
+static can_msg txFrames[4];
+
+static void InitCodecFrames()
+{
+	unsigned int seed = 12345;
+
+	for (int i=0; i<BENCH_FRAMES; i++)
+	{
+		can_msg* msg = &rxFrames[i];
+		int k = i % 6;
+
+		if (k < 4)
+			can_frame_init(msg, CAN_HAND_ID(ID_CMD_QUERY_CONTROL_DATA, ID_DEVICE_SUB_01 + k), 8);
+		else if (i % 97 == 0)
+			can_frame_init(msg, CAN_HAND_ID(ID_CMD_QUERY_ID, ID_COMMON), 8);
+		else
+			can_frame_init(msg, CAN_HAND_ID(k == 4 ? ID_CMD_AHRS_POSE : ID_CMD_AHRS_ACC, ID_COMMON), 6);
+		for (int j=0; j<8; j++)
+		{
+			seed = seed * 1103515245 + 12345;
+			msg->data[j] = (char)(seed >> 16);
+		}
+		for (int j=0; j<4; j++)
+		{
+			seed = seed * 1103515245 + 12345;
+			txPwm[i][j] = (short)(seed >> 16);
+		}
+	}
+}
+
+static unsigned int DecodeShiftSwitch(int n)
+{
+	unsigned int sum = 0;
+	unsigned char data[8];
+	char id_cmd, id_des, id_src;
+	int len;
+
+	for (int i=0; i<n; i++)
+	{
+		const can_msg* msg = &rxFrames[i & (BENCH_FRAMES-1)];
+
+		// get_message_wait()
+		id_cmd = (char)( (msg->msg_id >> 6) & 0x1f );
+		id_des = (char)( (msg->msg_id >> 3) & 0x07 );
+		id_src = (char)( msg->msg_id & 0x07 );
+		len = msg->data_length;
+		memcpy(data, msg->data, msg->data_length);
+
+		// the receive thread
+		switch (id_cmd)
+		{
+		case ID_CMD_QUERY_ID:
+			sum += (data[2] | (data[3] << 8)) + (data[4] | (data[5] << 8)) + data[7];
+			break;
+		case ID_CMD_AHRS_POSE:
+		case ID_CMD_AHRS_ACC:
+		case ID_CMD_AHRS_GYRO:
+		case ID_CMD_AHRS_MAG:
+			for (int j=0; j<3; j++)
+				sum += (unsigned short)(short)((data[j*2] << 8) | data[j*2+1]);
+			break;
+		case ID_CMD_QUERY_CONTROL_DATA:
+			if (id_src >= ID_DEVICE_SUB_01 && id_src <= ID_DEVICE_SUB_04)
+			{
+				for (int j=0; j<4; j++)
+					sum += (unsigned int)(data[j*2] | (data[j*2+1] << 8)) * (id_src - ID_DEVICE_SUB_01 + 1);
+			}
+			break;
+		}
+		sum += id_des + len;
+	}
+	return sum;
+}
+
+static unsigned int DecodeCodec(int n)
+{
+	unsigned int sum = 0;
+	CanFrameInfo f;
+
+	for (int i=0; i<n; i++)
+	{
+		const can_msg* msg = &rxFrames[i & (BENCH_FRAMES-1)];
+
+		can_decode(msg, &f);
+		switch (f.payload)
+		{
+		case CAN_PAYLOAD_ID:
+			sum += f.u.id.revision + f.u.id.firmware + f.u.id.hardwareType;
+			break;
+		case CAN_PAYLOAD_AHRS:
+			for (int j=0; j<3; j++)
+				sum += (unsigned short)f.u.ahrs[j];
+			break;
+		case CAN_PAYLOAD_ENCODER:
+			for (int j=0; j<4; j++)
+				sum += (unsigned int)f.u.enc[j] * (f.index + 1);
+			break;
+		}
+		sum += f.des + msg->data_length;
+	}
+	return sum;
+}
+
+static unsigned int FrameSum(const can_msg* msg)
+{
+	unsigned int sum = msg->msg_id + msg->data_length;
+	for (int j=0; j<8; j++)
+		sum = sum*31 + (unsigned char)msg->data[j];
+	return sum;
+}
+
+static unsigned int EncodeShiftSwitch(int n)
+{
+	unsigned int sum = 0;
+
+	for (int i=0; i<n; i++)
+	{
+		can_msg* msg = &txFrames[i & 3];
+		const short* pwm = txPwm[i & (BENCH_FRAMES-1)];
+
+		// setFrame() and setTorqueFrame()
+		msg->STD_EXT = STD;
+		msg->msg_id = ((unsigned long)(ID_CMD_SET_TORQUE_1 + (i & 3))<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
+		msg->data_length = 8;
+		for (int j = 0; j < 4; j++)
+		{
+			msg->data[2*j]   = (char)( (pwm[j] >> 8) & 0x00ff);
+			msg->data[2*j+1] = (char)(pwm[j] & 0x00ff);
+		}
+		if ((i & 3) == 3)
+		{
+			for (int k=0; k<4; k++)
+				sum += FrameSum(&txFrames[k]);
+		}
+	}
+	return sum;
+}
+
+static unsigned int EncodeCodec(int n)
+{
+	unsigned int sum = 0;
+
+	for (int i=0; i<n; i++)
+	{
+		can_msg* msg = &txFrames[i & 3];
+
+		can_frame_init(msg, CAN_HOST_ID(ID_CMD_SET_TORQUE_1 + (i & 3)), 8);
+		can_pack_pwm(msg->data, txPwm[i & (BENCH_FRAMES-1)]);
+		if ((i & 3) == 3)
+		{
+			for (int k=0; k<4; k++)
+				sum += FrameSum(&txFrames[k]);
+		}
+	}
+	return sum;
+}
+
+static void BenchCodec()
+{
+	InitCodecFrames();
+	PrintHeader("CAN frame codec", "shift/switch", "canCodec");
+	PrintCase("decode rx frame", DecodeShiftSwitch, DecodeCodec);
+	PrintCase("encode torque frame", EncodeShiftSwitch, EncodeCodec);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Per-cycle joint conversions (JointConversion.h) against the loops they replaced
+
+// parameters of a v2 hand, which has mixed directions
+static const int BENCH_HAND_VERSION = 2;
+static const bool BENCH_DC_24V = false;
+static const double bench_tau_cov_const_v2 = 800.0;
+static const double bench_tau_cov_const_v3 = 1200.0;
+static const short bench_pwm_max_DC8V = 800;
+static const short bench_pwm_max_DC24V = 500;
+static const double bench_enc_dir[MAX_DOF] = {
+	1.0, -1.0, 1.0, 1.0,
+	1.0, -1.0, 1.0, 1.0,
+	1.0, -1.0, 1.0, 1.0,
+	1.0, 1.0, -1.0, -1.0
+};
+static const double bench_motor_dir[MAX_DOF] = {
+	1.0, 1.0, 1.0, 1.0,
+	1.0, -1.0, -1.0, 1.0,
+	-1.0, 1.0, 1.0, 1.0,
+	1.0, 1.0, 1.0, 1.0
+};
+static const int bench_enc_offset[MAX_DOF] = {
+	-391, -64387, -129, 532,
+	178, -66030, -142, 547,
+	-234, -64916, 7317, 1923,
+	1124, -1319, -65983, -65566
+};
+
+#define BENCH_SETS	64 // encoder sets / torque vectors cycled through
+
+static JointConversion benchConversion;
+static int benchEnc[BENCH_SETS][MAX_DOF];
+static double benchTau[BENCH_SETS][MAX_DOF];
+
+static void InitJointSets()
+{
+	unsigned int seed = 4321;
+
+	JointConversionInit(&benchConversion, bench_enc_dir, bench_enc_offset, bench_motor_dir,
+		bench_tau_cov_const_v2, (BENCH_DC_24V ? bench_pwm_max_DC24V : bench_pwm_max_DC8V));
+	for (int k=0; k<BENCH_SETS; k++)
+	{
+		for (int i=0; i<MAX_DOF; i++)
+		{
+			seed = seed * 1103515245 + 12345;
+			benchEnc[k][i] = (int)((seed >> 8) & 0xffff);
+			seed = seed * 1103515245 + 12345;
+			benchTau[k][i] = ((double)((seed >> 8) & 0xffff) / 65535.0 - 0.5) * 3.0; // +-1.5, some clamped
+		}
+	}
+}
+
+// The kernel folds direction, offset and scale into one multiply and one
+// subtraction, so angles are compared to 1 nrad.
+static unsigned int AngleSum(const double* q)
+{
+	unsigned int sum = 0;
+	for (int i=0; i<MAX_DOF; i++)
+	{
+		double v = q[i] * 1e9;
+		sum = sum*31 + (unsigned int)(long long)(v + (v >= 0.0 ? 0.5 : -0.5));
+	}
+	return sum;
+}
+
+static unsigned int PwmSum(const short* pwm)
+{
+	unsigned int sum = 0;
+	for (int i=0; i<MAX_DOF; i++)
+		sum = sum*31 + (unsigned short)pwm[i];
+	return sum;
+}
+
+static unsigned int AngleLoop(int n)
+{
+	unsigned int sum = 0;
+	double q[MAX_DOF];
+
+	for (int k=0; k<n; k++)
+	{
+		const int* enc = benchEnc[k & (BENCH_SETS-1)];
+		for (int i=0; i<MAX_DOF; i++)
+			q[i] = (double)(enc[i]*bench_enc_dir[i]-32768-bench_enc_offset[i])*(333.3/65536.0)*(3.141592/180.0);
+		if ((k & (BENCH_SETS-1)) == 0)
+			sum += AngleSum(q);
+	}
+	return sum;
+}
+
+static unsigned int AngleKernel(int n)
+{
+	unsigned int sum = 0;
+	double q[MAX_DOF];
+
+	for (int k=0; k<n; k++)
+	{
+		EncoderToAngle(&benchConversion, benchEnc[k & (BENCH_SETS-1)], q);
+		if ((k & (BENCH_SETS-1)) == 0)
+			sum += AngleSum(q);
+	}
+	return sum;
+}
+
+static unsigned int PwmLoop(int n)
+{
+	unsigned int sum = 0;
+	double cur_des[MAX_DOF];
+	short pwm_demand[MAX_DOF];
+
+	for (int k=0; k<n; k++)
+	{
+		const double* tau_des = benchTau[k & (BENCH_SETS-1)];
+		int i;
+
+		for (i=0; i<MAX_DOF; i++)
+		{
+			cur_des[i] = tau_des[i] * bench_motor_dir[i];
+			if (cur_des[i] > 1.0) cur_des[i] = 1.0;
+			else if (cur_des[i] < -1.0) cur_des[i] = -1.0;
+		}
+		for (i=0; i<4; i++)
+		{
+			switch (BENCH_HAND_VERSION)
+			{
+				case 1:
+				case 2:
+					pwm_demand[i*4+3] = (short)(cur_des[i*4+0]*bench_tau_cov_const_v2);
+					pwm_demand[i*4+2] = (short)(cur_des[i*4+1]*bench_tau_cov_const_v2);
+					pwm_demand[i*4+1] = (short)(cur_des[i*4+2]*bench_tau_cov_const_v2);
+					pwm_demand[i*4+0] = (short)(cur_des[i*4+3]*bench_tau_cov_const_v2);
+					break;
+				case 3:
+				default:
+					pwm_demand[i*4+3] = (short)(cur_des[i*4+0]*bench_tau_cov_const_v3);
+					pwm_demand[i*4+2] = (short)(cur_des[i*4+1]*bench_tau_cov_const_v3);
+					pwm_demand[i*4+1] = (short)(cur_des[i*4+2]*bench_tau_cov_const_v3);
+					pwm_demand[i*4+0] = (short)(cur_des[i*4+3]*bench_tau_cov_const_v3);
+					break;
+			}
+			if (BENCH_DC_24V) {
+				for (int j=0; j<4; j++) {
+					if (pwm_demand[i*4+j] > bench_pwm_max_DC24V) pwm_demand[i*4+j] = bench_pwm_max_DC24V;
+					else if (pwm_demand[i*4+j] < -bench_pwm_max_DC24V) pwm_demand[i*4+j] = -bench_pwm_max_DC24V;
+				}
+			}
+			else {
+				for (int j=0; j<4; j++) {
+					if (pwm_demand[i*4+j] > bench_pwm_max_DC8V) pwm_demand[i*4+j] = bench_pwm_max_DC8V;
+					else if (pwm_demand[i*4+j] < -bench_pwm_max_DC8V) pwm_demand[i*4+j] = -bench_pwm_max_DC8V;
+				}
+			}
+		}
+		if ((k & (BENCH_SETS-1)) == 0)
+			sum += PwmSum(pwm_demand);
+	}
+	return sum;
+}
+
+static unsigned int PwmKernel(int n)
+{
+	unsigned int sum = 0;
+	short pwm_demand[MAX_DOF];
+
+	for (int k=0; k<n; k++)
+	{
+		TorqueToPwm(&benchConversion, benchTau[k & (BENCH_SETS-1)], pwm_demand);
+		if ((k & (BENCH_SETS-1)) == 0)
+			sum += PwmSum(pwm_demand);
+	}
+	return sum;
+}
+
+static unsigned int PwmScalar(int n)
+{
+	unsigned int sum = 0;
+	short pwm_demand[MAX_DOF];
+
+	for (int k=0; k<n; k++)
+	{
+		TorqueToPwmScalar(&benchConversion, benchTau[k & (BENCH_SETS-1)], pwm_demand);
+		if ((k & (BENCH_SETS-1)) == 0)
+			sum += PwmSum(pwm_demand);
+	}
+	return sum;
+}
+
+static void BenchJointConversion()
+{
+	char kernel[32];
+
+	InitJointSets();
+	sprintf(kernel, "%s kernel", JointConversionKernel());
+	PrintHeader("Joint conversion, 16 DOF", "loop", kernel);
+	PrintCase("encoder to angle", AngleLoop, AngleKernel);
+	PrintCase("torque to PWM", PwmLoop, PwmKernel);
+	PrintHeader("", "scalar table", kernel);
+	PrintCase("torque to PWM", PwmScalar, PwmKernel);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Fingertip kinematics (Kinematics.h) against BHand, which solves them in
+// UpdateControl() together with the rest of the controller
+
+static BHand* benchBHand;
+static KinematicsModel benchModel;
+static double benchQ[BENCH_SETS][MAX_DOF];
+static HandKinematics benchTips[BENCH_SETS]; // double precision model
+
+static void InitKinematicsSets()
+{
+	unsigned int seed = 2468;
+
+	benchBHand = bhCreateRightHand();
+	benchBHand->SetTimeInterval(0.003);
+	benchBHand->SetMotionType(BHandMotionType(eMotionType_NONE));
+	KinematicsInit(&benchModel, false);
+	for (int k=0; k<BENCH_SETS; k++)
+	{
+		for (int i=0; i<MAX_DOF; i++)
+		{
+			seed = seed * 1103515245 + 12345;
+			benchQ[k][i] = ((double)((seed >> 8) & 0xffff) / 65535.0 - 0.5) * 3.0; // +-1.5 rad
+		}
+		SolveKinematicsScalar(&benchModel, benchQ[k], &benchTips[k]);
+	}
+}
+
+#define TIP_TOLERANCE	1e-6 // m, the SIMD kernel computes in single precision
+
+// Counts the fingertips within TIP_TOLERANCE of the double precision model
+// and keeps the largest deviation in benchError.
+static unsigned int TipSum(int set, const double* x, const double* y, const double* z)
+{
+	const HandKinematics* ref = &benchTips[set];
+	unsigned int sum = 0;
+	for (int f=0; f<KIN_FINGERS; f++)
+	{
+		double err = fabs(x[f] - ref->x[f]);
+		if (fabs(y[f] - ref->y[f]) > err) err = fabs(y[f] - ref->y[f]);
+		if (fabs(z[f] - ref->z[f]) > err) err = fabs(z[f] - ref->z[f]);
+		if (err > benchError)
+			benchError = err;
+		if (err < TIP_TOLERANCE)
+			sum++;
+	}
+	return sum;
+}
+
+static unsigned int TipsBHand(int n)
+{
+	unsigned int sum = 0;
+	double x[KIN_FINGERS], y[KIN_FINGERS], z[KIN_FINGERS];
+
+	for (int k=0; k<n; k++)
+	{
+		benchBHand->SetJointPosition(benchQ[k & (BENCH_SETS-1)]);
+		benchBHand->UpdateControl(0);
+		benchBHand->GetFKResult(x, y, z);
+		if (k < BENCH_SETS || (k & (BENCH_SETS-1)) == 0)
+			sum += TipSum(k & (BENCH_SETS-1), x, y, z);
+	}
+	return sum;
+}
+
+static unsigned int TipsKernel(int n)
+{
+	unsigned int sum = 0;
+	HandKinematics tips;
+
+	for (int k=0; k<n; k++)
+	{
+		SolveKinematics(&benchModel, benchQ[k & (BENCH_SETS-1)], &tips);
+		if (k < BENCH_SETS || (k & (BENCH_SETS-1)) == 0)
+			sum += TipSum(k & (BENCH_SETS-1), tips.x, tips.y, tips.z);
+	}
+	return sum;
+}
+
+static unsigned int TipsScalar(int n)
+{
+	unsigned int sum = 0;
+	HandKinematics tips;
+
+	for (int k=0; k<n; k++)
+	{
+		SolveKinematicsScalar(&benchModel, benchQ[k & (BENCH_SETS-1)], &tips);
+		if (k < BENCH_SETS || (k & (BENCH_SETS-1)) == 0)
+			sum += TipSum(k & (BENCH_SETS-1), tips.x, tips.y, tips.z);
+	}
+	return sum;
+}
+
+// Offline sets: the configurations above repeated, result k is checked against set k % BENCH_SETS
+#define BENCH_BATCH	16384
+
+static KinematicsPool benchPool;
+static float* benchBatchQ;
+static float* benchBatchTips;
+static float* benchBatchJ;
+
+static unsigned int BatchSum(int n, const float* tips)
+{
+	unsigned int sum = 0;
+	for (int k=0; k<n; k += (k < BENCH_SETS ? 1 : BENCH_SETS))
+	{
+		double x[KIN_FINGERS], y[KIN_FINGERS], z[KIN_FINGERS];
+		for (int f=0; f<KIN_FINGERS; f++)
+		{
+			x[f] = tips[(k*KIN_FINGERS + f)*3 + 0];
+			y[f] = tips[(k*KIN_FINGERS + f)*3 + 1];
+			z[f] = tips[(k*KIN_FINGERS + f)*3 + 2];
+		}
+		sum += TipSum(k & (BENCH_SETS-1), x, y, z);
+	}
+	return sum;
+}
+
+static unsigned int BatchRun(int n, KinematicsPool* pool)
+{
+	unsigned int sum = 0;
+
+	for (int k=0; k<n; k+=BENCH_BATCH)
+	{
+		int count = (n - k < BENCH_BATCH ? n - k : BENCH_BATCH);
+		SolveKinematicsBatch(pool, &benchModel, benchBatchQ, count, benchBatchTips, benchBatchJ);
+		sum += BatchSum(count, benchBatchTips);
+	}
+	return sum;
+}
+
+static unsigned int TipsBlock(int n)
+{
+	return BatchRun(n, NULL);
+}
+
+static unsigned int TipsPool(int n)
+{
+	return BatchRun(n, &benchPool);
+}
+
+static void BenchKinematics()
+{
+	char kernel[32];
+
+	InitKinematicsSets();
+	sprintf(kernel, "%s kernel", KinematicsKernel());
+	PrintHeader("Fingertip kinematics", "BHand", kernel);
+	PrintModelCase("4 fingertips", TipsBHand, TipsKernel, TIP_TOLERANCE, 1e6, "um");
+	PrintHeader("", "scalar", kernel);
+	PrintModelCase("tips, J and R", TipsScalar, TipsKernel, TIP_TOLERANCE, 1e6, "um");
+
+	benchBatchQ = new float[BENCH_BATCH*MAX_DOF];
+	benchBatchTips = new float[BENCH_BATCH*KIN_FINGERS*3];
+	benchBatchJ = new float[BENCH_BATCH*KIN_BATCH_J];
+	for (int k=0; k<BENCH_BATCH; k++)
+		for (int i=0; i<MAX_DOF; i++)
+			benchBatchQ[k*MAX_DOF + i] = (float)benchQ[k & (BENCH_SETS-1)][i];
+	KinematicsPoolStart(&benchPool, 0);
+	sprintf(kernel, "%d thread%s", KinematicsPoolThreads(&benchPool), (KinematicsPoolThreads(&benchPool) > 1 ? "s" : ""));
+	PrintHeader("Batch kinematics", "BHand", kernel);
+	PrintModelCase("tips and J", TipsBHand, TipsPool, TIP_TOLERANCE, 1e6, "um");
+	PrintHeader("", "hand kernel", "batch kernel");
+	PrintModelCase("tips and J", TipsKernel, TipsBlock, TIP_TOLERANCE, 1e6, "um");
+	KinematicsPoolStop(&benchPool);
+	delete[] benchBatchQ;
+	delete[] benchBatchTips;
+	delete[] benchBatchJ;
+
+	delete benchBHand;
+	benchBHand = NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Gravity term (Gravity.h) on a tilted palm, over the configurations above
+
+static GravityModel benchGravity;
+static double benchUp[3];
+static double benchGravityTau[BENCH_SETS][MAX_DOF]; // double precision model
+
+#define TORQUE_TOLERANCE	1e-6 // Nm
+
+// Counts the torques within TORQUE_TOLERANCE of the double precision model
+// and keeps the largest deviation in benchError.
+static unsigned int TorqueSum(int set, const double* tau)
+{
+	unsigned int sum = 0;
+	for (int i=0; i<MAX_DOF; i++)
+	{
+		double err = fabs(tau[i] - benchGravityTau[set][i]);
+		if (err > benchError)
+			benchError = err;
+		if (err < TORQUE_TOLERANCE)
+			sum++;
+	}
+	return sum;
+}
+
+static unsigned int GravityKernel(int n)
+{
+	unsigned int sum = 0;
+	double tau[MAX_DOF];
+
+	for (int k=0; k<n; k++)
+	{
+		SolveGravity(&benchGravity, benchQ[k & (BENCH_SETS-1)], benchUp, tau);
+		if (k < BENCH_SETS || (k & (BENCH_SETS-1)) == 0)
+			sum += TorqueSum(k & (BENCH_SETS-1), tau);
+	}
+	return sum;
+}
+
+static unsigned int GravityScalar(int n)
+{
+	unsigned int sum = 0;
+	double tau[MAX_DOF];
+
+	for (int k=0; k<n; k++)
+	{
+		SolveGravityScalar(&benchGravity, benchQ[k & (BENCH_SETS-1)], benchUp, tau);
+		if (k < BENCH_SETS || (k & (BENCH_SETS-1)) == 0)
+			sum += TorqueSum(k & (BENCH_SETS-1), tau);
+	}
+	return sum;
+}
+
+static void BenchGravity()
+{
+	char kernel[32];
+
+	GravityInit(&benchGravity, false);
+	GravityUpFromPose(0.5, -0.3, benchUp);
+	for (int k=0; k<BENCH_SETS; k++)
+		SolveGravityScalar(&benchGravity, benchQ[k], benchUp, benchGravityTau[k]);
+	sprintf(kernel, "%s kernel", KinematicsKernel());
+	PrintHeader("Gravity term", "scalar", kernel);
+	PrintModelCase("16 torques", GravityScalar, GravityKernel, TORQUE_TOLERANCE, 1e6, "uNm");
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+void RunBenchmarks()
+{
+	BenchCodec();
+	BenchJointConversion();
+	BenchKinematics();
+	BenchGravity();
+}
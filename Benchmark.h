@@ -0,0 +1,7 @@
+#pragma once
+
+// Micro-benchmarks of the per-frame and per-cycle code paths (--bench).
+// Every case runs the current implementation next to the one it replaced
+// on the same input, prints the time per operation of both and checks
+// that they produce the same result.
+void RunBenchmarks();
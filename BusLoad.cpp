@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include "canDef.h"
+#include "BusLoad.h"
+
+// Frames exchanged every control period: one encoder frame from each finger
+// board and one torque frame to each. AHRS streams are 6-byte frames.
+static const int FRAMES_PER_CYCLE = 4 + 4;
+static const int CONTROL_DLC = 8;
+static const int AHRS_DLC = 6;
+
+int CanFrameBits(int dlc, bool worstCase)
+{
+	// SOF, 11-bit ID, RTR, IDE, r0, DLC, data and 15-bit CRC are subject to
+	// bit stuffing (34 + 8*dlc bits). CRC delimiter, ACK, EOF and the
+	// interframe space add 13 bits that are never stuffed.
+	int stuffed = 34 + 8*dlc;
+	int bits = stuffed + 13;
+	if (worstCase)
+		bits += (stuffed - 1) / 4;
+	return bits;
+}
+
+double AhrsRateHz(unsigned char rate)
+{
+	switch (rate)
+	{
+	case AHRS_RATE_1Hz: return 1.0;
+	case AHRS_RATE_10Hz: return 10.0;
+	case AHRS_RATE_20Hz: return 20.0;
+	case AHRS_RATE_50Hz: return 50.0;
+	case AHRS_RATE_100Hz: return 100.0;
+	}
+	return 0.0;
+}
+
+int AhrsRateFromHz(double hz)
+{
+	for (int rate = AHRS_RATE_1Hz; rate <= AHRS_RATE_100Hz; rate++)
+		if (AhrsRateHz((unsigned char)rate) == hz) return rate;
+	return -1;
+}
+
+double ControlBusLoad(int period_msec, unsigned char ahrsRate, unsigned char ahrsMask, bool worstCase)
+{
+	double bitsPerSec;
+	int streams = 0;
+
+	for (int m = AHRS_MASK_POSE; m <= AHRS_MASK_MAG; m <<= 1)
+		if (ahrsMask & m) streams++;
+
+	bitsPerSec = FRAMES_PER_CYCLE * CanFrameBits(CONTROL_DLC, worstCase) * (1000.0 / period_msec);
+	bitsPerSec += streams * AhrsRateHz(ahrsRate) * CanFrameBits(AHRS_DLC, worstCase);
+	return bitsPerSec / CAN_BITRATE;
+}
+
+// the gaps between the four torque frames keep the bus from being used by us
+static double TxGapLoad(int period_msec, double txGapUsec)
+{
+	return 3 * txGapUsec * 1e-3 / period_msec;
+}
+
+bool PlanAhrsRate(int period_msec, unsigned char maxRate, unsigned char ahrsMask, double txGapUsec, double ceiling, unsigned char* rate)
+{
+	*rate = maxRate;
+	if (period_msec < 1 || period_msec > 255)
+		return true; // CheckBusLoad() refuses it
+	double gaps = TxGapLoad(period_msec, txGapUsec);
+
+	// the rates are numbered from the slowest up
+	for (int r = maxRate; r >= AHRS_RATE_1Hz; r--)
+	{
+		*rate = (unsigned char)r;
+		if (ControlBusLoad(period_msec, *rate, ahrsMask, true) + gaps <= ceiling)
+			return true;
+	}
+	return false;
+}
+
+double MeasuredBusLoad(unsigned int controlFrames, unsigned int ahrsFrames, double seconds, bool worstCase)
+{
+	if (seconds <= 0.0)
+		return 0.0;
+	double bits = (double)controlFrames * CanFrameBits(CONTROL_DLC, worstCase) + (double)ahrsFrames * CanFrameBits(AHRS_DLC, worstCase);
+	return bits / seconds / CAN_BITRATE;
+}
+
+bool CheckBusLoad(int period_msec, unsigned char ahrsRate, unsigned char ahrsMask, double txGapUsec, bool overload)
+{
+	double nominal, worst, gaps;
+
+	if (period_msec < 1 || period_msec > 255)
+	{
+		printf("ERROR control period %d msec is out of range (1..255) !!! \n", period_msec);
+		return false;
+	}
+
+	gaps = TxGapLoad(period_msec, txGapUsec);
+	nominal = ControlBusLoad(period_msec, ahrsRate, ahrsMask, false) + gaps;
+	worst = ControlBusLoad(period_msec, ahrsRate, ahrsMask, true) + gaps;
+	printf(">CAN: control period %d msec, bus load %.1f%% (%.1f%% worst-case bit stuffing)\n", period_msec, nominal*100.0, worst*100.0);
+
+	if (nominal > BUS_LOAD_OVERLOAD || (worst > BUS_LOAD_LIMIT && !overload))
+	{
+		printf("ERROR %d msec control period would saturate the CAN bus !!! \n", period_msec);
+		if (nominal <= BUS_LOAD_OVERLOAD)
+			printf("      when the data needs maximum bit stuffing; --bus-overload runs it anyway\n");
+		return false;
+	}
+	if (worst > BUS_LOAD_LIMIT)
+		printf(">CAN: warning: frames can queue up when the data happens to need maximum bit stuffing\n");
+	return true;
+}
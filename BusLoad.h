@@ -0,0 +1,30 @@
+#pragma once
+
+// CAN bus load of the periodic Allegro Hand traffic
+// (standard 11-bit frames at CAN_BITRATE).
+
+#define CAN_BITRATE			1000000 // bit/s
+#define BUS_LOAD_LIMIT		1.0     // highest worst-case load accepted for a control period
+#define BUS_LOAD_OVERLOAD	0.95    // highest nominal load accepted with --bus-overload
+#define BUS_LOAD_CEILING	0.80    // default worst-case load the AHRS rate is planned for (--bus-ceiling)
+
+int CanFrameBits(int dlc, bool worstCase); // bits on the wire including the interframe space
+double AhrsRateHz(unsigned char rate); // AHRS_RATE_* -> frames per second for each enabled stream
+int AhrsRateFromHz(double hz);         // frames per second -> AHRS_RATE_*, -1 if the hand has no such rate
+double ControlBusLoad(int period_msec, unsigned char ahrsRate, unsigned char ahrsMask, bool worstCase); // fraction of the bus
+
+// Prints the load for the given period and returns false if frames needing
+// maximum bit stuffing could saturate the bus. With overload, only a nominal
+// load above BUS_LOAD_OVERLOAD is refused.
+// txGapUsec is the idle time kept between the torque frames (--tx-gap).
+bool CheckBusLoad(int period_msec, unsigned char ahrsRate, unsigned char ahrsMask, double txGapUsec, bool overload);
+
+// Highest AHRS_RATE_* up to maxRate at which the worst-case load of the control
+// and AHRS traffic, with the idle time of the torque frame gaps, stays under
+// ceiling. Returns false, with the lowest rate, if even that one exceeds it;
+// with ahrsMask 0 that tells whether the control frames alone fit.
+// A period out of range keeps maxRate; CheckBusLoad() reports it.
+bool PlanAhrsRate(int period_msec, unsigned char maxRate, unsigned char ahrsMask, double txGapUsec, double ceiling, unsigned char* rate);
+
+// Load of frames counted on the bus over seconds (control: 8 bytes, AHRS: 6 bytes)
+double MeasuredBusLoad(unsigned int controlFrames, unsigned int ahrsFrames, double seconds, bool worstCase);
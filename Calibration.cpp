@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "Calibration.h"
+
+// Nominal joint limits of the Allegro Hand (rad), in joint order: index,
+// middle and ring finger, thumb. The abduction joints (0, 4, 8) are symmetric,
+// so the table holds for both sides.
+static const double limitMin[MAX_DOF] = {
+	-0.47, -0.196, -0.174, -0.227,
+	-0.47, -0.196, -0.174, -0.227,
+	-0.47, -0.196, -0.174, -0.227,
+	 0.263, -0.105, -0.189, -0.162
+};
+static const double limitMax[MAX_DOF] = {
+	 0.47, 1.61, 1.709, 1.618,
+	 0.47, 1.61, 1.709, 1.618,
+	 0.47, 1.61, 1.709, 1.618,
+	 1.396, 1.163, 1.644, 1.719
+};
+
+void CalibrationStart(Calibration* c)
+{
+	memset(c, 0, sizeof(Calibration));
+	for (int f=0; f<4; f++)
+	{
+		c->phase[f] = CALIB_LOWER;
+		c->phaseStart[f] = -1.0;
+	}
+}
+
+void CalibrationGains(double* kp, double* kd)
+{
+	// a fifth of the gains of the sample motions (RockScissorsPaper.cpp)
+	static const double kpCalib[4] = { 100, 160, 180, 100 };
+	static const double kdCalib[4] = { 5, 10, 11, 8 };
+
+	for (int i=0; i<MAX_DOF; i++)
+	{
+		kp[i] = kpCalib[i%4];
+		kd[i] = kdCalib[i%4];
+	}
+}
+
+void CalibrationStep(Calibration* c, const HandProfile* p, const int* enc, const double* q, double time, double* q_des)
+{
+	for (int f=0; f<4; f++)
+	{
+		int phase = c->phase[f];
+		bool stalled = true;
+		double pos;
+		int i;
+
+		if (phase == CALIB_DONE)
+		{
+			// no push, only damping
+			for (i=f*4; i<f*4+4; i++)
+				q_des[i] = q[i];
+			continue;
+		}
+
+		if (c->phaseStart[f] < 0.0)
+		{
+			c->phaseStart[f] = time;
+			c->windowStart[f] = time;
+			for (i=f*4; i<f*4+4; i++)
+			{
+				c->windowPos[i] = enc[i]*p->enc_dir[i];
+				c->limit[phase][i] = c->windowPos[i];
+			}
+		}
+
+		for (i=f*4; i<f*4+4; i++)
+		{
+			pos = enc[i]*p->enc_dir[i];
+			if (phase == CALIB_LOWER)
+			{
+				if (pos < c->limit[phase][i]) c->limit[phase][i] = pos;
+				q_des[i] = q[i] - CALIB_PUSH;
+			}
+			else
+			{
+				if (pos > c->limit[phase][i]) c->limit[phase][i] = pos;
+				q_des[i] = q[i] + CALIB_PUSH;
+			}
+		}
+
+		if (time - c->windowStart[f] < CALIB_STALL_WINDOW)
+			continue;
+
+		// end of a stall window: has every joint of the finger stopped?
+		for (i=f*4; i<f*4+4; i++)
+		{
+			pos = enc[i]*p->enc_dir[i];
+			c->found[phase][i] = (time - c->phaseStart[f] >= CALIB_MIN_PUSH && fabs(pos - c->windowPos[i]) < CALIB_STALL_COUNTS);
+			// a joint may start at its lower limit, but it has to get away from it
+			if (phase == CALIB_UPPER && (pos - c->limit[CALIB_LOWER][i]) * ENC_RAD_PER_COUNT < CALIB_MIN_MOVE)
+				c->found[phase][i] = false;
+			if (!c->found[phase][i]) stalled = false;
+			c->windowPos[i] = pos;
+		}
+		c->windowStart[f] = time;
+		if (stalled || time - c->phaseStart[f] >= CALIB_TIMEOUT)
+		{
+			c->phaseStart[f] = -1.0;
+			c->phase[f] = phase + 1;
+		}
+	}
+}
+
+bool CalibrationDone(const Calibration* c)
+{
+	for (int f=0; f<4; f++)
+	{
+		if (c->phase[f] != CALIB_DONE)
+			return false;
+	}
+	return true;
+}
+
+bool CalibrationSolve(const Calibration* c, const HandProfile* p, HandProfile* result)
+{
+	bool ok = true;
+
+	*result = *p;
+	printf("joint   lower   upper   range  nominal   offset\n");
+	for (int i=0; i<MAX_DOF; i++)
+	{
+		// q = (enc*enc_dir - 32768 - enc_offset) * ENC_RAD_PER_COUNT at either limit
+		double offLower = c->limit[CALIB_LOWER][i] - 32768.0 - limitMin[i]/ENC_RAD_PER_COUNT;
+		double offUpper = c->limit[CALIB_UPPER][i] - 32768.0 - limitMax[i]/ENC_RAD_PER_COUNT;
+		double range = (c->limit[CALIB_UPPER][i] - c->limit[CALIB_LOWER][i]) * ENC_RAD_PER_COUNT;
+		double nominal = limitMax[i] - limitMin[i];
+		const char* note = "";
+		double off;
+
+		// a limit that was not reached, or a range that is not the joint's, says
+		// the joint was blocked or did not move: the counts do not give its offset
+		off = p->enc_offset[i];
+		if (!c->found[CALIB_LOWER][i] && !c->found[CALIB_UPPER][i])
+			note = "  no limit reached, offset kept";
+		else if (!c->found[CALIB_LOWER][i])
+			note = "  lower limit not reached, offset kept";
+		else if (!c->found[CALIB_UPPER][i])
+			note = "  upper limit not reached, offset kept";
+		else if (fabs(range - nominal) > CALIB_RANGE_TOL)
+			note = "  range differs from nominal, offset kept";
+		else
+			off = 0.5*(offLower + offUpper);
+		if (note[0])
+			ok = false;
+		result->enc_offset[i] = (int)floor(off + 0.5);
+		printf("%5d  %6.0f  %6.0f  %6.3f  %6.3f  %6d -> %6d%s\n", i, c->limit[CALIB_LOWER][i], c->limit[CALIB_UPPER][i],
+			range, nominal, p->enc_offset[i], result->enc_offset[i], note);
+	}
+	JointConversionInit(&result->conversion, result->enc_dir, result->enc_offset, result->motor_dir,
+		result->tau_cov_const, result->pwm_max);
+	return ok;
+}
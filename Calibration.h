@@ -0,0 +1,60 @@
+#pragma once
+
+#include "HandProfile.h"
+
+// Encoder offset calibration (--calibrate).
+//
+// Every finger pushes its four joints with a small, constant torque to their
+// lower and then to their upper mechanical limits: JOINT_PD with low gains
+// and the desired position a fixed step beyond the current one, so the push
+// does not depend on the offsets that are still unknown. A joint is at its
+// limit when its encoder moved less than CALIB_STALL_COUNTS over
+// CALIB_STALL_WINDOW; at the upper one only after it has come at least
+// CALIB_MIN_MOVE away from the lower one, so a joint that does not move at all
+// is pushed until CALIB_TIMEOUT and fails. The control thread records the encoder extremes of
+// every encoder set, and each finger goes on to its next phase as soon as its
+// own joints have stopped, so all fingers are calibrated at the same time in
+// one pass. The offsets then follow from the encoder counts at the limits and
+// the nominal joint limits of the hand, for the joints whose measured range is
+// within CALIB_RANGE_TOL of the nominal one.
+
+#define CALIB_PUSH			0.15 // rad, desired position beyond the current one
+#define CALIB_STALL_WINDOW	0.1  // sec
+#define CALIB_STALL_COUNTS	20   // encoder counts (about 0.1 deg)
+#define CALIB_MIN_PUSH		0.3  // sec a phase lasts at least
+#define CALIB_TIMEOUT		5.0  // sec a phase lasts at most
+#define CALIB_MIN_MOVE		0.2  // rad, shortest way from the lower limit to the upper one
+#define CALIB_RANGE_TOL		0.1  // rad, largest difference of the measured and nominal range
+
+enum eCalibPhase
+{
+	CALIB_LOWER, // pushing to the lower limits
+	CALIB_UPPER, // pushing to the upper limits
+	CALIB_DONE
+};
+
+typedef struct tagCalibration
+{
+	volatile bool active;      // set by the main thread, stepped by the control thread
+	volatile int phase[4];     // eCalibPhase of each finger
+	double phaseStart[4];      // time the phase of the finger began, -1 before its first step
+	double windowStart[4];     // start of the current stall window of the finger
+	double windowPos[MAX_DOF]; // enc*enc_dir at windowStart
+	bool found[2][MAX_DOF];    // the joint stopped at its lower / upper limit
+	double limit[2][MAX_DOF];  // enc*enc_dir at the lower / upper limit (counts)
+} Calibration;
+
+void CalibrationStart(Calibration* c);
+
+// Low JOINT_PD gains used while calibrating (BHand::SetGainsEx)
+void CalibrationGains(double* kp, double* kd);
+
+// Control thread, every encoder set: records the extremes and sets the desired positions
+void CalibrationStep(Calibration* c, const HandProfile* p, const int* enc, const double* q, double time, double* q_des);
+
+bool CalibrationDone(const Calibration* c);
+
+// Copies the profile with the offsets found and prints them. Joints that did
+// not reach both limits, or whose range is off the nominal one, keep their old
+// offset; false if there are any.
+bool CalibrationSolve(const Calibration* c, const HandProfile* p, HandProfile* result);
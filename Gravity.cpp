@@ -0,0 +1,49 @@
+#include <math.h>
+#include "Gravity.h"
+
+// First mass moments of the links (Nm), per joint of the chain: m*g times the
+// distance along the link of the centre of mass of everything beyond the
+// joint, l0..l3 of Kinematics.h. The base link of a finger turns about its
+// own axis and needs none. The thumb also carries a moment along v, where
+// its chain has the offset e.
+static const double fingerMoment[4] = { 0.0, 0.1033006, 0.0319162, 0.0056139 };
+static const double thumbMoment[4] = { 0.2231704, 0.0579267, 0.0248499, 0.0 };
+static const double thumbMomentE = -0.0011476;
+
+void GravityInit(GravityModel* g, bool leftHand)
+{
+	KinematicsModel* m = &g->chain;
+
+	// the geometry of the hand, then the moments in place of the lengths
+	KinematicsInit(m, leftHand);
+	for (int f=0; f<KIN_FINGERS; f++)
+	{
+		bool thumb = (f == KIN_FINGERS-1);
+		for (int i=0; i<4; i++)
+		{
+			m->dLen[i][f] = (thumb ? thumbMoment[i] : fingerMoment[i]);
+			m->len[i][f] = (float)m->dLen[i][f];
+		}
+		m->dE[f] = (thumb ? thumbMomentE : 0.0);
+		m->e[f] = (float)m->dE[f];
+	}
+}
+
+void GravityUpFromPose(double roll, double pitch, double* up)
+{
+	// last row of Rz(yaw)*Ry(pitch)*Rx(roll); the yaw does not tilt the palm
+	double cp = cos(pitch);
+	up[0] = -sin(pitch);
+	up[1] = sin(roll)*cp;
+	up[2] = cos(roll)*cp;
+}
+
+void SolveGravity(const GravityModel* g, const double* q, const double* up, double* tau)
+{
+	SolveKinematicsTorque(&g->chain, q, up, tau);
+}
+
+void SolveGravityScalar(const GravityModel* g, const double* q, const double* up, double* tau)
+{
+	SolveKinematicsTorqueScalar(&g->chain, q, up, tau);
+}
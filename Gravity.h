@@ -0,0 +1,45 @@
+#pragma once
+
+// Gravity term of the hand for any orientation of the palm, so that the
+// gravity compensation motion keeps holding the fingers while an arm moves
+// the hand around.
+//
+// The torque gravity puts on the joints of a finger is the Jacobian
+// transpose of the chain of Kinematics.h with its link lengths replaced by
+// first mass moments (m*g times the distance of the centre of mass of the
+// links beyond a joint), taken on the vertical of the palm:
+//   tau = J_M(q)^T * up
+// GravityInit() builds that chain once; SolveGravity() runs it through the
+// kinematics kernel, four fingers per register, and dots the Jacobians with
+// up before they leave the registers. One call gives all 16 torques.
+//
+// The moments are fitted to BHand's gravity term. On an upright palm the
+// fingers of the right hand agree with it to 1e-5 Nm and the thumb to
+// 3e-3 Nm: BHand's thumb term is not the gradient of any potential, so no
+// mass distribution reproduces it exactly. Tilted, BHand turns the gravity
+// of the index, ring and thumb by the palm splay on the wrong side of its
+// orientation matrix; the middle finger agrees at any orientation. BHand's
+// left hand uses the torques of its right one. Upright, that puts its index
+// and ring fingers up to 0.025 Nm off the mirror image this model uses;
+// tilted, its thumb as well.
+
+#include "Kinematics.h"
+
+typedef struct tagGravityModel
+{
+	KinematicsModel chain; // lengths and offsets are mass moments (Nm)
+} GravityModel;
+
+void GravityInit(GravityModel* g, bool leftHand);
+
+// Vertical (away from the earth) in the palm frame, from the roll and pitch
+// (rad) of a sensor aligned with the palm, as the AHRS reports them
+// (yaw about z, then pitch about y, then roll about x). Upright is (0, 0, 1).
+void GravityUpFromPose(double roll, double pitch, double* up);
+
+// q: joint angles of the hand (MAX_DOF, rad), up: unit vertical in the palm
+// frame, tau: MAX_DOF torques (Nm) that balance gravity
+void SolveGravity(const GravityModel* g, const double* q, const double* up, double* tau);
+
+// double precision scalar version
+void SolveGravityScalar(const GravityModel* g, const double* q, const double* up, double* tau);
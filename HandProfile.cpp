@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "HandProfile.h"
+
+// PWM counts at full current
+static const double tau_cov_const_v2 = 800.0; // 800.0 for SAH020xxxxx
+static const double tau_cov_const_v3 = 1200.0; // 1200.0 for SAH030xxxxx
+
+// PWM limits of the supply voltage
+static const short pwm_max_DC8V = 800; // 1200 is max
+static const short pwm_max_DC24V = 500;
+
+static const int default_enc_offset[MAX_DOF] = { // SAH020BR015 (upgrated to version 3)
+	 296,	 189,	 2652,	-509,
+	-16,	 302,	 1005,	 1903,
+	 1499,	 1034,	-1232,	 1012,
+	 470,	-6,	    -76,     145
+};
+
+// Settings of a new section before its keys are read; tau_cov_const and
+// pwm_max left at 0 follow version and supply.
+static void HandProfileInit(HandProfile* p, const char* name)
+{
+	memset(p, 0, sizeof(HandProfile));
+	strncpy(p->name, name, PROFILE_NAME_LEN-1);
+	p->version = 3;
+	p->rightHand = true;
+	p->supply = 8;
+	for (int i=0; i<MAX_DOF; i++)
+	{
+		p->enc_dir[i] = 1.0;
+		p->motor_dir[i] = 1.0;
+	}
+	p->revision = -1;
+	p->firmware = -1;
+	p->hardware = -1;
+}
+
+static void HandProfileBuild(HandProfile* p)
+{
+	if (p->tau_cov_const <= 0.0)
+		p->tau_cov_const = (p->version < 3 ? tau_cov_const_v2 : tau_cov_const_v3);
+	if (p->pwm_max <= 0)
+		p->pwm_max = (p->supply > 12 ? pwm_max_DC24V : pwm_max_DC8V);
+	JointConversionInit(&p->conversion, p->enc_dir, p->enc_offset, p->motor_dir, p->tau_cov_const, p->pwm_max);
+}
+
+void HandProfileDefault(HandProfile* p)
+{
+	HandProfileInit(p, "SAH020BR015");
+	memcpy(p->enc_offset, default_enc_offset, sizeof(p->enc_offset));
+	HandProfileBuild(p);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Profile file
+
+static bool SameText(const char* a, const char* b)
+{
+	while (*a && tolower((unsigned char)*a) == tolower((unsigned char)*b))
+	{
+		a++;
+		b++;
+	}
+	return (*a == 0 && *b == 0);
+}
+
+static char* Trim(char* s)
+{
+	char* end;
+
+	while (isspace((unsigned char)*s)) s++;
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1])) end--;
+	*end = 0;
+	return s;
+}
+
+// MAX_DOF numbers separated by blanks
+static bool ParseDoubles(const char* s, double* v)
+{
+	char* end;
+
+	for (int i=0; i<MAX_DOF; i++)
+	{
+		v[i] = strtod(s, &end);
+		if (end == s) return false;
+		s = end;
+	}
+	while (isspace((unsigned char)*s)) s++;
+	return (*s == 0);
+}
+
+static bool ParseInts(const char* s, int* v)
+{
+	char* end;
+
+	for (int i=0; i<MAX_DOF; i++)
+	{
+		v[i] = (int)strtol(s, &end, 0);
+		if (end == s) return false;
+		s = end;
+	}
+	while (isspace((unsigned char)*s)) s++;
+	return (*s == 0);
+}
+
+static bool ParseInt(const char* s, int* v)
+{
+	char* end;
+
+	*v = (int)strtol(s, &end, 0);
+	return (end != s && *end == 0);
+}
+
+static bool ParseKey(HandProfile* p, const char* key, const char* value)
+{
+	int n;
+
+	if (SameText(key, "version"))
+		return ParseInt(value, &p->version) && p->version >= 1;
+	if (SameText(key, "side"))
+	{
+		if (SameText(value, "right")) p->rightHand = true;
+		else if (SameText(value, "left")) p->rightHand = false;
+		else return false;
+		return true;
+	}
+	if (SameText(key, "supply"))
+		return ParseInt(value, &p->supply) && p->supply > 0;
+	if (SameText(key, "enc_dir"))
+		return ParseDoubles(value, p->enc_dir);
+	if (SameText(key, "motor_dir"))
+		return ParseDoubles(value, p->motor_dir);
+	if (SameText(key, "enc_offset"))
+		return ParseInts(value, p->enc_offset);
+	if (SameText(key, "tau_cov_const"))
+	{
+		p->tau_cov_const = atof(value);
+		return p->tau_cov_const > 0.0;
+	}
+	if (SameText(key, "pwm_max"))
+	{
+		if (!ParseInt(value, &n) || n <= 0 || n > 32767) return false;
+		p->pwm_max = (short)n;
+		return true;
+	}
+	if (SameText(key, "revision"))
+		return ParseInt(value, &p->revision) && p->revision >= 0 && p->revision <= 0xffff;
+	if (SameText(key, "firmware"))
+		return ParseInt(value, &p->firmware) && p->firmware >= 0 && p->firmware <= 0xffff;
+	if (SameText(key, "hardware"))
+		return ParseInt(value, &p->hardware) && p->hardware >= 0 && p->hardware <= 0xff;
+	return false;
+}
+
+int LoadHandProfiles(const char* fileName, HandProfile* profiles, int maxProfiles)
+{
+	FILE* fp = fopen(fileName, "r");
+	char line[512];
+	char* s;
+	char* eq;
+	int count = 0;
+	int lineNo = 0;
+	bool ok = true;
+
+	if (!fp)
+		return -1;
+
+	while (ok && fgets(line, sizeof(line), fp))
+	{
+		lineNo++;
+		s = line + strcspn(line, ";#");
+		*s = 0;
+		s = Trim(line);
+		if (*s == 0)
+			continue;
+
+		if (*s == '[')
+		{
+			eq = strchr(s, ']');
+			if (!eq || eq[1] != 0 || eq == s+1 || eq - s > PROFILE_NAME_LEN)
+			{
+				printf("ERROR %s:%d: invalid section name\n", fileName, lineNo);
+				ok = false;
+			}
+			else if (count >= maxProfiles)
+			{
+				printf("ERROR %s:%d: more than %d profiles\n", fileName, lineNo, maxProfiles);
+				ok = false;
+			}
+			else
+			{
+				*eq = 0;
+				HandProfileInit(&profiles[count++], s+1);
+			}
+			continue;
+		}
+
+		eq = strchr(s, '=');
+		if (!eq || count == 0)
+		{
+			printf("ERROR %s:%d: expected [serial number] or key = value\n", fileName, lineNo);
+			ok = false;
+			continue;
+		}
+		*eq = 0;
+		if (!ParseKey(&profiles[count-1], Trim(s), Trim(eq+1)))
+		{
+			printf("ERROR %s:%d: invalid %s\n", fileName, lineNo, Trim(s));
+			ok = false;
+		}
+	}
+	fclose(fp);
+	if (!ok)
+		return -2;
+
+	for (int i=0; i<count; i++)
+		HandProfileBuild(&profiles[i]);
+	return count;
+}
+
+const HandProfile* FindHandProfile(const HandProfile* profiles, int count, const char* name)
+{
+	for (int i=0; i<count; i++)
+	{
+		if (SameText(profiles[i].name, name))
+			return &profiles[i];
+	}
+	return NULL;
+}
+
+bool HandProfileMatches(const HandProfile* p, const CanHandId* id)
+{
+	if (p->revision < 0 && p->firmware < 0 && p->hardware < 0)
+		return false;
+	return (p->revision < 0 || p->revision == id->revision) &&
+		(p->firmware < 0 || p->firmware == id->firmware) &&
+		(p->hardware < 0 || p->hardware == id->hardwareType);
+}
+
+void PrintHandProfile(const HandProfile* p)
+{
+	printf("%s: %s Hand, v%i.x, %d V\n", p->name, (p->rightHand ? "Right" : "Left"), p->version, p->supply);
+}
+
+void WriteHandProfile(FILE* fp, const HandProfile* p)
+{
+	int i;
+
+	fprintf(fp, "[%s]\n", p->name);
+	fprintf(fp, "version = %d\n", p->version);
+	fprintf(fp, "side = %s\n", (p->rightHand ? "right" : "left"));
+	fprintf(fp, "supply = %d\n", p->supply);
+	fprintf(fp, "enc_dir    =");
+	for (i=0; i<MAX_DOF; i++)
+		fprintf(fp, "%s %g", (i%4 == 0 && i ? "  " : ""), p->enc_dir[i]);
+	fprintf(fp, "\nmotor_dir  =");
+	for (i=0; i<MAX_DOF; i++)
+		fprintf(fp, "%s %g", (i%4 == 0 && i ? "  " : ""), p->motor_dir[i]);
+	fprintf(fp, "\nenc_offset =");
+	for (i=0; i<MAX_DOF; i++)
+		fprintf(fp, "%s %d", (i%4 == 0 && i ? "  " : ""), p->enc_offset[i]);
+	fprintf(fp, "\ntau_cov_const = %g\n", p->tau_cov_const);
+	fprintf(fp, "pwm_max = %d\n", p->pwm_max);
+	if (p->revision >= 0) fprintf(fp, "revision = 0x%04x\n", p->revision);
+	if (p->firmware >= 0) fprintf(fp, "firmware = 0x%04x\n", p->firmware);
+	if (p->hardware >= 0) fprintf(fp, "hardware = %d\n", p->hardware);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdio.h>
+#include "canCodec.h"
+#include "JointConversion.h"
+
+// Hand profiles: the parameters that differ from one Allegro Hand to the
+// next (version, side, supply, encoder and motor directions, encoder offsets,
+// PWM limits). They are loaded at start-up from a text file, one section per
+// hand named by its serial number:
+//
+//     [SAH030AR023]
+//     version = 3          ; 2: v2.x, 3: v3.x
+//     side = right         ; right or left
+//     supply = 8           ; V, 8 or 24
+//     enc_dir = 1 1 1 1  1 1 1 1  1 1 1 1  1 1 1 1
+//     motor_dir = 1 1 1 1  1 1 1 1  1 1 1 1  1 1 1 1
+//     enc_offset = -1700 -568 -3064 -36  ...
+//     tau_cov_const = 1200 ; optional, PWM counts at full current (800 for v2, 1200 for v3)
+//     pwm_max = 800        ; optional, PWM limit (800 at 8 V, 500 at 24 V)
+//     revision = 0x0300    ; optional, ID_CMD_QUERY_ID reply that selects this profile
+//     firmware = 0x0100
+//     hardware = 3
+//
+// Text after ';' or '#' is a comment.
+
+#define MAX_PROFILES		32
+#define PROFILE_NAME_LEN	32
+
+typedef struct tagHandProfile
+{
+	JointConversion conversion; // built from the fields below, read by the control thread every cycle
+	char name[PROFILE_NAME_LEN]; // serial number
+	int version;
+	bool rightHand;
+	int supply;              // V
+	double enc_dir[MAX_DOF];
+	double motor_dir[MAX_DOF];
+	int enc_offset[MAX_DOF];
+	double tau_cov_const;
+	short pwm_max;
+	// ID_CMD_QUERY_ID reply fields the profile is selected by, -1: not compared
+	int revision;
+	int firmware;
+	int hardware;
+} HandProfile;
+
+// The hand the program was built for before profiles existed (SAH020BR015 upgraded to v3)
+void HandProfileDefault(HandProfile* p);
+
+// Reads the profiles of a file into profiles[0..maxProfiles-1] and returns how
+// many there are. -1 if the file cannot be opened, -2 if it is invalid (the
+// error is printed).
+int LoadHandProfiles(const char* fileName, HandProfile* profiles, int maxProfiles);
+
+const HandProfile* FindHandProfile(const HandProfile* profiles, int count, const char* name);
+
+// true if the profile gives at least one reply field and all it gives match
+bool HandProfileMatches(const HandProfile* p, const CanHandId* id);
+
+void PrintHandProfile(const HandProfile* p);
+
+// Writes the profile as a section of a profile file
+void WriteHandProfile(FILE* fp, const HandProfile* p);
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "canAPI.h"
+#include "canTransport.h"
+#include "rDeviceAllegroHandCANDef.h"
+#include "BHand/BHand.h"
+#include "RtThread.h"
+#include "SeqLock.h"
+#include "JointData.h"
+#include "LatencyHistogram.h"
+#include "HandProfile.h"
+#include "Calibration.h"
+#include "Telemetry.h"
+#include "Gravity.h"
+#include "Imu.h"
+
+// One Allegro Hand driven by this process: its CAN channel, device memory,
+// BHand instance, statistics and the three threads of its CAN pipeline.
+// Sessions share nothing but the read-only settings of the program, so each
+// hand runs on its own cores at its own pace.
+
+#define MAX_HANDS	8 // sessions one process can host
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// CAN pipeline: RX thread -> control thread -> TX thread
+typedef struct tagEncoderSet
+{
+	int enc_actual[MAX_DOF];
+	double rxTime;    // arrival of the first frame of the set
+	double readyTime; // the fourth board's frame has been decoded
+	double stamp;     // driver receive time stamp of the first frame, rxTime if the driver has none
+	unsigned char missing; // bit per finger board whose encoders were extrapolated
+	bool zeroTorque;  // too many incomplete sets in a row, send zero torque
+} EncoderSet;
+
+typedef struct tagPwmCommand
+{
+	short pwm_demand[MAX_DOF];
+	double rxTime;    // of the encoder set it was computed from
+	double setTime;   // that encoder set was complete
+	double readyTime; // control step finished
+} PwmCommand;
+
+enum ePipelineStage
+{
+	STAGE_RX,      // first encoder frame -> complete set published
+	STAGE_CONTROL, // set published -> PWM ready (wake-up + ComputeTorque)
+	STAGE_TX,      // PWM ready -> frames left the transmit queue
+	STAGE_TOTAL,   // first encoder frame -> frames left the transmit queue
+	STAGE_COUNT
+};
+
+typedef struct tagPipelineStage
+{
+	const char* name;
+	int cpu;      // -1: any
+	int priority; // 0: normal, 1..99: SCHED_FIFO
+	// latency statistics, written only by the stage's own thread (sec)
+	double last;
+	double max;
+	double sum;
+	unsigned int count;
+} PipelineStage;
+
+// Control cycle clock: dt between consecutive encoder sets, taken from the
+// driver receive time stamps. Written only by the control thread.
+typedef struct tagCycleClock
+{
+	double dt;          // last control step (sec)
+	double min;
+	double max;
+	unsigned int fallback; // steps that used delT because the stamps were unusable
+} CycleClock;
+
+// Per-cycle timing histograms, each written only by the thread that measures it.
+// A cycle whose RX-to-TX latency exceeds the control period is a deadline miss.
+enum eHistogram
+{
+	HIST_RX_PERIOD,    // complete encoder set -> next complete set (RX thread, driver time)
+	HIST_RX_TO_TX,     // encoder set complete -> its torque frames left the queue (TX thread)
+	HIST_COMPUTE,      // ComputeTorque() (control thread)
+	HIST_CAN_WRITE,    // torque frames handed to the driver -> transmitted (TX thread)
+	HIST_COUNT
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Hand session
+typedef struct tagHandSession
+{
+	int index;                      // 0 for the first hand
+	int ch;                         // CAN channel
+	const CanTransport* transport;  // adapter the channel is opened on
+	AllegroHand_DeviceMemory_t vars;
+	const HandProfile* profile;     // parameters of the hand, chosen by OpenCAN() before the periodic frames start
+	SeqLock<CanHandId> handId;      // ID_CMD_QUERY_ID reply, written by the RX thread
+	Calibration calibration;        // --calibrate, stepped by the control thread while active
+
+	// CAN pipeline
+	bool ioThreadRun;
+	double openTime; // host time the channel was opened
+	int recvNum;
+	int sendNum;
+	double statTime; // start of the current frame rate window, 0 before the first one
+	int statRecv;    // recvNum at statTime
+	int statSend;    // sendNum at statTime
+	double rxFirstStamp; // receive times of the first and the last frame, written by the RX thread
+	double rxLastStamp;
+	PipelineStage stage[STAGE_COUNT];
+	CycleClock cycleClock;
+	LatencyHistogram histogram[HIST_COUNT];
+	volatile unsigned int boardMisses[4]; // incomplete sets per finger board, written by the RX thread
+	SeqLock<EncoderSet> encoderSet;
+	SeqLock<PwmCommand> pwmCommand;
+	ImuState imu;      // AHRS samples, written by the RX thread
+	RtEvent ctrlEvent; // a complete encoder set is waiting
+	RtEvent txEvent;   // a new PWM command is waiting
+	RtThread rxThread;
+	RtThread ctrlThread;
+	RtThread txThread;
+	TelemetryRecorder recorder; // --record, written by the control thread
+
+	// BHand library
+	BHand* pBHand;
+	int motionType;      // applied to pBHand by the control thread
+	GravityModel gravity; // corrects BHand's gravity term for the tilt of the palm
+	double palmUp[3];    // vertical in the palm frame from the AHRS pose, control thread
+	// q, q_des and tau_des belong to the control thread.
+	// Other threads go through jointState / jointCommand (JointData.h).
+	double q[MAX_DOF];
+	double q_des[MAX_DOF];
+	double tau_des[MAX_DOF];
+	double curTime;
+	SeqLock<JointState> jointState;
+	SeqLock<JointCommand> jointCommand;
+	unsigned int cycleHash; // of q and tau_des of every cycle, with --capture and --replay
+	unsigned int cycles;
+} HandSession;
+
+// Main thread: the control thread of the hand switches to the motion at its next cycle.
+// q_des NULL keeps the desired positions, kp/kd NULL keeps BHand's default gains.
+void SetHandMotion(HandSession* h, int motionType, const double* q_des, const double* kp, const double* kd);
@@ -0,0 +1,52 @@
+#ifdef _WIN32
+#include "windows.h"
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+#include "HighResTimer.h"
+
+#ifdef _WIN32
+static double s_tickPeriod = 0.0;
+#endif
+
+double GetHighResTime()
+{
+#ifdef _WIN32
+	LARGE_INTEGER cnt;
+	if (s_tickPeriod == 0.0)
+	{
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+		s_tickPeriod = 1.0 / (double)freq.QuadPart;
+	}
+	QueryPerformanceCounter(&cnt);
+	return (double)cnt.QuadPart * s_tickPeriod;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+void DelayMicroseconds(double usec)
+{
+	double until = GetHighResTime() + usec * 1e-6;
+
+	// Let the scheduler have the bulk of long delays (its granularity is about
+	// a millisecond) and spin on the clock for the remainder.
+	if (usec > 2000.0)
+	{
+#ifdef _WIN32
+		Sleep((DWORD)(usec / 1000.0) - 1);
+#else
+		usleep((useconds_t)(usec - 1000.0));
+#endif
+	}
+	while (GetHighResTime() < until)
+	{
+#ifdef _WIN32
+		YieldProcessor();
+#endif
+	}
+}
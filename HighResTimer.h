@@ -0,0 +1,6 @@
+#pragma once
+
+// Monotonic high-resolution clock
+// (QueryPerformanceCounter on Windows, CLOCK_MONOTONIC on Linux).
+double GetHighResTime(); // seconds since an arbitrary fixed point
+void DelayMicroseconds(double usec); // waits on the clock itself, not on a loop count
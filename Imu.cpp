@@ -0,0 +1,198 @@
+#include <math.h>
+#include <string.h>
+#include "Imu.h"
+
+static const double PI = 3.14159265358979;
+
+static double WrapAngle(double a)
+{
+	while (a > PI) a -= 2.0*PI;
+	while (a < -PI) a += 2.0*PI;
+	return a;
+}
+
+void ImuInit(ImuState* s, unsigned char mask, double filterTau)
+{
+	memset((void*)s, 0, sizeof(*s));
+	s->mask = mask;
+	s->filterTau = filterTau;
+}
+
+void ImuAcc(const ImuSample* sample, double* g)
+{
+	for (int i=0; i<3; i++)
+		g[i] = sample->raw[1][i] * IMU_ACC_G;
+}
+
+void ImuGyro(const ImuSample* sample, double* rad_s)
+{
+	for (int i=0; i<3; i++)
+		rad_s[i] = sample->raw[2][i] * IMU_GYRO_RAD;
+}
+
+void ImuMag(const ImuSample* sample, double* gauss)
+{
+	for (int i=0; i<3; i++)
+		gauss[i] = sample->raw[3][i] * IMU_MAG_GAUSS;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Complementary filter (RX thread)
+
+// Heading of the magnetic field with the sensor levelled by roll and pitch
+static double MagHeading(const ImuSample* sample, double roll, double pitch)
+{
+	double m[3];
+	ImuMag(sample, m);
+	double sr = sin(roll), cr = cos(roll), sp = sin(pitch), cp = cos(pitch);
+	double x = m[0]*cp + m[1]*sp*sr + m[2]*sp*cr;
+	double y = m[1]*cr - m[2]*sr;
+	return atan2(-y, x);
+}
+
+static void FilterStep(ImuState* s, ImuSample* p)
+{
+	double acc[3], gyro[3], measured[3];
+	double* r = s->filterRpy;
+	double dt = p->stamp - s->filterStamp;
+	bool mag = ((s->mask & AHRS_MASK_MAG) != 0);
+
+	// the accelerometer reads +1 g along the vertical at rest
+	ImuAcc(p, acc);
+	ImuGyro(p, gyro);
+	measured[0] = atan2(acc[1], acc[2]);
+	measured[1] = atan2(-acc[0], sqrt(acc[1]*acc[1] + acc[2]*acc[2]));
+
+	if (!s->filterOn || dt <= 0.0 || dt > 1.0)
+	{
+		// (re)start from the accelerometer, and the magnetometer or the AHRS yaw
+		r[0] = measured[0];
+		r[1] = measured[1];
+		r[2] = (mag ? MagHeading(p, r[0], r[1]) : p->raw[0][2] * IMU_POSE_RAD);
+		s->filterOn = true;
+	}
+	else
+	{
+		// body rates to Euler angle rates (yaw, pitch, roll order)
+		double sr = sin(r[0]), cr = cos(r[0]), cp = cos(r[1]);
+		double qr = gyro[1]*sr + gyro[2]*cr;
+		double rate[3];
+		rate[0] = gyro[0] + (fabs(cp) > 1e-3 ? qr*sin(r[1])/cp : 0.0);
+		rate[1] = gyro[1]*cr - gyro[2]*sr;
+		rate[2] = (fabs(cp) > 1e-3 ? qr/cp : 0.0);
+
+		double k = dt / (s->filterTau + dt); // weight of the measurement
+		for (int i=0; i<3; i++)
+			r[i] += rate[i]*dt;
+		measured[2] = (mag ? MagHeading(p, r[0], r[1]) : r[2]);
+		for (int i=0; i<3; i++)
+			r[i] = WrapAngle(r[i] + k*WrapAngle(measured[i] - r[i]));
+	}
+	s->filterStamp = p->stamp;
+	memcpy(p->rpy, r, sizeof(p->rpy));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Ring (RX thread writes, anyone reads)
+
+static void Publish(ImuState* s)
+{
+	ImuSample* p = &s->pending;
+
+	if ((p->fresh & s->mask) != s->mask)
+		s->incomplete++;
+	if (s->filterTau > 0.0 && (s->mask & (AHRS_MASK_ACC | AHRS_MASK_GYRO)) == (AHRS_MASK_ACC | AHRS_MASK_GYRO))
+		FilterStep(s, p);
+	else
+	{
+		for (int i=0; i<3; i++)
+			p->rpy[i] = p->raw[0][i] * IMU_POSE_RAD;
+	}
+
+	// the slot before the count, so a reader that sees the count sees the sample
+	s->ring[s->head & (IMU_RING_SIZE-1)] = *p;
+	SEQLOCK_BARRIER();
+	s->head++;
+	SEQLOCK_BARRIER();
+	p->fresh = 0;
+}
+
+void ImuFrame(ImuState* s, int stream, const short* xyz, double stamp)
+{
+	if (stream < 0 || stream >= IMU_STREAMS)
+		return;
+	unsigned char bit = (unsigned char)(1 << stream);
+
+	if (s->frames[stream] == 0)
+		s->firstStamp[stream] = stamp;
+	s->lastStamp[stream] = stamp;
+	s->frames[stream]++;
+	// the stream again before the sample is complete: a frame of the period was lost
+	if (s->pending.fresh & bit)
+		Publish(s);
+	memcpy(s->pending.raw[stream], xyz, sizeof(s->pending.raw[stream]));
+	s->pending.fresh |= bit;
+	s->pending.stamp = stamp;
+	if ((s->pending.fresh & s->mask) == s->mask)
+		Publish(s);
+}
+
+// Copies sample number n; false if the writer came round to its slot meanwhile
+static bool CopySample(const ImuState* s, unsigned int n, ImuSample* sample)
+{
+	*sample = s->ring[n & (IMU_RING_SIZE-1)];
+	SEQLOCK_BARRIER();
+	return (s->head - n < IMU_RING_SIZE);
+}
+
+bool ImuLatest(const ImuState* s, ImuSample* sample)
+{
+	for (;;)
+	{
+		unsigned int head = s->head;
+		SEQLOCK_BARRIER();
+		if (head == 0)
+			return false;
+		if (CopySample(s, head-1, sample))
+			return true;
+	}
+}
+
+int ImuRead(const ImuState* s, unsigned int* next, ImuSample* samples, int n)
+{
+	unsigned int head = s->head;
+	int count = 0;
+
+	// the oldest slot is the one the writer fills next
+	SEQLOCK_BARRIER();
+	if (head - *next > IMU_RING_SIZE-1)
+		*next = head - (IMU_RING_SIZE-1);
+	while (*next != head && count < n)
+	{
+		if (CopySample(s, *next, &samples[count]))
+			count++;
+		(*next)++;
+	}
+	return count;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Rate accounting
+
+void ImuRates(const ImuState* s, double* hz)
+{
+	for (int i=0; i<IMU_STREAMS; i++)
+	{
+		unsigned int n = s->frames[i];
+		double span = s->lastStamp[i] - s->firstStamp[i];
+		hz[i] = (n > 1 && span > 0.0 ? (n - 1) / span : 0.0);
+	}
+}
+
+unsigned int ImuFrames(const ImuState* s)
+{
+	unsigned int n = 0;
+	for (int i=0; i<IMU_STREAMS; i++)
+		n += s->frames[i];
+	return n;
+}
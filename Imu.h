@@ -0,0 +1,85 @@
+#pragma once
+
+#include "SeqLock.h"
+#include "canDef.h"
+
+// AHRS streams of one hand (ID_CMD_AHRS_POSE, _ACC, _GYRO, _MAG), decoded by
+// the RX thread into timestamped samples for the controller and the status
+// output.
+//
+// The frames of one AHRS period arrive one stream after the other. They are
+// collected into a sample, which is published once every stream of the mask
+// has arrived, or early when a stream arrives a second time (a frame of the
+// period was lost; the sample keeps the older values of the missing stream).
+// Published samples go into a ring with one writer, the RX thread, and any
+// number of readers: a reader copies a slot and checks afterwards that the
+// writer has not come round to it meanwhile, so nobody ever waits.
+//
+// The orientation of a sample is the AHRS's own pose, or with a filter time
+// constant, a complementary filter: the gyro integrated, pulled towards the
+// tilt the accelerometer sees (roll, pitch) and the heading of the
+// magnetometer (yaw, when its stream is on; else the gyro alone) with that
+// time constant. The filter needs the acc and gyro streams.
+//
+// Frame counts and receive times per stream let the status output compare
+// the rate the hand delivers with the AHRS_RATE_* it was set to.
+
+#define IMU_STREAMS		4   // pose, acc, gyro, mag; stream s has AHRS_MASK_* bit s
+#define IMU_RING_SIZE	256 // samples kept, a power of two
+
+// sensor scales
+#define IMU_POSE_RAD	(0.01*3.14159265358979/180.0) // 0.01 deg/LSB
+#define IMU_ACC_G		0.001                         // 1 mg/LSB
+#define IMU_GYRO_RAD	(0.01*3.14159265358979/180.0) // 0.01 deg/s/LSB
+#define IMU_MAG_GAUSS	0.001                         // 1 mGauss/LSB
+
+typedef struct tagImuSample
+{
+	double stamp;            // receive time of the frame that completed the sample (sec)
+	short raw[IMU_STREAMS][3]; // sensor counts: roll, pitch, yaw; acc, gyro, mag xyz
+	unsigned char fresh;     // AHRS_MASK_* of the streams that arrived for this sample
+	double rpy[3];           // roll, pitch, yaw (rad): the AHRS pose or the filter
+} ImuSample;
+
+typedef struct tagImuState
+{
+	// ring, written by the RX thread
+	ImuSample ring[IMU_RING_SIZE];
+	volatile unsigned int head; // samples published so far
+
+	// frame counts per stream, written by the RX thread
+	volatile unsigned int frames[IMU_STREAMS];
+	double firstStamp[IMU_STREAMS]; // receive times of the first and the last frame
+	double lastStamp[IMU_STREAMS];
+	volatile unsigned int incomplete; // samples published with a stream missing
+
+	// RX thread only
+	unsigned char mask;      // streams the hand was asked for
+	double filterTau;        // complementary filter time constant (sec), 0 for the AHRS pose
+	ImuSample pending;       // sample being collected
+	bool filterOn;           // the filter has a state
+	double filterRpy[3];
+	double filterStamp;
+} ImuState;
+
+void ImuInit(ImuState* s, unsigned char mask, double filterTau);
+
+// RX thread: one AHRS frame. stream: bit number of its AHRS_MASK_*,
+// xyz: the three values in sensor counts, stamp: receive time (sec)
+void ImuFrame(ImuState* s, int stream, const short* xyz, double stamp);
+
+// Any thread: the newest sample, false before the first one
+bool ImuLatest(const ImuState* s, ImuSample* sample);
+// Any thread: up to n samples from sample number *next on, oldest first.
+// *next moves past them; samples the ring has dropped are skipped.
+int ImuRead(const ImuState* s, unsigned int* next, ImuSample* samples, int n);
+
+// Any thread: frames per second of each stream, between the receive times of
+// its first and last frame (the bus clock when the hand is simulated)
+void ImuRates(const ImuState* s, double* hz);
+unsigned int ImuFrames(const ImuState* s); // all streams
+
+// sample in physical units
+void ImuAcc(const ImuSample* sample, double* g);       // g
+void ImuGyro(const ImuSample* sample, double* rad_s);  // rad/s
+void ImuMag(const ImuSample* sample, double* gauss);   // Gauss
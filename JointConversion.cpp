@@ -0,0 +1,139 @@
+#include "JointConversion.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+// every x86 CPU Windows still runs on has SSE2 (gcc needs -msse2 for 32-bit)
+#define JOINT_CONV_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define JOINT_CONV_NEON
+#include <arm_neon.h>
+#endif
+
+void JointConversionInit(JointConversion* c, const double* enc_dir, const int* enc_offset,
+						 const double* motor_dir, double tau_cov_const, short pwm_max)
+{
+	for (int i=0; i<MAX_DOF; i++)
+	{
+		c->encGain[i] = enc_dir[i] * ENC_RAD_PER_COUNT;
+		c->encBias[i] = (32768.0 + enc_offset[i]) * ENC_RAD_PER_COUNT;
+
+		// clamping the current to +-1 and then the PWM to +-pwm_max is one clamp
+		// of tau*tau_cov_const to the smaller of the two
+		c->pwmScale[i] = motor_dir[i] * tau_cov_const;
+		c->pwmMax[i] = (tau_cov_const < pwm_max ? tau_cov_const : (double)pwm_max);
+		c->motor[i] = (i & ~3) + 3 - (i & 3);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Scalar kernels
+
+void EncoderToAngleScalar(const JointConversion* c, const int* enc, double* q)
+{
+	for (int i=0; i<MAX_DOF; i++)
+		q[i] = enc[i]*c->encGain[i] - c->encBias[i];
+}
+
+void TorqueToPwmScalar(const JointConversion* c, const double* tau, short* pwm)
+{
+	for (int i=0; i<MAX_DOF; i++)
+	{
+		double x = tau[i] * c->pwmScale[i];
+		if (x > c->pwmMax[i]) x = c->pwmMax[i];
+		else if (x < -c->pwmMax[i]) x = -c->pwmMax[i];
+		pwm[c->motor[i]] = (short)x;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// SSE2 kernels: two joints per register
+
+#if defined(JOINT_CONV_SSE2)
+
+void EncoderToAngle(const JointConversion* c, const int* enc, double* q)
+{
+	for (int i=0; i<MAX_DOF; i+=2)
+	{
+		__m128d x = _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)&enc[i]));
+		x = _mm_sub_pd(_mm_mul_pd(x, _mm_loadu_pd(&c->encGain[i])), _mm_loadu_pd(&c->encBias[i]));
+		_mm_storeu_pd(&q[i], x);
+	}
+}
+
+// PWM counts of joints i, i+1, i+2, i+3 as four int32
+static inline __m128i TorqueToPwm4(const JointConversion* c, const double* tau, int i)
+{
+	const __m128d sign = _mm_set1_pd(-0.0);
+	__m128d lim0 = _mm_loadu_pd(&c->pwmMax[i]);
+	__m128d lim1 = _mm_loadu_pd(&c->pwmMax[i+2]);
+	__m128d x0 = _mm_mul_pd(_mm_loadu_pd(&tau[i]), _mm_loadu_pd(&c->pwmScale[i]));
+	__m128d x1 = _mm_mul_pd(_mm_loadu_pd(&tau[i+2]), _mm_loadu_pd(&c->pwmScale[i+2]));
+
+	x0 = _mm_max_pd(_mm_min_pd(x0, lim0), _mm_xor_pd(lim0, sign));
+	x1 = _mm_max_pd(_mm_min_pd(x1, lim1), _mm_xor_pd(lim1, sign));
+	return _mm_unpacklo_epi64(_mm_cvttpd_epi32(x0), _mm_cvttpd_epi32(x1));
+}
+
+void TorqueToPwm(const JointConversion* c, const double* tau, short* pwm)
+{
+	for (int i=0; i<MAX_DOF; i+=8)
+	{
+		// two fingers, then the motor order of each reversed
+		__m128i p = _mm_packs_epi32(TorqueToPwm4(c, tau, i), TorqueToPwm4(c, tau, i+4));
+		p = _mm_shufflelo_epi16(p, _MM_SHUFFLE(0, 1, 2, 3));
+		p = _mm_shufflehi_epi16(p, _MM_SHUFFLE(0, 1, 2, 3));
+		_mm_storeu_si128((__m128i*)&pwm[i], p);
+	}
+}
+
+const char* JointConversionKernel() { return "SSE2"; }
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// NEON kernels (AArch64): two joints per register
+
+#elif defined(JOINT_CONV_NEON)
+
+void EncoderToAngle(const JointConversion* c, const int* enc, double* q)
+{
+	for (int i=0; i<MAX_DOF; i+=2)
+	{
+		float64x2_t x = vcvtq_f64_s64(vmovl_s32(vld1_s32(&enc[i])));
+		x = vsubq_f64(vmulq_f64(x, vld1q_f64(&c->encGain[i])), vld1q_f64(&c->encBias[i]));
+		vst1q_f64(&q[i], x);
+	}
+}
+
+void TorqueToPwm(const JointConversion* c, const double* tau, short* pwm)
+{
+	for (int i=0; i<MAX_DOF; i+=4)
+	{
+		float64x2_t lim0 = vld1q_f64(&c->pwmMax[i]);
+		float64x2_t lim1 = vld1q_f64(&c->pwmMax[i+2]);
+		float64x2_t x0 = vmulq_f64(vld1q_f64(&tau[i]), vld1q_f64(&c->pwmScale[i]));
+		float64x2_t x1 = vmulq_f64(vld1q_f64(&tau[i+2]), vld1q_f64(&c->pwmScale[i+2]));
+
+		x0 = vmaxq_f64(vminq_f64(x0, lim0), vnegq_f64(lim0));
+		x1 = vmaxq_f64(vminq_f64(x1, lim1), vnegq_f64(lim1));
+		int32x4_t p = vcombine_s32(vmovn_s64(vcvtq_s64_f64(x0)), vmovn_s64(vcvtq_s64_f64(x1)));
+		// one finger, motor order reversed
+		vst1_s16(&pwm[i], vrev64_s16(vmovn_s32(p)));
+	}
+}
+
+const char* JointConversionKernel() { return "NEON"; }
+
+#else
+
+void EncoderToAngle(const JointConversion* c, const int* enc, double* q)
+{
+	EncoderToAngleScalar(c, enc, q);
+}
+
+void TorqueToPwm(const JointConversion* c, const double* tau, short* pwm)
+{
+	TorqueToPwmScalar(c, tau, pwm);
+}
+
+const char* JointConversionKernel() { return "scalar"; }
+
+#endif
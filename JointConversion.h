@@ -0,0 +1,46 @@
+#pragma once
+
+#include "rDeviceAllegroHandCANDef.h"
+
+// Per-cycle unit conversions of the control thread: encoder counts to joint
+// angles and joint torques to motor PWM counts. Both are branch-free kernels
+// driven by a per-joint table built once from the hand parameters, with an
+// SSE2 version on x86/x64, a NEON version on AArch64 and a scalar one
+// elsewhere. All versions give the same PWM counts; angles agree to rounding.
+//
+// The motor order on the CAN bus is reversed against the joint order within
+// each finger (joint 4f+j is motor 4f+3-j). The SIMD kernels do that with a
+// shuffle; the scalar one goes through motor[].
+
+// Encoder scale: 333.3 degrees over 65536 counts
+static const double ENC_RAD_PER_COUNT = (333.3/65536.0)*(3.141592/180.0);
+
+// start of a cache line, so the table of a hand shares no line with other data
+#ifdef _MSC_VER
+#define CACHE_ALIGNED	__declspec(align(64))
+#else
+#define CACHE_ALIGNED	__attribute__((aligned(64)))
+#endif
+
+typedef struct CACHE_ALIGNED tagJointConversion
+{
+	// q = enc*encGain - encBias
+	double encGain[MAX_DOF];  // rad per count, with the encoder direction
+	double encBias[MAX_DOF];  // rad, 32768 + encoder offset counts
+	// pwm = (short)clamp(tau*pwmScale, -pwmMax, pwmMax)
+	double pwmScale[MAX_DOF]; // PWM counts per unit torque, with the motor direction
+	double pwmMax[MAX_DOF];   // smaller of the full-scale current and the supply limit
+	int motor[MAX_DOF];       // motor (PWM) index of each joint
+} JointConversion;
+
+// tau_cov_const: PWM counts at full current, pwm_max: limit of the supply voltage
+void JointConversionInit(JointConversion* c, const double* enc_dir, const int* enc_offset,
+						 const double* motor_dir, double tau_cov_const, short pwm_max);
+void EncoderToAngle(const JointConversion* c, const int* enc, double* q);
+void TorqueToPwm(const JointConversion* c, const double* tau, short* pwm);
+
+// scalar versions, also used where no SIMD kernel is compiled in
+void EncoderToAngleScalar(const JointConversion* c, const int* enc, double* q);
+void TorqueToPwmScalar(const JointConversion* c, const double* tau, short* pwm);
+
+const char* JointConversionKernel(); // "SSE2", "NEON" or "scalar"
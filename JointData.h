@@ -0,0 +1,28 @@
+#pragma once
+
+#include "rDeviceAllegroHandCANDef.h"
+#include "SeqLock.h"
+
+// Joint vectors shared between the control thread of a hand and the rest of
+// the application (HandSession::jointState / jointCommand). Each has exactly one
+// writer; readers take a SeqLock snapshot, so they never see a half-updated
+// 16-joint vector and never hold up the writer.
+
+typedef struct tagJointState // written by the control thread
+{
+	double q[MAX_DOF];       // joint positions (rad)
+	double tau_des[MAX_DOF]; // joint torques from BHand
+	double time;             // control time (sec)
+} JointState;
+
+// The control thread switches BHand to motionType when motion changes, at the
+// start of a cycle, so a motion command never lands in the middle of a step.
+typedef struct tagJointCommand // written by the main thread
+{
+	double q_des[MAX_DOF];   // desired joint positions (rad)
+	double kp[MAX_DOF];      // gains set with the motion if gains is true,
+	double kd[MAX_DOF];      // else BHand's defaults for the motion
+	int motionType;          // eMotionType
+	unsigned int motion;     // counts the motion commands, also those that repeat the motion type
+	bool gains;
+} JointCommand;
@@ -0,0 +1,628 @@
+#include <math.h>
+#include <string.h>
+#include "Kinematics.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define KINEMATICS_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define KINEMATICS_NEON
+#include <arm_neon.h>
+#endif
+
+// Geometry of the right hand. The palm splay is the sine and cosine BHand
+// uses (not quite normalized), so that positions match it to the last digit.
+static const double SPLAY_S = 0.0871;
+static const double SPLAY_C = 0.9962;
+
+typedef struct tagKinematicsChain
+{
+	double origin[3];
+	double u[3], v[3], w[3];
+	double len[4];
+	double e;
+} KinematicsChain;
+
+static const KinematicsChain rightHand[KIN_FINGERS] = {
+	// index: splayed towards +y about x
+	{ { 0.0, 0.04365, -0.00224 }, { 1.0, 0.0, 0.0 }, { 0.0, SPLAY_C, -SPLAY_S }, { 0.0, SPLAY_S, SPLAY_C },
+	  { 0.0161, 0.054, 0.0384, 0.0257 }, 0.0 },
+	// middle
+	{ { 0.0, 0.0, 0.0 }, { 1.0, 0.0, 0.0 }, { 0.0, 1.0, 0.0 }, { 0.0, 0.0, 1.0 },
+	  { 0.0161, 0.054, 0.0384, 0.0257 }, 0.0 },
+	// ring: splayed towards -y
+	{ { 0.0, -0.04365, -0.00224 }, { 1.0, 0.0, 0.0 }, { 0.0, SPLAY_C, SPLAY_S }, { 0.0, -SPLAY_S, SPLAY_C },
+	  { 0.0161, 0.054, 0.0384, 0.0257 }, 0.0 },
+	// thumb: q0 turns about -u through the origin, then q1 about w, 5 mm off that axis
+	{ { -0.0182, 0.01697378, -0.07309284 }, { 0.0, SPLAY_S, SPLAY_C }, { 1.0, 0.0, 0.0 }, { 0.0, SPLAY_C, -SPLAY_S },
+	  { 0.0548, 0.0514, 0.037, 0.0 }, 0.005 }
+};
+
+void KinematicsInit(KinematicsModel* m, bool leftHand)
+{
+	for (int f=0; f<KIN_FINGERS; f++)
+	{
+		const KinematicsChain* c = &rightHand[f];
+		bool thumb = (f == KIN_FINGERS-1);
+
+		for (int i=0; i<3; i++)
+		{
+			// mirror: negate y; on the fingers also v, which flips the sign of
+			// the abduction and keeps (u, v, w) right-handed
+			double mirror = (leftHand && i == 1 ? -1.0 : 1.0);
+			m->dOrigin[i][f] = mirror * c->origin[i];
+			m->dU[i][f] = mirror * c->u[i];
+			m->dV[i][f] = (leftHand && !thumb ? -mirror : mirror) * c->v[i];
+			m->dW[i][f] = mirror * c->w[i];
+		}
+		for (int i=0; i<4; i++)
+			m->dLen[i][f] = c->len[i];
+		m->dE[f] = c->e;
+		m->dHanded[f] = (leftHand && thumb ? -1.0 : 1.0);
+
+		for (int i=0; i<3; i++)
+		{
+			m->origin[i][f] = (float)m->dOrigin[i][f];
+			m->u[i][f] = (float)m->dU[i][f];
+			m->v[i][f] = (float)m->dV[i][f];
+			m->w[i][f] = (float)m->dW[i][f];
+		}
+		for (int i=0; i<4; i++)
+			m->len[i][f] = (float)m->dLen[i][f];
+		m->e[f] = (float)m->dE[f];
+		m->handed[f] = (float)m->dHanded[f];
+		m->thumb[f] = (thumb ? 0xffffffffu : 0u);
+	}
+	m->left = leftHand;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Scalar version
+
+void SolveKinematicsScalar(const KinematicsModel* m, const double* q, HandKinematics* k)
+{
+	for (int f=0; f<KIN_FINGERS; f++)
+	{
+		const double* qf = &q[f*KIN_JOINTS];
+		bool thumb = (f == KIN_FINGERS-1);
+		double psi = (thumb ? qf[1] : qf[0]);
+		double p1 = (thumb ? qf[2] : qf[1]);
+		double p2 = (thumb ? qf[3] : qf[2]);
+		double p3 = (thumb ? 0.0 : qf[3]);
+		double theta = (thumb ? qf[0] : 0.0);
+		double l0 = m->dLen[0][f], l1 = m->dLen[1][f], l2 = m->dLen[2][f], l3 = m->dLen[3][f];
+		double sp = sin(psi), cp = cos(psi), st = sin(theta), ct = cos(theta);
+		double s1 = sin(p1), c1 = cos(p1);
+		double s2 = sin(p1+p2), c2 = cos(p1+p2);
+		double s3 = sin(p1+p2+p3), c3 = cos(p1+p2+p3);
+
+		// b_k, a_k: sums of l_i*sin, l_i*cos over the links from joint k on
+		double b3 = l3*s3, b2 = b3 + l2*s2, rho = b2 + l1*s1;
+		double a3 = l3*c3, a2 = a3 + l2*c2, a1 = a2 + l1*c1;
+
+		// (u, v, w) components, then turned by theta
+		double d[6][3] = {
+			{ rho*cp, m->dE[f] + rho*sp, l0 + a1 }, // position
+			{ -rho*sp, rho*cp, 0.0 },               // d/dpsi
+			{ a1*cp, a1*sp, -rho },                 // d/dp1
+			{ a2*cp, a2*sp, -b2 },                  // d/dp2
+			{ a3*cp, a3*sp, -b3 },                  // d/dp3
+			{ cp*s3, sp*s3, c3 }                    // direction of the distal link
+		};
+		for (int r=0; r<6; r++)
+		{
+			double dv = d[r][2]*st + d[r][1]*ct;
+			d[r][2] = d[r][2]*ct - d[r][1]*st;
+			d[r][1] = dv;
+		}
+		double dTheta[3] = { 0.0, d[0][2], -d[0][1] };
+		double n[3] = { -sp, cp*ct, -cp*st }; // axis of the flexion joints
+
+		double world[6][3], dt[3], axis[3];
+		for (int i=0; i<3; i++)
+		{
+			for (int r=0; r<6; r++)
+				world[r][i] = d[r][0]*m->dU[i][f] + d[r][1]*m->dV[i][f] + d[r][2]*m->dW[i][f];
+			dt[i] = dTheta[0]*m->dU[i][f] + dTheta[1]*m->dV[i][f] + dTheta[2]*m->dW[i][f];
+			axis[i] = m->dHanded[f] * (n[0]*m->dU[i][f] + n[1]*m->dV[i][f] + n[2]*m->dW[i][f]);
+		}
+
+		k->x[f] = m->dOrigin[0][f] + world[0][0];
+		k->y[f] = m->dOrigin[1][f] + world[0][1];
+		k->z[f] = m->dOrigin[2][f] + world[0][2];
+		for (int i=0; i<3; i++)
+		{
+			// columns in joint order: the thumb's q0 is theta
+			k->J[f][i][0] = (thumb ? dt[i] : world[1][i]);
+			k->J[f][i][1] = (thumb ? world[1][i] : world[2][i]);
+			k->J[f][i][2] = (thumb ? world[2][i] : world[3][i]);
+			k->J[f][i][3] = (thumb ? world[3][i] : world[4][i]);
+			k->R[f][i][1] = axis[i];
+			k->R[f][i][2] = world[5][i];
+		}
+		k->R[f][0][0] = axis[1]*world[5][2] - axis[2]*world[5][1];
+		k->R[f][1][0] = axis[2]*world[5][0] - axis[0]*world[5][2];
+		k->R[f][2][0] = axis[0]*world[5][1] - axis[1]*world[5][0];
+	}
+}
+
+void SolveKinematicsTorqueScalar(const KinematicsModel* m, const double* q, const double* f, double* tau)
+{
+	HandKinematics k;
+
+	SolveKinematicsScalar(m, q, &k);
+	for (int n=0; n<KIN_FINGERS; n++)
+		for (int j=0; j<KIN_JOINTS; j++)
+			tau[n*KIN_JOINTS + j] = k.J[n][0][j]*f[0] + k.J[n][1][j]*f[1] + k.J[n][2][j]*f[2];
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// SIMD kernels: the four fingers in the lanes of one register. The kernel is
+// written once against the few operations below.
+
+#if defined(KINEMATICS_SSE2) || defined(KINEMATICS_NEON)
+
+#if defined(KINEMATICS_SSE2)
+
+typedef __m128 vf;
+typedef __m128i vi;
+
+static inline vf vAdd(vf a, vf b) { return _mm_add_ps(a, b); }
+static inline vf vSub(vf a, vf b) { return _mm_sub_ps(a, b); }
+static inline vf vMul(vf a, vf b) { return _mm_mul_ps(a, b); }
+static inline vf vSet(float a) { return _mm_set1_ps(a); }
+static inline vf vLoad(const float* p) { return _mm_load_ps(p); }
+static inline vf vLoadMask(const unsigned int* p) { return _mm_load_ps((const float*)p); }
+static inline vf vXor(vf a, vf b) { return _mm_xor_ps(a, b); }
+static inline vf vAnd(vf a, vf b) { return _mm_and_ps(a, b); }
+static inline vf vAndNot(vf mask, vf a) { return _mm_andnot_ps(mask, a); } // a & ~mask
+static inline vf vSelect(vf mask, vf a, vf b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+static inline vi vTrunc(vf a) { return _mm_cvttps_epi32(a); }
+static inline vf vFloat(vi a) { return _mm_cvtepi32_ps(a); }
+static inline vi iAdd(vi a, int b) { return _mm_add_epi32(a, _mm_set1_epi32(b)); }
+static inline vi iAnd(vi a, int b) { return _mm_and_si128(a, _mm_set1_epi32(b)); }
+static inline vf iIsZero(vi a) { return _mm_castsi128_ps(_mm_cmpeq_epi32(a, _mm_setzero_si128())); }
+// bit 2 of a moved to the sign bit
+static inline vf iSignOfBit2(vi a) { return _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(a, _mm_set1_epi32(4)), 29)); }
+
+// four doubles to floats, and the first n lanes back to doubles; the same for floats
+static inline vf vLoadD(const double* p) { return _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(p)), _mm_cvtpd_ps(_mm_loadu_pd(p+2))); }
+static inline void vStoreD(double* p, vf a, int n)
+{
+	_mm_storeu_pd(p, _mm_cvtps_pd(a));
+	if (n == 4)
+		_mm_storeu_pd(p+2, _mm_cvtps_pd(_mm_movehl_ps(a, a)));
+	else
+		p[2] = _mm_cvtss_f32(_mm_movehl_ps(a, a));
+}
+static inline vf vLoadF(const float* p) { return _mm_loadu_ps(p); }
+static inline void vStoreF(float* p, vf a, int n)
+{
+	if (n == 4)
+		_mm_storeu_ps(p, a);
+	else
+	{
+		_mm_storel_pi((__m64*)p, a);
+		_mm_store_ss(p+2, _mm_movehl_ps(a, a));
+	}
+}
+static inline vf vRotate(vf a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(0, 3, 2, 1)); } // lanes 1, 2, 3, 0
+static inline void vTranspose(vf* a) { _MM_TRANSPOSE4_PS(a[0], a[1], a[2], a[3]); }
+
+const char* KinematicsKernel() { return "SSE2"; }
+
+#else
+
+typedef float32x4_t vf;
+typedef int32x4_t vi;
+
+static inline vf vAdd(vf a, vf b) { return vaddq_f32(a, b); }
+static inline vf vSub(vf a, vf b) { return vsubq_f32(a, b); }
+static inline vf vMul(vf a, vf b) { return vmulq_f32(a, b); }
+static inline vf vSet(float a) { return vdupq_n_f32(a); }
+static inline vf vLoad(const float* p) { return vld1q_f32(p); }
+static inline vf vLoadMask(const unsigned int* p) { return vreinterpretq_f32_u32(vld1q_u32(p)); }
+static inline vf vXor(vf a, vf b) { return vreinterpretq_f32_u32(veorq_u32(vreinterpretq_u32_f32(a), vreinterpretq_u32_f32(b))); }
+static inline vf vAnd(vf a, vf b) { return vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(a), vreinterpretq_u32_f32(b))); }
+static inline vf vAndNot(vf mask, vf a) { return vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(a), vreinterpretq_u32_f32(mask))); }
+static inline vf vSelect(vf mask, vf a, vf b) { return vbslq_f32(vreinterpretq_u32_f32(mask), a, b); }
+static inline vi vTrunc(vf a) { return vcvtq_s32_f32(a); }
+static inline vf vFloat(vi a) { return vcvtq_f32_s32(a); }
+static inline vi iAdd(vi a, int b) { return vaddq_s32(a, vdupq_n_s32(b)); }
+static inline vi iAnd(vi a, int b) { return vandq_s32(a, vdupq_n_s32(b)); }
+static inline vf iIsZero(vi a) { return vreinterpretq_f32_u32(vceqq_s32(a, vdupq_n_s32(0))); }
+static inline vf iSignOfBit2(vi a) { return vreinterpretq_f32_s32(vshlq_n_s32(vandq_s32(a, vdupq_n_s32(4)), 29)); }
+
+static inline vf vLoadD(const double* p) { return vcombine_f32(vcvt_f32_f64(vld1q_f64(p)), vcvt_f32_f64(vld1q_f64(p+2))); }
+static inline void vStoreD(double* p, vf a, int n)
+{
+	vst1q_f64(p, vcvt_f64_f32(vget_low_f32(a)));
+	if (n == 4)
+		vst1q_f64(p+2, vcvt_high_f64_f32(a));
+	else
+		p[2] = vgetq_lane_f32(a, 2);
+}
+static inline vf vLoadF(const float* p) { return vld1q_f32(p); }
+static inline void vStoreF(float* p, vf a, int n)
+{
+	if (n == 4)
+		vst1q_f32(p, a);
+	else
+	{
+		vst1_f32(p, vget_low_f32(a));
+		vst1q_lane_f32(p+2, a, 2);
+	}
+}
+static inline vf vRotate(vf a) { return vextq_f32(a, a, 1); }
+static inline void vTranspose(vf* a)
+{
+	float64x2_t t0 = vreinterpretq_f64_f32(vtrn1q_f32(a[0], a[1])), t1 = vreinterpretq_f64_f32(vtrn2q_f32(a[0], a[1]));
+	float64x2_t t2 = vreinterpretq_f64_f32(vtrn1q_f32(a[2], a[3])), t3 = vreinterpretq_f64_f32(vtrn2q_f32(a[2], a[3]));
+	a[0] = vreinterpretq_f32_f64(vtrn1q_f64(t0, t2));
+	a[1] = vreinterpretq_f32_f64(vtrn1q_f64(t1, t3));
+	a[2] = vreinterpretq_f32_f64(vtrn2q_f64(t0, t2));
+	a[3] = vreinterpretq_f32_f64(vtrn2q_f64(t1, t3));
+}
+
+const char* KinematicsKernel() { return "NEON"; }
+
+#endif
+
+// sin and cos of four angles: reduced by pi/4 in three parts, then the
+// single precision minimax polynomials of Cephes' sinf/cosf. About 1e-7
+// absolute for |x| up to a few thousand radians.
+static inline void vSinCos(vf x, vf* s, vf* c)
+{
+	const vf signBit = vSet(-0.0f);
+	vf sign = vAnd(x, signBit);
+	x = vAndNot(signBit, x);
+
+	// octant, rounded up to even
+	vi j = iAnd(iAdd(vTrunc(vMul(x, vSet(1.27323954473516f))), 1), ~1);
+	vf y = vFloat(j);
+	vf polyMask = iIsZero(iAnd(j, 2)); // sin from the sine polynomial
+	vf signSin = vXor(sign, iSignOfBit2(j));
+	vf signCos = vXor(iSignOfBit2(iAdd(j, -2)), signBit);
+
+	x = vSub(x, vMul(y, vSet(0.78515625f)));
+	x = vSub(x, vMul(y, vSet(2.4187564849853515625e-4f)));
+	x = vSub(x, vMul(y, vSet(3.77489497744594108e-8f)));
+	vf z = vMul(x, x);
+
+	vf pc = vAdd(vMul(vSet(2.443315711809948e-5f), z), vSet(-1.388731625493765e-3f));
+	pc = vAdd(vMul(pc, z), vSet(4.166664568298827e-2f));
+	pc = vAdd(vSub(vMul(vMul(pc, z), z), vMul(z, vSet(0.5f))), vSet(1.0f));
+	vf ps = vAdd(vMul(vSet(-1.9515295891e-4f), z), vSet(8.3321608736e-3f));
+	ps = vAdd(vMul(ps, z), vSet(-1.6666654611e-1f));
+	ps = vAdd(vMul(vMul(ps, z), x), x);
+
+	*s = vXor(vSelect(polyMask, ps, pc), signSin);
+	*c = vXor(vSelect(polyMask, pc, ps), signCos);
+}
+
+// Chain constants of the four lanes: the four fingers of a hand, or one
+// finger in every lane, whose lanes then hold four configurations.
+typedef struct tagKinematicsLanes
+{
+	vf origin[3], u[3], v[3], w[3];
+	vf len[4], e, handed, thumb;
+} KinematicsLanes;
+
+enum { LANES_HAND, LANES_FINGER, LANES_THUMB };
+
+static inline void LoadHandLanes(const KinematicsModel* m, KinematicsLanes* c)
+{
+	for (int i=0; i<3; i++)
+	{
+		c->origin[i] = vLoad(m->origin[i]);
+		c->u[i] = vLoad(m->u[i]);
+		c->v[i] = vLoad(m->v[i]);
+		c->w[i] = vLoad(m->w[i]);
+	}
+	for (int i=0; i<4; i++)
+		c->len[i] = vLoad(m->len[i]);
+	c->e = vLoad(m->e);
+	c->handed = vLoad(m->handed);
+	c->thumb = vLoadMask(m->thumb);
+}
+
+static inline void LoadFingerLanes(const KinematicsModel* m, int f, KinematicsLanes* c)
+{
+	for (int i=0; i<3; i++)
+	{
+		c->origin[i] = vSet(m->origin[i][f]);
+		c->u[i] = vSet(m->u[i][f]);
+		c->v[i] = vSet(m->v[i][f]);
+		c->w[i] = vSet(m->w[i][f]);
+	}
+	for (int i=0; i<4; i++)
+		c->len[i] = vSet(m->len[i][f]);
+	c->e = vSet(m->e[f]);
+	c->handed = vSet(m->handed[f]);
+	c->thumb = vSet(0.0f); // unused, the kind of lanes tells the thumb
+}
+
+// (u, v, w) components of a vector to the palm frame
+static inline void vToWorld(const KinematicsLanes* c, vf du, vf dv, vf dw, vf* out)
+{
+	for (int i=0; i<3; i++)
+		out[i] = vAdd(vAdd(vMul(du, c->u[i]), vMul(dv, c->v[i])), vMul(dw, c->w[i]));
+}
+
+// turns (v, w) by theta, then to the palm frame; fingers have no theta
+static inline void vTurnToWorld(const KinematicsLanes* c, int kind, vf st, vf ct, vf du, vf dv, vf dw, vf* out)
+{
+	if (kind == LANES_FINGER)
+		vToWorld(c, du, dv, dw, out);
+	else
+		vToWorld(c, du, vAdd(vMul(dw, st), vMul(dv, ct)), vSub(vMul(dw, ct), vMul(dv, st)), out);
+}
+
+typedef struct tagKinematicsLaneResult
+{
+	vf pos[3];
+	vf J[KIN_JOINTS][3];  // columns in joint order
+	vf side[3], axis[3], tip[3]; // columns of R
+} KinematicsLaneResult;
+
+// a: psi, p1, p2 by lane, then p3 on the fingers or theta on the thumb. Each
+// kind of lanes gets its own copy, which only does the work of that kind.
+template <int kind>
+static void SolveLanes(const KinematicsLanes* c, const vf* a, bool jacobian, bool orientation, KinematicsLaneResult* r)
+{
+	vf zero = vSet(0.0f), one = vSet(1.0f);
+	vf p1 = a[1], p12 = vAdd(p1, a[2]), p123, theta = zero;
+	if (kind == LANES_HAND)
+	{
+		p123 = vAdd(p12, vAndNot(c->thumb, a[3]));
+		theta = vAnd(c->thumb, a[3]);
+	}
+	else if (kind == LANES_FINGER)
+		p123 = vAdd(p12, a[3]);
+	else
+	{
+		p123 = p12;
+		theta = a[3];
+	}
+
+	vf sp, cp, s1, c1, s2, c2, s3, c3, st = zero, ct = one;
+	vSinCos(a[0], &sp, &cp);
+	vSinCos(p1, &s1, &c1);
+	vSinCos(p12, &s2, &c2);
+	if (kind == LANES_THUMB)
+	{
+		s3 = s2;
+		c3 = c2;
+	}
+	else
+		vSinCos(p123, &s3, &c3);
+	if (kind != LANES_FINGER)
+		vSinCos(theta, &st, &ct);
+
+	vf b3 = vMul(c->len[3], s3), b2 = vAdd(b3, vMul(c->len[2], s2)), rho = vAdd(b2, vMul(c->len[1], s1));
+	vf a3 = vMul(c->len[3], c3), a2 = vAdd(a3, vMul(c->len[2], c2)), a1 = vAdd(a2, vMul(c->len[1], c1));
+
+	// position, turned by theta
+	vf pu = vMul(rho, cp), pv = vAdd(c->e, vMul(rho, sp)), pw = vAdd(c->len[0], a1);
+	if (kind != LANES_FINGER)
+	{
+		vf pv0 = pv;
+		pv = vAdd(vMul(pw, st), vMul(pv0, ct));
+		pw = vSub(vMul(pw, ct), vMul(pv0, st));
+	}
+	vToWorld(c, pu, pv, pw, r->pos);
+	for (int i=0; i<3; i++)
+		r->pos[i] = vAdd(r->pos[i], c->origin[i]);
+
+	if (jacobian)
+	{
+		vf dPsi[3], d1[3], d2[3], d3[3], dTheta[3];
+		vTurnToWorld(c, kind, st, ct, vSub(zero, vMul(rho, sp)), vMul(rho, cp), zero, dPsi);
+		vTurnToWorld(c, kind, st, ct, vMul(a1, cp), vMul(a1, sp), vSub(zero, rho), d1);
+		vTurnToWorld(c, kind, st, ct, vMul(a2, cp), vMul(a2, sp), vSub(zero, b2), d2);
+		if (kind != LANES_THUMB)
+			vTurnToWorld(c, kind, st, ct, vMul(a3, cp), vMul(a3, sp), vSub(zero, b3), d3);
+		if (kind != LANES_FINGER)
+			vToWorld(c, zero, pw, vSub(zero, pv), dTheta);
+		for (int i=0; i<3; i++)
+		{
+			// the thumb's q0 is theta
+			if (kind == LANES_HAND)
+			{
+				r->J[0][i] = vSelect(c->thumb, dTheta[i], dPsi[i]);
+				r->J[1][i] = vSelect(c->thumb, dPsi[i], d1[i]);
+				r->J[2][i] = vSelect(c->thumb, d1[i], d2[i]);
+				r->J[3][i] = vSelect(c->thumb, d2[i], d3[i]);
+			}
+			else if (kind == LANES_FINGER)
+			{
+				r->J[0][i] = dPsi[i];
+				r->J[1][i] = d1[i];
+				r->J[2][i] = d2[i];
+				r->J[3][i] = d3[i];
+			}
+			else
+			{
+				r->J[0][i] = dTheta[i];
+				r->J[1][i] = dPsi[i];
+				r->J[2][i] = d1[i];
+				r->J[3][i] = d2[i];
+			}
+		}
+	}
+
+	if (orientation)
+	{
+		vTurnToWorld(c, kind, st, ct, vMul(cp, s3), vMul(sp, s3), c3, r->tip);
+		vTurnToWorld(c, kind, st, ct, vSub(zero, sp), cp, zero, r->axis);
+		for (int i=0; i<3; i++)
+			r->axis[i] = vMul(r->axis[i], c->handed);
+		for (int i=0; i<3; i++)
+		{
+			int i1 = (i+1) % 3, i2 = (i+2) % 3;
+			r->side[i] = vSub(vMul(r->axis[i1], r->tip[i2]), vMul(r->axis[i2], r->tip[i1]));
+		}
+	}
+}
+
+void SolveKinematics(const KinematicsModel* m, const double* q, HandKinematics* k)
+{
+	// lane f is finger f; the thumb's joints are rotated by one, so that
+	// its theta (q0) comes where the fingers have p3
+	KinematicsLanes c;
+	KinematicsLaneResult r;
+	vf a[KIN_JOINTS];
+
+	for (int f=0; f<KIN_FINGERS; f++)
+		a[f] = vLoadD(&q[f*KIN_JOINTS]);
+	a[KIN_FINGERS-1] = vRotate(a[KIN_FINGERS-1]);
+	vTranspose(a);
+	LoadHandLanes(m, &c);
+	SolveLanes<LANES_HAND>(&c, a, true, true, &r);
+
+	vStoreD(k->x, r.pos[0], 4);
+	vStoreD(k->y, r.pos[1], 4);
+	vStoreD(k->z, r.pos[2], 4);
+	for (int i=0; i<3; i++)
+	{
+		// lanes to fingers
+		vf j[KIN_JOINTS] = { r.J[0][i], r.J[1][i], r.J[2][i], r.J[3][i] };
+		vTranspose(j);
+		for (int f=0; f<KIN_FINGERS; f++)
+			vStoreD(k->J[f][i], j[f], KIN_JOINTS);
+
+		vf rot[KIN_FINGERS] = { r.side[i], r.axis[i], r.tip[i], vSet(0.0f) };
+		vTranspose(rot);
+		for (int f=0; f<KIN_FINGERS; f++)
+			vStoreD(k->R[f][i], rot[f], 3);
+	}
+}
+
+void SolveKinematicsTorque(const KinematicsModel* m, const double* q, const double* f, double* tau)
+{
+	KinematicsLanes c;
+	KinematicsLaneResult r;
+	vf a[KIN_JOINTS], t[KIN_JOINTS];
+	vf fx = vSet((float)f[0]), fy = vSet((float)f[1]), fz = vSet((float)f[2]);
+
+	for (int n=0; n<KIN_FINGERS; n++)
+		a[n] = vLoadD(&q[n*KIN_JOINTS]);
+	a[KIN_FINGERS-1] = vRotate(a[KIN_FINGERS-1]);
+	vTranspose(a);
+	LoadHandLanes(m, &c);
+	SolveLanes<LANES_HAND>(&c, a, true, false, &r);
+
+	// joint j of the four fingers, then lanes to fingers
+	for (int j=0; j<KIN_JOINTS; j++)
+		t[j] = vAdd(vAdd(vMul(r.J[j][0], fx), vMul(r.J[j][1], fy)), vMul(r.J[j][2], fz));
+	vTranspose(t);
+	for (int n=0; n<KIN_FINGERS; n++)
+		vStoreD(&tau[n*KIN_JOINTS], t[n], KIN_JOINTS);
+}
+
+// Four configurations of finger f, one per lane.
+template <int kind>
+static void SolveFingerOf4(const KinematicsLanes* c, int f, const float* q, float* tips, float* J)
+{
+	KinematicsLaneResult r;
+	vf a[4];
+
+	for (int n=0; n<4; n++)
+	{
+		a[n] = vLoadF(&q[n*MAX_DOF + f*KIN_JOINTS]);
+		if (kind == LANES_THUMB)
+			a[n] = vRotate(a[n]);
+	}
+	vTranspose(a);
+	SolveLanes<kind>(c, a, (J != NULL), false, &r);
+
+	// lanes to configurations
+	vf p[4] = { r.pos[0], r.pos[1], r.pos[2], vSet(0.0f) };
+	vTranspose(p);
+	for (int n=0; n<4; n++)
+		vStoreF(&tips[(n*KIN_FINGERS + f)*3], p[n], 3);
+	if (J != NULL)
+	{
+		for (int i=0; i<3; i++)
+		{
+			vf j[KIN_JOINTS] = { r.J[0][i], r.J[1][i], r.J[2][i], r.J[3][i] };
+			vTranspose(j);
+			for (int n=0; n<4; n++)
+				vStoreF(&J[((n*KIN_FINGERS + f)*3 + i)*KIN_JOINTS], j[n], KIN_JOINTS);
+		}
+	}
+}
+
+// Four configurations of every finger.
+static void SolveHandsOf4(const KinematicsLanes* c, const float* q, float* tips, float* J)
+{
+	for (int f=0; f<KIN_FINGERS-1; f++)
+		SolveFingerOf4<LANES_FINGER>(&c[f], f, q, tips, J);
+	SolveFingerOf4<LANES_THUMB>(&c[KIN_FINGERS-1], KIN_FINGERS-1, q, tips, J);
+}
+
+void SolveKinematicsBlock(const KinematicsModel* m, const float* q, int n, float* tips, float* J)
+{
+	KinematicsLanes c[KIN_FINGERS];
+	int k;
+
+	for (int f=0; f<KIN_FINGERS; f++)
+		LoadFingerLanes(m, f, &c[f]);
+	for (k=0; k+4<=n; k+=4)
+		SolveHandsOf4(c, &q[k*MAX_DOF], &tips[k*KIN_FINGERS*3], (J != NULL ? &J[k*KIN_BATCH_J] : NULL));
+
+	if (k < n)
+	{
+		// the last one to three, padded with zero angles
+		float qPad[4][MAX_DOF], tipsPad[4][KIN_FINGERS*3], jPad[4][KIN_BATCH_J];
+		int rest = n - k;
+
+		memset(qPad, 0, sizeof(qPad));
+		memcpy(qPad, &q[k*MAX_DOF], rest*sizeof(qPad[0]));
+		SolveHandsOf4(c, qPad[0], tipsPad[0], (J != NULL ? jPad[0] : NULL));
+		memcpy(&tips[k*KIN_FINGERS*3], tipsPad, rest*sizeof(tipsPad[0]));
+		if (J != NULL)
+			memcpy(&J[k*KIN_BATCH_J], jPad, rest*sizeof(jPad[0]));
+	}
+}
+
+#else
+
+void SolveKinematics(const KinematicsModel* m, const double* q, HandKinematics* k)
+{
+	SolveKinematicsScalar(m, q, k);
+}
+
+void SolveKinematicsTorque(const KinematicsModel* m, const double* q, const double* f, double* tau)
+{
+	SolveKinematicsTorqueScalar(m, q, f, tau);
+}
+
+void SolveKinematicsBlock(const KinematicsModel* m, const float* q, int n, float* tips, float* J)
+{
+	double qd[MAX_DOF];
+	HandKinematics h;
+
+	for (int k=0; k<n; k++)
+	{
+		for (int i=0; i<MAX_DOF; i++)
+			qd[i] = q[k*MAX_DOF + i];
+		SolveKinematicsScalar(m, qd, &h);
+		for (int f=0; f<KIN_FINGERS; f++)
+		{
+			tips[(k*KIN_FINGERS + f)*3 + 0] = (float)h.x[f];
+			tips[(k*KIN_FINGERS + f)*3 + 1] = (float)h.y[f];
+			tips[(k*KIN_FINGERS + f)*3 + 2] = (float)h.z[f];
+			if (J != NULL)
+			{
+				for (int i=0; i<3; i++)
+					for (int j=0; j<KIN_JOINTS; j++)
+						J[k*KIN_BATCH_J + (f*3 + i)*KIN_JOINTS + j] = (float)h.J[f][i][j];
+			}
+		}
+	}
+}
+
+const char* KinematicsKernel() { return "scalar"; }
+
+#endif
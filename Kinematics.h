@@ -0,0 +1,102 @@
+#pragma once
+
+// Forward kinematics of the four fingertips and their Jacobians, in the palm
+// frame and joint conventions of BHand (BHand::GetFKResult(), metres, x out of
+// the palm, y towards the index finger on the right hand, z along the
+// fingers). One call solves the whole hand.
+//
+// Every finger is evaluated by the same chain, so the four fingers run side by
+// side in the lanes of one SIMD register (lane f is finger f, structure of
+// arrays) with a polynomial sin/cos: SSE2 on x86/x64, NEON on AArch64, and the
+// double precision scalar version elsewhere. The SIMD kernels compute in single
+// precision; positions agree with the scalar version to 0.1 micrometre.
+//
+// The chain of a finger, in its own frame (u, v, w): the tip sits at
+//   (rho*cos(psi), e + rho*sin(psi), zeta)
+//   rho  = l1*sin(p1) + l2*sin(p1+p2) + l3*sin(p1+p2+p3)
+//   zeta = l0 + l1*cos(p1) + l2*cos(p1+p2) + l3*cos(p1+p2+p3)
+// psi turns about w, the flexion joints p1..p3 about v (turned by psi). The
+// fingers have psi, p1, p2, p3 = q0..q3 and e = 0. The thumb has psi = q1,
+// p1, p2 = q2, q3, no third link, and its q0 turns the whole chain by theta
+// about -u, the axis the thumb opposes about.
+//
+// Left hands are the mirror image (y -> -y) of right hands. The abduction of
+// the fingers changes sign with it, so that a positive q0 moves the tip
+// towards +y on either hand, as BHand does; the thumb keeps its joint signs.
+// BHand's left index and ring fingers are not a mirror of its right ones and
+// differ from this model by up to 2.5 cm; middle finger and thumb agree.
+
+#include "rDeviceAllegroHandCANDef.h"
+
+#define KIN_FINGERS	4 // fingers of a hand, lane f is finger f
+#define KIN_JOINTS	4 // joints of a finger
+
+#ifndef CACHE_ALIGNED
+#ifdef _MSC_VER
+#define CACHE_ALIGNED	__declspec(align(64))
+#else
+#define CACHE_ALIGNED	__attribute__((aligned(64)))
+#endif
+#endif
+
+// Chain parameters, lane f is finger f. The world frame of a finger is
+// origin + pu*u + pv*v + pw*w.
+typedef struct CACHE_ALIGNED tagKinematicsModel
+{
+	float origin[3][KIN_FINGERS]; // base of the chain in the palm frame (x, y, z; m)
+	float u[3][KIN_FINGERS];      // direction the flexion joints move the tip at psi = 0
+	float v[3][KIN_FINGERS];      // axis of the flexion joints at psi = 0 (the negated one on the left thumb)
+	float w[3][KIN_FINGERS];      // axis of psi
+	float len[4][KIN_FINGERS];    // l0..l3 (m)
+	float e[KIN_FINGERS];         // offset along v (m)
+	float handed[KIN_FINGERS];    // +1 for a right-handed (u, v, w), -1 for the left thumb
+	unsigned int thumb[KIN_FINGERS]; // all bits set in the lane of the thumb
+	// the same in double precision, for the scalar version
+	double dOrigin[3][KIN_FINGERS];
+	double dU[3][KIN_FINGERS];
+	double dV[3][KIN_FINGERS];
+	double dW[3][KIN_FINGERS];
+	double dLen[4][KIN_FINGERS];
+	double dE[KIN_FINGERS];
+	double dHanded[KIN_FINGERS];
+	bool left;
+} KinematicsModel;
+
+typedef struct tagHandKinematics
+{
+	double x[KIN_FINGERS];        // fingertip positions (m), as BHand::GetFKResult()
+	double y[KIN_FINGERS];
+	double z[KIN_FINGERS];
+	// Orientation of the distal link, a rotation matrix whose columns are the
+	// axis of the last flexion joint cross the link (the side the tip
+	// presses with), the axis of the last flexion joint and the direction
+	// from that joint to the tip.
+	double R[KIN_FINGERS][3][3];
+	// Jacobian of each fingertip position in the joints of its finger:
+	// J[f][i][j] = d(x, y, z)[i] / dq[4f+j], as BHand's _J.
+	double J[KIN_FINGERS][3][KIN_JOINTS];
+} HandKinematics;
+
+void KinematicsInit(KinematicsModel* m, bool leftHand);
+// q: joint angles of the hand (MAX_DOF, rad)
+void SolveKinematics(const KinematicsModel* m, const double* q, HandKinematics* k);
+
+// Joint torques of the same force f (palm frame, N) on every fingertip,
+// tau[4f+j] = sum_i J[f][i][j]*f[i], without storing the Jacobians. On a
+// chain whose lengths are mass moments this is the gravity term (Gravity.h).
+void SolveKinematicsTorque(const KinematicsModel* m, const double* q, const double* f, double* tau);
+
+// n configurations at once, four per register (lane k is configuration k),
+// positions and Jacobians only; KinematicsBatch.h spreads them over threads.
+// Single precision in and out, like the kernel, which halves the memory
+// traffic that bounds large sets.
+// q: n x MAX_DOF joint angles, tips: n x KIN_FINGERS x (x, y, z),
+// J: n x KIN_BATCH_J laid out as HandKinematics::J, or NULL to skip them.
+#define KIN_BATCH_J	(KIN_FINGERS*3*KIN_JOINTS)
+void SolveKinematicsBlock(const KinematicsModel* m, const float* q, int n, float* tips, float* J);
+
+// double precision scalar versions, also used where no SIMD kernel is compiled in
+void SolveKinematicsScalar(const KinematicsModel* m, const double* q, HandKinematics* k);
+void SolveKinematicsTorqueScalar(const KinematicsModel* m, const double* q, const double* f, double* tau);
+
+const char* KinematicsKernel(); // "SSE2", "NEON" or "scalar"
@@ -0,0 +1,123 @@
+#ifdef _WIN32
+#include "windows.h"
+#else
+#include <unistd.h>
+#endif
+#include "KinematicsBatch.h"
+
+#ifdef _WIN32
+#define POOL_FETCH_ADD(p, n)	InterlockedExchangeAdd((volatile LONG*)(p), (LONG)(n))
+#else
+#define POOL_FETCH_ADD(p, n)	__sync_fetch_and_add((p), (n))
+#endif
+
+static int CpuCount()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0 ? (int)n : 1);
+#endif
+}
+
+// Takes chunks of the batch until none is left.
+static void SolveChunks(KinematicsPool* pool)
+{
+	for (;;)
+	{
+		long k = POOL_FETCH_ADD(&pool->next, KIN_BATCH_CHUNK);
+		if (k >= pool->n)
+			break;
+		int count = (int)(pool->n - k < KIN_BATCH_CHUNK ? pool->n - k : KIN_BATCH_CHUNK);
+		SolveKinematicsBlock(pool->model, &pool->q[(size_t)k*MAX_DOF], count, &pool->tips[(size_t)k*KIN_FINGERS*3],
+			(pool->J != NULL ? &pool->J[(size_t)k*KIN_BATCH_J] : NULL));
+	}
+}
+
+static void WorkerThreadProc(void* arg)
+{
+	KinematicsWorker* w = (KinematicsWorker*)arg;
+	KinematicsPool* pool = w->pool;
+
+	for (;;)
+	{
+		RtEventWait(&w->wake, -1);
+		if (pool->quit)
+			break;
+		SolveChunks(pool);
+		if (POOL_FETCH_ADD(&pool->running, -1) == 1)
+			RtEventSet(&pool->done);
+	}
+}
+
+bool KinematicsPoolStart(KinematicsPool* pool, int threads)
+{
+	if (threads <= 0)
+		threads = CpuCount();
+	if (threads > KIN_POOL_MAX + 1)
+		threads = KIN_POOL_MAX + 1;
+
+	pool->workers = 0;
+	pool->quit = false;
+	RtEventCreate(&pool->done);
+	for (int i=0; i<threads-1; i++)
+	{
+		KinematicsWorker* w = &pool->worker[pool->workers];
+		w->pool = pool;
+		RtEventCreate(&w->wake);
+		if (!RtThreadStart(&w->thread, "Kinematics", WorkerThreadProc, w, -1, 0))
+		{
+			RtEventDestroy(&w->wake);
+			break;
+		}
+		pool->workers++;
+	}
+	return (threads == 1 || pool->workers > 0);
+}
+
+void KinematicsPoolStop(KinematicsPool* pool)
+{
+	int i;
+
+	pool->quit = true;
+	for (i=0; i<pool->workers; i++)
+		RtEventSet(&pool->worker[i].wake);
+	for (i=0; i<pool->workers; i++)
+	{
+		RtThreadJoin(&pool->worker[i].thread);
+		RtEventDestroy(&pool->worker[i].wake);
+	}
+	pool->workers = 0;
+	RtEventDestroy(&pool->done);
+}
+
+int KinematicsPoolThreads(const KinematicsPool* pool)
+{
+	return (pool != NULL ? pool->workers + 1 : 1);
+}
+
+void SolveKinematicsBatch(KinematicsPool* pool, const KinematicsModel* m, const float* q, int n,
+						  float* tips, float* J)
+{
+	if (pool == NULL || pool->workers == 0 || n <= KIN_BATCH_CHUNK)
+	{
+		SolveKinematicsBlock(m, q, n, tips, J);
+		return;
+	}
+
+	pool->model = m;
+	pool->q = q;
+	pool->tips = tips;
+	pool->J = J;
+	pool->n = n;
+	pool->next = 0;
+	pool->running = pool->workers;
+	for (int i=0; i<pool->workers; i++)
+		RtEventSet(&pool->worker[i].wake); // also publishes the batch to the worker
+
+	SolveChunks(pool);
+	RtEventWait(&pool->done, -1);
+}
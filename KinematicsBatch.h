@@ -0,0 +1,51 @@
+#pragma once
+
+#include "Kinematics.h"
+#include "RtThread.h"
+
+// Fingertip positions and Jacobians of large sets of hand configurations
+// (grasp databases), spread over a pool of worker threads. Each thread takes
+// KIN_BATCH_CHUNK configurations at a time from a shared counter and solves
+// them with SolveKinematicsBlock(), four per register; the calling thread
+// works along and returns when the whole set is done. Workers sleep on their
+// event between batches.
+
+#define KIN_POOL_MAX	64   // worker threads
+#define KIN_BATCH_CHUNK	1024 // configurations taken at a time
+
+struct tagKinematicsPool;
+
+typedef struct tagKinematicsWorker
+{
+	struct tagKinematicsPool* pool;
+	RtThread thread;
+	RtEvent wake;               // a batch is ready, or quit
+} KinematicsWorker;
+
+typedef struct tagKinematicsPool
+{
+	KinematicsWorker worker[KIN_POOL_MAX];
+	int workers;                // threads besides the caller
+	RtEvent done;               // the last worker finished its part
+	bool quit;
+
+	// batch being solved
+	const KinematicsModel* model;
+	const float* q;
+	float* tips;
+	float* J;
+	long n;
+	volatile long next;         // first configuration not taken yet
+	volatile long running;      // workers still busy with the batch
+} KinematicsPool;
+
+// threads: total including the caller, 0 for one per CPU. false if no worker could be started.
+bool KinematicsPoolStart(KinematicsPool* pool, int threads);
+void KinematicsPoolStop(KinematicsPool* pool);
+int KinematicsPoolThreads(const KinematicsPool* pool); // including the caller
+
+// Solves n configurations: q n x MAX_DOF, tips n x KIN_FINGERS x 3, J n x
+// KIN_BATCH_J or NULL (see SolveKinematicsBlock()). Only one batch runs at a
+// time per pool. pool may be NULL to solve on the calling thread alone.
+void SolveKinematicsBatch(KinematicsPool* pool, const KinematicsModel* m, const float* q, int n,
+						  float* tips, float* J);
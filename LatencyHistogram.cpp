@@ -0,0 +1,130 @@
+#include <string.h>
+#include "LatencyHistogram.h"
+
+void HistInit(LatencyHistogram* h, const char* name, double budget)
+{
+	memset((void*)h, 0, sizeof(LatencyHistogram));
+	h->name = name;
+	h->budget = (unsigned int)(budget*1e6 + 0.5);
+	h->min = 0xffffffff;
+}
+
+unsigned int HistBucketIndex(unsigned int usec)
+{
+	if (usec < HIST_SUB_BUCKET_COUNT)
+		return usec;
+
+	// shift the value down until it fits the upper half of the sub-buckets
+	unsigned int shift = 0;
+	while ((usec >> shift) >= HIST_SUB_BUCKET_COUNT)
+		shift++;
+	if (shift > HIST_MAGNITUDES)
+		return HIST_BUCKET_COUNT - 1;
+	return HIST_SUB_BUCKET_COUNT + (shift-1)*HIST_SUB_BUCKET_HALF + ((usec >> shift) - HIST_SUB_BUCKET_HALF);
+}
+
+unsigned int HistBucketValue(unsigned int index)
+{
+	if (index < HIST_SUB_BUCKET_COUNT)
+		return index;
+
+	unsigned int shift = (index - HIST_SUB_BUCKET_COUNT) / HIST_SUB_BUCKET_HALF + 1;
+	unsigned int sub = (index - HIST_SUB_BUCKET_COUNT) % HIST_SUB_BUCKET_HALF + HIST_SUB_BUCKET_HALF;
+	return ((sub + 1) << shift) - 1;
+}
+
+void HistRecord(LatencyHistogram* h, double value)
+{
+	unsigned int usec;
+	if (value <= 0.0) usec = 0;
+	else if (value >= 4294.0) usec = 0xffffffff;
+	else usec = (unsigned int)(value*1e6 + 0.5);
+
+	h->counts[HistBucketIndex(usec)]++;
+	h->total++;
+	if (usec < h->min) h->min = usec;
+	if (usec > h->max) h->max = usec;
+	if (h->budget && usec > h->budget)
+	{
+		h->misses++;
+		h->missRun++;
+		if (h->missRun > h->missRunMax) h->missRunMax = h->missRun;
+	}
+	else
+	{
+		h->missRun = 0;
+	}
+}
+
+void HistSnapshot(const LatencyHistogram* h, LatencyHistogram* copy)
+{
+	unsigned int total = 0;
+
+	copy->name = h->name;
+	copy->budget = h->budget;
+	for (int i=0; i<HIST_BUCKET_COUNT; i++)
+	{
+		copy->counts[i] = h->counts[i];
+		total += copy->counts[i];
+	}
+	// the buckets are the reference, total may already count a newer sample
+	copy->total = total;
+	copy->min = h->min;
+	copy->max = h->max;
+	copy->misses = h->misses;
+	copy->missRun = h->missRun;
+	copy->missRunMax = h->missRunMax;
+}
+
+unsigned int HistPercentile(const LatencyHistogram* h, double percentile)
+{
+	if (h->total == 0)
+		return 0;
+
+	unsigned int target = (unsigned int)(percentile/100.0 * h->total + 0.5);
+	unsigned int sum = 0;
+	if (target < 1) target = 1;
+	for (int i=0; i<HIST_BUCKET_COUNT; i++)
+	{
+		sum += h->counts[i];
+		if (sum >= target)
+		{
+			unsigned int value = HistBucketValue(i);
+			return (value < h->max ? value : h->max);
+		}
+	}
+	return h->max;
+}
+
+void HistPrint(const LatencyHistogram* h)
+{
+	LatencyHistogram s;
+	HistSnapshot(h, &s);
+	printf("  %-12s %10u %8u %8u %8u %8u %8u %8u %8u  %u (run %u)\n", s.name, s.total,
+		(s.total ? s.min : 0),
+		HistPercentile(&s, 50.0), HistPercentile(&s, 90.0), HistPercentile(&s, 99.0),
+		HistPercentile(&s, 99.9), HistPercentile(&s, 99.99),
+		s.max, s.misses, s.missRunMax);
+}
+
+void HistDump(const LatencyHistogram* h, FILE* fp)
+{
+	LatencyHistogram s;
+	unsigned int sum = 0;
+
+	HistSnapshot(h, &s);
+	fprintf(fp, "# %s: %u samples, budget %u usec, %u over budget\n", s.name, s.total, s.budget, s.misses);
+	fprintf(fp, "# %10s %12s %10s %12s\n", "value_usec", "percentile", "count", "1/(1-p)");
+	for (int i=0; i<HIST_BUCKET_COUNT; i++)
+	{
+		if (s.counts[i] == 0)
+			continue;
+		sum += s.counts[i];
+		double p = (double)sum / s.total;
+		if (p < 1.0)
+			fprintf(fp, "%12u %12.6f %10u %12.2f\n", HistBucketValue(i), p, s.counts[i], 1.0/(1.0-p));
+		else
+			fprintf(fp, "%12u %12.6f %10u %12s\n", HistBucketValue(i), p, s.counts[i], "inf");
+	}
+	fprintf(fp, "\n");
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdio.h>
+
+// Log-linear latency histogram in the style of HdrHistogram.
+// Values are kept in microseconds: 0..31 usec at 1 usec resolution, then
+// 16 sub-buckets per power of two (about 3% relative error) up to ~2 sec.
+// Larger values land in the last bucket.
+//
+// Each histogram has a single writer (the thread that owns the measurement)
+// and takes no lock. Every counter is one aligned word, so another thread
+// can read it at any time; a snapshot may be a few samples behind but never
+// holds a torn counter.
+#define HIST_SUB_BUCKET_BITS	5
+#define HIST_SUB_BUCKET_COUNT	(1 << HIST_SUB_BUCKET_BITS)
+#define HIST_SUB_BUCKET_HALF	(HIST_SUB_BUCKET_COUNT / 2)
+#define HIST_MAGNITUDES			16
+#define HIST_BUCKET_COUNT		(HIST_SUB_BUCKET_COUNT + HIST_MAGNITUDES*HIST_SUB_BUCKET_HALF)
+
+typedef struct tagLatencyHistogram
+{
+	const char* name;
+	unsigned int budget;  // usec, samples above it count as misses
+	volatile unsigned int counts[HIST_BUCKET_COUNT];
+	volatile unsigned int total;
+	volatile unsigned int min; // usec
+	volatile unsigned int max; // usec
+	volatile unsigned int misses;    // samples above budget
+	volatile unsigned int missRun;   // consecutive samples above budget, up to the last one
+	volatile unsigned int missRunMax;
+} LatencyHistogram;
+
+void HistInit(LatencyHistogram* h, const char* name, double budget); // budget in seconds
+void HistRecord(LatencyHistogram* h, double value); // seconds, writer thread only
+void HistSnapshot(const LatencyHistogram* h, LatencyHistogram* copy);
+
+unsigned int HistBucketIndex(unsigned int usec);
+unsigned int HistBucketValue(unsigned int index); // highest value (usec) that maps onto the bucket
+unsigned int HistPercentile(const LatencyHistogram* h, double percentile); // usec
+
+void HistPrint(const LatencyHistogram* h); // one summary line
+void HistDump(const LatencyHistogram* h, FILE* fp); // percentile distribution, one line per used bucket
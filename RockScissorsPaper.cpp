@@ -1,5 +1,7 @@
 #include "rDeviceAllegroHandCANDef.h"
 #include "BHand/BHand.h"
+#include "HandSession.h"
+#include "RockScissorsPaper.h"
 
 // ROCK-SCISSORS-PAPER(LEFT HAND)
 //static double rock[] = {
@@ -35,50 +37,31 @@ static double scissors[] = {
 	1.0244, 1.0, 0.6331, 1.3509, 1.0};
 
 
-extern BHand* pBHand;
-extern double q_des[MAX_DOF];
+// gains of the JOINT_PD motion
+static double kpRSP[] = {
+	500, 800, 900, 500,
+	500, 800, 900, 500,
+	500, 800, 900, 500,
+	1000, 700, 600, 600
+};
+static double kdRSP[] = {
+	25, 50, 55, 40,
+	25, 50, 55, 40,
+	25, 50, 55, 40,
+	50, 50, 50, 40
+};
 
-static void SetGainsRSP()
+void MotionRock(HandSession* hand)
 {
-	// This function should be called after the function SetMotionType() is called.
-	// Once SetMotionType() function is called, all gains are reset using the default values.
-	if (!pBHand) return;
-	double kp[] = {
-		500, 800, 900, 500,
-		500, 800, 900, 500,
-		500, 800, 900, 500,
-		1000, 700, 600, 600
-	};
-	double kd[] = {
-		25, 50, 55, 40,
-		25, 50, 55, 40,
-		25, 50, 55, 40,
-		50, 50, 50, 40
-	};
-	pBHand->SetGainsEx(kp, kd);
+	SetHandMotion(hand, eMotionType_JOINT_PD, rock, kpRSP, kdRSP);
 }
 
-void MotionRock()
+void MotionScissors(HandSession* hand)
 {
-	for (int i=0; i<16; i++)
-		q_des[i] = rock[i];
-	if (pBHand) pBHand->SetMotionType(eMotionType_JOINT_PD);
-	SetGainsRSP();
-
-}
-
-void MotionScissors()
-{
-	for (int i=0; i<16; i++)
-		q_des[i] = scissors[i];
-	if (pBHand) pBHand->SetMotionType(eMotionType_JOINT_PD);
-	SetGainsRSP();
+	SetHandMotion(hand, eMotionType_JOINT_PD, scissors, kpRSP, kdRSP);
 }
 
-void MotionPaper()
+void MotionPaper(HandSession* hand)
 {
-	for (int i=0; i<16; i++)
-		q_des[i] = paper[i];
-	if (pBHand) pBHand->SetMotionType(eMotionType_JOINT_PD);
-	SetGainsRSP();
+	SetHandMotion(hand, eMotionType_JOINT_PD, paper, kpRSP, kdRSP);
 }
@@ -1,5 +1,7 @@
 #pragma once
 
-void MotionRock();
-void MotionScissors();
-void MotionPaper();
+#include "HandSession.h"
+
+void MotionRock(HandSession* hand);
+void MotionScissors(HandSession* hand);
+void MotionPaper(HandSession* hand);
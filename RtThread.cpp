@@ -0,0 +1,168 @@
+#ifdef _WIN32
+#include "windows.h"
+#include <process.h>
+#else
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#endif
+#include <stdio.h>
+#include "RtThread.h"
+
+// Applies the requested affinity and priority from inside the new thread,
+// so a failure (e.g. no permission for SCHED_FIFO) only costs determinism.
+static void ApplySchedule(RtThread* thread)
+{
+#ifdef _WIN32
+	if (thread->cpu >= 0)
+	{
+		if (!SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << thread->cpu))
+			printf(">%s: SetThreadAffinityMask(%d) failed with error %ld\n", thread->name, thread->cpu, GetLastError());
+	}
+	if (thread->priority > 0)
+	{
+		int level;
+		if (thread->priority >= 90) level = THREAD_PRIORITY_TIME_CRITICAL;
+		else if (thread->priority >= 50) level = THREAD_PRIORITY_HIGHEST;
+		else level = THREAD_PRIORITY_ABOVE_NORMAL;
+		if (!SetThreadPriority(GetCurrentThread(), level))
+			printf(">%s: SetThreadPriority(%d) failed with error %ld\n", thread->name, level, GetLastError());
+	}
+#else
+	int ret;
+	if (thread->cpu >= 0)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(thread->cpu, &cpus);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (ret != 0)
+			printf(">%s: pthread_setaffinity_np(%d) failed: %s\n", thread->name, thread->cpu, strerror(ret));
+	}
+	if (thread->priority > 0)
+	{
+		struct sched_param param;
+		param.sched_priority = thread->priority;
+		ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (ret != 0)
+			printf(">%s: SCHED_FIFO priority %d not granted: %s\n", thread->name, thread->priority, strerror(ret));
+	}
+#endif
+}
+
+#ifdef _WIN32
+static unsigned int __stdcall RtThreadEntry(void* inst)
+#else
+static void* RtThreadEntry(void* inst)
+#endif
+{
+	RtThread* thread = (RtThread*)inst;
+	ApplySchedule(thread);
+	thread->func(thread->arg);
+	return 0;
+}
+
+bool RtThreadStart(RtThread* thread, const char* name, RtThreadFunc func, void* arg, int cpu, int priority)
+{
+	thread->name = name;
+	thread->func = func;
+	thread->arg = arg;
+	thread->cpu = cpu;
+	thread->priority = priority;
+#ifdef _WIN32
+	thread->handle = (HANDLE)_beginthreadex(NULL, 0, RtThreadEntry, thread, 0, NULL);
+	thread->started = (thread->handle != 0);
+#else
+	thread->started = (pthread_create(&thread->handle, NULL, RtThreadEntry, thread) == 0);
+#endif
+	if (!thread->started)
+		printf(">%s: could not create thread\n", name);
+	return thread->started;
+}
+
+void RtThreadJoin(RtThread* thread)
+{
+	if (!thread->started)
+		return;
+#ifdef _WIN32
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+#else
+	pthread_join(thread->handle, NULL);
+#endif
+	thread->started = false;
+}
+
+void RtEventCreate(RtEvent* ev)
+{
+#ifdef _WIN32
+	ev->handle = CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ev->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&ev->mutex, NULL);
+	ev->signaled = false;
+#endif
+}
+
+void RtEventDestroy(RtEvent* ev)
+{
+#ifdef _WIN32
+	CloseHandle(ev->handle);
+	ev->handle = NULL;
+#else
+	pthread_cond_destroy(&ev->cond);
+	pthread_mutex_destroy(&ev->mutex);
+#endif
+}
+
+void RtEventSet(RtEvent* ev)
+{
+#ifdef _WIN32
+	SetEvent(ev->handle);
+#else
+	pthread_mutex_lock(&ev->mutex);
+	ev->signaled = true;
+	pthread_cond_signal(&ev->cond);
+	pthread_mutex_unlock(&ev->mutex);
+#endif
+}
+
+bool RtEventWait(RtEvent* ev, int timeout_msec)
+{
+#ifdef _WIN32
+	return (WaitForSingleObject(ev->handle, (timeout_msec < 0 ? INFINITE : (DWORD)timeout_msec)) == WAIT_OBJECT_0);
+#else
+	struct timespec until;
+	bool signaled;
+
+	clock_gettime(CLOCK_MONOTONIC, &until);
+	if (timeout_msec > 0)
+	{
+		until.tv_sec += timeout_msec / 1000;
+		until.tv_nsec += (long)(timeout_msec % 1000) * 1000000L;
+		if (until.tv_nsec >= 1000000000L)
+		{
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&ev->mutex);
+	while (!ev->signaled)
+	{
+		if (timeout_msec < 0)
+			pthread_cond_wait(&ev->cond, &ev->mutex);
+		else if (pthread_cond_timedwait(&ev->cond, &ev->mutex, &until) == ETIMEDOUT)
+			break;
+	}
+	signaled = ev->signaled;
+	ev->signaled = false;
+	pthread_mutex_unlock(&ev->mutex);
+	return signaled;
+#endif
+}
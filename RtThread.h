@@ -0,0 +1,46 @@
+#pragma once
+
+#ifdef _WIN32
+#include "windows.h"
+#else
+#include <pthread.h>
+#endif
+
+// Thread with its own CPU affinity and real-time priority, used for the
+// stages of the CAN pipeline.
+typedef void (*RtThreadFunc)(void* arg);
+
+typedef struct tagRtThread
+{
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	pthread_t handle;
+#endif
+	const char* name;
+	RtThreadFunc func;
+	void* arg;
+	int cpu;      // CPU the thread is pinned to, -1 lets the OS choose
+	int priority; // 0: normal, 1..99: SCHED_FIFO priority (mapped onto THREAD_PRIORITY_* on Windows)
+	bool started;
+} RtThread;
+
+// Auto-reset wake-up event.
+typedef struct tagRtEvent
+{
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool signaled;
+#endif
+} RtEvent;
+
+bool RtThreadStart(RtThread* thread, const char* name, RtThreadFunc func, void* arg, int cpu, int priority);
+void RtThreadJoin(RtThread* thread);
+
+void RtEventCreate(RtEvent* ev);
+void RtEventDestroy(RtEvent* ev);
+void RtEventSet(RtEvent* ev);
+bool RtEventWait(RtEvent* ev, int timeout_msec); // true if signaled, false on timeout
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string.h>
+#ifdef _WIN32
+#include "windows.h"
+#define SEQLOCK_BARRIER()	MemoryBarrier()
+#else
+#define SEQLOCK_BARRIER()	__sync_synchronize()
+#endif
+
+// Single-writer sequence lock.
+// The writer never waits. A reader copies the value and retries if the writer
+// was in the middle of an update, so it always gets a consistent snapshot.
+template <typename T>
+class SeqLock
+{
+public:
+	SeqLock() : m_seq(0) { memset(&m_value, 0, sizeof(T)); }
+
+	void Write(const T& value)
+	{
+		m_seq++;
+		SEQLOCK_BARRIER();
+		m_value = value;
+		SEQLOCK_BARRIER();
+		m_seq++;
+	}
+
+	// Returns the number of writes the snapshot reflects.
+	unsigned int Read(T& value) const
+	{
+		unsigned int seq0, seq1;
+		do
+		{
+			seq0 = m_seq;
+			SEQLOCK_BARRIER();
+			value = m_value;
+			SEQLOCK_BARRIER();
+			seq1 = m_seq;
+		} while (seq0 != seq1 || (seq0 & 1));
+		return (seq0 >> 1);
+	}
+
+	unsigned int Version() const { return (m_seq >> 1); }
+
+private:
+	volatile unsigned int m_seq;
+	T m_value;
+};
@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "Telemetry.h"
+#include "SeqLock.h"
+
+#define TOUCH_STRIDE	4096 // smallest page size of the supported platforms
+#define IDLE_WAIT		100  // msec, the recorder thread also checks for a full segment this often
+
+static void SegmentPath(const TelemetryRecorder* r, unsigned int segment, char* path)
+{
+	sprintf(path, "%s_can%d_%06u.tlm", r->prefix, r->info.ch, segment);
+}
+
+// Creates, preallocates and maps a segment file and faults in all its pages
+static bool OpenSegment(TelemetryRecorder* r, TelemetrySegment* s, unsigned int segment)
+{
+	char* base;
+	size_t i;
+
+	SegmentPath(r, segment, s->path);
+	s->size = TELEMETRY_HEADER_SIZE + (size_t)r->info.capacity*sizeof(TelemetryRecord);
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	size.QuadPart = s->size;
+	s->file = CreateFileA(s->path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (s->file == INVALID_HANDLE_VALUE)
+	{
+		printf("ERROR cannot create %s (error %ld)\n", s->path, GetLastError());
+		return false;
+	}
+	// the mapping extends the file to its full size
+	s->mapping = CreateFileMappingA(s->file, NULL, PAGE_READWRITE, size.HighPart, size.LowPart, NULL);
+	base = (s->mapping ? (char*)MapViewOfFile(s->mapping, FILE_MAP_WRITE, 0, 0, s->size) : NULL);
+	if (!base)
+	{
+		printf("ERROR cannot map %s (error %ld)\n", s->path, GetLastError());
+		if (s->mapping) CloseHandle(s->mapping);
+		CloseHandle(s->file);
+		DeleteFileA(s->path);
+		return false;
+	}
+#else
+	int ret;
+	s->fd = open(s->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (s->fd < 0)
+	{
+		printf("ERROR cannot create %s: %s\n", s->path, strerror(errno));
+		return false;
+	}
+	// reserve the disk blocks now, so a full disk fails here and not with SIGBUS in the control thread
+	ret = posix_fallocate(s->fd, 0, s->size);
+	if (ret == EINVAL || ret == EOPNOTSUPP)
+	{
+		// file system without preallocation: sparse file
+		ret = (ftruncate(s->fd, s->size) == 0 ? 0 : errno);
+	}
+	base = (char*)MAP_FAILED;
+	if (ret == 0)
+	{
+		base = (char*)mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+		if (base == MAP_FAILED)
+			ret = errno;
+	}
+	if (ret != 0)
+	{
+		printf("ERROR cannot map %s: %s\n", s->path, strerror(ret));
+		close(s->fd);
+		unlink(s->path);
+		return false;
+	}
+#endif
+
+	for (i=0; i<s->size; i+=TOUCH_STRIDE)
+		base[i] = 0;
+
+	s->header = (TelemetryHeader*)base;
+	s->records = (TelemetryRecord*)(base + TELEMETRY_HEADER_SIZE);
+	s->used = 0;
+	*s->header = r->info;
+	s->header->segment = segment;
+	r->info.segment = segment + 1;
+
+	// the ring: drop the segment that is keep files older than this one
+	if (r->keep > 0 && segment >= r->keep)
+	{
+		char oldest[TELEMETRY_PATH];
+		SegmentPath(r, segment - r->keep, oldest);
+		remove(oldest);
+	}
+	return true;
+}
+
+// Flushes and closes a segment, cut to the records it holds; an empty one is deleted.
+// Returns the number of records.
+static unsigned int CloseSegment(TelemetrySegment* s)
+{
+	unsigned int count = s->header->count;
+	size_t used = TELEMETRY_HEADER_SIZE + (size_t)count*sizeof(TelemetryRecord);
+
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	size.QuadPart = used;
+	FlushViewOfFile(s->header, 0);
+	UnmapViewOfFile(s->header);
+	CloseHandle(s->mapping);
+	SetFilePointerEx(s->file, size, NULL, FILE_BEGIN);
+	SetEndOfFile(s->file);
+	CloseHandle(s->file);
+#else
+	msync(s->header, s->size, MS_SYNC);
+	munmap(s->header, s->size);
+	if (ftruncate(s->fd, used) != 0)
+		printf("ERROR cannot truncate %s: %s\n", s->path, strerror(errno));
+	close(s->fd);
+#endif
+	if (count == 0)
+		remove(s->path);
+	s->header = NULL;
+	s->records = NULL;
+	return count;
+}
+
+// Recorder thread: closes the segment the control thread filled and prepares the next one
+static void ServiceRecorder(TelemetryRecorder* r)
+{
+	TelemetrySegment* s;
+	int i;
+
+	s = r->full;
+	if (s)
+	{
+		if (CloseSegment(s) > 0)
+			r->segments++;
+		SEQLOCK_BARRIER();
+		r->full = NULL;
+	}
+
+	if (!r->ready && !r->failed)
+	{
+		// a slot is free if it is not mapped; current and full are
+		for (i=0; i<3; i++)
+		{
+			s = &r->slot[i];
+			if (!s->header)
+				break;
+		}
+		if (i < 3)
+		{
+			if (OpenSegment(r, s, r->info.segment))
+			{
+				SEQLOCK_BARRIER();
+				r->ready = s;
+			}
+			else
+			{
+				r->failed = true;
+			}
+		}
+	}
+}
+
+static void TelemetryThreadProc(void* inst)
+{
+	TelemetryRecorder* r = (TelemetryRecorder*)inst;
+
+	while (r->running)
+	{
+		ServiceRecorder(r);
+		RtEventWait(&r->wake, IDLE_WAIT);
+	}
+}
+
+bool TelemetryStart(TelemetryRecorder* r, const char* prefix, int ch, const char* profile,
+	int controlPeriod, unsigned char ahrsMask, unsigned int capacity, unsigned int keep)
+{
+	memset((void*)r, 0, sizeof(*r));
+	strncpy(r->prefix, prefix, sizeof(r->prefix)-1);
+	memcpy(r->info.magic, TELEMETRY_MAGIC, sizeof(r->info.magic));
+	r->info.headerSize = TELEMETRY_HEADER_SIZE;
+	r->info.recordSize = sizeof(TelemetryRecord);
+	r->info.capacity = (capacity > 0 ? capacity : 1);
+	r->info.ch = ch;
+	r->info.controlPeriod = controlPeriod;
+	r->info.ahrsMask = ahrsMask;
+	r->info.startTime = (double)time(NULL);
+	strncpy(r->info.profile, profile, sizeof(r->info.profile)-1);
+	r->keep = keep;
+
+	if (!OpenSegment(r, &r->slot[0], 0))
+		return false;
+	printf(">CAN(%d): recording to %s\n", ch, r->slot[0].path);
+	r->current = &r->slot[0];
+	r->running = true;
+	RtEventCreate(&r->wake);
+	// runs at normal priority on any CPU: it must keep up, but only once per segment
+	if (!RtThreadStart(&r->thread, "telemetry", TelemetryThreadProc, r, -1, 0))
+	{
+		r->running = false;
+		RtEventDestroy(&r->wake);
+	}
+	return true;
+}
+
+void TelemetryStop(TelemetryRecorder* r)
+{
+	int i;
+
+	if (!r->current)
+		return;
+	if (r->running)
+	{
+		r->running = false;
+		RtEventSet(&r->wake);
+		RtThreadJoin(&r->thread);
+		RtEventDestroy(&r->wake);
+	}
+	for (i=0; i<3; i++)
+	{
+		if (r->slot[i].header && CloseSegment(&r->slot[i]) > 0)
+			r->segments++;
+	}
+	printf(">CAN(%d): recorded %u cycles in %u segment(s)", r->info.ch, r->records, r->segments);
+	if (r->dropped)
+		printf(", %u dropped", r->dropped);
+	printf("\n");
+	r->current = NULL;
+	r->ready = NULL;
+	r->full = NULL;
+}
+
+TelemetryRecord* TelemetryBegin(TelemetryRecorder* r)
+{
+	TelemetrySegment* s = r->current;
+
+	if (!s)
+		return NULL;
+	if (s->used == s->header->capacity)
+	{
+		// switch to the prepared segment; the recorder thread closes this one
+		TelemetrySegment* next = r->ready;
+		if (!next || r->full)
+		{
+			r->dropped++;
+			return NULL;
+		}
+		r->ready = NULL;
+		SEQLOCK_BARRIER();
+		r->full = s;
+		r->current = next;
+		s = next;
+		RtEventSet(&r->wake); // once per segment, not worth the recorder thread's polling delay
+	}
+	return &s->records[s->used];
+}
+
+void TelemetryCommit(TelemetryRecorder* r)
+{
+	TelemetrySegment* s = r->current;
+
+	s->used++;
+	SEQLOCK_BARRIER(); // the record is complete before a reader may count it
+	s->header->count = s->used;
+	r->records++;
+}
+
+int TelemetryExport(const char* path, FILE* out)
+{
+	TelemetryHeader header;
+	TelemetryRecord rec;
+	FILE* fp;
+	unsigned int n;
+	int i;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+	{
+		printf("ERROR cannot open %s\n", path);
+		return -1;
+	}
+	if (fread(&header, sizeof(header), 1, fp) != 1
+		|| memcmp(header.magic, TELEMETRY_MAGIC, sizeof(header.magic)) != 0
+		|| header.headerSize != TELEMETRY_HEADER_SIZE
+		|| header.recordSize != sizeof(TelemetryRecord))
+	{
+		printf("ERROR %s is not a telemetry segment of this version\n", path);
+		fclose(fp);
+		return -1;
+	}
+
+	fprintf(out, "# CAN(%d) profile %s, period %d msec, segment %u, %u records\n",
+		header.ch, header.profile, header.controlPeriod, header.segment, header.count);
+	fprintf(out, "time,stamp,set,missing,zero_torque,ahrs_count");
+	for (i=0; i<MAX_DOF; i++) fprintf(out, ",enc%d", i);
+	for (i=0; i<MAX_DOF; i++) fprintf(out, ",q%d", i);
+	for (i=0; i<MAX_DOF; i++) fprintf(out, ",tau%d", i);
+	for (i=0; i<MAX_DOF; i++) fprintf(out, ",pwm%d", i);
+	fprintf(out, ",roll,pitch,yaw,acc_x,acc_y,acc_z,gyro_x,gyro_y,gyro_z,mag_x,mag_y,mag_z\n");
+
+	fseek(fp, TELEMETRY_HEADER_SIZE, SEEK_SET);
+	for (n=0; n<header.count && fread(&rec, sizeof(rec), 1, fp) == 1; n++)
+	{
+		fprintf(out, "%.6f,%.6f,%u,%u,%u,%u", rec.time, rec.stamp, rec.set, rec.missing, rec.zeroTorque, rec.ahrsCount);
+		for (i=0; i<MAX_DOF; i++) fprintf(out, ",%d", rec.enc[i]);
+		for (i=0; i<MAX_DOF; i++) fprintf(out, ",%.6f", rec.q[i]);
+		for (i=0; i<MAX_DOF; i++) fprintf(out, ",%.6f", rec.tau[i]);
+		for (i=0; i<MAX_DOF; i++) fprintf(out, ",%d", rec.pwm[i]);
+		for (i=0; i<12; i++) fprintf(out, ",%d", rec.ahrs[i]);
+		fprintf(out, "\n");
+	}
+	fclose(fp);
+	return (int)n;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stdio.h>
+#ifdef _WIN32
+#include "windows.h"
+#endif
+#include "rDeviceAllegroHandCANDef.h"
+#include "RtThread.h"
+
+// Binary telemetry of one hand: one fixed-size record per control cycle,
+// written by the control thread into memory-mapped segment files.
+//
+// A segment file is a TelemetryHeader padded to TELEMETRY_HEADER_SIZE bytes,
+// followed by room for a fixed number of records. The recorder's own thread
+// creates, preallocates and maps the next segment (touching every page) before
+// the control thread needs it, so writing a record is a copy into memory: no
+// system call, no allocation and no lock. When a segment is full the control
+// thread switches to the prepared one and leaves the full one to the recorder
+// thread, which flushes, unmaps and closes it and prepares the next. With a
+// segment limit the oldest file is deleted each time a new one is opened, so
+// the files form a ring of the last hours.
+//
+// header.count is updated after every record, so a segment is readable while
+// it is written and after the program died. Closed segments are cut to the
+// records they hold. Numbers are in the byte order of the host (little-endian
+// on every supported platform).
+
+#define TELEMETRY_MAGIC			"AHTLM01" // with the terminating zero, 8 bytes
+#define TELEMETRY_HEADER_SIZE	256       // records start at this file offset
+#define TELEMETRY_PATH			260
+
+typedef struct tagTelemetryRecord
+{
+	double time;             // control time (sec)
+	double stamp;            // driver receive time of the encoder set (sec)
+	unsigned int set;        // encoder set number, gaps are sets the control thread skipped
+	unsigned char missing;   // bit per finger board whose encoders were extrapolated
+	unsigned char zeroTorque;
+	unsigned short ahrsCount; // AHRS frames received so far (mod 65536)
+	int enc[MAX_DOF];        // encoder counts
+	float q[MAX_DOF];        // joint positions (rad)
+	float tau[MAX_DOF];      // joint torques from BHand
+	short pwm[MAX_DOF];      // PWM demand as sent, motor order
+	short ahrs[12];          // latest AHRS reading in sensor counts: roll, pitch, yaw, acc xyz, gyro xyz, mag xyz
+} TelemetryRecord;
+
+typedef struct tagTelemetryHeader
+{
+	char magic[8];             // TELEMETRY_MAGIC
+	unsigned int headerSize;   // TELEMETRY_HEADER_SIZE
+	unsigned int recordSize;   // sizeof(TelemetryRecord)
+	unsigned int capacity;     // records the segment has room for
+	volatile unsigned int count; // records written
+	unsigned int segment;      // segment number of the hand, from 0
+	int ch;                    // CAN channel of the hand
+	int controlPeriod;         // msec
+	unsigned int ahrsMask;     // AHRS_MASK_* requested from the hand
+	double startTime;          // calendar time the recording started (sec since 1970)
+	char profile[32];          // hand profile name
+} TelemetryHeader;
+
+typedef struct tagTelemetrySegment
+{
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+	char path[TELEMETRY_PATH];
+	size_t size;
+	TelemetryHeader* header;  // NULL while the slot is free
+	TelemetryRecord* records;
+	unsigned int used;        // records written, control thread
+} TelemetrySegment;
+
+// The control thread owns current; ready is handed from the recorder thread to the
+// control thread and full the other way, each set by one side and cleared by the other.
+typedef struct tagTelemetryRecorder
+{
+	char prefix[TELEMETRY_PATH-32]; // leaves room for the suffix of the file names
+	TelemetryHeader info;     // header of the next segment
+	unsigned int keep;        // segment files kept on disk, 0: all
+	TelemetrySegment slot[3];
+	TelemetrySegment* volatile current;
+	TelemetrySegment* volatile ready;
+	TelemetrySegment* volatile full;
+	volatile unsigned int records;  // written
+	volatile unsigned int dropped;  // lost because the next segment was not ready
+	volatile unsigned int segments; // closed
+	volatile bool running;
+	bool failed;              // a segment could not be opened, no more are tried
+	RtThread thread;
+	RtEvent wake;
+} TelemetryRecorder;
+
+// Opens the first segment <prefix>_can<ch>_000000.tlm and starts the recorder thread.
+// capacity is the number of records per segment.
+bool TelemetryStart(TelemetryRecorder* r, const char* prefix, int ch, const char* profile,
+	int controlPeriod, unsigned char ahrsMask, unsigned int capacity, unsigned int keep);
+// Stops the recorder thread and closes all segments. Call after the control thread has stopped.
+void TelemetryStop(TelemetryRecorder* r);
+
+// Control thread only: the record to fill, NULL if the recorder is off or has no room;
+// TelemetryCommit() makes it part of the segment.
+TelemetryRecord* TelemetryBegin(TelemetryRecorder* r);
+void TelemetryCommit(TelemetryRecorder* r);
+
+// Writes the records of a segment file as CSV, one line per record. Returns the number of records or -1.
+int TelemetryExport(const char* path, FILE* out);
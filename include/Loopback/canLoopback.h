@@ -0,0 +1,44 @@
+/*
+ *\brief Extra API of the in-process loopback CAN backend (src/Loopback)
+ *\detailed The loopback backend connects the application to a simulated hand
+ *          (sim/HandSimulator) through a pair of lock-free frame rings.
+ *          Time on that bus is virtual: it only moves when the host has
+ *          answered the last encoder set, so a run does not depend on the
+ *          speed of the machine and can go much faster than real time.
+ */
+
+#ifndef _CANLOOPBACK_H
+#define _CANLOOPBACK_H
+
+#include "canDef.h"
+#include "HandSimulator.h"
+
+CANAPI_BEGIN
+
+// Virtual time of the channel in seconds, 0 at command_can_open().
+double can_loopback_time(int ch);
+
+// true (default): the virtual clock is held back to wall-clock speed, as a real hand would.
+// false: the clock jumps to the next frame as soon as the host is ready for it.
+void can_loopback_realtime(int ch, bool realtime);
+
+// Lets the clock run up to t (sec) and waits until it got there and the host
+// has sent the torques for the last encoder set. The clock stays at t until
+// the next call. Returns false if that did not happen within timeout_msec.
+bool can_loopback_run_until(int ch, double t, int timeout_msec);
+
+// Lets the clock run up to t without waiting. Releasing several channels before
+// calling can_loopback_run_until() on each lets their hands run in parallel.
+void can_loopback_release(int ch, double t);
+
+// Drops the encoder frame of the given finger board (0..3, -1 for all four)
+// in every n-th control period; n = 0 stops dropping.
+void can_loopback_drop(int ch, int board, int every);
+
+// The simulated hand. Its joint state is consistent while the clock is held
+// by can_loopback_run_until().
+const HandSimulator* can_loopback_hand(int ch);
+
+CANAPI_END
+
+#endif
@@ -12,6 +12,7 @@
 #define _CANDAPI_H
 
 #include "canDef.h"
+#include "canCodec.h"
 
 CANAPI_BEGIN
 
@@ -33,6 +34,8 @@ CANAPI_BEGIN
 #define mbxID               (0)
 #define BASE_ID             (0)
 #define MAX_BUS             (256)
+#define CAN_WAIT_INFINITE   (-1)
+#define CAN_TIMESTAMP_NONE  (-1.0)
 
 /******************/
 /* CAN device API */
@@ -50,8 +53,17 @@ int command_can_stop(int ch);
 int command_can_AHRS_set(int ch, unsigned char rate, unsigned char mask); // since v3.0
 
 int write_current(int ch, int findex, short* pwm);
+int write_current_all(int ch, const short* pwm); // pwm[16], the four ID_CMD_SET_TORQUE_x frames handed to the driver in one call
+
+int can_send_batch(int ch, const can_msg* msg, int count); // uses the driver's multi-frame write where there is one
+int can_wait_tx(int ch, int timeout_msec); // waits for the transmit queue to drain: 0 drained, 1 timed out, -1 driver cannot tell
 
 int get_message(int ch, char* cmd, char* src, char* des, int* len, unsigned char* data, int blocking);
+// get_message_wait() sleeps on the driver's receive event, CAN_WAIT_INFINITE waits forever.
+// timestamp (may be NULL) gets the driver's receive time in sec, CAN_TIMESTAMP_NONE if it has none.
+int get_message_wait(int ch, char* cmd, char* src, char* des, int* len, unsigned char* data, int timeout_msec, double* timestamp);
+// get_frame_wait() is get_message_wait() with the frame taken apart by can_decode().
+int get_frame_wait(int ch, CanFrameInfo* frame, int timeout_msec, double* timestamp);
 
 CANAPI_END
 
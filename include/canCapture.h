@@ -0,0 +1,98 @@
+/*
+ *\brief Capture of the CAN traffic of a channel and its replay
+ *\detailed While a capture is open, the protocol layer (src/canProtocol.cpp)
+ *          logs every frame get_message*() receives and every frame
+ *          write_current*() and the command_can_*() calls send, in the order
+ *          they pass, together with notes the application adds (the commands
+ *          its controller ran on). The Replay transport plays such a file back
+ *          to the application instead of a bus, either at the original pace or
+ *          as fast as the host answers, so a recorded run can be fed to the
+ *          controller again.
+ *
+ *          Replay is paced by the frames the host sent in the capture: a
+ *          frame received after one the host sent is not handed out before the
+ *          host has sent its counterpart (the next one with the same identifier),
+ *          which is compared with the captured one. The bus clock (can_bus_time()) follows the capture, and when the
+ *          host waits for a frame that is not due yet the clock jumps to the end
+ *          of the wait, so time-outs expire where they did in the original run.
+ */
+
+#ifndef _CANCAPTURE_H
+#define _CANCAPTURE_H
+
+#include <stdio.h>
+#include "canDef.h"
+
+CANAPI_BEGIN
+
+/*=====================*/
+/*       Defines       */
+/*=====================*/
+#define CAN_CAPTURE_MAGIC   "AHCAP01" // with the terminating zero, 8 bytes
+#define CAN_CAPTURE_RX      (0)       // frame received by the host
+#define CAN_CAPTURE_TX      (1)       // frame sent by the host
+#define CAN_CAPTURE_NOTE    (2)       // application data, len bytes follow the record
+#define CAN_CAPTURE_NOTE_MAX (512)
+
+// File layout: a CanCaptureHeader, then records in the order the frames passed.
+// Numbers are in the byte order of the host.
+typedef struct tagCanCaptureHeader
+{
+	char magic[8];           // CAN_CAPTURE_MAGIC
+	unsigned int recordSize; // sizeof(CanCaptureRecord)
+	int ch;                  // channel the capture was taken on
+	double startTime;        // calendar time the capture was opened (sec since 1970)
+} CanCaptureHeader;
+
+typedef struct tagCanCaptureRecord
+{
+	double time;            // bus time the frame passed the protocol layer (host time on real buses, sec)
+	double stamp;           // driver receive time stamp, CAN_TIMESTAMP_NONE for frames sent and notes
+	unsigned int id;        // msg_id of the frame, tag of a note
+	unsigned short len;     // data bytes of the frame or the note
+	unsigned char kind;     // CAN_CAPTURE_RX, CAN_CAPTURE_TX or CAN_CAPTURE_NOTE
+	unsigned char reserved;
+	unsigned char data[8];  // frame data
+} CanCaptureRecord;
+
+typedef struct tagCanReplayStats
+{
+	unsigned int rxFrames;  // handed to the host
+	unsigned int txFrames;  // captured frames the host has sent again
+	unsigned int txDiffer;  // of those, frames whose identifier or data differ
+	unsigned int txMissing; // captured frames the host did not send
+	unsigned int txExtra;   // frames the host sent that were not compared
+	unsigned int notes;     // notes handed to the application
+	bool done;              // every received frame of the capture has been handed out
+} CanReplayStats;
+
+/*=========================*/
+/*       Capture           */
+/*=========================*/
+// Starts logging channel ch to path; the file is replaced. 0 on success.
+int can_capture_open(int ch, const char* path);
+int can_capture_close(int ch);
+bool can_capture_active(int ch);
+// Adds a note of 1 to CAN_CAPTURE_NOTE_MAX bytes at the current position of the log.
+void can_capture_note(int ch, unsigned int tag, const void* data, int size);
+// Protocol layer: logs frames received (CAN_CAPTURE_RX, stamp may be NULL) or sent (CAN_CAPTURE_TX)
+void can_capture_frames(int ch, int kind, const can_msg* msg, const double* stamp, int count);
+
+/*=========================*/
+/*       Replay            */
+/*=========================*/
+// Loads a capture for channel ch; command_can_open_transport(ch, &canTransportReplay, ...) then plays it.
+// realtime: frames are handed out at their original pace, else as soon as the host is ready.
+int can_replay_load(int ch, const char* path, bool realtime);
+// Channel the capture was taken on, -1 if the file cannot be read.
+int can_replay_channel(const char* path);
+// Next note of the capture the replay has passed. Waits up to timeout_msec for it.
+// Returns the size of the note, 0 on time-out or at the end of the capture.
+int can_replay_note(int ch, unsigned int* tag, void* data, int maxSize, int timeout_msec);
+// The frames sent after the last received one are compared when the channel is closed,
+// which also prints the final counts.
+void can_replay_stats(int ch, CanReplayStats* stats);
+
+CANAPI_END
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ *\brief Frame codec of the Allegro Hand CAN protocol
+ *\detailed Builds and takes apart the 11-bit identifiers and the payloads of
+ *          every command in canDef.h. Everything is inline and works on the
+ *          caller's buffers, so encoding or decoding a frame allocates nothing.
+ *          The layout of each command comes from one table indexed by the
+ *          5-bit command field, CAN_ID() gives identifiers as constant
+ *          expressions (filters, case labels).
+ *
+ *          Identifier:  | cmd (5 bits) | destination (3 bits) | source (3 bits) |
+ *          Payloads:    torque, position  4 x int16, big-endian
+ *                       encoders          4 x uint16, little-endian
+ *                       AHRS              3 x int16, big-endian
+ */
+
+#ifndef _CANCODEC_H
+#define _CANCODEC_H
+
+#include "canDef.h"
+
+CANAPI_BEGIN
+
+/*=====================*/
+/*       Defines       */
+/*=====================*/
+#define CAN_ID_CMD_SHIFT	6
+#define CAN_ID_DES_SHIFT	3
+#define CAN_ID_CMD_MASK		0x1f
+#define CAN_ID_NODE_MASK	0x07
+#define CAN_CMD_COUNT		32 // values of the command field
+
+// identifier of a frame from src to des
+#define CAN_ID(cmd, des, src)	((((unsigned long)(cmd) & CAN_ID_CMD_MASK) << CAN_ID_CMD_SHIFT) | \
+								 (((unsigned long)(des) & CAN_ID_NODE_MASK) << CAN_ID_DES_SHIFT) | \
+								 ((unsigned long)(src) & CAN_ID_NODE_MASK))
+// frames of the host (ID_DEVICE_MAIN) to the hand, and of a hand board to the host
+#define CAN_HOST_ID(cmd)		CAN_ID(cmd, ID_COMMON, ID_DEVICE_MAIN)
+#define CAN_HAND_ID(cmd, src)	CAN_ID(cmd, ID_DEVICE_MAIN, src)
+
+// payload layouts
+enum eCanPayload
+{
+	CAN_PAYLOAD_UNKNOWN,  // no such command
+	CAN_PAYLOAD_NONE,     // no data
+	CAN_PAYLOAD_BYTES,    // plain bytes (SET_PERIOD, AHRS_SET)
+	CAN_PAYLOAD_PWM,      // 4 x int16 big-endian (SET_TORQUE_n, SET_POSITION_n)
+	CAN_PAYLOAD_ENCODER,  // 4 x uint16 little-endian (QUERY_CONTROL_DATA from a finger board)
+	CAN_PAYLOAD_AHRS,     // 3 x int16 big-endian (AHRS_POSE, _ACC, _GYRO, _MAG)
+	CAN_PAYLOAD_ID        // revision, firmware, hardware type (QUERY_ID reply)
+};
+
+/*=========================*/
+/*       Command table     */
+/*=========================*/
+typedef struct tagCanCommandInfo
+{
+	const char* name;
+	unsigned char payload; // eCanPayload
+	unsigned char dlc;     // data bytes the payload needs
+	unsigned char index;   // finger of SET_TORQUE_n / SET_POSITION_n, AHRS_MASK_* bit number of AHRS_*
+} CanCommandInfo;
+
+static const CanCommandInfo canCommandTable[CAN_CMD_COUNT] = {
+	{ "?",                  CAN_PAYLOAD_UNKNOWN, 0, 0 }, // 0x00
+	{ "SET_SYSTEM_ON",      CAN_PAYLOAD_NONE,    0, 0 }, // ID_CMD_SET_SYSTEM_ON
+	{ "SET_SYSTEM_OFF",     CAN_PAYLOAD_NONE,    0, 0 }, // ID_CMD_SET_SYSTEM_OFF
+	{ "SET_PERIOD",         CAN_PAYLOAD_BYTES,   1, 0 }, // ID_CMD_SET_PERIOD
+	{ "SET_MODE_JOINT",     CAN_PAYLOAD_NONE,    0, 0 }, // ID_CMD_SET_MODE_JOINT
+	{ "SET_MODE_TASK",      CAN_PAYLOAD_NONE,    0, 0 }, // ID_CMD_SET_MODE_TASK
+	{ "SET_TORQUE_1",       CAN_PAYLOAD_PWM,     8, 0 }, // ID_CMD_SET_TORQUE_1
+	{ "SET_TORQUE_2",       CAN_PAYLOAD_PWM,     8, 1 }, // ID_CMD_SET_TORQUE_2
+	{ "SET_TORQUE_3",       CAN_PAYLOAD_PWM,     8, 2 }, // ID_CMD_SET_TORQUE_3
+	{ "SET_TORQUE_4",       CAN_PAYLOAD_PWM,     8, 3 }, // ID_CMD_SET_TORQUE_4
+	{ "SET_POSITION_1",     CAN_PAYLOAD_PWM,     8, 0 }, // ID_CMD_SET_POSITION_1
+	{ "SET_POSITION_2",     CAN_PAYLOAD_PWM,     8, 1 }, // ID_CMD_SET_POSITION_2
+	{ "SET_POSITION_3",     CAN_PAYLOAD_PWM,     8, 2 }, // ID_CMD_SET_POSITION_3
+	{ "SET_POSITION_4",     CAN_PAYLOAD_PWM,     8, 3 }, // ID_CMD_SET_POSITION_4
+	{ "QUERY_STATE_DATA",   CAN_PAYLOAD_NONE,    0, 0 }, // ID_CMD_QUERY_STATE_DATA
+	{ "QUERY_CONTROL_DATA", CAN_PAYLOAD_ENCODER, 8, 0 }, // ID_CMD_QUERY_CONTROL_DATA
+	{ "QUERY_ID",           CAN_PAYLOAD_ID,      8, 0 }, // ID_CMD_QUERY_ID
+	{ "AHRS_SET",           CAN_PAYLOAD_BYTES,   2, 0 }, // ID_CMD_AHRS_SET
+	{ "AHRS_POSE",          CAN_PAYLOAD_AHRS,    6, 0 }, // ID_CMD_AHRS_POSE
+	{ "AHRS_ACC",           CAN_PAYLOAD_AHRS,    6, 1 }, // ID_CMD_AHRS_ACC
+	{ "AHRS_GYRO",          CAN_PAYLOAD_AHRS,    6, 2 }, // ID_CMD_AHRS_GYRO
+	{ "AHRS_MAG",           CAN_PAYLOAD_AHRS,    6, 3 }, // ID_CMD_AHRS_MAG
+	{ "?", CAN_PAYLOAD_UNKNOWN, 0, 0 }, { "?", CAN_PAYLOAD_UNKNOWN, 0, 0 }, // 0x16..0x1f
+	{ "?", CAN_PAYLOAD_UNKNOWN, 0, 0 }, { "?", CAN_PAYLOAD_UNKNOWN, 0, 0 },
+	{ "?", CAN_PAYLOAD_UNKNOWN, 0, 0 }, { "?", CAN_PAYLOAD_UNKNOWN, 0, 0 },
+	{ "?", CAN_PAYLOAD_UNKNOWN, 0, 0 }, { "?", CAN_PAYLOAD_UNKNOWN, 0, 0 },
+	{ "?", CAN_PAYLOAD_UNKNOWN, 0, 0 }, { "?", CAN_PAYLOAD_UNKNOWN, 0, 0 }
+};
+
+inline const CanCommandInfo* can_command_info(unsigned int cmd)
+{
+	return &canCommandTable[cmd & CAN_ID_CMD_MASK];
+}
+
+/*=========================*/
+/*       Identifiers       */
+/*=========================*/
+inline unsigned char can_id_cmd(unsigned long id) { return (unsigned char)((id >> CAN_ID_CMD_SHIFT) & CAN_ID_CMD_MASK); }
+inline unsigned char can_id_des(unsigned long id) { return (unsigned char)((id >> CAN_ID_DES_SHIFT) & CAN_ID_NODE_MASK); }
+inline unsigned char can_id_src(unsigned long id) { return (unsigned char)(id & CAN_ID_NODE_MASK); }
+
+// Sets the header of a frame; the data is left to the caller.
+inline void can_frame_init(can_msg* msg, unsigned long id, int len)
+{
+	msg->STD_EXT = STD;
+	msg->msg_id = id;
+	msg->data_length = (unsigned char)len;
+}
+
+/*=========================*/
+/*       Payloads          */
+/*=========================*/
+// can_msg::data is plain char; every byte is read as unsigned char so that
+// values of 0x80 and above do not sign-extend into the neighbouring byte.
+inline unsigned int can_get_u8(const char* data, int i) { return (unsigned char)data[i]; }
+
+inline short can_get_be16(const char* data, int i)
+{
+	return (short)((can_get_u8(data, i) << 8) | can_get_u8(data, i+1));
+}
+
+inline unsigned short can_get_le16(const char* data, int i)
+{
+	return (unsigned short)(can_get_u8(data, i) | (can_get_u8(data, i+1) << 8));
+}
+
+inline void can_put_be16(char* data, int i, int v)
+{
+	data[i]   = (char)((v >> 8) & 0xff);
+	data[i+1] = (char)(v & 0xff);
+}
+
+inline void can_put_le16(char* data, int i, int v)
+{
+	data[i]   = (char)(v & 0xff);
+	data[i+1] = (char)((v >> 8) & 0xff);
+}
+
+// SET_TORQUE_n, SET_POSITION_n: four motor values of one finger
+inline void can_pack_pwm(char* data, const short* pwm)
+{
+	can_put_be16(data, 0, pwm[0]);
+	can_put_be16(data, 2, pwm[1]);
+	can_put_be16(data, 4, pwm[2]);
+	can_put_be16(data, 6, pwm[3]);
+}
+
+inline void can_unpack_pwm(const char* data, short* pwm)
+{
+	pwm[0] = can_get_be16(data, 0);
+	pwm[1] = can_get_be16(data, 2);
+	pwm[2] = can_get_be16(data, 4);
+	pwm[3] = can_get_be16(data, 6);
+}
+
+// QUERY_CONTROL_DATA: four encoder counts (0..65535) of one finger board
+inline void can_pack_encoders(char* data, const int* enc)
+{
+	can_put_le16(data, 0, enc[0]);
+	can_put_le16(data, 2, enc[1]);
+	can_put_le16(data, 4, enc[2]);
+	can_put_le16(data, 6, enc[3]);
+}
+
+inline void can_unpack_encoders(const char* data, int* enc)
+{
+	enc[0] = can_get_le16(data, 0);
+	enc[1] = can_get_le16(data, 2);
+	enc[2] = can_get_le16(data, 4);
+	enc[3] = can_get_le16(data, 6);
+}
+
+// AHRS_POSE, _ACC, _GYRO, _MAG: x, y, z (roll, pitch, yaw for the pose)
+inline void can_pack_ahrs(char* data, const short* xyz)
+{
+	can_put_be16(data, 0, xyz[0]);
+	can_put_be16(data, 2, xyz[1]);
+	can_put_be16(data, 4, xyz[2]);
+}
+
+inline void can_unpack_ahrs(const char* data, short* xyz)
+{
+	xyz[0] = can_get_be16(data, 0);
+	xyz[1] = can_get_be16(data, 2);
+	xyz[2] = can_get_be16(data, 4);
+}
+
+// QUERY_ID reply
+typedef struct tagCanHandId
+{
+	unsigned short revision;
+	unsigned short firmware;
+	unsigned char hardwareType;
+} CanHandId;
+
+inline void can_pack_query_id(char* data, const CanHandId* id)
+{
+	data[0] = 0;
+	data[1] = 0;
+	can_put_le16(data, 2, id->revision);
+	can_put_le16(data, 4, id->firmware);
+	data[6] = 0;
+	data[7] = (char)id->hardwareType;
+}
+
+inline void can_unpack_query_id(const char* data, CanHandId* id)
+{
+	id->revision = can_get_le16(data, 2);
+	id->firmware = can_get_le16(data, 4);
+	id->hardwareType = (unsigned char)can_get_u8(data, 7);
+}
+
+/*=========================*/
+/*       Frames            */
+/*=========================*/
+// A received frame taken apart by can_decode(). Only the member of the union
+// that belongs to payload is set.
+typedef struct tagCanFrameInfo
+{
+	unsigned char cmd;
+	unsigned char des;
+	unsigned char src;
+	unsigned char payload; // eCanPayload, CAN_PAYLOAD_UNKNOWN also for frames too short for their command
+	unsigned char index;   // finger (PWM, encoder frames) or AHRS_MASK_* bit number (AHRS frames)
+	union
+	{
+		short pwm[4];
+		int enc[4];
+		short ahrs[3];
+		CanHandId id;
+	} u;
+} CanFrameInfo;
+
+inline void can_decode(const can_msg* msg, CanFrameInfo* f)
+{
+	const CanCommandInfo* info;
+
+	f->cmd = can_id_cmd(msg->msg_id);
+	f->des = can_id_des(msg->msg_id);
+	f->src = can_id_src(msg->msg_id);
+	info = can_command_info(f->cmd);
+	f->payload = (msg->data_length >= info->dlc ? info->payload : (unsigned char)CAN_PAYLOAD_UNKNOWN);
+	f->index = info->index;
+
+	switch (f->payload)
+	{
+	case CAN_PAYLOAD_PWM:
+		can_unpack_pwm(msg->data, f->u.pwm);
+		break;
+	case CAN_PAYLOAD_ENCODER:
+		// the finger board is the sender
+		if (f->src < ID_DEVICE_SUB_01 || f->src > ID_DEVICE_SUB_04)
+			f->payload = CAN_PAYLOAD_UNKNOWN;
+		f->index = (unsigned char)(f->src - ID_DEVICE_SUB_01);
+		can_unpack_encoders(msg->data, f->u.enc);
+		break;
+	case CAN_PAYLOAD_AHRS:
+		can_unpack_ahrs(msg->data, f->u.ahrs);
+		break;
+	case CAN_PAYLOAD_ID:
+		can_unpack_query_id(msg->data, &f->u.id);
+		break;
+	}
+}
+
+CANAPI_END
+
+#endif
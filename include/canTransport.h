@@ -0,0 +1,83 @@
+/*
+ *\brief Frame transport of the CAN backends
+ *\detailed The Allegro Hand protocol (command_can_*, write_current*, get_message*)
+ *          is implemented once in src/canProtocol.cpp. A backend under src/<vendor>
+ *          only moves frames between its driver and the host and exports them
+ *          as a CanTransport. Every backend compiled in (PEAKCAN, KVASERCAN, ...)
+ *          is listed in the registry, and each channel is bound to a transport
+ *          when it is opened, so a binary built with several backends can drive hands on
+ *          different adapters (README.md: CAN adapters).
+ */
+
+#ifndef _CANTRANSPORT_H
+#define _CANTRANSPORT_H
+
+#include "canDef.h"
+
+CANAPI_BEGIN
+
+/*=====================*/
+/*       Defines       */
+/*=====================*/
+#define CAN_OPEN_DEFAULT    (-1) // type of command_can_open_transport(): open the channel as command_can_open() does
+
+/*=========================*/
+/*       Transport         */
+/*=========================*/
+// All functions take the channel number the application uses (bus); the backend
+// keeps its per-channel state under that number.
+typedef struct tagCanTransport
+{
+	const char* name; // "Peak", "Kvaser", ... as given to the --can option
+	int channel;      // channel the application opens when none is given
+
+	// Opens the driver channel. type CAN_OPEN_DEFAULT picks the adapter for bus,
+	// otherwise type and index select it in a backend specific way (command_can_open_ex).
+	int (*open)(int bus, int type, int index);
+	int (*close)(int bus);
+	int (*reset)(int bus); // NULL if the driver cannot reset the bus
+
+	// Queues count frames for transmission in order. 0 on success.
+	int (*send_batch)(int bus, const can_msg* msg, int count);
+	// Reads up to maxCount received frames without blocking. timestamp[i] is the driver's
+	// receive time in sec or CAN_TIMESTAMP_NONE. Returns the number of frames, < 0 on error.
+	int (*recv_batch)(int bus, can_msg* msg, double* timestamp, int maxCount);
+	// Sleeps until received frames are pending: 0 pending, 1 timed out, < 0 error.
+	// CAN_WAIT_INFINITE waits forever.
+	int (*wait)(int bus, int timeout_msec);
+	// Waits for the transmit queue to drain: 0 drained, 1 timed out. NULL if the driver cannot tell.
+	int (*wait_tx)(int bus, int timeout_msec);
+
+	// Time base of the bus in sec if it is not the host clock (simulated buses), else NULL.
+	double (*time)(int bus);
+} CanTransport;
+
+// Transports of the backends; only those compiled in are defined.
+extern const CanTransport canTransportPeak;       // PEAKCAN
+extern const CanTransport canTransportIXXAT;      // IXXATCAN
+extern const CanTransport canTransportESD;        // ESDCAN
+extern const CanTransport canTransportKvaser;     // KVASERCAN
+extern const CanTransport canTransportNI;         // NICAN
+extern const CanTransport canTransportSofting;    // SOFTINGCAN
+extern const CanTransport canTransportEasySYNC;   // EASYSYNCCAN
+extern const CanTransport canTransportSocketCAN;  // SOCKETCAN
+extern const CanTransport canTransportLoopback;   // LOOPBACKCAN
+extern const CanTransport canTransportReplay;     // always, plays a capture back (canCapture.h)
+
+/*=========================*/
+/*       Registry          */
+/*=========================*/
+int can_transport_count();
+const CanTransport* can_transport_get(int i);             // NULL if i is out of range
+const CanTransport* can_transport_find(const char* name); // case-insensitive, NULL if not compiled in
+
+// Opens channel ch on the given transport; command_can_open() uses the first one registered.
+int command_can_open_transport(int ch, const CanTransport* transport, int type, int index);
+const CanTransport* can_channel_transport(int ch); // NULL while the channel is closed
+
+// Time base of the channel's bus in sec, CAN_TIMESTAMP_NONE if that is the host clock.
+double can_bus_time(int ch);
+
+CANAPI_END
+
+#endif
@@ -14,12 +14,20 @@
 #pragma once
 
 #include "rPanelManipulatorCmd.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 #ifdef _RTX_VER
 #include "Rtapi.h"
 #pragma comment(lib, "rtapi_w32.lib")
 #endif
 
-#ifdef _RTX_VER
+#if !defined(_WIN32)
+// POSIX shared memory object standing in for the Win32 file mapping.
+#define RPANEL_SHM_NAME			"/RoboticsLab_rPanelManipulatorCmd"
+#elif defined(_RTX_VER)
 #define _rCloseHandle			RtCloseHandle 
 #define _rCreateEvent			RtCreateEvent 
 #define _rSetEvent				RtSetEvent 
@@ -32,8 +40,10 @@
 #endif
 
 static rPanelManipulatorData_t* s_shm = NULL;
+#ifdef _WIN32
 static HANDLE s_hShm = NULL;
 static HANDLE s_dataUpdateEvent = NULL;
+#endif
 
 /**
  * Create or get the shared memory.
@@ -43,7 +53,20 @@ inline rPanelManipulatorData_t* getrPanelManipulatorCmdMemory()
 	if (s_shm != NULL)
 		return s_shm;
 		
-#ifndef _RTX_VER
+#if !defined(_WIN32)
+	int fd = shm_open(RPANEL_SHM_NAME, O_RDWR | O_CREAT, 0666);
+	if (fd >= 0)
+	{
+		if (ftruncate(fd, sizeof(rPanelManipulatorData_t)) == 0)
+		{
+			void* p = mmap(NULL, sizeof(rPanelManipulatorData_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (p != MAP_FAILED)
+				s_shm = (rPanelManipulatorData_t*)p;
+		}
+		close(fd);
+	}
+
+#elif !defined(_RTX_VER)
 	s_hShm = OpenFileMapping(
 		FILE_MAP_ALL_ACCESS, 
 		FALSE, 
@@ -97,6 +120,11 @@ inline rPanelManipulatorData_t* getrPanelManipulatorCmdMemory()
  */
 inline void closerPanelManipulatorCmdMemory()
 {
+#if !defined(_WIN32)
+	if (s_shm)
+		munmap(s_shm, sizeof(rPanelManipulatorData_t));
+	s_shm = NULL;
+#else
 #ifndef _RTX_VER
 	if (s_shm)
 		UnmapViewOfFile(s_shm);
@@ -105,8 +133,11 @@ inline void closerPanelManipulatorCmdMemory()
 		_rCloseHandle(s_hShm);
 	s_shm = NULL;
 	s_hShm = NULL;
+#endif
 }
 
+#ifdef _WIN32
+
 /**
  * Wait for data update
  */
@@ -128,3 +159,4 @@ inline BOOL setrPanelManipulatorCmdUpdate()
 
 	return _rSetEvent(s_dataUpdateEvent);
 }
+#endif // _WIN32
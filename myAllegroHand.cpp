@@ -2,305 +2,853 @@
 //
 
 #include "stdafx.h"
+#ifdef _WIN32
 #include "windows.h"
 #include <conio.h>
 #include <process.h>
 #include <tchar.h>
+#endif
 #include "canAPI.h"
+#include "canTransport.h"
+#include "canCodec.h"
+#include "canCapture.h"
 #include "rDeviceAllegroHandCANDef.h"
 #include "rPanelManipulatorCmdUtil.h"
 #include "BHand/BHand.h"
+#include "BHandMotion.h"
+#include "HighResTimer.h"
+#include "RtThread.h"
+#include "SeqLock.h"
+#include "JointData.h"
+#include "BusLoad.h"
+#include "LatencyHistogram.h"
+#include "Benchmark.h"
+#include "HandProfile.h"
+#include "HandSession.h"
+#ifdef LOOPBACKCAN
+#include "Loopback/canLoopback.h"
+#endif
 
 /////////////////////////////////////////////////////////////////////////////////////////
-/////////////////////////////////////////////////////////////////////////////////////////
-// IMPORTANT !!
-// SET CORRECT HAND PARAMETER HERE BEFORE RUNNING THIS PROGRAM.
-//#define SAH020
-#define SAH030
-const bool	RIGHT_HAND = true;
-const bool	DC_24V = false;
-#if defined SAH020
-const int	HAND_VERSION = 2;
-#elif defined SAH030
-const int	HAND_VERSION = 3;
+// for CAN communication
+int controlPeriod = 3; // msec, firmware ID_CMD_SET_PERIOD (--period)
+double delT = 0.003; // control period in seconds, follows controlPeriod
+unsigned char ahrsRate = AHRS_RATE_100Hz; // --ahrs-rate, lowered by PlanAhrsRate() to fit under busCeiling
+unsigned char ahrsMask = AHRS_MASK_POSE | AHRS_MASK_ACC; // --imu-filter adds the gyro, --ahrs-mag the magnetometer
+double busCeiling = BUS_LOAD_CEILING; // --bus-ceiling: worst-case bus load the AHRS rate is planned for
+bool busOverload = false; // --bus-overload: accept a period whose worst-case bit stuffing saturates the bus
+double imuFilterTau = 0.0; // --imu-filter: complementary filter time constant (sec), 0 uses the AHRS pose
+const int ioWaitTime = 10; // msec, longest the CAN thread sleeps on the receive event before re-checking ioThreadRun
+double txGapUsec = 0.0; // optional idle time between torque frames (usec), 0 sends all four in one batch
+#ifdef LOOPBACKCAN
+int sequenceRuns = 0; // --sequence: grasp sequences to run on the simulated hand instead of the keyboard loop
+int dropBoard = 0;    // --drop: finger board (0..3, -1 all) whose encoder frame the simulated bus loses
+int dropEvery = 0;    //         in every n-th period
 #endif
+
 /////////////////////////////////////////////////////////////////////////////////////////
-/////////////////////////////////////////////////////////////////////////////////////////
+// Hands driven by this process, one session each (HandSession.h)
+HandSession hand[MAX_HANDS];
+int handCount = 0;
+int handOpened = 0;    // sessions OpenCAN() succeeded for, CloseCAN() closes them
+int selectedHand = -1; // hand the keyboard and rPanelManipulator commands go to, -1: all hands
+
+// CPU and priority of the pipeline threads of the first hand (--rx-cpu, ...).
+// Hand i runs its threads on cpu + i*cpuStride, so every hand has cores of its own.
+PipelineStage stageConfig[STAGE_COUNT] = {
+	{ "rx",      -1, 0 },
+	{ "control", -1, 0 },
+	{ "tx",      -1, 0 },
+	{ "total",   -1, 0 }
+};
+int cpuStride = 0; // --cpu-stride, 0: the number of CPUs the first hand's threads span
 
+const char* histogramFile = "latency.hgrm";
 
-/////////////////////////////////////////////////////////////////////////////////////////
-// for CAN communication
-const double delT = 0.003;
-int CAN_Ch = 0;
-bool ioThreadRun = false;
-uintptr_t ioThread = 0;
-int recvNum = 0;
-int sendNum = 0;
-double statTime = -1.0;
-AllegroHand_DeviceMemory_t vars;
+// Encoder set deadline. A set that is still incomplete setDeadline periods after
+// its first frame, or when one board reports twice, is published anyway with the
+// missing boards extrapolated from their last two samples. If no frame arrives at
+// all for 1.5 periods, the whole set is extrapolated. After maxMisses incomplete
+// sets in a row the torque is switched off until as many complete sets in a row
+// have been received.
+const double setDeadline = 0.5;
+int maxMisses = 5; // --max-misses
+
+typedef struct tagBoardSample
+{
+	int enc[4];
+	double stamp;
+} BoardSample;
+
+// Encoder set being assembled by the RX thread
+typedef struct tagEncoderAssembly
+{
+	unsigned char boards; // bit per board received for the current set
+	double start;         // host time of the first frame of the set
+	double first;         // BusClock() at the first frame of the set
+	double stamp;         // driver time of the first frame of the set
+	double lastStamp;     // of the previously published set
+	double lastPublish;   // BusClock() when the previous set was published
+	BoardSample last[4];  // latest two measured samples of each board
+	BoardSample prev[4];
+	int samples[4];       // measured samples so far (up to 2)
+	int missRun;          // incomplete sets in a row
+	int okRun;            // complete sets in a row while the torque is off
+	bool zeroTorque;
+	EncoderSet es;
+} EncoderAssembly;
 
 /////////////////////////////////////////////////////////////////////////////////////////
 // for rPanelManipulator
 rPanelManipulatorData_t* pSHM = NULL;
-double curTime = 0.0;
 
 /////////////////////////////////////////////////////////////////////////////////////////
-// for BHand library
-BHand* pBHand = NULL;
-double q[MAX_DOF];
-double q_des[MAX_DOF];
-double tau_des[MAX_DOF];
-double cur_des[MAX_DOF];
+// Hand profiles (HandProfile.h). Every hand starts with the default profile and
+// switches to the profile its ID_CMD_QUERY_ID reply matches, if there is one.
+char profileFile[MAX_PATH] = "hands.ini"; // --profiles
+HandProfile handProfiles[MAX_PROFILES];
+int handProfileCount = 0;
+const HandProfile* defaultProfile = NULL; // --profile, else the first one of the file
+const double queryIdWait = 0.3; // sec, longest OpenCAN() waits for the ID reply (v2 hands send none)
+const char* calibrationFile = "calibration.ini"; // profiles written by --calibrate
 
 /////////////////////////////////////////////////////////////////////////////////////////
-// Hand parameters
-
-const double tau_cov_const_v2 = 800.0; // 800.0 for SAH020xxxxx
-const double tau_cov_const_v3 = 1200.0; // 1200.0 for SAH030xxxxx
-
-const short pwm_max_DC8V = 800; // 1200 is max
-const short pwm_max_DC24V = 500;
-
-#if defined SAH020
-//const double enc_dir[MAX_DOF] = { // SAH020xxxxx
-//	1.0, -1.0, 1.0, 1.0,
-//	1.0, -1.0, 1.0, 1.0,
-//	1.0, -1.0, 1.0, 1.0,
-//	1.0, 1.0, -1.0, -1.0
-//};
-//const double motor_dir[MAX_DOF] = { // SAH020xxxxx
-//	1.0, 1.0, 1.0, 1.0,
-//	1.0, -1.0, -1.0, 1.0,
-//	-1.0, 1.0, 1.0, 1.0,
-//	1.0, 1.0, 1.0, 1.0
-//};
-//const int enc_offset[MAX_DOF] = { // SAH020CR020
-//	-611, -66016, 1161, 1377,
-//	-342, -66033, -481, 303,
-//	30, -65620, 446, 387,
-//	-3942, -626, -65508, -66768
-//};
-//const int enc_offset[MAX_DOF] = { // SAH020BR013
-//	-391,	-64387,	-129,	 532,
-//	 178,	-66030,	-142,	 547,
-//	-234,	-64916,	 7317,	 1923,
-//	 1124,	-1319,	-65983, -65566
-//};
-
-#elif defined SAH030
-
-const double enc_dir[MAX_DOF] = { // SAH030xxxxx
-	1.0, 1.0, 1.0, 1.0,
-	1.0, 1.0, 1.0, 1.0,
-	1.0, 1.0, 1.0, 1.0,
-	1.0, 1.0, 1.0, 1.0
-};
-const double motor_dir[MAX_DOF] = { // SAH030xxxxx
-	1.0, 1.0, 1.0, 1.0,
-	1.0, 1.0, 1.0, 1.0,
-	1.0, 1.0, 1.0, 1.0,
-	1.0, 1.0, 1.0, 1.0
-};
-const int enc_offset[MAX_DOF] = { // SAH020BR015 (upgrated to version 3)
-	 296,	 189,	 2652,	-509,
-	-16,	 302,	 1005,	 1903,
-	 1499,	 1034,	-1232,	 1012,
-	 470,	-6,	    -76,     145
+// Telemetry recording (Telemetry.h), one set of segment files per hand
+char recordPrefix[MAX_PATH] = ""; // --record, empty: off
+double recordMinutes = 10.0;      // --record-minutes, length of one segment file
+int recordKeep = 0;               // --record-keep, segment files kept per hand, 0: all
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// CAN capture and replay (canCapture.h)
+char capturePrefix[MAX_PATH] = ""; // --capture: every hand's traffic goes to <prefix>_can<channel>.cap
+char replayFile[MAX_PATH] = "";    // --replay: one hand, fed from this capture instead of a bus
+bool replayRealtime = false;       // --replay-realtime: at the original pace
+bool hashCycles = false;           // sum up q and tau_des of every cycle to compare a replay with its capture
+const int replayNoteWait = 1000;   // msec, longest the control thread waits for the commands of a cycle
+
+// Notes the control thread adds to a capture, in this order, for every cycle
+enum eCaptureNote
+{
+	NOTE_COMMAND = 1, // JointCommand, when it changed
+	NOTE_CYCLE = 2    // number of the encoder set the cycle ran on
 };
-//const int enc_offset[MAX_DOF] = { // SAH030AR023
-//	-1700, -568, -3064, -36,
-//	-2015, -1687, 188, -772,
-//	-3763, 782, -3402, 368,
-//	1059, -2547, -692, 2411
-//};
-//const int enc_offset[MAX_DOF] = { // SAH030AL025
-//	-21, 617, -123, -2613,
-//	-57, 2265, -270, 284,
-//	2055, 1763, 1683, -2427,
-//	870, -856, 2143, 59
-//};
-//const int enc_offset[MAX_DOF] = { // SAH030AL026
-//	-647, 1776, -198, -2132,
-//	3335, 350, -3093, 468,
-//	-14, 1499, -2176, -960,
-//	-196, -367, 4, -1380
-//};
-//const int enc_offset[MAX_DOF] = { // SAH030BR027
-//	849, 240, 392, -4099,
-//	532, 512, -1062, -853,
-//	-512, -130, -1837, 2565,
-//	853, -2355, 665, 109
-//};
 
-#endif
+// Commands of the original run, taken from the capture by the control thread during a replay
+typedef struct tagReplayCursor
+{
+	unsigned int set; // NOTE_CYCLE read but not used yet, 0: none
+	JointCommand command;
+	unsigned int lost; // cycles of the original run this run did not compute
+} ReplayCursor;
 
 /////////////////////////////////////////////////////////////////////////////////////////
 // sample motions
 #include "RockScissorsPaper.h"
 
 
+
 /////////////////////////////////////////////////////////////////////////////////////////
 // functions declarations
 void PrintInstruction();
 void MainLoop();
-bool OpenCAN();
-void CloseCAN();
+bool OpenCAN(HandSession* h);
+void CloseCAN(HandSession* h);
 int GetCANChannelIndex(const TCHAR* cname);
-bool CreateBHandAlgorithm();
-void DestroyBHandAlgorithm();
-void ComputeTorque();
+bool CreateBHandAlgorithm(HandSession* h);
+void DestroyBHandAlgorithm(HandSession* h);
+void ComputeTorque(HandSession* h);
+void PrintPipelineStats(HandSession* h);
+void PrintThroughput();
+void DumpHistograms();
+bool RunCalibration();
+void RunReplay();
+#ifdef LOOPBACKCAN
+void RunSequence(int runs);
+#endif
 
 
 /////////////////////////////////////////////////////////////////////////////////////////
-// CAN communication thread
-static unsigned int __stdcall ioThreadProc(void* inst)
-{
-	char id_des;
-	char id_cmd;
-	char id_src;
-	int len;
-	unsigned char data[8];
-	unsigned char data_return = 0;
-	int i;
+// Hand sessions
+
+// Resets a session to be opened on the given channel
+static void InitHandSession(HandSession* h, int index, const CanTransport* transport, int ch)
+{
+	h->index = index;
+	h->ch = ch;
+	h->transport = transport;
+	memset(&h->vars, 0, sizeof(h->vars));
+
+	h->ioThreadRun = false;
+	h->openTime = 0.0;
+	h->recvNum = 0;
+	h->sendNum = 0;
+	h->statTime = -1.0;
+	h->statRecv = 0;
+	h->statSend = 0;
+	for (int s=0; s<STAGE_COUNT; s++)
+	{
+		h->stage[s] = stageConfig[s];
+		if (h->stage[s].cpu >= 0)
+			h->stage[s].cpu += index*cpuStride;
+	}
+	memset(&h->cycleClock, 0, sizeof(h->cycleClock));
+	memset((void*)h->boardMisses, 0, sizeof(h->boardMisses));
+
+	memset((void*)&h->recorder, 0, sizeof(h->recorder));
+
+	h->profile = defaultProfile;
+	h->pBHand = NULL;
+	h->motionType = eMotionType_NONE;
+	h->palmUp[0] = 0.0;
+	h->palmUp[1] = 0.0;
+	h->palmUp[2] = 1.0;
+	memset(h->q, 0, sizeof(h->q));
+	memset(h->q_des, 0, sizeof(h->q_des));
+	memset(h->tau_des, 0, sizeof(h->tau_des));
+	h->curTime = 0.0;
+}
+
+// true if keyboard and rPanelManipulator commands go to hand i
+static bool IsSelected(int i)
+{
+	return (selectedHand < 0 || selectedHand == i);
+}
+
+void SetHandMotion(HandSession* h, int motionType, const double* q_des, const double* kp, const double* kd)
+{
+	JointCommand jc;
+
+	h->jointCommand.Read(jc);
+	if (q_des)
+		memcpy(jc.q_des, q_des, sizeof(jc.q_des));
+	jc.motionType = motionType;
+	jc.motion++;
+	jc.gains = (kp && kd);
+	if (jc.gains)
+	{
+		memcpy(jc.kp, kp, sizeof(jc.kp));
+		memcpy(jc.kd, kd, sizeof(jc.kd));
+	}
+	h->jointCommand.Write(jc);
+}
+
+static void SetMotionType(int motionType)
+{
+	for (int i=0; i<handCount; i++)
+	{
+		if (IsSelected(i))
+			SetHandMotion(&hand[i], motionType, NULL, NULL, NULL);
+	}
+}
+
+static void SetMotion(void (*motion)(HandSession* hand))
+{
+	for (int i=0; i<handCount; i++)
+	{
+		if (IsSelected(i))
+			motion(&hand[i]);
+	}
+}
+
+static void PrintSelection()
+{
+	if (selectedHand < 0)
+		printf(">Commands go to all %d hands\n", handCount);
+	else
+		printf(">Commands go to hand %d, CAN(%d) %s\n", selectedHand+1, hand[selectedHand].ch, hand[selectedHand].transport->name);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Pipeline latency statistics
+static void UpdateStageLatency(HandSession* h, int s, double latency)
+{
+	PipelineStage* st = &h->stage[s];
+	st->last = latency;
+	if (latency > st->max) st->max = latency;
+	st->sum += latency;
+	st->count++;
+}
+
+// AHRS frames per second of each stream, against the rate it was set to
+static void PrintImuRates(const HandSession* h)
+{
+	static const char* streamName[IMU_STREAMS] = { "pose", "acc", "gyro", "mag" };
+	double hz[IMU_STREAMS];
+
+	ImuRates(&h->imu, hz);
+	printf("  AHRS frames/s (set to %.0f):", AhrsRateHz(ahrsRate));
+	for (int s=0; s<IMU_STREAMS; s++)
+	{
+		if (ahrsMask & (1 << s))
+			printf(" %s %.1f", streamName[s], hz[s]);
+	}
+	printf(", %u incomplete samples\n", h->imu.incomplete);
+}
+
+// Load of the frames seen on the bus since it was opened, against the plan
+static void PrintBusLoad(const HandSession* h)
+{
+	double seconds = h->rxLastStamp - h->rxFirstStamp;
+	unsigned int control = h->recvNum + 4*h->sendNum; // encoder frames in, torque frames out
+	unsigned int ahrs = ImuFrames(&h->imu);
+
+	printf("  bus load: %.1f%% (%.1f%% worst-case bit stuffing), planned %.1f%% (%.1f%%), ceiling %.0f%%\n",
+		MeasuredBusLoad(control, ahrs, seconds, false)*100.0, MeasuredBusLoad(control, ahrs, seconds, true)*100.0,
+		ControlBusLoad(controlPeriod, ahrsRate, ahrsMask, false)*100.0, ControlBusLoad(controlPeriod, ahrsRate, ahrsMask, true)*100.0,
+		busCeiling*100.0);
+}
+
+void PrintPipelineStats(HandSession* h)
+{
+	if (handCount > 1)
+		printf("Hand %d, CAN(%d) %s\n", h->index+1, h->ch, h->transport->name);
+	printf("CAN pipeline latency (usec):    last      avg      max   (cpu, priority)\n");
+	for (int s=0; s<STAGE_COUNT; s++)
+	{
+		PipelineStage st = h->stage[s];
+		printf("  %-8s %10u cycles %8.1f %8.1f %8.1f", st.name, st.count,
+			st.last*1e6, (st.count ? st.sum/st.count*1e6 : 0.0), st.max*1e6);
+		if (s != STAGE_TOTAL) printf("   (%d, %d)", st.cpu, st.priority);
+		printf("\n");
+	}
+	printf("  incomplete encoder sets per board: %u %u %u %u\n",
+		h->boardMisses[0], h->boardMisses[1], h->boardMisses[2], h->boardMisses[3]);
+	PrintImuRates(h);
+	PrintBusLoad(h);
+	CycleClock cc = h->cycleClock;
+	printf("  control dt (usec): last %.1f, min %.1f, max %.1f, nominal %.1f, fallbacks %u\n",
+		cc.dt*1e6, cc.min*1e6, cc.max*1e6, delT*1e6, cc.fallback);
+
+	printf("Cycle timing (usec):      samples      min      p50      p90      p99    p99.9   p99.99      max  over budget\n");
+	for (int hi=0; hi<HIST_COUNT; hi++)
+		HistPrint(&h->histogram[hi]);
+}
+
+// Frame rates of all hands together since they were opened
+void PrintThroughput()
+{
+	double now = GetHighResTime();
+	double rxRate = 0.0;
+	double txRate = 0.0;
+
+	for (int i=0; i<handOpened; i++)
+	{
+		if (hand[i].openTime <= 0.0 || now <= hand[i].openTime)
+			continue;
+		rxRate += hand[i].recvNum / (now - hand[i].openTime);
+		txRate += hand[i].sendNum / (now - hand[i].openTime);
+	}
+	printf("All %d hands: %.0f encoder frames/s received, %.0f torque commands/s sent\n", handOpened, rxRate, txRate);
+}
+
+void DumpHistograms()
+{
+	FILE* fp = fopen(histogramFile, "w");
+	if (!fp)
+	{
+		printf("ERROR: cannot write %s\n", histogramFile);
+		return;
+	}
+	for (int i=0; i<handOpened; i++)
+	{
+		if (handCount > 1)
+			fprintf(fp, "# hand %d, CAN(%d) %s\n", i+1, hand[i].ch, hand[i].transport->name);
+		for (int h=0; h<HIST_COUNT; h++)
+			HistDump(&hand[i].histogram[h], fp);
+	}
+	fclose(fp);
+	printf("Timing histograms written to %s\n", histogramFile);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Publish frame rates and deadline misses to rPanelManipulator
+static void UpdateMasterState(HandSession* h, rPanelManipulatorMasterState_t* ms)
+{
+	double now = GetHighResTime();
+	int recv = h->recvNum;
+	int send = h->sendNum;
+
+	if (h->statTime <= 0.0)
+	{
+		h->statTime = now;
+		h->statRecv = recv;
+		h->statSend = send;
+	}
+	else if (now - h->statTime >= 1.0)
+	{
+		ms->frame_rate_recv = (float)((recv - h->statRecv) / (now - h->statTime));
+		ms->frame_rate_send = (float)((send - h->statSend) / (now - h->statTime));
+		h->statTime = now;
+		h->statRecv = recv;
+		h->statSend = send;
+	}
+	ms->frames_recv = recv;
+	ms->frames_send = send;
+	ms->error_count = (int)h->histogram[HIST_RX_TO_TX].misses;
+	ms->error_count_continuous = (int)h->histogram[HIST_RX_TO_TX].missRun;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Encoder set assembly (RX thread)
+
+// Clock of the encoder set deadlines: the host clock, or the virtual clock of
+// the bus when the hand is simulated in-process.
+static double BusClock(const HandSession* h)
+{
+	double t = can_bus_time(h->ch);
+	return (t != CAN_TIMESTAMP_NONE ? t : GetHighResTime());
+}
+
+static void ExtrapolateBoard(const EncoderAssembly* a, int board, double t, int* enc)
+{
+	const BoardSample* l = &a->last[board];
+	const BoardSample* p = &a->prev[board];
+	double k;
+	int j, v;
+
+	if (a->samples[board] == 0)
+		return; // never heard from, the torque goes off after maxMisses sets
+	if (a->samples[board] == 1 || l->stamp <= p->stamp)
+	{
+		memcpy(enc, l->enc, sizeof(l->enc));
+		return;
+	}
+
+	k = (t - l->stamp) / (l->stamp - p->stamp);
+	if (k < 0.0) k = 0.0;
+	else if (k > maxMisses) k = maxMisses;
+	for (j=0; j<4; j++)
+	{
+		v = l->enc[j] + (int)((l->enc[j] - p->enc[j]) * k);
+		enc[j] = (v < 0 ? 0 : (v > 0xffff ? 0xffff : v));
+	}
+}
+
+static void PublishEncoderSet(HandSession* h, EncoderAssembly* a)
+{
+	unsigned char missing = (unsigned char)(~a->boards & 0x0f);
+	double now = GetHighResTime();
+	int b;
+
+	if (a->boards == 0)
+	{
+		// nothing arrived at all: the set is due one period after the last one
+		a->start = now;
+		a->first = BusClock(h);
+		a->stamp = (a->lastStamp != 0.0 ? a->lastStamp + delT : now);
+	}
+
+	for (b=0; b<4; b++)
+	{
+		if (missing & (0x01 << b))
+		{
+			ExtrapolateBoard(a, b, a->stamp, &a->es.enc_actual[b*4]);
+			h->boardMisses[b]++;
+		}
+	}
+
+	if (missing)
+	{
+		a->okRun = 0;
+		if (++a->missRun >= maxMisses && !a->zeroTorque)
+		{
+			a->zeroTorque = true;
+			printf(">CAN(%d): %d incomplete encoder sets in a row, torque off\n", h->ch, a->missRun);
+		}
+	}
+	else
+	{
+		a->missRun = 0;
+		if (a->zeroTorque && ++a->okRun >= maxMisses)
+		{
+			a->zeroTorque = false;
+			printf(">CAN(%d): %d complete encoder sets in a row, torque on\n", h->ch, a->okRun);
+		}
+	}
+
+	// hand the set over to the control thread and go back to draining the bus
+	memcpy(h->vars.enc_actual, a->es.enc_actual, sizeof(h->vars.enc_actual));
+	a->es.rxTime = a->start;
+	a->es.readyTime = now;
+	a->es.stamp = a->stamp;
+	a->es.missing = missing;
+	a->es.zeroTorque = a->zeroTorque;
+	h->encoderSet.Write(a->es);
+	RtEventSet(&h->ctrlEvent);
+	UpdateStageLatency(h, STAGE_RX, a->es.readyTime - a->es.rxTime);
+	if (a->lastStamp != 0.0)
+		HistRecord(&h->histogram[HIST_RX_PERIOD], a->stamp - a->lastStamp);
+	a->lastStamp = a->stamp;
+	a->lastPublish = BusClock(h);
+	a->boards = 0;
+}
+
+static void AddBoardSample(HandSession* h, EncoderAssembly* a, int board, const int* enc, double stamp)
+{
+	BoardSample* l = &a->last[board];
+
+	// the board is already in the set, so its other boards' frames of that cycle were lost
+	if (a->boards & (0x01 << board))
+		PublishEncoderSet(h, a);
+
+	if (a->boards == 0)
+	{
+		a->start = GetHighResTime();
+		a->first = BusClock(h);
+		a->stamp = stamp;
+	}
 
-	while (ioThreadRun)
+	a->prev[board] = *l;
+	memcpy(l->enc, enc, sizeof(l->enc));
+	l->stamp = stamp;
+	if (a->samples[board] < 2) a->samples[board]++;
+
+	memcpy(&a->es.enc_actual[board*4], l->enc, sizeof(l->enc));
+	a->boards |= (0x01 << board);
+	if (a->boards == (0x01 | 0x02 | 0x04 | 0x08))
+		PublishEncoderSet(h, a);
+}
+
+// BusClock() time at which the set being assembled is published even if incomplete, 0 if none
+static double EncoderSetDeadline(const EncoderAssembly* a)
+{
+	if (a->boards)
+		return a->first + setDeadline*delT;
+	if (a->lastPublish != 0.0)
+		return a->lastPublish + 1.5*delT;
+	return 0.0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// CAN receive thread: decodes frames and publishes one encoder set per control period
+static void rxThreadProc(void* inst)
+{
+	HandSession* h = (HandSession*)inst;
+	CanFrameInfo frame;
+	double rxStamp;
+	double deadline;
+	double remaining;
+	int waitTime;
+	EncoderAssembly a;
+
+	memset(&a, 0, sizeof(a));
+
+	while (h->ioThreadRun)
 	{
-		while (0 == get_message(CAN_Ch, &id_cmd, &id_src, &id_des, &len, data, FALSE))
+		// sleep until the next frame, but not past the deadline of the current set
+		waitTime = ioWaitTime;
+		deadline = EncoderSetDeadline(&a);
+		if (deadline != 0.0)
 		{
-			switch (id_cmd)
+			remaining = deadline - BusClock(h);
+			if (remaining <= 0.0) waitTime = 0;
+			else if (remaining < ioWaitTime*1e-3) waitTime = (int)(remaining*1e3) + 1;
+		}
+
+		if (0 == get_frame_wait(h->ch, &frame, waitTime, &rxStamp))
+		{
+			if (rxStamp == CAN_TIMESTAMP_NONE)
+				rxStamp = GetHighResTime();
+			if (h->rxFirstStamp == 0.0)
+				h->rxFirstStamp = rxStamp;
+			h->rxLastStamp = rxStamp;
+
+			// the payload layout says what the frame is; frames too short for
+			// their command, and encoder frames not from a finger board, are unknown
+			switch (frame.payload)
 			{
-			case ID_CMD_QUERY_ID:
-				{
-					printf(">CAN(%d): AllegroHand revision info: 0x%02x%02x\n", CAN_Ch, data[3], data[2]);
-					printf("                      firmware info: 0x%02x%02x\n", data[5], data[4]);
-					printf("                      hardware type: 0x%02x\n", data[7]);
-				}
+			case CAN_PAYLOAD_ID:
+				printf(">CAN(%d): AllegroHand revision info: 0x%04x\n", h->ch, frame.u.id.revision);
+				printf("                      firmware info: 0x%04x\n", frame.u.id.firmware);
+				printf("                      hardware type: 0x%02x\n", frame.u.id.hardwareType);
+				h->handId.Write(frame.u.id);
 				break;
 
-			case ID_CMD_AHRS_POSE:
-				{
-					/*printf(">CAN(%d): AHRS Roll : 0x%02x%02x\n", CAN_Ch, data[0], data[1]);
-					printf("               Pitch: 0x%02x%02x\n", data[2], data[3]);
-					printf("               Yaw  : 0x%02x%02x\n", data[4], data[5]);*/
-				}
+			case CAN_PAYLOAD_AHRS:
+				ImuFrame(&h->imu, frame.index, frame.u.ahrs, rxStamp);
 				break;
 
-			case ID_CMD_AHRS_ACC:
-				{
-					/*printf(">CAN(%d): AHRS Acc(x): 0x%02x%02x\n", CAN_Ch, data[0], data[1]);
-					printf("               Acc(y): 0x%02x%02x\n", data[2], data[3]);
-					printf("               Acc(z): 0x%02x%02x\n", data[4], data[5]);*/
-				}
+			case CAN_PAYLOAD_ENCODER:
+				AddBoardSample(h, &a, frame.index, frame.u.enc, rxStamp);
+				h->recvNum++;
 				break;
+			}
+		}
 
-			case ID_CMD_AHRS_GYRO:
-				{
-					/*printf(">CAN(%d): AHRS Angular Vel(x): 0x%02x%02x\n", CAN_Ch, data[0], data[1]);
-					printf("               Angular Vel(y): 0x%02x%02x\n", data[2], data[3]);
-					printf("               Angular Vel(z): 0x%02x%02x\n", data[4], data[5]);*/
-				}
-				break;
+		if (deadline != 0.0 && BusClock(h) >= deadline && deadline == EncoderSetDeadline(&a))
+			PublishEncoderSet(h, &a);
+	}
+}
 
-			case ID_CMD_AHRS_MAG:
+/////////////////////////////////////////////////////////////////////////////////////////
+// During a replay the control thread runs on the commands of the original run and skips the
+// encoder sets that run skipped. false: the original run computed no cycle on this set.
+static bool ReplayCycle(HandSession* h, unsigned int set, ReplayCursor* cursor, JointCommand* jc)
+{
+	unsigned char note[CAN_CAPTURE_NOTE_MAX];
+	unsigned int tag;
+	int size;
+
+	for (;;)
+	{
+		if (cursor->set == 0)
+		{
+			size = can_replay_note(h->ch, &tag, note, sizeof(note), replayNoteWait);
+			if (size == 0)
+				return false; // end of the capture
+			if (tag == NOTE_COMMAND && size == sizeof(JointCommand))
+				memcpy(&cursor->command, note, size);
+			else if (tag == NOTE_CYCLE && size == sizeof(unsigned int))
+				memcpy(&cursor->set, note, size);
+			continue;
+		}
+		if (cursor->set > set)
+			return false;
+		if (cursor->set == set)
+		{
+			cursor->set = 0;
+			*jc = cursor->command;
+			return true;
+		}
+		// a set the original run computed and this one skipped
+		cursor->set = 0;
+		cursor->lost++;
+	}
+}
+
+// FNV-1a over the joint positions and torques of a cycle
+static unsigned int HashCycle(unsigned int hash, const HandSession* h)
+{
+	const unsigned char* p;
+	size_t i;
+
+	p = (const unsigned char*)h->q;
+	for (i=0; i<sizeof(h->q); i++)
+		hash = (hash ^ p[i])*16777619u;
+	p = (const unsigned char*)h->tau_des;
+	for (i=0; i<sizeof(h->tau_des); i++)
+		hash = (hash ^ p[i])*16777619u;
+	return hash;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Control thread: woken per encoder set, computes the PWM command.
+// If it falls behind, intermediate sets are skipped and the newest one is used.
+static void ctrlThreadProc(void* inst)
+{
+	HandSession* h = (HandSession*)inst;
+	EncoderSet es;
+	PwmCommand cmd;
+	JointCommand jc;
+	JointState js;
+	ImuSample imu;
+	TelemetryRecord* rec;
+	ReplayCursor replay;
+	unsigned int lastSet = h->encoderSet.Version();
+	unsigned int curSet;
+	unsigned int command;
+	unsigned int capturedCommand = 0;
+	unsigned int appliedMotion = 0;
+	double lastStamp = 0.0;
+	double dt;
+	double computeStart;
+	bool firstSet = true;
+	bool replaying = (h->transport == &canTransportReplay);
+	const JointConversion* conversion;
+
+	memset(&replay, 0, sizeof(replay));
+	memset(&jc, 0, sizeof(jc));
+	memset(&imu, 0, sizeof(imu));
+	while (h->ioThreadRun)
+	{
+		if (!RtEventWait(&h->ctrlEvent, ioWaitTime))
+			continue;
+		curSet = h->encoderSet.Read(es);
+		if (curSet == lastSet)
+			continue;
+		lastSet = curSet;
+
+		// The commands of the cycle. A capture notes them with the set they were applied on,
+		// so a replay applies them on the same cycles.
+		if (replaying)
+		{
+			if (!ReplayCycle(h, curSet, &replay, &jc))
+				continue;
+		}
+		else
+		{
+			command = h->jointCommand.Read(jc);
+			if (can_capture_active(h->ch))
+			{
+				if (command != capturedCommand)
 				{
-					/*printf(">CAN(%d): AHRS Magnetic Field(x): 0x%02x%02x\n", CAN_Ch, data[0], data[1]);
-					printf("               Magnetic Field(y): 0x%02x%02x\n", data[2], data[3]);
-					printf("               Magnetic Field(z): 0x%02x%02x\n", data[4], data[5]);*/
+					can_capture_note(h->ch, NOTE_COMMAND, &jc, sizeof(jc));
+					capturedCommand = command;
 				}
-				break;
+				can_capture_note(h->ch, NOTE_CYCLE, &curSet, sizeof(curSet));
+			}
+		}
 
-			case ID_CMD_QUERY_CONTROL_DATA:
+		// Step the controller by the time that really passed between the two sets.
+		// Fall back to the nominal period on the first set or when the stamps jump
+		// (driver restart, time stamp source changed, clock wrap not caught).
+		dt = es.stamp - lastStamp;
+		lastStamp = es.stamp;
+		if (firstSet || dt <= 0.0 || dt > 10.0*delT)
+		{
+			if (!firstSet) h->cycleClock.fallback++;
+			firstSet = false;
+			dt = delT;
+		}
+		h->cycleClock.dt = dt;
+		if (h->cycleClock.min == 0.0 || dt < h->cycleClock.min) h->cycleClock.min = dt;
+		if (dt > h->cycleClock.max) h->cycleClock.max = dt;
+
+		// convert encoder count to joint angle
+		conversion = &h->profile->conversion;
+		EncoderToAngle(conversion, es.enc_actual, h->q);
+
+		// compute joint torque
+		if (jc.motion != appliedMotion && h->pBHand)
+		{
+			// SetMotionType() loads the default gains of the motion, so the gains go after it
+			h->pBHand->SetMotionType(BHandMotionType(jc.motionType));
+			if (jc.gains)
+				h->pBHand->SetGainsEx(jc.kp, jc.kd);
+			h->motionType = jc.motionType;
+		}
+		appliedMotion = jc.motion;
+		memcpy(h->q_des, jc.q_des, sizeof(h->q_des));
+		if (h->calibration.active)
+			CalibrationStep(&h->calibration, h->profile, es.enc_actual, h->q, h->curTime, h->q_des);
+		if (h->pBHand) h->pBHand->SetTimeInterval(dt);
+		// tilt of the palm from the newest AHRS sample, upright until the first one
+		if (ImuLatest(&h->imu, &imu))
+			GravityUpFromPose(imu.rpy[0], imu.rpy[1], h->palmUp);
+		computeStart = GetHighResTime();
+		ComputeTorque(h);
+		HistRecord(&h->histogram[HIST_COMPUTE], GetHighResTime() - computeStart);
+		if (hashCycles)
+		{
+			h->cycleHash = HashCycle(h->cycleHash, h);
+			h->cycles++;
+		}
+
+		memcpy(js.q, h->q, sizeof(js.q));
+		memcpy(js.tau_des, h->tau_des, sizeof(js.tau_des));
+		js.time = h->curTime;
+		h->jointState.Write(js);
+
+		// convert desired torque to motor PWM counts (the motor order is different from that of encoders)
+		TorqueToPwm(conversion, h->tau_des, cmd.pwm_demand);
+		if (es.zeroTorque)
+			memset(cmd.pwm_demand, 0, sizeof(cmd.pwm_demand));
+		memcpy(h->vars.pwm_demand, cmd.pwm_demand, sizeof(h->vars.pwm_demand));
+		cmd.rxTime = es.rxTime;
+		cmd.setTime = es.readyTime;
+		cmd.readyTime = GetHighResTime();
+		h->pwmCommand.Write(cmd);
+		RtEventSet(&h->txEvent);
+		UpdateStageLatency(h, STAGE_CONTROL, cmd.readyTime - es.readyTime);
+
+		// the torques are on their way, the record of the cycle can wait until now
+		rec = TelemetryBegin(&h->recorder);
+		if (rec)
+		{
+			rec->time = h->curTime;
+			rec->stamp = es.stamp;
+			rec->set = curSet;
+			rec->missing = es.missing;
+			rec->zeroTorque = es.zeroTorque;
+			rec->ahrsCount = (unsigned short)ImuFrames(&h->imu);
+			memcpy(rec->enc, es.enc_actual, sizeof(rec->enc));
+			for (int i=0; i<MAX_DOF; i++)
+			{
+				rec->q[i] = (float)h->q[i];
+				rec->tau[i] = (float)h->tau_des[i];
+			}
+			memcpy(rec->pwm, cmd.pwm_demand, sizeof(rec->pwm));
+			memcpy(rec->ahrs, imu.raw, sizeof(rec->ahrs));
+			TelemetryCommit(&h->recorder);
+		}
+
+		h->curTime += dt;
+	}
+	if (replay.lost)
+		printf(">CAN(%d): %u cycles of the capture were not replayed\n", h->ch, replay.lost);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// CAN transmit thread: sends the newest PWM command
+static void txThreadProc(void* inst)
+{
+	HandSession* h = (HandSession*)inst;
+	PwmCommand cmd;
+	unsigned int lastCmd = h->pwmCommand.Version();
+	unsigned int curCmd;
+	double txStart;
+	double txDone;
+	int i;
+
+	while (h->ioThreadRun)
+	{
+		if (!RtEventWait(&h->txEvent, ioWaitTime))
+			continue;
+		curCmd = h->pwmCommand.Read(cmd);
+		if (curCmd == lastCmd)
+			continue;
+		lastCmd = curCmd;
+
+		txStart = GetHighResTime();
+		if (txGapUsec > 0.0)
+		{
+			for (i=0; i<4; i++)
+			{
+				write_current(h->ch, i, &cmd.pwm_demand[4*i]);
+				if (i < 3)
 				{
-					if (id_src >= ID_DEVICE_SUB_01 && id_src <= ID_DEVICE_SUB_04)
-					{
-						vars.enc_actual[(id_src-ID_DEVICE_SUB_01)*4 + 0] = (int)(data[0] | (data[1] << 8));
-						vars.enc_actual[(id_src-ID_DEVICE_SUB_01)*4 + 1] = (int)(data[2] | (data[3] << 8));
-						vars.enc_actual[(id_src-ID_DEVICE_SUB_01)*4 + 2] = (int)(data[4] | (data[5] << 8));
-						vars.enc_actual[(id_src-ID_DEVICE_SUB_01)*4 + 3] = (int)(data[6] | (data[7] << 8));
-						data_return |= (0x01 << (id_src-ID_DEVICE_SUB_01));
-						recvNum++;
-					}
-					if (data_return == (0x01 | 0x02 | 0x04 | 0x08))
-					{
-						// convert encoder count to joint angle
-						for (i=0; i<MAX_DOF; i++)
-							q[i] = (double)(vars.enc_actual[i]*enc_dir[i]-32768-enc_offset[i])*(333.3/65536.0)*(3.141592/180.0);
-
-						// compute joint torque
-						ComputeTorque();
-
-						// convert desired torque to desired current and PWM count
-						for (i=0; i<MAX_DOF; i++)
-						{
-							cur_des[i] = tau_des[i] * motor_dir[i];
-							if (cur_des[i] > 1.0) cur_des[i] = 1.0;
-							else if (cur_des[i] < -1.0) cur_des[i] = -1.0;
-						}
-
-						// send torques
-						for (int i=0; i<4;i++)
-						{
-							// the index order for motors is different from that of encoders
-
-							switch (HAND_VERSION)
-							{
-								case 1:
-								case 2:
-									vars.pwm_demand[i*4+3] = (short)(cur_des[i*4+0]*tau_cov_const_v2);
-									vars.pwm_demand[i*4+2] = (short)(cur_des[i*4+1]*tau_cov_const_v2);
-									vars.pwm_demand[i*4+1] = (short)(cur_des[i*4+2]*tau_cov_const_v2);
-									vars.pwm_demand[i*4+0] = (short)(cur_des[i*4+3]*tau_cov_const_v2);
-									break;
-
-								case 3:
-								default:
-									vars.pwm_demand[i*4+3] = (short)(cur_des[i*4+0]*tau_cov_const_v3);
-									vars.pwm_demand[i*4+2] = (short)(cur_des[i*4+1]*tau_cov_const_v3);
-									vars.pwm_demand[i*4+1] = (short)(cur_des[i*4+2]*tau_cov_const_v3);
-									vars.pwm_demand[i*4+0] = (short)(cur_des[i*4+3]*tau_cov_const_v3);
-									break;
-							}
-
-							if (DC_24V) {
-								for (int j=0; j<4; j++) {
-									if (vars.pwm_demand[i*4+j] > pwm_max_DC24V) vars.pwm_demand[i*4+j] = pwm_max_DC24V;
-									else if (vars.pwm_demand[i*4+j] < -pwm_max_DC24V) vars.pwm_demand[i*4+j] = -pwm_max_DC24V;
-								}
-							} 
-							else {
-								for (int j=0; j<4; j++) {
-									if (vars.pwm_demand[i*4+j] > pwm_max_DC8V) vars.pwm_demand[i*4+j] = pwm_max_DC8V;
-									else if (vars.pwm_demand[i*4+j] < -pwm_max_DC8V) vars.pwm_demand[i*4+j] = -pwm_max_DC8V;
-								}
-
-							}
-
-							write_current(CAN_Ch, i, &vars.pwm_demand[4*i]);
-							for(int k=0; k<100000; k++);
-						}
-						sendNum++;
-						curTime += delT;
-
-						data_return = 0;
-					}
+					can_wait_tx(h->ch, TX_TIMEOUT);
+					DelayMicroseconds(txGapUsec);
 				}
-				break;
 			}
 		}
+		else
+		{
+			write_current_all(h->ch, cmd.pwm_demand);
+		}
+		can_wait_tx(h->ch, TX_TIMEOUT); // keep the next cycle from queueing behind this one
+		h->sendNum++;
+
+		txDone = GetHighResTime();
+		UpdateStageLatency(h, STAGE_TX, txDone - cmd.readyTime);
+		UpdateStageLatency(h, STAGE_TOTAL, txDone - cmd.rxTime);
+		HistRecord(&h->histogram[HIST_CAN_WRITE], txDone - txStart);
+		HistRecord(&h->histogram[HIST_RX_TO_TX], txDone - cmd.setTime);
 	}
-
-	return 0;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 // Compute control torque for each joint using BHand library
-void ComputeTorque()
+void ComputeTorque(HandSession* h)
 {
-	if (!pBHand) return;
-	pBHand->SetJointPosition(q); // tell BHand library the current joint positions
-	pBHand->SetJointDesiredPosition(q_des);
-	pBHand->UpdateControl(0);
-	pBHand->GetJointTorque(tau_des);
+	if (!h->pBHand) return;
+	h->pBHand->SetJointPosition(h->q); // tell BHand library the current joint positions
+	h->pBHand->SetJointDesiredPosition(h->q_des);
+	h->pBHand->UpdateControl(0);
+	h->pBHand->GetJointTorque(h->tau_des);
+
+	// BHand holds the fingers up on an upright palm; add what the tilt of
+	// the palm changes (nothing while it stays upright). Without BHand's
+	// gravity compensation (Linux) the model gives all of it.
+	if (h->motionType == eMotionType_GRAVITY_COMP)
+	{
+		double tilt[3] = { h->palmUp[0], h->palmUp[1], h->palmUp[2] - BHAND_GRAVITY_COMP };
+		double tau[MAX_DOF];
+		SolveGravity(&h->gravity, h->q, tilt, tau);
+		for (int i=0; i<MAX_DOF; i++)
+			h->tau_des[i] += tau[i];
+	}
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -309,6 +857,7 @@ void MainLoop()
 {
 	bool bRun = true;
 	int i;
+	JointState js;
 
 	while (bRun)
 	{
@@ -322,43 +871,61 @@ void MainLoop()
 				case CMD_SERVO_ON:
 					break;
 				case CMD_SERVO_OFF:
-					if (pBHand) pBHand->SetMotionType(eMotionType_NONE);
+					SetMotionType(eMotionType_NONE);
 					break;
 				case CMD_CMD_1:
-					if (pBHand) pBHand->SetMotionType(eMotionType_HOME);
+					SetMotionType(eMotionType_HOME);
 					break;
 				case CMD_CMD_2:
-					if (pBHand) pBHand->SetMotionType(eMotionType_READY);
+					SetMotionType(eMotionType_READY);
 					break;
 				case CMD_CMD_3:
-					if (pBHand) pBHand->SetMotionType(eMotionType_GRASP_3);
+					SetMotionType(eMotionType_GRASP_3);
 					break;
 				case CMD_CMD_4:
-					if (pBHand) pBHand->SetMotionType(eMotionType_GRASP_4);
+					SetMotionType(eMotionType_GRASP_4);
 					break;
 				case CMD_CMD_5:
-					if (pBHand) pBHand->SetMotionType(eMotionType_PINCH_IT);
+					SetMotionType(eMotionType_PINCH_IT);
 					break;
 				case CMD_CMD_6:
-					if (pBHand) pBHand->SetMotionType(eMotionType_PINCH_MT);
+					SetMotionType(eMotionType_PINCH_MT);
 					break;
 				case CMD_CMD_7:
-					if (pBHand) pBHand->SetMotionType(eMotionType_ENVELOP);
+					SetMotionType(eMotionType_ENVELOP);
 					break;
 				case CMD_CMD_8:
-					if (pBHand) pBHand->SetMotionType(eMotionType_GRAVITY_COMP);
+					SetMotionType(eMotionType_GRAVITY_COMP);
 					break;
 				case CMD_EXIT:
 					bRun = false;
 					break;
 				}
 				pSHM->cmd.command = CMD_NULL;
+
+				// rPanelManipulator shows one hand: the selected one, or the first
+				HandSession* h = &hand[selectedHand < 0 ? 0 : selectedHand];
+				h->jointState.Read(js);
 				for (i=0; i<MAX_DOF; i++)
 				{
-					pSHM->state.slave_state[i].position = q[i];
-					pSHM->cmd.slave_command[i].torque = tau_des[i];
+					pSHM->state.slave_state[i].position = js.q[i];
+					pSHM->state.slave_state[i].errcount = (int)h->boardMisses[i/4];
+					pSHM->cmd.slave_command[i].torque = js.tau_des[i];
+				}
+				pSHM->state.time = js.time;
+				UpdateMasterState(h, &pSHM->state.master_state);
+
+				// the orientation of the palm, which the four fingers share
+				ImuSample imu;
+				if (ImuLatest(&h->imu, &imu))
+				{
+					for (i=0; i<MAX_BRANCH_COUNT; i++)
+					{
+						pSHM->state.endeffector_state[i].roll = imu.rpy[0];
+						pSHM->state.endeffector_state[i].pitch = imu.rpy[1];
+						pSHM->state.endeffector_state[i].yaw = imu.rpy[2];
+					}
 				}
-				pSHM->state.time = curTime;
 			}
 		}
 		else
@@ -367,56 +934,80 @@ void MainLoop()
 			switch (c)
 			{
 			case 'q':
-				if (pBHand) pBHand->SetMotionType(eMotionType_NONE);
+				selectedHand = -1;
+				SetMotionType(eMotionType_NONE);
 				bRun = false;
 				break;
-			
+
 			case 'h':
-				if (pBHand) pBHand->SetMotionType(eMotionType_HOME);
+				SetMotionType(eMotionType_HOME);
 				break;
-			
+
 			case 'r':
-				if (pBHand) pBHand->SetMotionType(eMotionType_READY);
+				SetMotionType(eMotionType_READY);
 				break;
-			
+
 			case 'g':
-				if (pBHand) pBHand->SetMotionType(eMotionType_GRASP_3);
+				SetMotionType(eMotionType_GRASP_3);
 				break;
 
 			case 'k':
-				if (pBHand) pBHand->SetMotionType(eMotionType_GRASP_4);
+				SetMotionType(eMotionType_GRASP_4);
 				break;
-			
+
 			case 'p':
-				if (pBHand) pBHand->SetMotionType(eMotionType_PINCH_IT);
+				SetMotionType(eMotionType_PINCH_IT);
 				break;
-			
+
 			case 'm':
-				if (pBHand) pBHand->SetMotionType(eMotionType_PINCH_MT);
+				SetMotionType(eMotionType_PINCH_MT);
 				break;
-			
+
 			case 'a':
-				if (pBHand) pBHand->SetMotionType(eMotionType_GRAVITY_COMP);
+				SetMotionType(eMotionType_GRAVITY_COMP);
 				break;
 
 			case 'e':
-				if (pBHand) pBHand->SetMotionType(eMotionType_ENVELOP);
+				SetMotionType(eMotionType_ENVELOP);
 				break;
 
 			case 'o':
-				if (pBHand) pBHand->SetMotionType(eMotionType_NONE);
+				SetMotionType(eMotionType_NONE);
+				break;
+
+			case 'n':
+				if (handCount > 1)
+				{
+					// all hands -> hand 1 -> ... -> hand N -> all hands
+					selectedHand = (selectedHand + 2) % (handCount + 1) - 1;
+					PrintSelection();
+				}
+				break;
+
+			case 'l':
+				for (i=0; i<handCount; i++)
+				{
+					if (IsSelected(i))
+						PrintPipelineStats(&hand[i]);
+				}
+				if (handCount > 1)
+					PrintThroughput();
+				break;
+
+			case 't':
+				DumpHistograms();
 				break;
 
 			case '1':
-				MotionRock();
+				SetMotion(MotionRock);
 				break;
 
 			case '2':
-				MotionScissors();
+				SetMotion(MotionScissors);
 				break;
 
 			case '3':
-				MotionPaper();
+				SetMotion(MotionPaper);
 				break;
 			}
 		}
@@ -424,103 +1015,385 @@ void MainLoop()
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
-// Open a CAN data channel
-bool OpenCAN()
+// Encoder offset calibration of all hands at the same time (Calibration.h).
+// The profiles with the offsets found are written to calibrationFile, unless
+// a joint of any hand failed. false if nothing was written.
+bool RunCalibration()
 {
-	int ret;
-	
-#if defined(PEAKCAN)
-	CAN_Ch = GetCANChannelIndex(_T("USBBUS1"));
-#elif defined(IXXATCAN)
-	CAN_Ch = 1;
-#elif defined(SOFTINGCAN)
-	CAN_Ch = 1;
-#elif defined(NICAN)
-	CAN_Ch = 0;
-#else
-	CAN_Ch = 1;
+	double kp[MAX_DOF], kd[MAX_DOF];
+	double start = GetHighResTime();
+	HandProfile result[MAX_HANDS];
+	bool done = false;
+	bool ok = true;
+	FILE* fp;
+	int k;
+
+	printf(">Calibration: moving all joints to their limits, keep the hand clear of obstacles\n");
+	CalibrationGains(kp, kd);
+	for (k=0; k<handOpened; k++)
+	{
+		CalibrationStart(&hand[k].calibration);
+		SetHandMotion(&hand[k], eMotionType_JOINT_PD, NULL, kp, kd);
+		hand[k].calibration.active = true;
+	}
+
+	// each phase of a finger ends by CALIB_TIMEOUT; the rest is for the first encoder set
+	while (!done && GetHighResTime() - start < 2*CALIB_TIMEOUT + 2.0)
+	{
+		Sleep(10);
+		done = true;
+		for (k=0; k<handOpened; k++)
+		{
+			if (!CalibrationDone(&hand[k].calibration))
+				done = false;
+		}
+	}
+	for (k=0; k<handOpened; k++)
+	{
+		hand[k].calibration.active = false;
+		SetHandMotion(&hand[k], eMotionType_NONE, NULL, NULL, NULL);
+	}
+	if (!done)
+	{
+		printf("ERROR calibration did not finish, are the encoder frames coming in?\n");
+		return false;
+	}
+
+	for (k=0; k<handOpened; k++)
+	{
+		printf(">CAN(%d): calibrated offsets of %s\n", hand[k].ch, hand[k].profile->name);
+		if (!CalibrationSolve(&hand[k].calibration, hand[k].profile, &result[k]))
+			ok = false;
+	}
+	if (!ok)
+	{
+		printf("ERROR calibration failed for some joints, %s not written. Is the hand free to move, "
+			"and are enc_dir and motor_dir right?\n", calibrationFile);
+		return false;
+	}
+
+	fp = fopen(calibrationFile, "w");
+	if (!fp)
+	{
+		printf("ERROR cannot write %s\n", calibrationFile);
+		return false;
+	}
+	fprintf(fp, "; Hand profiles written by myAllegroHand --calibrate. Copy them into hands.ini.\n");
+	for (k=0; k<handOpened; k++)
+	{
+		fprintf(fp, "\n; CAN(%d)\n", hand[k].ch);
+		WriteHandProfile(fp, &result[k]);
+	}
+	fclose(fp);
+	printf(">Calibration: profiles written to %s\n", calibrationFile);
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Plays the capture given with --replay to the hand until its last received frame.
+// Closing the channel then prints how the frames the host sent compare with the captured ones.
+void RunReplay()
+{
+	HandSession* h = &hand[0];
+	CanReplayStats stats;
+	double start = GetHighResTime();
+
+	printf(">Replay: %s%s\n", replayFile, (replayRealtime ? " at the original pace" : ""));
+	do
+	{
+		Sleep(10);
+		can_replay_stats(h->ch, &stats);
+	} while (!stats.done);
+	printf(">Replay: %u frames in %.2f sec\n", stats.rxFrames, GetHighResTime() - start);
+	// the control thread may still be on the last encoder set
+	Sleep(100);
+}
+
+#ifdef LOOPBACKCAN
+/////////////////////////////////////////////////////////////////////////////////////////
+// Runs HOME -> READY -> GRASP_3 on the simulated hands, on the virtual clocks of their
+// loopback buses as fast as the control pipelines allow. The clocks of all hands are
+// released together, so every hand's threads run at the same time.
+static HandSession* RunSimulatedHands(HandSession** sim, int count, const double* tStart, double t)
+{
+	int k;
+
+	for (k=0; k<count; k++)
+		can_loopback_release(sim[k]->ch, tStart[k] + t);
+	for (k=0; k<count; k++)
+	{
+		if (!can_loopback_run_until(sim[k]->ch, tStart[k] + t, 10000))
+			return sim[k];
+	}
+	return NULL;
+}
+
+void RunSequence(int runs)
+{
+	static const struct { eMotionType type; double duration; } step[] = {
+		{ eMotionType_HOME,    1.0 },
+		{ eMotionType_READY,   1.0 },
+		{ eMotionType_GRASP_3, 2.0 }
+	};
+	const int stepCount = sizeof(step)/sizeof(step[0]);
+	HandSession* sim[MAX_HANDS];
+	HandSession* stalled;
+	double tStart[MAX_HANDS];
+	double t, realStart, real;
+	unsigned int torqueFrames = 0;
+	int simCount = 0;
+	int r, i, k;
+
+	for (k=0; k<handOpened; k++)
+	{
+		if (hand[k].transport == &canTransportLoopback)
+			sim[simCount++] = &hand[k];
+	}
+	for (k=0; k<simCount; k++)
+	{
+		can_loopback_realtime(sim[k]->ch, false);
+		tStart[k] = can_loopback_time(sim[k]->ch);
+	}
+	t = 0.0;
+	realStart = GetHighResTime();
+	if (simCount == 1)
+		printf(">Sequence: %d x HOME -> READY -> GRASP_3 on the simulated hand\n", runs);
+	else
+		printf(">Sequence: %d x HOME -> READY -> GRASP_3 on %d simulated hands\n", runs, simCount);
+
+	for (r=0; r<runs; r++)
+	{
+		for (i=0; i<stepCount; i++)
+		{
+			stalled = RunSimulatedHands(sim, simCount, tStart, t);
+			if (stalled)
+			{
+				printf("ERROR: the control loop of CAN(%d) stalled at %.3f sec (run %d)\n", stalled->ch, can_loopback_time(stalled->ch), r+1);
+				return;
+			}
+			for (k=0; k<simCount; k++)
+				SetHandMotion(sim[k], step[i].type, NULL, NULL, NULL);
+			t += step[i].duration;
+		}
+	}
+	stalled = RunSimulatedHands(sim, simCount, tStart, t);
+	if (stalled)
+		printf("ERROR: the control loop of CAN(%d) stalled at %.3f sec\n", stalled->ch, can_loopback_time(stalled->ch));
+	for (k=0; k<simCount; k++)
+	{
+		SetHandMotion(sim[k], eMotionType_NONE, NULL, NULL, NULL);
+		torqueFrames += can_loopback_hand(sim[k]->ch)->torqueFrames;
+	}
+
+	real = GetHighResTime() - realStart;
+	t = can_loopback_time(sim[0]->ch) - tStart[0];
+	printf(">Sequence: %.1f sec simulated in %.3f sec (%.0fx real time), %u torque frames\n",
+		t, real, (real > 0.0 ? t/real : 0.0), torqueFrames);
+	if (simCount > 1)
+		printf(">Sequence: %d hands, %.0f hand-sec per sec of real time together\n",
+			simCount, (real > 0.0 ? simCount*t/real : 0.0));
+	for (k=0; k<simCount; k++)
+	{
+		const HandSimulator* simHand = can_loopback_hand(sim[k]->ch);
+		if (simCount == 1)
+			printf(">Sequence: final joint positions (rad):\n");
+		else
+			printf(">Sequence: final joint positions of CAN(%d) (rad):\n", sim[k]->ch);
+		for (i=0; i<MAX_DOF; i++)
+			printf("%8.4f%s", simHand->q[i], ((i%4) == 3 ? "\n" : " "));
+	}
+}
 #endif
 
-	printf(">CAN(%d): open\n", CAN_Ch);
-	ret = command_can_open(CAN_Ch);
+/////////////////////////////////////////////////////////////////////////////////////////
+// Open the CAN data channel of a hand and start its pipeline threads
+// Switches to the profile the ID reply of the hand matches, if the current one does not
+static bool SelectHandProfile(HandSession* h)
+{
+	const HandProfile* profile = h->profile;
+	CanHandId id;
+
+	if (h->handId.Read(id) == 0)
+		printf(">CAN(%d): no ID reply\n", h->ch);
+	else if (!HandProfileMatches(profile, &id))
+	{
+		for (int i=0; i<handProfileCount; i++)
+		{
+			if (HandProfileMatches(&handProfiles[i], &id))
+			{
+				profile = &handProfiles[i];
+				break;
+			}
+		}
+	}
+
+	printf(">CAN(%d): hand profile ", h->ch);
+	PrintHandProfile(profile);
+	if (profile->rightHand != h->profile->rightHand)
+	{
+		// the periodic frames have not been started, so the control thread is idle
+		DestroyBHandAlgorithm(h);
+		h->profile = profile;
+		if (!CreateBHandAlgorithm(h))
+		{
+			printf("ERROR CreateBHandAlgorithm !!! \n");
+			return false;
+		}
+	}
+	h->profile = profile;
+	return true;
+}
+
+// Stops the RX, control and TX threads of a hand; false if they were not running
+static bool StopPipeline(HandSession* h)
+{
+	if (!h->ioThreadRun)
+		return false;
+	h->ioThreadRun = false;
+	RtEventSet(&h->ctrlEvent);
+	RtEventSet(&h->txEvent);
+	RtThreadJoin(&h->rxThread);
+	RtThreadJoin(&h->ctrlThread);
+	RtThreadJoin(&h->txThread);
+	RtEventDestroy(&h->ctrlEvent);
+	RtEventDestroy(&h->txEvent);
+	return true;
+}
+
+// Undoes OpenCAN() once the threads run: they stop using the channel before it is closed
+static bool AbortOpenCAN(HandSession* h)
+{
+	StopPipeline(h);
+	TelemetryStop(&h->recorder);
+	command_can_close(h->ch);
+	return false;
+}
+
+bool OpenCAN(HandSession* h)
+{
+	int ret;
+
+	printf(">CAN(%d): open %s\n", h->ch, h->transport->name);
+	ret = command_can_open_transport(h->ch, h->transport, CAN_OPEN_DEFAULT, 0);
 	if(ret < 0)
 	{
 		printf("ERROR command_canopen !!! \n");
 		return false;
 	}
-
-	recvNum = 0;
-	sendNum = 0;
-	statTime = 0.0;
-
-	ioThreadRun = true;
-	ioThread = _beginthreadex(NULL, 0, ioThreadProc, NULL, 0, NULL);
-	printf(">CAN: starts listening CAN frames\n");
-	
-	printf(">CAN: query system id\n");
-	ret = command_can_query_id(CAN_Ch);
+	if (capturePrefix[0])
+	{
+		char path[MAX_PATH+32];
+		sprintf(path, "%s_can%d.cap", capturePrefix, h->ch);
+		if (can_capture_open(h->ch, path) != 0)
+		{
+			command_can_close(h->ch);
+			return false;
+		}
+		printf(">CAN(%d): capturing to %s\n", h->ch, path);
+	}
+	h->cycleHash = 2166136261u;
+	h->cycles = 0;
+
+	h->openTime = GetHighResTime();
+	h->recvNum = 0;
+	h->sendNum = 0;
+	h->statTime = 0.0;
+	h->rxFirstStamp = 0.0;
+	h->rxLastStamp = 0.0;
+	memset((void*)h->boardMisses, 0, sizeof(h->boardMisses));
+	ImuInit(&h->imu, ahrsMask, imuFilterTau);
+#ifdef LOOPBACKCAN
+	if (h->transport == &canTransportLoopback)
+		can_loopback_drop(h->ch, dropBoard, dropEvery);
+#endif
+	HistInit(&h->histogram[HIST_RX_PERIOD], "rx period", 1.5*delT);
+	HistInit(&h->histogram[HIST_RX_TO_TX], "rx to tx", delT);
+	HistInit(&h->histogram[HIST_COMPUTE], "compute", delT);
+	HistInit(&h->histogram[HIST_CAN_WRITE], "can write", delT);
+
+	h->ioThreadRun = true;
+	RtEventCreate(&h->ctrlEvent);
+	RtEventCreate(&h->txEvent);
+	RtThreadStart(&h->txThread, "CAN TX", txThreadProc, h, h->stage[STAGE_TX].cpu, h->stage[STAGE_TX].priority);
+	RtThreadStart(&h->ctrlThread, "control", ctrlThreadProc, h, h->stage[STAGE_CONTROL].cpu, h->stage[STAGE_CONTROL].priority);
+	RtThreadStart(&h->rxThread, "CAN RX", rxThreadProc, h, h->stage[STAGE_RX].cpu, h->stage[STAGE_RX].priority);
+	printf(">CAN(%d): starts listening CAN frames\n", h->ch);
+
+	printf(">CAN(%d): query system id\n", h->ch);
+	ret = command_can_query_id(h->ch);
 	if(ret < 0)
 	{
 		printf("ERROR command_can_query_id !!! \n");
-		command_can_close(CAN_Ch);
-		return false;
+		return AbortOpenCAN(h);
 	}
 
-	printf(">CAN: AHRS set\n");
-	ret = command_can_AHRS_set(CAN_Ch, AHRS_RATE_100Hz, AHRS_MASK_POSE | AHRS_MASK_ACC);
+	// the reply takes a few msec; the threads are running, so it is waited for here
+	double queryTime = GetHighResTime();
+	while (h->handId.Version() == 0 && GetHighResTime() - queryTime < queryIdWait)
+		Sleep(1);
+	if (!SelectHandProfile(h))
+		return AbortOpenCAN(h);
+
+	if (recordPrefix[0])
+	{
+		// one record per period, the segment length rounded to whole records
+		unsigned int capacity = (unsigned int)(recordMinutes*60000.0/controlPeriod + 0.5);
+		if (!TelemetryStart(&h->recorder, recordPrefix, h->ch, h->profile->name, controlPeriod, ahrsMask, capacity, recordKeep))
+			return AbortOpenCAN(h);
+	}
+
+	printf(">CAN(%d): AHRS set\n", h->ch);
+	ret = command_can_AHRS_set(h->ch, ahrsRate, ahrsMask);
 	if(ret < 0)
 	{
 		printf("ERROR command_can_AHRS_set !!! \n");
-		command_can_close(CAN_Ch);
-		return false;
+		return AbortOpenCAN(h);
 	}
 
-	printf(">CAN: system init\n");
-	ret = command_can_sys_init(CAN_Ch, 3/*msec*/);
+	printf(">CAN(%d): system init\n", h->ch);
+	ret = command_can_sys_init(h->ch, controlPeriod);
 	if(ret < 0)
 	{
 		printf("ERROR command_can_sys_init !!! \n");
-		command_can_close(CAN_Ch);
-		return false;
+		return AbortOpenCAN(h);
 	}
 
-	printf(">CAN: start periodic communication\n");
-	ret = command_can_start(CAN_Ch);
+	printf(">CAN(%d): start periodic communication\n", h->ch);
+	ret = command_can_start(h->ch);
 	if(ret < 0)
 	{
 		printf("ERROR command_can_start !!! \n");
-		command_can_stop(CAN_Ch);
-		command_can_close(CAN_Ch);
-		return false;
+		command_can_stop(h->ch);
+		return AbortOpenCAN(h);
 	}
 
 	return true;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
-// Close CAN data channel
-void CloseCAN()
+// Stop the pipeline threads of a hand and close its CAN data channel
+void CloseCAN(HandSession* h)
 {
 	int ret;
 
-	printf(">CAN: stop periodic communication\n");
-	ret = command_can_stop(CAN_Ch);
+	printf(">CAN(%d): stop periodic communication\n", h->ch);
+	ret = command_can_stop(h->ch);
 	if(ret < 0)
 	{
 		printf("ERROR command_can_stop !!! \n");
 	}
 
-	if (ioThreadRun)
+	if (StopPipeline(h))
 	{
-		printf(">CAN: stoped listening CAN frames\n");
-		ioThreadRun = false;
-		WaitForSingleObject((HANDLE)ioThread, INFINITE);
-		CloseHandle((HANDLE)ioThread);
-		ioThread = 0;
+		printf(">CAN(%d): stoped listening CAN frames\n", h->ch);
+		PrintPipelineStats(h);
 	}
+	TelemetryStop(&h->recorder);
+	if (hashCycles)
+		printf(">CAN(%d): %u control cycles, q/tau_des hash %08x\n", h->ch, h->cycles, h->cycleHash);
 
-	printf(">CAN(%d): close\n", CAN_Ch);
-	ret = command_can_close(CAN_Ch);
+	printf(">CAN(%d): close\n", h->ch);
+	ret = command_can_close(h->ch);
 	if(ret < 0) printf("ERROR command_can_close !!! \n");
 }
 
@@ -530,11 +1403,18 @@ void PrintInstruction()
 {
 	printf("--------------------------------------------------\n");
 	printf("myAllegroHand: ");
-	if (RIGHT_HAND) printf("Right Hand, v%i.x\n\n", HAND_VERSION); else printf("Left Hand, v%i.x\n\n", HAND_VERSION);
+	PrintHandProfile(defaultProfile);
+	printf("\n");
+	if (handCount > 1)
+	{
+		for (int i=0; i<handCount; i++)
+			printf("Hand %d: CAN(%d) %s\n", i+1, hand[i].ch, hand[i].transport->name);
+		printf("\n");
+	}
 
 	printf("Keyboard Commands:\n");
 	printf("H: Home Position (PD control)\n");
-	printf("R: Ready Position (used before grasping)\n");	
+	printf("R: Ready Position (used before grasping)\n");
 	printf("G: Three-Finger Grasp\n");
 	printf("K: Four-Finger Grasp\n");
 	printf("P: Two-finger pinch (index-thumb)\n");
@@ -543,6 +1423,10 @@ void PrintInstruction()
 	printf("A: Gravity Compensation\n\n");
 
 	printf("O: Servos OFF (any grasp cmd turns them back on)\n");
+	if (handCount > 1)
+		printf("N: Send the commands to the next hand (all hands, hand 1, hand 2, ...)\n");
+	printf("L: Print CAN pipeline latency and cycle timing\n");
+	printf("T: Write cycle timing histograms to %s\n", histogramFile);
 	printf("Q: Quit this program\n");
 
 	printf("--------------------------------------------------\n\n");
@@ -616,52 +1500,419 @@ int GetCANChannelIndex(const TCHAR* cname)
 
 /////////////////////////////////////////////////////////////////////////////////////////
 // Load and create grasping algorithm
-bool CreateBHandAlgorithm()
+bool CreateBHandAlgorithm(HandSession* h)
 {
-	if (RIGHT_HAND)
-		pBHand = bhCreateRightHand();
+	if (h->profile->rightHand)
+		h->pBHand = bhCreateRightHand();
 	else
-		pBHand = bhCreateLeftHand();
+		h->pBHand = bhCreateLeftHand();
 
-	if (!pBHand) return false;
-	pBHand->SetTimeInterval(delT);
+	if (!h->pBHand) return false;
+	h->pBHand->SetTimeInterval(delT);
+	GravityInit(&h->gravity, !h->profile->rightHand);
 	return true;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 // Destroy grasping algorithm
-void DestroyBHandAlgorithm()
+void DestroyBHandAlgorithm(HandSession* h)
 {
-	if (pBHand)
+	if (h->pBHand)
 	{
 #ifndef _DEBUG
-		delete pBHand;
+		delete h->pBHand;
 #endif
-		pBHand = NULL;
+		h->pBHand = NULL;
 	}
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////
+// Command line helpers
+
+// Copy of an argument as a char string; names and paths are plain ASCII
+static void ArgToChar(const TCHAR* arg, char* s, int size)
+{
+	int i;
+
+	for (i=0; arg[i] && i < size-1; i++)
+		s[i] = (char)arg[i];
+	s[i] = 0;
+}
+
+// Transport given by name (--can, --hand), NULL after listing the ones compiled in
+static const CanTransport* FindTransport(const TCHAR* arg)
+{
+	const CanTransport* transport;
+	char name[32];
+	int i;
+
+	ArgToChar(arg, name, sizeof(name));
+	transport = can_transport_find(name);
+	if (!transport)
+	{
+		printf("ERROR unknown CAN driver %s, compiled in:", name);
+		for (i=0; i<can_transport_count(); i++)
+			printf(" %s", can_transport_get(i)->name);
+		printf("\n");
+	}
+	return transport;
+}
+
+// Channel given by number (--channel, --hand), -1 if it is out of range
+static int ParseChannel(const CanTransport* transport, const TCHAR* arg)
+{
+	int ch;
+
+	// PCAN-Basic channels can also be given by name (USBBUS1, ...)
+#ifdef PEAKCAN
+	if (transport == &canTransportPeak)
+		ch = GetCANChannelIndex(arg);
+	else
+#endif
+		ch = _tstoi(arg);
+	if (ch < 0 || ch >= MAX_BUS)
+	{
+		printf("ERROR invalid CAN channel %d\n", ch);
+		return -1;
+	}
+	return ch;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////
 // Program main
 int _tmain(int argc, _TCHAR* argv[])
 {
-	PrintInstruction();
+	const CanTransport* canTransport = NULL; // --can, else the first backend compiled in
+	const TCHAR* channelName = NULL;         // --channel, else the default channel of the transport
+	int hands = 1;                           // --hands
+	const CanTransport* handTransport[MAX_HANDS]; // --hand, one per hand
+	int handChannel[MAX_HANDS];
+	int handArgs = 0;
+	bool bench = false;                      // --bench
+	bool calibrate = false;                  // --calibrate
+	bool profileFileGiven = false;
+	char profileName[PROFILE_NAME_LEN] = ""; // --profile
+	int i, k;
+
+	for (int a=1; a<argc; a++)
+	{
+		if (_tcsicmp(argv[a], _T("--period")) == 0 && a+1 < argc)
+			controlPeriod = _tstoi(argv[++a]);
+		else if (_tcsicmp(argv[a], _T("--can")) == 0 && a+1 < argc)
+		{
+			canTransport = FindTransport(argv[++a]);
+			if (!canTransport)
+				return 1;
+		}
+		else if (_tcsicmp(argv[a], _T("--channel")) == 0 && a+1 < argc)
+			channelName = argv[++a];
+		else if (_tcsicmp(argv[a], _T("--hands")) == 0 && a+1 < argc)
+			hands = _tstoi(argv[++a]);
+		else if (_tcsicmp(argv[a], _T("--hand")) == 0 && a+2 < argc)
+		{
+			if (handArgs >= MAX_HANDS)
+			{
+				printf("ERROR at most %d hands\n", MAX_HANDS);
+				return 1;
+			}
+			handTransport[handArgs] = FindTransport(argv[++a]);
+			if (!handTransport[handArgs])
+				return 1;
+			handChannel[handArgs] = ParseChannel(handTransport[handArgs], argv[++a]);
+			if (handChannel[handArgs] < 0)
+				return 1;
+			handArgs++;
+		}
+#ifdef LOOPBACKCAN
+		else if (_tcsicmp(argv[a], _T("--sequence")) == 0 && a+1 < argc)
+			sequenceRuns = _tstoi(argv[++a]);
+		else if (_tcsicmp(argv[a], _T("--drop")) == 0 && a+2 < argc)
+		{
+			dropBoard = _tstoi(argv[++a]);
+			dropEvery = _tstoi(argv[++a]);
+		}
+#endif
+		else if (_tcsicmp(argv[a], _T("--imu-filter")) == 0 && a+1 < argc)
+		{
+			imuFilterTau = _tstof(argv[++a]);
+			if (imuFilterTau > 0.0)
+				ahrsMask |= AHRS_MASK_ACC | AHRS_MASK_GYRO;
+		}
+		else if (_tcsicmp(argv[a], _T("--ahrs-rate")) == 0 && a+1 < argc)
+		{
+			int rate = AhrsRateFromHz(_tstof(argv[++a]));
+			if (rate < 0)
+			{
+				printf("ERROR --ahrs-rate takes 1, 10, 20, 50 or 100 (Hz)\n");
+				return 1;
+			}
+			ahrsRate = (unsigned char)rate;
+		}
+		else if (_tcsicmp(argv[a], _T("--ahrs-mag")) == 0)
+			ahrsMask |= AHRS_MASK_MAG;
+		else if (_tcsicmp(argv[a], _T("--bus-ceiling")) == 0 && a+1 < argc)
+			busCeiling = _tstof(argv[++a]) / 100.0;
+		else if (_tcsicmp(argv[a], _T("--bus-overload")) == 0)
+			busOverload = true;
+		else if (_tcsicmp(argv[a], _T("--max-misses")) == 0 && a+1 < argc)
+			maxMisses = _tstoi(argv[++a]);
+		else if (_tcsicmp(argv[a], _T("--tx-gap")) == 0 && a+1 < argc)
+			txGapUsec = _tstof(argv[++a]);
+		else if (_tcsicmp(argv[a], _T("--rx-cpu")) == 0 && a+1 < argc)
+			stageConfig[STAGE_RX].cpu = _tstoi(argv[++a]);
+		else if (_tcsicmp(argv[a], _T("--rx-prio")) == 0 && a+1 < argc)
+			stageConfig[STAGE_RX].priority = _tstoi(argv[++a]);
+		else if (_tcsicmp(argv[a], _T("--control-cpu")) == 0 && a+1 < argc)
+			stageConfig[STAGE_CONTROL].cpu = _tstoi(argv[++a]);
+		else if (_tcsicmp(argv[a], _T("--control-prio")) == 0 && a+1 < argc)
+			stageConfig[STAGE_CONTROL].priority = _tstoi(argv[++a]);
+		else if (_tcsicmp(argv[a], _T("--tx-cpu")) == 0 && a+1 < argc)
+			stageConfig[STAGE_TX].cpu = _tstoi(argv[++a]);
+		else if (_tcsicmp(argv[a], _T("--tx-prio")) == 0 && a+1 < argc)
+			stageConfig[STAGE_TX].priority = _tstoi(argv[++a]);
+		else if (_tcsicmp(argv[a], _T("--cpu-stride")) == 0 && a+1 < argc)
+			cpuStride = _tstoi(argv[++a]);
+		else if (_tcsicmp(argv[a], _T("--bench")) == 0)
+			bench = true;
+		else if (_tcsicmp(argv[a], _T("--calibrate")) == 0)
+			calibrate = true;
+		else if (_tcsicmp(argv[a], _T("--profiles")) == 0 && a+1 < argc)
+		{
+			ArgToChar(argv[++a], profileFile, sizeof(profileFile));
+			profileFileGiven = true;
+		}
+		else if (_tcsicmp(argv[a], _T("--profile")) == 0 && a+1 < argc)
+			ArgToChar(argv[++a], profileName, sizeof(profileName));
+		else if (_tcsicmp(argv[a], _T("--record")) == 0 && a+1 < argc)
+			ArgToChar(argv[++a], recordPrefix, sizeof(recordPrefix));
+		else if (_tcsicmp(argv[a], _T("--record-minutes")) == 0 && a+1 < argc)
+			recordMinutes = _tstof(argv[++a]);
+		else if (_tcsicmp(argv[a], _T("--record-keep")) == 0 && a+1 < argc)
+			recordKeep = _tstoi(argv[++a]);
+		else if (_tcsicmp(argv[a], _T("--export")) == 0 && a+1 < argc)
+		{
+			// convert a telemetry segment to CSV on stdout and exit
+			char path[MAX_PATH];
+			ArgToChar(argv[++a], path, sizeof(path));
+			return (TelemetryExport(path, stdout) < 0 ? 1 : 0);
+		}
+		else if (_tcsicmp(argv[a], _T("--capture")) == 0 && a+1 < argc)
+			ArgToChar(argv[++a], capturePrefix, sizeof(capturePrefix));
+		else if (_tcsicmp(argv[a], _T("--replay")) == 0 && a+1 < argc)
+			ArgToChar(argv[++a], replayFile, sizeof(replayFile));
+		else if (_tcsicmp(argv[a], _T("--replay-realtime")) == 0)
+			replayRealtime = true;
+	}
+
+	if (bench)
+	{
+		RunBenchmarks();
+		return 0;
+	}
+	if (recordMinutes <= 0.0 || recordKeep < 0)
+	{
+		printf("ERROR --record-minutes must be positive and --record-keep at least 0\n");
+		return 1;
+	}
+	if (busCeiling <= 0.0 || busCeiling > 1.0)
+	{
+		printf("ERROR --bus-ceiling takes a load above 0 and up to 100 (%%)\n");
+		return 1;
+	}
+	if (replayFile[0] && capturePrefix[0])
+	{
+		printf("ERROR --replay and --capture cannot be combined\n");
+		return 1;
+	}
+	hashCycles = (replayFile[0] || capturePrefix[0]);
+
+	delT = controlPeriod / 1000.0;
+	if (maxMisses < 1) maxMisses = 1;
+	if (cpuStride <= 0)
+	{
+		// the next hand starts on the CPU after the highest one the first hand uses
+		int cpuMin = -1, cpuMax = -1;
+		for (int s=0; s<STAGE_COUNT; s++)
+		{
+			if (stageConfig[s].cpu < 0) continue;
+			if (cpuMin < 0 || stageConfig[s].cpu < cpuMin) cpuMin = stageConfig[s].cpu;
+			if (stageConfig[s].cpu > cpuMax) cpuMax = stageConfig[s].cpu;
+		}
+		cpuStride = (cpuMin < 0 ? 0 : cpuMax - cpuMin + 1);
+	}
+
+	// hand profiles, the built-in one if there is no profile file
+	handProfileCount = LoadHandProfiles(profileFile, handProfiles, MAX_PROFILES);
+	if (handProfileCount == -2 || (handProfileCount == -1 && profileFileGiven))
+	{
+		if (handProfileCount == -1)
+			printf("ERROR cannot open %s\n", profileFile);
+		return 1;
+	}
+	if (handProfileCount <= 0)
+	{
+		HandProfileDefault(&handProfiles[0]);
+		handProfileCount = 1;
+	}
+	defaultProfile = &handProfiles[0];
+	if (profileName[0])
+	{
+		defaultProfile = FindHandProfile(handProfiles, handProfileCount, profileName);
+		if (!defaultProfile)
+		{
+			printf("ERROR unknown hand profile %s, known:", profileName);
+			for (i=0; i<handProfileCount; i++)
+				printf(" %s", handProfiles[i].name);
+			printf("\n");
+			return 1;
+		}
+	}
+
+	// a replay drives one hand on the channel of the capture; hands given one by one with --hand,
+	// else --hands on consecutive channels of --can
+	if (replayFile[0])
+	{
+		int ch = can_replay_channel(replayFile);
+		if (ch < 0 || ch >= MAX_BUS || can_replay_load(ch, replayFile, replayRealtime) != 0)
+		{
+			printf("ERROR cannot replay %s\n", replayFile);
+			return 1;
+		}
+		handTransport[0] = &canTransportReplay;
+		handChannel[0] = ch;
+		handArgs = 1;
+	}
+	else if (handArgs == 0)
+	{
+		if (!canTransport)
+			canTransport = can_transport_get(0);
+		if (!canTransport)
+		{
+			printf("ERROR no CAN driver is compiled in !!! \n");
+			return 1;
+		}
+		if (hands < 1 || hands > MAX_HANDS)
+		{
+			printf("ERROR --hands takes 1 to %d\n", MAX_HANDS);
+			return 1;
+		}
+		int ch = canTransport->channel;
+		if (channelName)
+		{
+			ch = ParseChannel(canTransport, channelName);
+			if (ch < 0)
+				return 1;
+		}
+		for (handArgs=0; handArgs<hands; handArgs++)
+		{
+			handTransport[handArgs] = canTransport;
+			handChannel[handArgs] = ch + handArgs;
+		}
+	}
+	for (i=0; i<handArgs; i++)
+	{
+		if (handChannel[i] >= MAX_BUS)
+		{
+			printf("ERROR invalid CAN channel %d\n", handChannel[i]);
+			return 1;
+		}
+		for (k=0; k<i; k++)
+		{
+			// channel numbers are shared by all adapters (canTransport.h)
+			if (handChannel[k] == handChannel[i])
+			{
+				printf("ERROR CAN channel %d is given to two hands\n", handChannel[i]);
+				return 1;
+			}
+		}
+		InitHandSession(&hand[i], i, handTransport[i], handChannel[i]);
+	}
+	handCount = handArgs;
 
-	memset(&vars, 0, sizeof(vars));
-	memset(q, 0, sizeof(q));
-	memset(q_des, 0, sizeof(q_des));
-	memset(tau_des, 0, sizeof(tau_des));
-	memset(cur_des, 0, sizeof(cur_des));
-	curTime = 0.0;
+	PrintInstruction();
 
 	pSHM = getrPanelManipulatorCmdMemory();
-	
-	if (CreateBHandAlgorithm() && OpenCAN())
-		MainLoop();
+	int exitCode = 0;
+
+	// the fastest AHRS rate the bus has room for
+	unsigned char plannedRate;
+	bool fits = PlanAhrsRate(controlPeriod, ahrsRate, ahrsMask, txGapUsec, busCeiling, &plannedRate);
+	if (!fits)
+	{
+		// no AHRS rate fits: run without the AHRS if the control frames alone do
+		unsigned char controlRate;
+		if (PlanAhrsRate(controlPeriod, plannedRate, 0, txGapUsec, busCeiling, &controlRate))
+		{
+			printf(">CAN: AHRS turned off, even %.0f Hz would take the worst-case bus load over %.0f%%\n", AhrsRateHz(plannedRate), busCeiling*100.0);
+			ahrsMask = 0;
+			fits = true;
+		}
+		else if (busOverload)
+		{
+			printf(">CAN: warning: the control frames alone exceed the %.0f%% ceiling, running at %.0f Hz AHRS anyway\n", busCeiling*100.0, AhrsRateHz(plannedRate));
+			fits = true;
+		}
+		else
+			printf("ERROR the control frames alone exceed the %.0f%% bus load ceiling !!! \n", busCeiling*100.0);
+	}
+	else if (plannedRate != ahrsRate)
+		printf(">CAN: AHRS rate lowered from %.0f to %.0f Hz to keep the worst-case bus load under %.0f%%\n",
+			AhrsRateHz(ahrsRate), AhrsRateHz(plannedRate), busCeiling*100.0);
+	ahrsRate = plannedRate;
+
+	if (!fits || !CheckBusLoad(controlPeriod, ahrsRate, ahrsMask, txGapUsec, busOverload))
+		exitCode = 1;
+	else
+	{
+		bool opened = true;
+		for (i=0; i<handCount && opened; i++)
+		{
+			opened = CreateBHandAlgorithm(&hand[i]);
+			if (opened)
+			{
+				opened = OpenCAN(&hand[i]);
+				if (opened)
+					handOpened++;
+			}
+		}
+		if (!opened)
+			exitCode = 1;
+
+		if (opened)
+		{
+#ifdef LOOPBACKCAN
+			bool simulated = false;
+			for (i=0; i<handCount; i++)
+			{
+				if (hand[i].transport == &canTransportLoopback)
+					simulated = true;
+			}
+			if (replayFile[0])
+				RunReplay();
+			else if (calibrate)
+				exitCode = (RunCalibration() ? 0 : 1);
+			else if (sequenceRuns > 0 && simulated)
+				RunSequence(sequenceRuns);
+			else
+				MainLoop();
+#else
+			if (replayFile[0])
+				RunReplay();
+			else if (calibrate)
+				exitCode = (RunCalibration() ? 0 : 1);
+			else
+				MainLoop();
+#endif
+		}
+	}
 
-	CloseCAN();
-	DestroyBHandAlgorithm();
+	for (i=0; i<handOpened; i++)
+		CloseCAN(&hand[i]);
+	if (handOpened > 1)
+		PrintThroughput();
+	for (i=0; i<handCount; i++)
+		DestroyBHandAlgorithm(&hand[i]);
 	closerPanelManipulatorCmdMemory();
 
-	return 0;
+	return exitCode;
 }
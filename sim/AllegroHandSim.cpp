@@ -0,0 +1,179 @@
+// AllegroHandSim.cpp : Allegro Hand firmware simulator on a SocketCAN bus.
+//
+// Runs the HandSimulator model against a (virtual) CAN interface, so that
+// myAllegroHand can be started unchanged on the same bus:
+//
+//     sudo ip link add dev vcan0 type vcan && sudo ip link set up vcan0
+//     ./AllegroHandSim vcan0 &
+//     ./myAllegroHand
+//
+
+#ifdef _WIN32
+
+#include <stdio.h>
+
+int main(int argc, char* argv[])
+{
+	printf("AllegroHandSim needs SocketCAN (Linux). On Windows use the in-process simulator.\n");
+	return 1;
+}
+
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include "HandSimulator.h"
+#include "HighResTimer.h"
+
+static volatile bool simRun = true;
+
+static void OnSignal(int)
+{
+	simRun = false;
+}
+
+static int OpenBus(const char* ifname)
+{
+	struct sockaddr_can addr;
+	struct ifreq ifr;
+	int fd;
+
+	fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (fd < 0)
+	{
+		printf("OpenBus(): socket() failed with error %d\n", errno);
+		return -1;
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, IFNAMSIZ, "%s", ifname);
+	if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0)
+	{
+		printf("OpenBus(): %s not found (error %d)\n", ifname, errno);
+		close(fd);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		printf("OpenBus(): bind() failed with error %d\n", errno);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool SendFrame(int fd, const can_msg* msg)
+{
+	struct can_frame frame;
+	memset(&frame, 0, sizeof(frame));
+	frame.can_id = (canid_t)(msg->msg_id & CAN_SFF_MASK);
+	frame.can_dlc = msg->data_length;
+	memcpy(frame.data, msg->data, msg->data_length);
+	return (write(fd, &frame, sizeof(frame)) == (ssize_t)sizeof(frame));
+}
+
+int main(int argc, char* argv[])
+{
+	const char* ifname = "vcan0";
+	int handVersion = 3;
+	HandSimulator sim;
+	can_msg out[32];
+	struct can_frame frame;
+	struct pollfd pfd;
+	double now, next, statTime;
+	int fd, n, i, waitTime;
+	unsigned int lastIn = 0, lastOut = 0;
+
+	for (int a=1; a<argc; a++)
+	{
+		if (strcmp(argv[a], "--version") == 0 && a+1 < argc)
+			handVersion = atoi(argv[++a]);
+		else if (argv[a][0] != '-')
+			ifname = argv[a];
+		else
+		{
+			printf("usage: %s [--version 2|3] [interface]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	fd = OpenBus(ifname);
+	if (fd < 0)
+		return 1;
+	signal(SIGINT, OnSignal);
+	signal(SIGTERM, OnSignal);
+
+	HandSimInit(&sim, handVersion);
+	printf(">AllegroHandSim: v%d hand on %s\n", handVersion, ifname);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	statTime = GetHighResTime();
+	while (simRun)
+	{
+		// sleep until a host frame arrives or the next hand frame is due
+		now = GetHighResTime();
+		next = HandSimNextEvent(&sim);
+		waitTime = 100;
+		if (next >= 0.0)
+			waitTime = (next <= now ? 0 : (int)((next - now)*1e3));
+		pfd.revents = 0;
+		if (poll(&pfd, 1, waitTime) > 0)
+		{
+			while (read(fd, &frame, sizeof(frame)) == (ssize_t)sizeof(frame))
+			{
+				can_msg msg;
+				msg.STD_EXT = ((frame.can_id & CAN_EFF_FLAG) ? EXT : STD);
+				msg.msg_id = frame.can_id & CAN_EFF_MASK;
+				msg.data_length = frame.can_dlc;
+				memcpy(msg.data, frame.data, sizeof(msg.data));
+				HandSimReceive(&sim, &msg, GetHighResTime());
+
+				pfd.revents = 0;
+				if (poll(&pfd, 1, 0) <= 0)
+					break;
+			}
+		}
+
+		// poll() has millisecond resolution, the rest is spun on the clock
+		next = HandSimNextEvent(&sim);
+		if (next >= 0.0 && next - GetHighResTime() < 1e-3)
+			DelayMicroseconds((next - GetHighResTime())*1e6);
+
+		n = HandSimStep(&sim, GetHighResTime(), out, sizeof(out)/sizeof(out[0]));
+		for (i=0; i<n; i++)
+		{
+			if (!SendFrame(fd, &out[i]))
+				printf(">AllegroHandSim: write() failed with error %d\n", errno);
+		}
+
+		now = GetHighResTime();
+		if (now - statTime >= 5.0)
+		{
+			printf(">AllegroHandSim: %s, %.0f frames/s in, %.0f frames/s out\n",
+				(sim.systemOn ? "on" : "off"),
+				(sim.framesIn - lastIn)/(now - statTime), (sim.framesOut - lastOut)/(now - statTime));
+			lastIn = sim.framesIn;
+			lastOut = sim.framesOut;
+			statTime = now;
+		}
+	}
+
+	close(fd);
+	printf(">AllegroHandSim: %u frames in (%u torque), %u frames out\n", sim.framesIn, sim.torqueFrames, sim.framesOut);
+	return 0;
+}
+
+#endif // _WIN32
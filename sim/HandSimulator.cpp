@@ -0,0 +1,256 @@
+#include <string.h>
+#include "HandSimulator.h"
+#include "canCodec.h"
+
+// Encoder scale of the application: 333.3 degrees over 65536 counts.
+static const double ENC_RAD_PER_COUNT = (333.3/65536.0)*(3.141592/180.0);
+
+// AHRS frames carry three big-endian 16-bit values. The simulated palm is at
+// rest and level: pose 0.01 deg/LSB, acceleration 1 mg/LSB, angular rate
+// 0.01 deg/s/LSB, magnetic field 1 mGauss/LSB.
+static const short AHRS_ACC_Z = 1000;
+static const short AHRS_MAG_X = 250;
+
+static void SetFrame(can_msg* msg, int cmd, int src, int len)
+{
+	can_frame_init(msg, CAN_HAND_ID(cmd, src), len);
+	memset(msg->data, 0, sizeof(msg->data));
+}
+
+static double AhrsPeriod(unsigned char rate)
+{
+	switch (rate)
+	{
+	case AHRS_RATE_1Hz: return 1.0;
+	case AHRS_RATE_10Hz: return 0.1;
+	case AHRS_RATE_20Hz: return 0.05;
+	case AHRS_RATE_50Hz: return 0.02;
+	case AHRS_RATE_100Hz: return 0.01;
+	}
+	return 0.0;
+}
+
+// Nominal joint limits of the hand (rad), the ones the application calibrates against
+static const double jointMin[HANDSIM_DOF] = {
+	-0.47, -0.196, -0.174, -0.227,
+	-0.47, -0.196, -0.174, -0.227,
+	-0.47, -0.196, -0.174, -0.227,
+	 0.263, -0.105, -0.189, -0.162
+};
+static const double jointMax[HANDSIM_DOF] = {
+	 0.47, 1.61, 1.709, 1.618,
+	 0.47, 1.61, 1.709, 1.618,
+	 0.47, 1.61, 1.709, 1.618,
+	 1.396, 1.163, 1.644, 1.719
+};
+
+void HandSimInit(HandSimulator* sim, int handVersion)
+{
+	memset(sim, 0, sizeof(HandSimulator));
+	sim->revision = 0x0300;
+	sim->firmware = 0x0100;
+	sim->hardwareType = (unsigned char)handVersion;
+	sim->period_msec = 3;
+	sim->ahrsRate = AHRS_RATE_100Hz;
+	sim->pwmToTorque = 1.0 / (handVersion <= 2 ? 800.0 : 1200.0);
+	sim->maxStep = 0.0002;
+	sim->modelTime = -1.0;
+
+	for (int i=0; i<HANDSIM_DOF; i++)
+	{
+		HandSimJoint* j = &sim->joint[i];
+		j->inertia = 0.0002;
+		j->damping = 0.02;
+		j->qMin = jointMin[i];
+		j->qMax = jointMax[i];
+		j->encDir = 1.0;
+		j->encOffset = 0;
+		j->motorDir = 1.0;
+	}
+	for (int i=0; i<HANDSIM_DOF; i++)
+		if (sim->q[i] < sim->joint[i].qMin) sim->q[i] = sim->joint[i].qMin;
+}
+
+static void Integrate(HandSimulator* sim, double until)
+{
+	if (sim->modelTime < 0.0)
+	{
+		sim->modelTime = until; // the model starts with the first call
+		return;
+	}
+
+	while (sim->modelTime < until)
+	{
+		double h = until - sim->modelTime;
+		if (h > sim->maxStep) h = sim->maxStep;
+		for (int i=0; i<HANDSIM_DOF; i++)
+		{
+			const HandSimJoint* j = &sim->joint[i];
+			double tau = (sim->systemOn ? sim->pwm[i] * sim->pwmToTorque * j->motorDir : 0.0);
+			// semi-implicit Euler, the friction term implicitly for stability at any step
+			sim->qd[i] = (sim->qd[i] + h*tau/j->inertia) / (1.0 + h*j->damping/j->inertia);
+			sim->q[i] += h*sim->qd[i];
+			if (sim->q[i] < j->qMin) { sim->q[i] = j->qMin; if (sim->qd[i] < 0.0) sim->qd[i] = 0.0; }
+			else if (sim->q[i] > j->qMax) { sim->q[i] = j->qMax; if (sim->qd[i] > 0.0) sim->qd[i] = 0.0; }
+		}
+		sim->modelTime += h;
+	}
+}
+
+static void Queue(HandSimulator* sim, const can_msg* msg)
+{
+	if (sim->queueCount < HANDSIM_QUEUE_SIZE)
+		sim->queue[sim->queueCount++] = *msg;
+}
+
+void HandSimReceive(HandSimulator* sim, const can_msg* msg, double now)
+{
+	int cmd = can_id_cmd(msg->msg_id);
+	const unsigned char* data = (const unsigned char*)msg->data;
+	can_msg reply;
+	CanHandId id;
+	short pwm[4];
+
+	sim->framesIn++;
+	Integrate(sim, now);
+
+	switch (cmd)
+	{
+	case ID_CMD_QUERY_ID:
+		SetFrame(&reply, ID_CMD_QUERY_ID, ID_COMMON, 8);
+		id.revision = sim->revision;
+		id.firmware = sim->firmware;
+		id.hardwareType = sim->hardwareType;
+		can_pack_query_id(reply.data, &id);
+		Queue(sim, &reply);
+		break;
+
+	case ID_CMD_SET_PERIOD:
+		if (msg->data_length >= 1 && data[0] > 0)
+			sim->period_msec = data[0];
+		break;
+
+	case ID_CMD_SET_SYSTEM_ON:
+		if (!sim->systemOn)
+		{
+			sim->systemOn = true;
+			sim->nextControl = now + sim->period_msec*1e-3;
+			sim->nextAhrs = now + AhrsPeriod(sim->ahrsRate);
+		}
+		break;
+
+	case ID_CMD_SET_SYSTEM_OFF:
+		sim->systemOn = false;
+		memset(sim->pwm, 0, sizeof(sim->pwm));
+		break;
+
+	case ID_CMD_AHRS_SET:
+		if (msg->data_length >= 2)
+		{
+			sim->ahrsRate = data[0];
+			sim->ahrsMask = data[1];
+			sim->nextAhrs = now + AhrsPeriod(sim->ahrsRate);
+		}
+		break;
+
+	case ID_CMD_SET_TORQUE_1:
+	case ID_CMD_SET_TORQUE_2:
+	case ID_CMD_SET_TORQUE_3:
+	case ID_CMD_SET_TORQUE_4:
+		if (msg->data_length >= 8)
+		{
+			// big-endian PWM, the motor order is reversed against the joint order
+			int f = cmd - ID_CMD_SET_TORQUE_1;
+			can_unpack_pwm(msg->data, pwm);
+			for (int m=0; m<4; m++)
+				sim->pwm[f*4 + 3-m] = pwm[m];
+			sim->torqueFrames++;
+		}
+		break;
+	}
+}
+
+static void EncoderFrame(const HandSimulator* sim, int finger, can_msg* msg)
+{
+	int enc[4];
+
+	SetFrame(msg, ID_CMD_QUERY_CONTROL_DATA, ID_DEVICE_SUB_01 + finger, 8);
+	for (int k=0; k<4; k++)
+	{
+		int i = finger*4 + k;
+		const HandSimJoint* j = &sim->joint[i];
+		// inverse of q = (enc*enc_dir - 32768 - enc_offset) * ENC_RAD_PER_COUNT
+		double counts = (sim->q[i]/ENC_RAD_PER_COUNT + 32768.0 + j->encOffset) * j->encDir;
+		enc[k] = (int)(counts + (counts >= 0.0 ? 0.5 : -0.5));
+		if (enc[k] < 0) enc[k] = 0;
+		else if (enc[k] > 0xffff) enc[k] = 0xffff;
+	}
+	can_pack_encoders(msg->data, enc);
+}
+
+static void AhrsFrame(int cmd, short x, short y, short z, can_msg* msg)
+{
+	short xyz[3] = { x, y, z };
+
+	SetFrame(msg, cmd, ID_COMMON, 6);
+	can_pack_ahrs(msg->data, xyz);
+}
+
+int HandSimStep(HandSimulator* sim, double now, can_msg* out, int maxCount)
+{
+	int n = 0;
+	double period = sim->period_msec*1e-3;
+
+	while (n < maxCount && sim->queueCount > 0)
+	{
+		out[n++] = sim->queue[0];
+		sim->queueCount--;
+		memmove(&sim->queue[0], &sim->queue[1], sim->queueCount*sizeof(can_msg));
+	}
+
+	if (sim->systemOn)
+	{
+		// a caller that fell far behind resumes on the current period
+		if (now - sim->nextControl > 10.0*period)
+			sim->nextControl = now;
+
+		while (now >= sim->nextControl && n + 4 <= maxCount)
+		{
+			Integrate(sim, sim->nextControl);
+			for (int f=0; f<4; f++)
+				EncoderFrame(sim, f, &out[n++]);
+			sim->nextControl += period;
+		}
+
+		double ahrsPeriod = AhrsPeriod(sim->ahrsRate);
+		if (sim->ahrsMask && ahrsPeriod > 0.0)
+		{
+			if (now - sim->nextAhrs > 10.0*ahrsPeriod)
+				sim->nextAhrs = now;
+			while (now >= sim->nextAhrs && n + 4 <= maxCount)
+			{
+				if (sim->ahrsMask & AHRS_MASK_POSE) AhrsFrame(ID_CMD_AHRS_POSE, 0, 0, 0, &out[n++]);
+				if (sim->ahrsMask & AHRS_MASK_ACC)  AhrsFrame(ID_CMD_AHRS_ACC, 0, 0, AHRS_ACC_Z, &out[n++]);
+				if (sim->ahrsMask & AHRS_MASK_GYRO) AhrsFrame(ID_CMD_AHRS_GYRO, 0, 0, 0, &out[n++]);
+				if (sim->ahrsMask & AHRS_MASK_MAG)  AhrsFrame(ID_CMD_AHRS_MAG, AHRS_MAG_X, 0, 0, &out[n++]);
+				sim->nextAhrs += ahrsPeriod;
+			}
+		}
+	}
+
+	Integrate(sim, now);
+	sim->framesOut += n;
+	return n;
+}
+
+double HandSimNextEvent(const HandSimulator* sim)
+{
+	if (sim->queueCount > 0)
+		return sim->modelTime;
+	if (!sim->systemOn)
+		return -1.0;
+	double next = sim->nextControl;
+	if (sim->ahrsMask && AhrsPeriod(sim->ahrsRate) > 0.0 && sim->nextAhrs < next)
+		next = sim->nextAhrs;
+	return next;
+}
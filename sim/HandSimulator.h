@@ -0,0 +1,69 @@
+#pragma once
+
+#include "canDef.h"
+
+// Allegro Hand firmware simulator.
+//
+// Speaks the protocol of canDef.h from the hand's side of the bus: it answers
+// ID_CMD_QUERY_ID, takes ID_CMD_SET_PERIOD, ID_CMD_SET_SYSTEM_ON/OFF and
+// ID_CMD_AHRS_SET, and while the system is on emits one
+// ID_CMD_QUERY_CONTROL_DATA frame per finger board (ID_DEVICE_SUB_01..04) every
+// period plus the enabled AHRS streams. The ID_CMD_SET_TORQUE_1..4 PWM frames
+// drive 16 independent joints (inertia, viscous friction, joint limits).
+//
+// The simulator has no clock and no transport of its own: the caller feeds it
+// frames and the current time, and sends whatever HandSimStep() returns. This
+// lets the same model run on a vcan bus (AllegroHandSim) or in-process.
+
+#define HANDSIM_DOF			16
+#define HANDSIM_QUEUE_SIZE	16 // replies waiting for the next HandSimStep()
+
+typedef struct tagHandSimJoint
+{
+	double inertia;  // kg m^2
+	double damping;  // Nm s/rad
+	double qMin;     // rad
+	double qMax;     // rad
+	double encDir;   // +1 or -1, as enc_dir[] of the application
+	int encOffset;   // counts, as enc_offset[] of the application
+	double motorDir; // +1 or -1, as motor_dir[] of the application
+} HandSimJoint;
+
+typedef struct tagHandSimulator
+{
+	// identification returned for ID_CMD_QUERY_ID
+	unsigned short revision;
+	unsigned short firmware;
+	unsigned char hardwareType;
+
+	// firmware state
+	bool systemOn;
+	int period_msec;
+	unsigned char ahrsRate;
+	unsigned char ahrsMask;
+	double nextControl; // time the next encoder frames are due
+	double nextAhrs;
+	short pwm[HANDSIM_DOF]; // per joint, as decoded from the torque frames
+	double pwmToTorque;     // Nm per PWM count (tau_cov_const of the application, inverted)
+
+	// joint model
+	HandSimJoint joint[HANDSIM_DOF];
+	double q[HANDSIM_DOF];  // rad
+	double qd[HANDSIM_DOF]; // rad/s
+	double modelTime;       // the model has been integrated up to here, -1 before the first frame
+	double maxStep;         // integration step (sec)
+
+	// frames to send on the next HandSimStep() besides the periodic ones
+	can_msg queue[HANDSIM_QUEUE_SIZE];
+	int queueCount;
+
+	// statistics
+	unsigned int framesIn;
+	unsigned int framesOut;
+	unsigned int torqueFrames;
+} HandSimulator;
+
+void HandSimInit(HandSimulator* sim, int handVersion);
+void HandSimReceive(HandSimulator* sim, const can_msg* msg, double now); // one frame from the host
+int HandSimStep(HandSimulator* sim, double now, can_msg* out, int maxCount); // frames due by now
+double HandSimNextEvent(const HandSimulator* sim); // time the next frame is due, negative if none is scheduled
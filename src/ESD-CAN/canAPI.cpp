@@ -16,24 +16,27 @@
 
 #include "canDef.h"
 #include "canAPI.h"
+#include "canTransport.h"
+#include "canCodec.h"
 #include "ESD-CAN/ntcan.h"
 
 CANAPI_BEGIN
 
 
-#define CH_COUNT			(int)4 // number of CAN channels
+#define CH_COUNT			MAX_BUS // number of CAN channels
 
-static NTCAN_HANDLE canDev[CH_COUNT] = { // CAN channel handles
-	(NTCAN_HANDLE)-1,
-	(NTCAN_HANDLE)-1,
-	(NTCAN_HANDLE)-1,
-	(NTCAN_HANDLE)-1
-}; 
+static NTCAN_HANDLE canDev[CH_COUNT]; // CAN channel handles, valid while the channel is open
+static int rxTimeout[CH_COUNT];       // receive timeout currently set on each handle
+static double tsPeriod[CH_COUNT];     // seconds per CMSG_T timestamp tick, 0 if not supported
+
+// frames taken by a blocking canReadT() in esdWait(), handed out by the next esdRecvBatch()
+static CMSG_T rxStash[CH_COUNT][RX_QUEUE_SIZE];
+static long rxStashCount[CH_COUNT];
 
 /*========================================*/
-/*       Public functions (CAN API)       */
+/*       Private functions                */
 /*========================================*/
-void allowMessage(int bus, int id, int mask){
+static void allowMessage(int bus, int id, int mask){
     int i;
     DWORD retvalue;
 	for(i=0;i<2048;i++){
@@ -49,7 +52,7 @@ void allowMessage(int bus, int id, int mask){
 	}
 }
 
-int initCAN(int bus){
+static int initCAN(int bus){
     DWORD retvalue;
 #ifndef _WIN32
     pthread_mutex_init(&commMutex, NULL);
@@ -63,6 +66,7 @@ int initCAN(int bus){
 		printf("initCAN(): canOpen() failed with error %ld", retvalue);
         return(1);
     }
+    rxTimeout[bus] = RX_TIMEOUT; // set by canOpen()
     
     retvalue = canSetBaudrate(canDev[bus], 0); // 1 = 1Mbps, 2 = 500kbps, 3 = 250kbps
     if(retvalue != 0)
@@ -79,269 +83,201 @@ int initCAN(int bus){
     //allowMessage(bus, 0x0403, 0x03E0); // Group 3 messages
     //allowMessage(bus, 0x0406, 0x03E0); // Group 6 messages
 
-	unsigned long Txid;
-	Txid = ((unsigned long)(ID_CMD_QUERY_CONTROL_DATA) <<6) | ((unsigned long)ID_DEVICE_MAIN <<3) | ((unsigned long)ID_DEVICE_SUB_01);
-	allowMessage(bus, Txid, 0);
-	Txid = ((unsigned long)(ID_CMD_QUERY_CONTROL_DATA) <<6) | ((unsigned long)ID_DEVICE_MAIN <<3) | ((unsigned long)ID_DEVICE_SUB_02);
-	allowMessage(bus, Txid, 0);
-	Txid = ((unsigned long)(ID_CMD_QUERY_CONTROL_DATA) <<6) | ((unsigned long)ID_DEVICE_MAIN <<3) | ((unsigned long)ID_DEVICE_SUB_03);
-	allowMessage(bus, Txid, 0);
-	Txid = ((unsigned long)(ID_CMD_QUERY_CONTROL_DATA) <<6) | ((unsigned long)ID_DEVICE_MAIN <<3) | ((unsigned long)ID_DEVICE_SUB_04);
-	allowMessage(bus, Txid, 0);
-	Txid = ((unsigned long)(ID_DEVICE_MAIN)<<3) | ((unsigned long)ID_COMMON);
-	allowMessage(bus, Txid, 0x38);
+	allowMessage(bus, CAN_HAND_ID(ID_CMD_QUERY_CONTROL_DATA, ID_DEVICE_SUB_01), 0);
+	allowMessage(bus, CAN_HAND_ID(ID_CMD_QUERY_CONTROL_DATA, ID_DEVICE_SUB_02), 0);
+	allowMessage(bus, CAN_HAND_ID(ID_CMD_QUERY_CONTROL_DATA, ID_DEVICE_SUB_03), 0);
+	allowMessage(bus, CAN_HAND_ID(ID_CMD_QUERY_CONTROL_DATA, ID_DEVICE_SUB_04), 0);
+	allowMessage(bus, CAN_ID(0, ID_DEVICE_MAIN, ID_COMMON), 0x38);
+
+    uint64_t tsFreq = 0;
+    retvalue = canIoctl(canDev[bus], NTCAN_IOCTL_GET_TIMESTAMP_FREQ, &tsFreq);
+    tsPeriod[bus] = (retvalue == NTCAN_SUCCESS && tsFreq != 0 ? 1.0 / (double)tsFreq : 0.0);
 	
     return(0);
 }
 
-void freeCAN(int bus){
+static void freeCAN(int bus){
     canClose(canDev[bus]);
 }
 
-int canReadMsg(int bus, int *id, int *len, unsigned char *data, int blocking){
-    CMSG    msg;
+static int setRxTimeout(int bus, int timeout_msec){
     DWORD   retvalue;
-    long    msgCt = 1;
-    int     i;
-    
-    if(blocking){
-        retvalue = canRead(canDev[bus], &msg, &msgCt, NULL);
-    }else{
-        retvalue = canTake(canDev[bus], &msg, &msgCt);
-    }
-    if(retvalue != NTCAN_SUCCESS){
-#ifndef _WIN32
-        syslog(LOG_ERR, "canReadMsg(): canRead/canTake error: %ld", retvalue);
-#endif
-		//printf("canReadMsg(): canRead/canTake error: %ld", retvalue);
-        if(retvalue == NTCAN_RX_TIMEOUT)
-            return(1);
-        else
-            return(2);
-    }
-    if(msgCt == 1){
-        *id = msg.id;
-        *len = msg.len;
-        for(i = 0; i < msg.len; i++)
-            data[i] = msg.data[i];
-            
-        return(0);
-    }
-    
-    return(1); // No message received, return err
-}
+    uint32_t timeout;
 
-int canSendMsg(int bus, int id, char len, unsigned char *data, int blocking){
-    CMSG    msg;
-    DWORD   retvalue;
-    long    msgCt = 1;
-    int     i;
-    
-    msg.id = id;
-    msg.len = len & 0x0F;
-    for(i = 0; i < len; i++)
-        msg.data[i] = data[i];
-    
-    if(blocking){
-        retvalue = canWrite(canDev[bus], &msg, &msgCt, NULL);
-    }else{
-        retvalue = canSend(canDev[bus], &msg, &msgCt);
-    }
-    
+    if(timeout_msec == rxTimeout[bus])
+        return 0;
+
+    timeout = (timeout_msec < 0 ? 0 : timeout_msec); // 0 = wait forever
+    retvalue = canIoctl(canDev[bus], NTCAN_IOCTL_SET_RX_TIMEOUT, &timeout);
     if(retvalue != NTCAN_SUCCESS){
 #ifndef _WIN32
-        syslog(LOG_ERR, "canSendMsg(): canWrite/Send() failed with error %d", retvalue);
+        syslog(LOG_ERR, "setRxTimeout(): canIoctl() failed with error %d", retvalue);
 #endif
-		printf("canSendMsg(): canWrite/Send() failed with error %ld", retvalue);
+		printf("setRxTimeout(): canIoctl() failed with error %ld", retvalue);
         return(1);
     }
+    rxTimeout[bus] = timeout_msec;
     return 0;
 }
 
+static int copyFrames(int bus, const CMSG_T* cmsg, long count, can_msg* msg, double* timestamp){
+    int n = 0;
+    int i, j;
+
+    for(i = 0; i < count; i++){
+        if(cmsg[i].len & NTCAN_RTR)
+            continue;
+        msg[n].STD_EXT = ((cmsg[i].id & NTCAN_20B_BASE) ? EXT : STD);
+        msg[n].msg_id = (cmsg[i].id & ~NTCAN_20B_BASE);
+        msg[n].data_length = cmsg[i].len & 0x0F;
+        for(j = 0; j < msg[n].data_length; j++)
+            msg[n].data[j] = cmsg[i].data[j];
+        timestamp[n] = (tsPeriod[bus] > 0.0 ? (double)cmsg[i].timestamp * tsPeriod[bus] : CAN_TIMESTAMP_NONE);
+        n++;
+    }
+    return n;
+}
+
 /*========================================*/
-/*       CAN API                          */
+/*       Transport                        */
 /*========================================*/
-int command_can_open(int ch)
+static int esdOpen(int bus, int type, int index)
 {
-	assert(ch >= 0 && ch < CH_COUNT);
+	assert(bus >= 0 && bus < CH_COUNT);
 
 	DWORD ret;
 
+	// the channel number is the NTCAN net number; type and index are not used.
 	printf("<< CAN: Open Channel...\n");
-	ret = initCAN(ch);
+	ret = initCAN(bus);
 	if (ret != 0) return ret;
-	printf("\t- Ch.%2d (OK)\n", ch);
+	rxStashCount[bus] = 0;
+	printf("\t- Ch.%2d (OK)\n", bus);
 	printf("\t- Done\n");
 
 	return 0;
 }
 
-int command_can_open_ex(int ch, int type, int index)
-{
-	return command_can_open(ch);
-}
-
-int command_can_reset(int ch)
-{
-	return -1;
-}
-
-int command_can_close(int ch)
+static int esdClose(int bus)
 {
-	assert(ch >= 0 && ch < CH_COUNT);
+	assert(bus >= 0 && bus < CH_COUNT);
 
 	DWORD ret;
 
 	printf("<< CAN: Close...\n");
-	ret = canClose(canDev[ch]);
+	ret = canClose(canDev[bus]);
 	if (ret != 0) return ret;
-	canDev[ch] = (NTCAN_HANDLE)-1;
+	canDev[bus] = (NTCAN_HANDLE)-1;
+	rxTimeout[bus] = RX_TIMEOUT;
+	rxStashCount[bus] = 0;
 	printf("\t- Done\n");
 
 	return 0;
 }
 
-int command_can_query_id(int ch)
+static int esdSendBatch(int bus, const can_msg* msg, int count)
 {
-	assert(ch >= 0 && ch < CH_COUNT);
-
-	long Txid;
-	unsigned char data[8];
-	int ret;
-
-	Txid = ((unsigned long)ID_CMD_QUERY_ID<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(ch, Txid, 0, data, TRUE);
-
-	return 0;
-}
-
-int command_can_sys_init(int ch, int period_msec)
-{
-	assert(ch >= 0 && ch < CH_COUNT);
-
-	long Txid;
-	unsigned char data[8];
-	int ret;
-
-	Txid = ((unsigned long)ID_CMD_SET_PERIOD<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	data[0] = (unsigned char)period_msec;
-	ret = canSendMsg(ch, Txid, 1, data, TRUE);
-
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_SET_MODE_TASK<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(ch, Txid, 0, data, TRUE);
-
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_QUERY_STATE_DATA<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(ch, Txid, 0, data, TRUE);
-
-	return 0;
-}
-
-int command_can_start(int ch)
-{
-	assert(ch >= 0 && ch < CH_COUNT);
-
-	long Txid;
-	unsigned char data[8];
-	int ret;
-
-	Txid = ((unsigned long)ID_CMD_QUERY_STATE_DATA<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(ch, Txid, 0, data, TRUE);
-
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_SET_SYSTEM_ON<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(ch, Txid, 0, data, TRUE);
-
-	return 0;
-}
-
-int command_can_stop(int ch)
-{
-	assert(ch >= 0 && ch < CH_COUNT);
-
-	long Txid;
-	unsigned char data[8];
-	int ret;
-
-	Txid = ((unsigned long)ID_CMD_SET_SYSTEM_OFF<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(ch, Txid, 0, data, TRUE);
+	assert(bus >= 0 && bus < CH_COUNT);
+	assert(count <= TX_QUEUE_SIZE);
+
+	CMSG    cmsg[TX_QUEUE_SIZE];
+	DWORD   retvalue;
+	long    msgCt = count;
+	int     i, j;
+
+	for(i = 0; i < count; i++){
+		cmsg[i].id = (msg[i].STD_EXT == EXT ? (msg[i].msg_id | NTCAN_20B_BASE) : msg[i].msg_id);
+		cmsg[i].len = msg[i].data_length & 0x0F;
+		for(j = 0; j < cmsg[i].len; j++)
+			cmsg[i].data[j] = msg[i].data[j];
+	}
 
+	// one canSend() call queues every frame in the handle's transmit FIFO.
+	retvalue = canSend(canDev[bus], cmsg, &msgCt);
+	if(retvalue != NTCAN_SUCCESS){
+#ifndef _WIN32
+		syslog(LOG_ERR, "esdSendBatch(): canSend() failed with error %d", retvalue);
+#endif
+		printf("esdSendBatch(): canSend() failed with error %ld", retvalue);
+		return(1);
+	}
+	if(msgCt != count)
+		return(1);
 	return 0;
 }
 
-int command_can_AHRS_set(int ch, unsigned char rate, unsigned char mask)
+static int esdRecvBatch(int bus, can_msg* msg, double* timestamp, int maxCount)
 {
-	assert(ch >= 0 && ch < CH_COUNT);
-
-	long Txid;
-	unsigned char data[8];
-	int ret;
-
-	Txid = ((unsigned long)ID_CMD_AHRS_SET<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	data[0] = (unsigned char)rate;
-	data[1] = (unsigned char)mask;
-	ret = canSendMsg(ch, Txid, 2, data, TRUE);
+	assert(bus >= 0 && bus < CH_COUNT);
+
+	CMSG_T  cmsg[RX_QUEUE_SIZE];
+	DWORD   retvalue;
+	long    msgCt;
+	int     n;
+
+	if(maxCount > RX_QUEUE_SIZE)
+		maxCount = RX_QUEUE_SIZE;
+
+	// the frames esdWait() already took from the driver come first.
+	if(rxStashCount[bus] > 0){
+		n = copyFrames(bus, rxStash[bus], rxStashCount[bus], msg, timestamp);
+		rxStashCount[bus] = 0;
+		if(n > 0)
+			return n;
+	}
 
-	return 0;
+	// canTakeT() returns whatever is queued without blocking.
+	msgCt = maxCount;
+	retvalue = canTakeT(canDev[bus], cmsg, &msgCt);
+	if(retvalue != NTCAN_SUCCESS){
+#ifndef _WIN32
+		syslog(LOG_ERR, "esdRecvBatch(): canTakeT() failed with error %ld", retvalue);
+#endif
+		return -2;
+	}
+	return copyFrames(bus, cmsg, msgCt, msg, timestamp);
 }
 
-int write_current(int ch, int findex, short* pwm)
+static int esdWait(int bus, int timeout_msec)
 {
-	assert(ch >= 0 && ch < CH_COUNT);
-
-	long Txid;
-	unsigned char data[8];
-	int ret;
-
-	if (findex >= 0 && findex < 4)
-	{
-		data[0] = (unsigned char)( (pwm[0] >> 8) & 0x00ff);
-		data[1] = (unsigned char)(pwm[0] & 0x00ff);
-
-		data[2] = (unsigned char)( (pwm[1] >> 8) & 0x00ff);
-		data[3] = (unsigned char)(pwm[1] & 0x00ff);
-
-		data[4] = (unsigned char)( (pwm[2] >> 8) & 0x00ff);
-		data[5] = (unsigned char)(pwm[2] & 0x00ff);
-
-		data[6] = (unsigned char)( (pwm[3] >> 8) & 0x00ff);
-		data[7] = (unsigned char)(pwm[3] & 0x00ff);
-
-		Txid = ((unsigned long)(ID_CMD_SET_TORQUE_1 + findex)<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-		ret = canSendMsg(ch, Txid, 8, data, TRUE);
+	assert(bus >= 0 && bus < CH_COUNT);
+
+	DWORD   retvalue;
+	long    msgCt;
+
+	if(rxStashCount[bus] > 0)
+		return 0;
+
+	// NTCAN has no receive event; canReadT() sleeps in the driver until a frame
+	// arrives or the handle's receive timeout expires. What it takes is kept
+	// for the next esdRecvBatch().
+	setRxTimeout(bus, timeout_msec);
+	msgCt = RX_QUEUE_SIZE;
+	retvalue = canReadT(canDev[bus], rxStash[bus], &msgCt, NULL);
+	if(retvalue == NTCAN_RX_TIMEOUT)
+		return 1;
+	if(retvalue != NTCAN_SUCCESS){
+#ifndef _WIN32
+		syslog(LOG_ERR, "esdWait(): canReadT() failed with error %ld", retvalue);
+#endif
+		return -2;
 	}
-	else
-		return -1;
-	
-	return 0;
+	rxStashCount[bus] = msgCt;
+	return (msgCt > 0 ? 0 : 1);
 }
 
-int get_message(int ch, char* cmd, char* src, char* des, int* len, unsigned char* data, int blocking)
-{
-	int Rxid;
-	unsigned char rdata[8];
-	int dlc;
-	int ret;
-
-	memset(rdata, NULL, sizeof(rdata));
-	ret = canReadMsg(ch, &Rxid, &dlc, rdata, TRUE);
-	if (ret != 0) return ret;
-	//printf("    %ld+%ld (%d)", Rxid-Rxid%128, Rxid%128, dlc);
-	//for(int nd=0; nd<(int)dlc; nd++) printf(" %3d ", rdata[nd]);
-	//printf("\n");
-
-	*cmd = (char)( (Rxid >> 6) & 0x1f );
-	*des = (char)( (Rxid >> 3) & 0x07 );
-	*src = (char)( Rxid & 0x07);
-	*len = (int)dlc;
-	for(int nd=0; nd<(int)dlc; nd++) data[nd] = rdata[nd];
-
-	return 0;
-}
+const CanTransport canTransportESD = {
+	"ESD",
+	1,
+	esdOpen,
+	esdClose,
+	NULL,
+	esdSendBatch,
+	esdRecvBatch,
+	esdWait,
+	NULL, // NTCAN does not report the transmit queue level
+	NULL
+};
 
 
 
@@ -22,6 +22,7 @@ extern "C" {
 }
 #include "canDef.h"
 #include "canAPI.h"
+#include "canTransport.h"
 
 
 CANAPI_BEGIN
@@ -30,18 +31,17 @@ CANAPI_BEGIN
 /*       Global file-scope variables       */
 /*=========================================*/
 
-CANHANDLE canDev[MAX_BUS] = { 0, };
+static CANHANDLE canDev[MAX_BUS] = { 0, };
+static int rxTimeout[MAX_BUS] = { 0, }; // read timeout currently programmed into the adapter (msec), 0 is the 1 msec set by initCAN()
 
-/*==========================================*/
-/*       Private functions prototypes       */
-/*==========================================*/
-int canReadMsg(CANHANDLE h, int *id, int *len, unsigned char *data, int blocking);
-int canSendMsg(CANHANDLE h, int id, char len, unsigned char *data, int blocking);
+// canplus has no receive event; easysyncWait() reads the frame it waited for into here
+static can_msg rxStash[MAX_BUS];
+static bool rxStashed[MAX_BUS] = { false, };
 
 /*========================================*/
-/*       Public functions (CAN API)       */
+/*       Private functions                */
 /*========================================*/
-CANHANDLE initCAN(int bus){
+static CANHANDLE initCAN(int bus){
 	char szAdapter[10];
 	const char szBitrate[] = "1000";
 	const char szAcceptanceCode[] = "000"; 
@@ -110,7 +110,7 @@ CANHANDLE initCAN(int bus){
 	return handle;
 }
 
-int freeCAN(CANHANDLE h){
+static int freeCAN(CANHANDLE h){
 	CAN_STATUS status;
 
 	status = canplus_Close(h);
@@ -126,7 +126,7 @@ int freeCAN(CANHANDLE h){
 	return 0;
 }
 
-int resetCAN(CANHANDLE h){
+static int resetCAN(CANHANDLE h){
 	CAN_STATUS status;
 
 	status = canplus_Reset(h);
@@ -142,7 +142,7 @@ int resetCAN(CANHANDLE h){
 	return 0;
 }
 
-int canReadMsg(CANHANDLE h, int *id, int *len, unsigned char *data, int blocking){
+static int canReadMsg(CANHANDLE h, can_msg *rmsg){
 	CANMsg msg;
 	CAN_STATUS status;
 	int i;
@@ -152,7 +152,7 @@ int canReadMsg(CANHANDLE h, int *id, int *len, unsigned char *data, int blocking
 	status = canplus_Read(h, &msg);
 	if (status == ERROR_CANPLUS_NO_MESSAGE) {
 		//printf("canReadMsg(): The receive buffer is empty.\n");
-		return 0;
+		return status;
 	}
 	else if (status < 0) {
 		printf("canReadMsg(): canplus_Read() failed with error %ld\n", status);
@@ -162,15 +162,16 @@ int canReadMsg(CANHANDLE h, int *id, int *len, unsigned char *data, int blocking
 		return status;
 	}
 
-	*id = msg.id;
-	*len = msg.len;
+	rmsg->STD_EXT = ((msg.flags & 0x80) ? EXT : STD); // CANMSG_EXTENDED
+	rmsg->msg_id = msg.id;
+	rmsg->data_length = msg.len;
 	for(i = 0; i < msg.len; i++)
-		data[i] = msg.data[i];
+		rmsg->data[i] = msg.data[i];
 
 	return 0;
 }
 
-int canSendMsg(CANHANDLE h, int id, char len, unsigned char *data, int blocking){
+static int canSendMsg(CANHANDLE h, int id, char len, unsigned char *data, int blocking){
 	CANMsg msg;
 	CAN_STATUS status;
 	int i;
@@ -195,201 +196,163 @@ int canSendMsg(CANHANDLE h, int id, char len, unsigned char *data, int blocking)
 	return 0;
 }
 
+static int setRxTimeout(int ch, int timeout_msec){
+	CAN_STATUS status;
+
+	if (rxTimeout[ch] == timeout_msec)
+		return 0;
+
+	// the adapter always waits at least 1 msec on an empty receive buffer
+	status = canplus_SetTimeouts(canDev[ch], (timeout_msec < 0 ? INFINITE : (timeout_msec == 0 ? 1 : timeout_msec)), 1);
+	if (status <= 0) {
+		printf("setRxTimeout(): canplus_SetTimeouts() failed with error %ld\n", status);
+		return -1;
+	}
+
+	rxTimeout[ch] = timeout_msec;
+	return 0;
+}
+
 /*========================================*/
-/*       CAN API                          */
+/*       Transport                        */
 /*========================================*/
-int command_can_open(int ch)
+static int easysyncOpen(int bus, int type, int index)
 {
-	assert(ch >= 0 && ch < CH_COUNT);
+	assert(bus >= 0 && bus < MAX_BUS);
 
 	CANHANDLE ret;
 
+	// the channel number counts the adapters found by canplus_getFirstAdapter()/getNextAdapter().
 	printf("<< CAN: Open Channel...\n");
-	ret = initCAN(ch);
+	ret = initCAN(bus);
 	if (ret < 0) return ret;
-	canDev[ch] = ret;
-	printf("\t- Ch.%2d (OK)\n", ch);
+	canDev[bus] = ret;
+	rxTimeout[bus] = 0;
+	rxStashed[bus] = false;
+	printf("\t- Ch.%2d (OK)\n", bus);
 	printf("\t- Done\n");
 
 	return 0;
 }
 
-int command_can_open_ex(int ch, int type, int index)
-{
-	return command_can_open(ch);
-}
-
-int command_can_reset(int ch)
+static int easysyncReset(int bus)
 {
-	assert(ch >= 0 && ch < CH_COUNT);
+	assert(bus >= 0 && bus < MAX_BUS);
 
 	printf("<< CAN: Reset...\n");
-
-	int status = resetCAN(canDev[ch]);
+	int status = resetCAN(canDev[bus]);
 	if (status < 0)
 		return status;
-
+	rxStashed[bus] = false;
 	printf("\t- Done\n");
-	return -1;
+
+	return 0;
 }
 
-int command_can_close(int ch)
+static int easysyncClose(int bus)
 {
-	assert(ch >= 0 && ch < CH_COUNT);
+	assert(bus >= 0 && bus < MAX_BUS);
 
-	printf("<< CAN: Close...\n");
+	int status;
 
-	int status = freeCAN(canDev[ch]);
+	printf("<< CAN: Close...\n");
+	status = freeCAN(canDev[bus]);
 	if (status < 0)
 		return status;
-
+	canDev[bus] = 0;
+	rxStashed[bus] = false;
 	printf("\t- Done\n");
-	canDev[ch] = -1;
-	return 0;
-}
-
-int command_can_query_id(int ch)
-{
-	assert(ch >= 0 && ch < MAX_BUS);
-
-	long Txid;
-	unsigned char data[8];
-	int ret;
-
-	Txid = ((unsigned long)ID_CMD_QUERY_ID<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(canDev[ch], Txid, 0, data, TRUE);
 
 	return 0;
 }
 
-int command_can_sys_init(int ch, int period_msec)
+static int easysyncSendBatch(int bus, const can_msg* msg, int count)
 {
-	assert(ch >= 0 && ch < MAX_BUS);
+	assert(bus >= 0 && bus < MAX_BUS);
 
-	long Txid;
-	unsigned char data[8];
 	int ret;
 
-	Txid = ((unsigned long)ID_CMD_SET_PERIOD<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	data[0] = (unsigned char)period_msec;
-	ret = canSendMsg(canDev[ch], Txid, 1, data, TRUE);
-
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_SET_MODE_TASK<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(canDev[ch], Txid, 0, data, TRUE);
-
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_QUERY_STATE_DATA<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(canDev[ch], Txid, 0, data, TRUE);
-
-	return 0;
-}
-
-int command_can_start(int ch)
-{
-	assert(ch >= 0 && ch < MAX_BUS);
-
-	long Txid;
-	unsigned char data[8];
-	int ret;
-
-	Txid = ((unsigned long)ID_CMD_QUERY_STATE_DATA<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(canDev[ch], Txid, 0, data, TRUE);
-
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_SET_SYSTEM_ON<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(canDev[ch], Txid, 0, data, TRUE);
-
-	return 0;
-}
-
-int command_can_stop(int ch)
-{
-	assert(ch >= 0 && ch < MAX_BUS);
-
-	long Txid;
-	unsigned char data[8];
-	int ret;
-
-	Txid = ((unsigned long)ID_CMD_SET_SYSTEM_OFF<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(canDev[ch], Txid, 0, data, TRUE);
-
-	return 0;
-}
-
-int command_can_AHRS_set(int ch, unsigned char rate, unsigned char mask)
-{
-	assert(ch >= 0 && ch < MAX_BUS);
-
-	long Txid;
-	unsigned char data[8];
-	int ret;
-
-	Txid = ((unsigned long)ID_CMD_AHRS_SET<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	data[0] = (unsigned char)rate;
-	data[1] = (unsigned char)mask;
-	ret = canSendMsg(canDev[ch], Txid, 2, data, TRUE);
+	// canplus has no multi-frame write.
+	for (int i = 0; i < count; i++)
+	{
+		ret = canSendMsg(canDev[bus], (int)msg[i].msg_id, msg[i].data_length, (unsigned char*)msg[i].data, TRUE);
+		if (ret)
+			return ret;
+	}
 
 	return 0;
 }
 
-int write_current(int ch, int findex, short* pwm)
+static int easysyncRecvBatch(int bus, can_msg* msg, double* timestamp, int maxCount)
 {
-	assert(ch >= 0 && ch < MAX_BUS);
+	assert(bus >= 0 && bus < MAX_BUS);
 
-	long Txid;
-	unsigned char data[8];
-	int ret;
+	int n = 0;
+	int err;
 
-	if (findex >= 0 && findex < 4)
+	// the adapter is opened without CANPLUS_FLAG_TIMESTAMP
+	if (rxStashed[bus])
 	{
-		data[0] = (unsigned char)( (pwm[0] >> 8) & 0x00ff);
-		data[1] = (unsigned char)(pwm[0] & 0x00ff);
-
-		data[2] = (unsigned char)( (pwm[1] >> 8) & 0x00ff);
-		data[3] = (unsigned char)(pwm[1] & 0x00ff);
-
-		data[4] = (unsigned char)( (pwm[2] >> 8) & 0x00ff);
-		data[5] = (unsigned char)(pwm[2] & 0x00ff);
-
-		data[6] = (unsigned char)( (pwm[3] >> 8) & 0x00ff);
-		data[7] = (unsigned char)(pwm[3] & 0x00ff);
+		msg[n] = rxStash[bus];
+		timestamp[n++] = CAN_TIMESTAMP_NONE;
+		rxStashed[bus] = false;
+	}
 
-		Txid = ((unsigned long)(ID_CMD_SET_TORQUE_1 + findex)<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-		ret = canSendMsg(canDev[ch], Txid, 8, data, TRUE);
+	// every read of an empty buffer takes the adapter's minimum timeout of 1 msec,
+	// so stop at the first one.
+	err = setRxTimeout(bus, 0);
+	if (err)
+		return (n > 0 ? n : err);
+	while (n < maxCount)
+	{
+		err = canReadMsg(canDev[bus], &msg[n]);
+		if (err == ERROR_CANPLUS_NO_MESSAGE)
+			break;
+		if (err)
+			return (n > 0 ? n : err);
+		timestamp[n++] = CAN_TIMESTAMP_NONE;
 	}
-	else
-		return -1;
-	
-	return 0;
+
+	return n;
 }
 
-int get_message(int ch, char* cmd, char* src, char* des, int* len, unsigned char* data, int /*blocking*/) // non-blocking read is not supported.
+static int easysyncWait(int bus, int timeout_msec)
 {
+	assert(bus >= 0 && bus < MAX_BUS);
+
 	int err;
-	unsigned long Rxid;
 
-	err = canReadMsg(canDev[ch], (int*)&Rxid, len, data, TRUE);
-	if (!err)
-	{
-		/*printf("    %ld+%ld (%d)", Rxid-Rxid%128, Rxid%128, len);
-		for(int nd=0; nd<(*len); nd++) printf(" %3d ", data[nd]);
-		printf("\n");*/
+	if (rxStashed[bus])
+		return 0;
 
-		*cmd = (char)( (Rxid >> 6) & 0x1f );
-		*des = (char)( (Rxid >> 3) & 0x07 );
-		*src = (char)( Rxid & 0x07);
-	}
-	else
-	{
+	// canplus_Read() blocks for the read timeout of the adapter; the frame it
+	// returns is kept for the next easysyncRecvBatch().
+	err = setRxTimeout(bus, timeout_msec);
+	if (err)
 		return err;
-	}
+	err = canReadMsg(canDev[bus], &rxStash[bus]);
+	if (err == ERROR_CANPLUS_NO_MESSAGE)
+		return 1;
+	if (err)
+		return err;
+	rxStashed[bus] = true;
+
 	return 0;
 }
 
+const CanTransport canTransportEasySYNC = {
+	"EasySYNC",
+	1,
+	easysyncOpen,
+	easysyncClose,
+	easysyncReset,
+	easysyncSendBatch,
+	easysyncRecvBatch,
+	easysyncWait,
+	NULL, // canplus does not report the transmit queue level
+	NULL
+};
+
 
 
 CANAPI_END
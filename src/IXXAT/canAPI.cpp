@@ -20,288 +20,175 @@ extern "C" {
 #include "select.hpp"
 #include "canDef.h"
 #include "canAPI.h"
+#include "canTransport.h"
 
 CANAPI_BEGIN
 
 
-#define CH_COUNT			(int)2 // number of CAN channels
+#define CH_COUNT			MAX_BUS // number of CAN channels
 
 
 //////////////////////////////////////////////////////////////////////////
 // global variables
 //////////////////////////////////////////////////////////////////////////
-static HANDLE hDevice[CH_COUNT] = {(HANDLE) 0, (HANDLE) 0};  // device handle
-static LONG   lCtrlNo[CH_COUNT] = {         0,          0};  // controller number
-static HANDLE hCanCtl[CH_COUNT] = {(HANDLE)-1, (HANDLE)-1};  // controller handle 
-static HANDLE hCanChn[CH_COUNT] = {(HANDLE)-1, (HANDLE)-1};  // channel handle
+// indexed by channel-1, the handles are valid while the channel is open
+static HANDLE hDevice[CH_COUNT];      // device handle
+static LONG   lCtrlNo[CH_COUNT];      // controller number
+static HANDLE hCanCtl[CH_COUNT];      // controller handle 
+static HANDLE hCanChn[CH_COUNT];      // channel handle
+static double dTickPeriod[CH_COUNT];  // seconds per CANMSG.dwTime tick, 0 if unknown
+static UINT32 dwTimeLast[CH_COUNT];   // for extending the 32-bit message time
+static double dTimeWraps[CH_COUNT];
 
 //////////////////////////////////////////////////////////////////////////
 // static function prototypes
 //////////////////////////////////////////////////////////////////////////
-HRESULT SelectDevice ( UINT32 dwCanChNo, BOOL fUserSelect );
-HRESULT InitSocket   ( UINT32 dwCanChNo, UINT32 dwCanNo );
-void    FinalizeApp  ( UINT32 dwCanChNo );
-void    DisplayError ( /*UINT32 dwCanChNo,*/ HRESULT hResult );
+static HRESULT SelectDevice ( UINT32 dwCanChNo, BOOL fUserSelect );
+static HRESULT InitSocket   ( UINT32 dwCanChNo, UINT32 dwCanNo );
+static void    FinalizeApp  ( UINT32 dwCanChNo );
+static void    DisplayError ( /*UINT32 dwCanChNo,*/ HRESULT hResult );
 
 
 
-/**
-  This function transmit a CAN data frame.
-*/
-int canWrite(HANDLE handle,
-			 unsigned long id, 
-			 void * msg,
-			 unsigned int dlc,
-			 int mode)
-{
-	if (handle < 0)
-		return -1;
-
-	HRESULT hResult;
-	CANMSG  sCanMsg;
-	UINT8   i;
-
-	sCanMsg.dwTime   = 0;
-	sCanMsg.dwMsgId  = id;    // CAN message identifier
-
-	sCanMsg.uMsgInfo.Bytes.bType  = CAN_MSGTYPE_DATA;
-	sCanMsg.uMsgInfo.Bytes.bFlags = CAN_MAKE_MSGFLAGS(dlc,0,0,0,mode);
-	sCanMsg.uMsgInfo.Bits.srr     = 0;
-
-	for (i = 0; i < sCanMsg.uMsgInfo.Bits.dlc; i++)
-	{
-		sCanMsg.abData[i] = ((unsigned char*)msg)[i];
-	}
-
-	// write the CAN message into the transmit FIFO
-	hResult = canChannelSendMessage(handle, INFINITE, &sCanMsg);
-
-	if (hResult != VCI_OK)
-	{
-		DisplayError(hResult);
-	}
-
-	return hResult;
-}
-
 /**
   This function opens a CAN data channel.
 */
-int command_can_open(int ch)
+static int ixxatOpen(int bus, int type, int index)
 {
-	assert(ch >= 1 && ch <= CH_COUNT);
+	assert(bus >= 1 && bus <= CH_COUNT);
 
 	HRESULT hResult;
 
-	hResult = SelectDevice( ch-1, TRUE );
+	hResult = SelectDevice( bus-1, TRUE );
 	if ( VCI_OK != hResult ) {
 		DisplayError(hResult);
 		return hResult;
 	}
 
-	hResult = InitSocket( ch-1, lCtrlNo[ch-1] );
+	hResult = InitSocket( bus-1, lCtrlNo[bus-1] );
 	DisplayError(hResult);
 	return hResult;
 }
 
 /**
-  This function opens a CAN data channel.
-*/
-int command_can_open_ex(int ch, int type, int index)
-{
-	return command_can_open(ch);
-}
-
-/**
-*/
-int command_can_reset(int ch)
-{
-	return -1;
-}
-
-/**
-*/
-int command_can_close(int ch)
-{
-	FinalizeApp(ch);
-	return 0;
-}
-
-/**
+  This function closes a CAN data channel.
 */
-int command_can_query_id(int ch)
+static int ixxatClose(int bus)
 {
-	long Txid;
-	unsigned char data[8];
-
-	Txid = ((unsigned long)ID_CMD_QUERY_ID<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(hCanChn[ch-1], Txid, data, 0, STD);
+	assert(bus >= 1 && bus <= CH_COUNT);
 
+	FinalizeApp(bus-1);
 	return 0;
 }
 
 /**
+  This function writes all CAN data frames into the transmit FIFO at once.
 */
-int command_can_sys_init(int ch, int period_msec)
+static int ixxatSendBatch(int bus, const can_msg* msg, int count)
 {
-	long Txid;
-	unsigned char data[8];
-
-	Txid = ((unsigned long)ID_CMD_SET_PERIOD<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	data[0] = (unsigned char)period_msec;
-	canWrite(hCanChn[ch-1], Txid, data, 1, STD);
-
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_SET_MODE_TASK<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(hCanChn[ch-1], Txid, data, 0, STD);
+	assert(bus >= 1 && bus <= CH_COUNT);
+	assert(count <= TX_QUEUE_SIZE);
 
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_QUERY_STATE_DATA<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(hCanChn[ch-1], Txid, data, 0, STD);
-
-	return 0;
-}
-
-/**
-*/
-int command_can_start(int ch)
-{
-	long Txid;
-	unsigned char data[8];
-
-	Txid = ((unsigned long)ID_CMD_QUERY_STATE_DATA<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(hCanChn[ch-1], Txid, data, 0, STD);
+	HRESULT hResult;
+	CANMSG  aCanMsg[TX_QUEUE_SIZE];
+	UINT32  dwNum = count;
+	int     i, j;
 
-	Sleep(10);
+	for (i = 0; i < count; i++)
+	{
+		aCanMsg[i].dwTime   = 0;
+		aCanMsg[i].dwMsgId  = msg[i].msg_id;
 
-	Txid = ((unsigned long)ID_CMD_SET_SYSTEM_ON<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(hCanChn[ch-1], Txid, data, 0, STD);
+		aCanMsg[i].uMsgInfo.Bytes.bType  = CAN_MSGTYPE_DATA;
+		aCanMsg[i].uMsgInfo.Bytes.bFlags = CAN_MAKE_MSGFLAGS(msg[i].data_length,0,0,0,msg[i].STD_EXT);
+		aCanMsg[i].uMsgInfo.Bits.srr     = 0;
 
-	return 0;
-}
-
-/**
-*/
-int command_can_stop(int ch)
-{
-	long Txid;
-	unsigned char data[8];
+		for (j = 0; j < aCanMsg[i].uMsgInfo.Bits.dlc; j++)
+			aCanMsg[i].abData[j] = (UINT8)msg[i].data[j];
+	}
 
-	Txid = ((unsigned long)ID_CMD_SET_SYSTEM_OFF<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(hCanChn[ch-1], Txid, data, 0, STD);
+	// write all CAN messages into the transmit FIFO at once
+	hResult = canChannelSendMultipleMessages(hCanChn[bus-1], INFINITE, &dwNum, aCanMsg);
+	if (hResult != VCI_OK)
+	{
+		DisplayError(hResult);
+	}
 
-	return 0;
+	return hResult;
 }
 
 /**
+  This function takes every message waiting in the receive FIFO without
+  blocking. Only data frames are returned; info and error frames are printed.
 */
-int command_can_AHRS_set(int ch, unsigned char rate, unsigned char mask)
+static int ixxatRecvBatch(int bus, can_msg* msg, double* timestamp, int maxCount)
 {
-	long Txid;
-	unsigned char data[8];
-
-	Txid = ((unsigned long)ID_CMD_AHRS_SET<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	data[0] = (unsigned char)rate;
-	data[1] = (unsigned char)mask;
-	canWrite(hCanChn[ch-1], Txid, data, 2, STD);
-
-	return 0;
-}
+	assert(bus >= 1 && bus <= CH_COUNT);
 
-/**
-*/
-int write_current(int ch, int findex, short* pwm)
-{
-	long Txid;
-	unsigned char data[8];
+	HRESULT hResult;
+	CANMSG  aCanMsg[RX_QUEUE_SIZE];
+	UINT32  dwNum = (maxCount < RX_QUEUE_SIZE ? maxCount : RX_QUEUE_SIZE);
+	int     n = 0;
+	UINT32  i;
 
-	if (findex >= 0 && findex < 4)
+	hResult = canChannelPeekMultipleMessages(hCanChn[bus-1], &dwNum, aCanMsg);
+	if (hResult != VCI_OK)
 	{
-		data[0] = (unsigned char)( (pwm[0] >> 8) & 0x00ff);
-		data[1] = (unsigned char)(pwm[0] & 0x00ff);
-
-		data[2] = (unsigned char)( (pwm[1] >> 8) & 0x00ff);
-		data[3] = (unsigned char)(pwm[1] & 0x00ff);
-
-		data[4] = (unsigned char)( (pwm[2] >> 8) & 0x00ff);
-		data[5] = (unsigned char)(pwm[2] & 0x00ff);
-
-		data[6] = (unsigned char)( (pwm[3] >> 8) & 0x00ff);
-		data[7] = (unsigned char)(pwm[3] & 0x00ff);
-
-		Txid = ((unsigned long)(ID_CMD_SET_TORQUE_1 + findex)<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-		canWrite(hCanChn[ch-1], Txid, data, 8, STD);
-	}
-	else
+		if (VCI_E_RXQUEUE_EMPTY == hResult)
+			return 0;
+		DisplayError(hResult);
 		return -1;
-	
-	return 0;
-}
+	}
 
-/**
-*/
-int get_message(int ch, char* cmd, char* src, char* des, int* len, unsigned char* data, int blocking)
-{
-	HRESULT hResult;
-	CANMSG  sCanMsg;
-
-	//hResult = canChannelReadMessage(hCanChn[ch-1], (blocking ? INFINITE : 0), &sCanMsg);
-	if (blocking)
-		hResult = canChannelReadMessage(hCanChn[ch-1], INFINITE, &sCanMsg);
-	else
-		hResult = canChannelPeekMessage(hCanChn[ch-1], &sCanMsg);
-	
-	if (hResult == VCI_OK)
+	for (i = 0; i < dwNum; i++)
 	{
-		if (sCanMsg.uMsgInfo.Bytes.bType == CAN_MSGTYPE_DATA)
+		CANMSG* pCanMsg = &aCanMsg[i];
+
+		if (pCanMsg->uMsgInfo.Bytes.bType == CAN_MSGTYPE_DATA)
 		{
-			if (sCanMsg.uMsgInfo.Bits.rtr == 0)
+			if (pCanMsg->uMsgInfo.Bits.rtr == 0)
 			{
-				*cmd = (char)( (sCanMsg.dwMsgId >> 6) & 0x1f );
-				*des = (char)( (sCanMsg.dwMsgId >> 3) & 0x07 );
-				*src = (char)( sCanMsg.dwMsgId & 0x07 );
-				*len = (int)( sCanMsg.uMsgInfo.Bits.dlc );
-				for(int nd=0; nd<(*len); nd++) data[nd] = sCanMsg.abData[nd];
-
-#ifdef _DEBUG
-				/*UINT8 j;
-				printf("\nTime: %10u  ID: %3X  DLC: %1u  Data:",
-					sCanMsg.dwTime,
-					sCanMsg.dwMsgId,
-					sCanMsg.uMsgInfo.Bits.dlc);
-				for (j = 0; j < sCanMsg.uMsgInfo.Bits.dlc; j++)
-					printf(" %.2X", sCanMsg.abData[j]);
-				printf("\n");*/
-#endif
+				msg[n].STD_EXT = (pCanMsg->uMsgInfo.Bits.ext ? EXT : STD);
+				msg[n].msg_id = pCanMsg->dwMsgId;
+				msg[n].data_length = (unsigned char)pCanMsg->uMsgInfo.Bits.dlc;
+				for (int nd = 0; nd < msg[n].data_length; nd++) msg[n].data[nd] = pCanMsg->abData[nd];
+				if (dTickPeriod[bus-1] > 0.0)
+				{
+					if (pCanMsg->dwTime < dwTimeLast[bus-1])
+						dTimeWraps[bus-1] += 4294967296.0;
+					dwTimeLast[bus-1] = pCanMsg->dwTime;
+					timestamp[n] = (dTimeWraps[bus-1] + pCanMsg->dwTime) * dTickPeriod[bus-1];
+				}
+				else
+					timestamp[n] = CAN_TIMESTAMP_NONE;
+				n++;
 			}
 			else
 			{
 				printf("\nTime: %10u ID: %3X  DLC: %1u  Remote Frame",
-						sCanMsg.dwTime,
-						sCanMsg.dwMsgId,
-						sCanMsg.uMsgInfo.Bits.dlc);
+						pCanMsg->dwTime,
+						pCanMsg->dwMsgId,
+						pCanMsg->uMsgInfo.Bits.dlc);
 			}
 		}
-		else if (sCanMsg.uMsgInfo.Bytes.bType == CAN_MSGTYPE_INFO)
+		else if (pCanMsg->uMsgInfo.Bytes.bType == CAN_MSGTYPE_INFO)
 		{
 			//
 			// show informational frames
 			//
-			switch (sCanMsg.abData[0])
+			switch (pCanMsg->abData[0])
 			{
 				case CAN_INFO_START: printf("\nCAN started..."); break;
 				case CAN_INFO_STOP : printf("\nCAN stoped...");  break;
 				case CAN_INFO_RESET: printf("\nCAN reseted..."); break;
 			}
 		}
-		else if (sCanMsg.uMsgInfo.Bytes.bType == CAN_MSGTYPE_ERROR)
+		else if (pCanMsg->uMsgInfo.Bytes.bType == CAN_MSGTYPE_ERROR)
 		{
 			//
 			// show error frames
 			//
-			switch (sCanMsg.abData[0])
+			switch (pCanMsg->abData[0])
 			{
 				case CAN_ERROR_STUFF: printf("\nstuff error...");          break; 
 				case CAN_ERROR_FORM : printf("\nform error...");           break; 
@@ -312,15 +199,56 @@ int get_message(int ch, char* cmd, char* src, char* des, int* len, unsigned char
 				default             : printf("\nother error...");          break;
 			}
 		}
-    }
-	else
+	}
+
+	return n;
+}
+
+/**
+  This function waits until a CAN message is received or the time-out
+  interval elapses. The calling thread sleeps on the channel's receive event.
+*/
+static int ixxatWait(int bus, int timeout_msec)
+{
+	assert(bus >= 1 && bus <= CH_COUNT);
+
+	HRESULT hResult;
+
+	hResult = canChannelWaitRxEvent(hCanChn[bus-1], (timeout_msec < 0 ? INFINITE : (UINT32)timeout_msec));
+	if (hResult == VCI_OK)
+		return 0;
+	if (hResult == VCI_E_TIMEOUT)
+		return 1;
+	DisplayError(hResult);
+	return -1;
+}
+
+/**
+  This function waits until the transmit FIFO is empty.
+*/
+static int ixxatWaitTx(int bus, int timeout_msec)
+{
+	assert(bus >= 1 && bus <= CH_COUNT);
+
+	HRESULT hResult;
+	CANCHANSTATUS sStatus;
+	DWORD dwStart = GetTickCount();
+
+	// VCI signals free FIFO space, not an empty FIFO, so watch the load instead.
+	for (;;)
 	{
-		 if (VCI_E_RXQUEUE_EMPTY != hResult &&
-			 VCI_E_TIMEOUT != hResult)
-			 DisplayError(hResult);
+		hResult = canChannelGetStatus(hCanChn[bus-1], &sStatus);
+		if (hResult != VCI_OK)
+		{
+			DisplayError(hResult);
+			return hResult;
+		}
+		if (sStatus.bTxFifoLoad == 0)
+			return 0;
+		if (timeout_msec >= 0 && (int)(GetTickCount() - dwStart) >= timeout_msec)
+			return 1;
+		Sleep(0);
 	}
-	
-	return hResult;
 }
 
 /**
@@ -333,7 +261,7 @@ int get_message(int ch, char* cmd, char* src, char* des, int* len, unsigned char
   @return
     VCI_OK on success, otherwise an Error code
 */
-HRESULT SelectDevice( UINT32 dwCanChNo, BOOL fUserSelect )
+static HRESULT SelectDevice( UINT32 dwCanChNo, BOOL fUserSelect )
 {
   HRESULT hResult; // error code
 
@@ -400,7 +328,7 @@ HRESULT SelectDevice( UINT32 dwCanChNo, BOOL fUserSelect )
     If <dwCanNo> is set to 0xFFFFFFFF, the function shows a dialog box
     which allows the user to select the VCI device and CAN controller.
 */
-HRESULT InitSocket( UINT32 dwCanChNo, UINT32 dwCanNo )
+static HRESULT InitSocket( UINT32 dwCanChNo, UINT32 dwCanNo )
 {
   HRESULT hResult;
 
@@ -465,6 +393,19 @@ HRESULT InitSocket( UINT32 dwCanChNo, UINT32 dwCanNo )
                                          CAN_ACC_CODE_ALL, CAN_ACC_MASK_ALL);
     }
 
+    //
+    // get the resolution of the receive time stamps
+    //
+    if (hResult == VCI_OK)
+    {
+      CANCAPABILITIES sCanCaps;
+      dTickPeriod[dwCanChNo] = 0.0;
+      dwTimeLast[dwCanChNo] = 0;
+      dTimeWraps[dwCanChNo] = 0.0;
+      if (canControlGetCaps(hCanCtl[dwCanChNo], &sCanCaps) == VCI_OK && sCanCaps.dwClockFreq != 0)
+        dTickPeriod[dwCanChNo] = (double)sCanCaps.dwTscDivisor / (double)sCanCaps.dwClockFreq;
+    }
+
     //
     // start the CAN controller
     //
@@ -485,7 +426,7 @@ HRESULT InitSocket( UINT32 dwCanChNo, UINT32 dwCanNo )
 /**
   Finalizes the application
 */
-void FinalizeApp( UINT32 dwCanChNo )
+static void FinalizeApp( UINT32 dwCanChNo )
 {
   //
   // close all open handles
@@ -507,7 +448,7 @@ void FinalizeApp( UINT32 dwCanChNo )
   @param hResult
     Error code or -1 to display the error code returned by GetLastError().
 */
-void DisplayError( /*UINT32 dwCanChNo,*/ HRESULT hResult )
+static void DisplayError( /*UINT32 dwCanChNo,*/ HRESULT hResult )
 {
   char szError[VCI_MAX_ERRSTRLEN];
 
@@ -523,5 +464,18 @@ void DisplayError( /*UINT32 dwCanChNo,*/ HRESULT hResult )
   }
 }
 
+const CanTransport canTransportIXXAT = {
+	"IXXAT",
+	1, // channels are numbered from 1
+	ixxatOpen,
+	ixxatClose,
+	NULL,
+	ixxatSendBatch,
+	ixxatRecvBatch,
+	ixxatWait,
+	ixxatWaitTx,
+	NULL
+};
+
 
 CANAPI_END
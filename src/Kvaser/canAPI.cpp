@@ -16,18 +16,24 @@
 
 #include "canDef.h"
 #include "canAPI.h"
+#include "canTransport.h"
 #include "Kvaser/canlib.h"
 
 CANAPI_BEGIN
 
 
-#define CH_COUNT			(int)2 // number of CAN channels
+#define CH_COUNT			MAX_BUS // number of CAN channels
 
-static int hCAN[CH_COUNT] = {-1, -1}; // CAN channel handles
+static int hCAN[CH_COUNT]; // CAN channel handles, valid while the channel is open
 
-int command_can_open(int ch)
+#define TIMER_SCALE			(10) // usec per canRead() time unit
+static DWORD timerScale[CH_COUNT]; // usec per time unit in effect (1000 is the driver default)
+static unsigned long rxTimeLast[CH_COUNT]; // for extending the 32-bit receive time
+static double rxTimeWraps[CH_COUNT];
+
+static int kvaserOpen(int bus, int type, int index)
 {
-	assert(ch >= 0 && ch < CH_COUNT);
+	assert(bus >= 0 && bus < CH_COUNT);
 
 	canStatus ret;
 	
@@ -36,21 +42,31 @@ int command_can_open(int ch)
 	printf("\t- Done\n");
 	Sleep(200);
 
+	// CANlib numbers the channels of all adapters together; the channel number is used as is.
 	printf("<< CAN: Open Channel...\n");
-	hCAN[ch] = canOpenChannel(ch, canOPEN_EXCLUSIVE);
-	if (hCAN[ch] < 0) return -1;
-	printf("\t- Ch.%2d (OK)\n", ch);
+	hCAN[bus] = canOpenChannel(bus, canOPEN_EXCLUSIVE);
+	if (hCAN[bus] < 0) return -1;
+	printf("\t- Ch.%2d (OK)\n", bus);
 	printf("\t- Done\n");
 	Sleep(200);
 
 	printf("<< CAN: Set Bus Parameter...\n");
-	ret = canSetBusParams(hCAN[ch], BAUD_1M, 0, 0, 0, 0, 0);
+	ret = canSetBusParams(hCAN[bus], BAUD_1M, 0, 0, 0, 0, 0);
 	if (ret < 0) return -2;
 	printf("\t- Done\n");
 	Sleep(200);
 
+	printf("<< CAN: Set Timer Scale...\n");
+	DWORD scale = TIMER_SCALE;
+	ret = canIoCtl(hCAN[bus], canIOCTL_SET_TIMER_SCALE, &scale, sizeof(scale));
+	if (ret < 0) printf("\t- Not supported, receive times are in msec\n");
+	else printf("\t- Done\n");
+	timerScale[bus] = (ret < 0 ? 1000 : TIMER_SCALE);
+	rxTimeLast[bus] = 0;
+	rxTimeWraps[bus] = 0.0;
+
 	printf("<< CAN: Bus On...\n");
-	ret = canBusOn(hCAN[ch]);
+	ret = canBusOn(hCAN[bus]);
 	if (ret < 0) return -3;
 	printf("\t- Done\n");
 	Sleep(200);
@@ -58,19 +74,14 @@ int command_can_open(int ch)
 	return 0;
 }
 
-int command_can_open_ex(int ch, int type, int index)
-{
-	return command_can_open(ch);
-}
-
-int command_can_reset(int ch)
+static int kvaserReset(int bus)
 {
-	assert(ch >= 0 && ch < CH_COUNT);
+	assert(bus >= 0 && bus < CH_COUNT);
 
 	canStatus ret;
 
 	printf("<< CAN: Reset Bus...\n");
-	ret = canResetBus(hCAN[ch]);
+	ret = canResetBus(hCAN[bus]);
 	if (ret < 0) return ret;
 	printf("\t- Done\n");
 	Sleep(200);
@@ -78,164 +89,110 @@ int command_can_reset(int ch)
 	return 0;
 }
 
-int command_can_close(int ch)
+static int kvaserClose(int bus)
 {
-	assert(ch >= 0 && ch < CH_COUNT);
+	assert(bus >= 0 && bus < CH_COUNT);
 
 	canStatus ret;
 
 	printf("<< CAN: Close...\n");
-	ret = canClose(hCAN[ch]);
+	ret = canClose(hCAN[bus]);
 	if (ret < 0) return ret;
-	hCAN[ch] = 0;
+	hCAN[bus] = -1;
 	printf("\t- Done\n");
 	Sleep(200);
 	return 0;
 }
 
-int command_can_query_id(int ch)
+static int kvaserSendBatch(int bus, const can_msg* msg, int count)
 {
-	assert(ch >= 0 && ch < CH_COUNT);
+	assert(bus >= 0 && bus < CH_COUNT);
 
-	long Txid;
-	unsigned char data[8];
 	canStatus ret;
 
-	Txid = ((unsigned long)ID_CMD_QUERY_ID<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canWrite(hCAN[ch], Txid, data, 0, STD);
-
-	return 0;
-}
-
-int command_can_sys_init(int ch, int period_msec)
-{
-	assert(ch >= 0 && ch < CH_COUNT);
-
-	long Txid;
-	unsigned char data[8];
-	canStatus ret;
-
-	Txid = ((unsigned long)ID_CMD_SET_PERIOD<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	data[0] = (unsigned char)period_msec;
-	ret = canWrite(hCAN[ch], Txid, data, 1, STD);
-
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_SET_MODE_TASK<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canWrite(hCAN[ch], Txid, data, 0, STD);
-
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_QUERY_STATE_DATA<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canWrite(hCAN[ch], Txid, data, 0, STD);
-
-	return 0;
-}
-
-int command_can_start(int ch)
-{
-	assert(ch >= 0 && ch < CH_COUNT);
-
-	long Txid;
-	unsigned char data[8];
-	canStatus ret;
-
-	Txid = ((unsigned long)ID_CMD_QUERY_STATE_DATA<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canWrite(hCAN[ch], Txid, data, 0, STD);
-
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_SET_SYSTEM_ON<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canWrite(hCAN[ch], Txid, data, 0, STD);
+	// CANlib has no multi-frame write; canWrite() only queues the frame.
+	for (int i = 0; i < count; i++)
+	{
+		ret = canWrite(hCAN[bus], (long)msg[i].msg_id, (void*)msg[i].data, msg[i].data_length, (msg[i].STD_EXT == EXT ? canMSG_EXT : STD));
+		if (ret != canOK)
+			return ret;
+	}
 
 	return 0;
 }
 
-int command_can_stop(int ch)
+static int kvaserRecvBatch(int bus, can_msg* msg, double* timestamp, int maxCount)
 {
-	assert(ch >= 0 && ch < CH_COUNT);
+	assert(bus >= 0 && bus < CH_COUNT);
 
-	long Txid;
-	unsigned char data[8];
+	long Rxid;
+	unsigned int dlc;
+	unsigned int flag;
+	unsigned long time;
 	canStatus ret;
+	int n;
 
-	Txid = ((unsigned long)ID_CMD_SET_SYSTEM_OFF<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canWrite(hCAN[ch], Txid, data, 0, STD);
+	// canRead() returns one frame per call; drain what is queued.
+	for (n = 0; n < maxCount; )
+	{
+		memset(msg[n].data, 0, sizeof(msg[n].data));
+		ret = canRead(hCAN[bus], &Rxid, msg[n].data, &dlc, &flag, &time);
+		if (ret == canERR_NOMSG)
+			break;
+		if (ret != canOK)
+			return (n > 0 ? n : ret);
+		if (flag & (canMSG_RTR | canMSG_ERROR_FRAME))
+			continue;
+
+		if (time < rxTimeLast[bus])
+			rxTimeWraps[bus] += 4294967296.0;
+		rxTimeLast[bus] = time;
+		timestamp[n] = (rxTimeWraps[bus] + time) * timerScale[bus] * 1e-6;
+		msg[n].STD_EXT = ((flag & canMSG_EXT) ? EXT : STD);
+		msg[n].msg_id = Rxid;
+		msg[n].data_length = (unsigned char)dlc;
+		n++;
+	}
 
-	return 0;
+	return n;
 }
 
-int command_can_AHRS_set(int ch, unsigned char rate, unsigned char mask)
+static int kvaserWait(int bus, int timeout_msec)
 {
-	assert(ch >= 0 && ch < CH_COUNT);
+	assert(bus >= 0 && bus < CH_COUNT);
 
-	long Txid;
-	unsigned char data[8];
 	canStatus ret;
 
-	Txid = ((unsigned long)ID_CMD_AHRS_SET<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	data[0] = (unsigned char)rate;
-	data[1] = (unsigned char)mask;
-	ret = canWrite(hCAN[ch], Txid, data, 2, STD);
-
-	return 0;
+	ret = canReadSync(hCAN[bus], (timeout_msec < 0 ? 0xFFFFFFFF : (unsigned long)timeout_msec));
+	if (ret == canERR_TIMEOUT)
+		return 1;
+	return (ret == canOK ? 0 : ret);
 }
 
-int write_current(int ch, int findex, short* pwm)
+static int kvaserWaitTx(int bus, int timeout_msec)
 {
-	assert(ch >= 0 && ch < CH_COUNT);
+	assert(bus >= 0 && bus < CH_COUNT);
 
-	long Txid;
-	unsigned char data[8];
 	canStatus ret;
 
-	if (findex >= 0 && findex < 4)
-	{
-		data[0] = (unsigned char)( (pwm[0] >> 8) & 0x00ff);
-		data[1] = (unsigned char)(pwm[0] & 0x00ff);
-
-		data[2] = (unsigned char)( (pwm[1] >> 8) & 0x00ff);
-		data[3] = (unsigned char)(pwm[1] & 0x00ff);
-
-		data[4] = (unsigned char)( (pwm[2] >> 8) & 0x00ff);
-		data[5] = (unsigned char)(pwm[2] & 0x00ff);
-
-		data[6] = (unsigned char)( (pwm[3] >> 8) & 0x00ff);
-		data[7] = (unsigned char)(pwm[3] & 0x00ff);
-
-		Txid = ((unsigned long)(ID_CMD_SET_TORQUE_1 + findex)<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-		ret = canWrite(hCAN[ch], Txid, data, 8, STD);
-	}
-	else
-		return -1;
-	
-	return 0;
+	ret = canWriteSync(hCAN[bus], (timeout_msec < 0 ? 0xFFFFFFFF : (unsigned long)timeout_msec));
+	if (ret == canERR_TIMEOUT)
+		return 1;
+	return (ret == canOK ? 0 : ret);
 }
 
-int get_message(int ch, char* cmd, char* src, char* des, int* len, unsigned char* data, int blocking)
-{
-	long Rxid;
-	unsigned char rdata[8];
-	unsigned int dlc;
-	unsigned int flag;
-	unsigned long time;
-	canStatus ret;
-
-	memset(rdata, NULL, sizeof(rdata));
-	ret = canRead(hCAN[ch], &Rxid, rdata, &dlc, &flag, &time);
-	if (ret != canOK) return ret;
-	//printf("    %ld+%ld (%d)", Rxid-Rxid%128, Rxid%128, dlc);
-	//for(int nd=0; nd<(int)dlc; nd++) printf(" %3d ", rdata[nd]);
-	//printf("\n");
-
-	*cmd = (char)( (Rxid >> 6) & 0x1f );
-	*des = (char)( (Rxid >> 3) & 0x07 );
-	*src = (char)( Rxid & 0x07);
-	*len = (int)dlc;
-	for(int nd=0; nd<(int)dlc; nd++) data[nd] = rdata[nd];
-
-	return 0;
-}
+const CanTransport canTransportKvaser = {
+	"Kvaser",
+	1,
+	kvaserOpen,
+	kvaserClose,
+	kvaserReset,
+	kvaserSendBatch,
+	kvaserRecvBatch,
+	kvaserWait,
+	kvaserWaitTx,
+	NULL
+};
 
 
 
@@ -0,0 +1,470 @@
+/*======================*/
+/*       Includes       */
+/*======================*/
+//system headers
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#ifdef _WIN32
+#include "windows.h"
+#else
+#include <sched.h>
+#include <unistd.h>
+#endif
+//project headers
+#include "canDef.h"
+#include "canAPI.h"
+#include "canTransport.h"
+#include "canCodec.h"
+#include "Loopback/canLoopback.h"
+#include "HandSimulator.h"
+#include "HighResTimer.h"
+#include "SeqLock.h"
+
+
+CANAPI_BEGIN
+
+/*=====================*/
+/*       Defines       */
+/*=====================*/
+//constants
+#define CH_COUNT			MAX_BUS // number of CAN channels
+#define RING_SIZE			(256) // frames per direction, power of two
+#define TORQUE_WAIT_MAX		(0.1) // sec of wall-clock time the clock waits for the host's torques
+#define HOLD_NONE			(1e30) // hold time while can_loopback_run_until() is not used
+//macros
+#ifdef _WIN32
+#define RING_BARRIER()			MemoryBarrier()
+#define RING_CAS(p, o, n)		(InterlockedCompareExchange((volatile LONG*)(p), (LONG)(n), (LONG)(o)) == (LONG)(o))
+#define YIELD()					Sleep(0)
+#define IDLE()					Sleep(1)
+#else
+#define RING_BARRIER()			__sync_synchronize()
+#define RING_CAS(p, o, n)		__sync_bool_compare_and_swap((p), (o), (n))
+#define YIELD()					sched_yield()
+#define IDLE()					usleep(1000)
+#endif
+//typedefs & structs
+
+// Bounded multi-producer/multi-consumer frame queue (D. Vyukov). Each cell
+// carries a sequence number, so producers and the consumer never take a lock.
+typedef struct tagRingCell
+{
+	volatile unsigned int seq;
+	can_msg msg;
+	double stamp; // virtual time the frame was put on the bus
+} RingCell;
+
+class FrameRing
+{
+public:
+	void Reset()
+	{
+		for (unsigned int i = 0; i < RING_SIZE; i++)
+			m_cell[i].seq = i;
+		m_head = 0;
+		m_tail = 0;
+	}
+
+	bool Push(const can_msg& msg, double stamp)
+	{
+		RingCell* cell;
+		unsigned int pos = m_head;
+		for (;;)
+		{
+			cell = &m_cell[pos & (RING_SIZE-1)];
+			unsigned int seq = cell->seq;
+			RING_BARRIER();
+			int dif = (int)(seq - pos);
+			if (dif == 0)
+			{
+				if (RING_CAS(&m_head, pos, pos+1))
+					break;
+			}
+			else if (dif < 0)
+				return false; // full
+			pos = m_head;
+		}
+		cell->msg = msg;
+		cell->stamp = stamp;
+		RING_BARRIER();
+		cell->seq = pos + 1;
+		return true;
+	}
+
+	// Only exact for the consumer thread.
+	bool Empty() const
+	{
+		unsigned int pos = m_tail;
+		return (int)(m_cell[pos & (RING_SIZE-1)].seq - (pos+1)) < 0;
+	}
+
+	bool Pop(can_msg& msg, double& stamp)
+	{
+		RingCell* cell;
+		unsigned int pos = m_tail;
+		for (;;)
+		{
+			cell = &m_cell[pos & (RING_SIZE-1)];
+			unsigned int seq = cell->seq;
+			RING_BARRIER();
+			int dif = (int)(seq - (pos+1));
+			if (dif == 0)
+			{
+				if (RING_CAS(&m_tail, pos, pos+1))
+					break;
+			}
+			else if (dif < 0)
+				return false; // empty
+			pos = m_tail;
+		}
+		msg = cell->msg;
+		stamp = cell->stamp;
+		RING_BARRIER();
+		cell->seq = pos + RING_SIZE;
+		return true;
+	}
+
+private:
+	RingCell m_cell[RING_SIZE];
+	volatile unsigned int m_head;
+	volatile unsigned int m_tail;
+};
+
+typedef struct tagLoopbackChannel
+{
+	bool opened;
+	FrameRing toHand; // written by any host thread, read by the receiving thread
+	FrameRing toHost; // both ends in the receiving thread, which also runs the hand
+
+	// The hand and its clock belong to the thread that calls get_message_wait().
+	HandSimulator sim;
+	double now;            // virtual time (sec)
+	double realBase;       // wall-clock time of virtual time 0 in real-time mode
+	unsigned int torqueExpected; // sim.torqueFrames once the host answered the last set
+	double torqueWaitStart;      // wall-clock time the wait for those torques began
+	bool setIncomplete;    // frames of the last set were dropped, the host waits for its deadline
+	unsigned int setCount;
+
+	// shared with the other threads
+	SeqLock<double> clock;  // now, for can_loopback_time()
+	SeqLock<double> hold;   // the clock does not move past this time
+	volatile bool held;     // the clock reached hold and the host is idle
+	volatile bool realtime;
+	volatile int dropBoard;
+	volatile int dropEvery;
+} LoopbackChannel;
+
+/*=========================================*/
+/*       Global file-scope variables       */
+/*=========================================*/
+
+static LoopbackChannel canDev[CH_COUNT];
+
+/*========================================*/
+/*       Private functions                */
+/*========================================*/
+static int initCAN(int bus){
+	LoopbackChannel* dev = &canDev[bus];
+
+	dev->toHand.Reset();
+	dev->toHost.Reset();
+	HandSimInit(&dev->sim, 3);
+	dev->now = 0.0;
+	dev->realBase = GetHighResTime();
+	dev->torqueExpected = 0;
+	dev->torqueWaitStart = 0.0;
+	dev->setIncomplete = false;
+	dev->setCount = 0;
+	dev->clock.Write(0.0);
+	dev->hold.Write(HOLD_NONE);
+	dev->held = false;
+	dev->realtime = true;
+	dev->dropBoard = 0;
+	dev->dropEvery = 0;
+	dev->opened = true;
+	return 0;
+}
+
+static int freeCAN(int bus){
+	canDev[bus].opened = false;
+	return 0;
+}
+
+// Hands the host's frames to the simulated hand at the current virtual time.
+static void deliverToHand(LoopbackChannel* dev)
+{
+	can_msg msg;
+	double stamp;
+
+	while (dev->toHand.Pop(msg, stamp))
+		HandSimReceive(&dev->sim, &msg, dev->now);
+}
+
+// Moves the clock to t and queues the frames the hand sends by then.
+static void advanceClock(LoopbackChannel* dev, double t)
+{
+	can_msg out[32];
+	int encoders = 0;
+	int dropped = 0;
+	int n, i, board;
+
+	dev->held = false;
+	RING_BARRIER();
+	dev->now = t;
+	dev->clock.Write(t);
+
+	n = HandSimStep(&dev->sim, t, out, sizeof(out)/sizeof(out[0]));
+	for (i = 0; i < n; i++)
+	{
+		if (can_id_cmd(out[i].msg_id) == ID_CMD_QUERY_CONTROL_DATA)
+		{
+			board = (int)can_id_src(out[i].msg_id) - ID_DEVICE_SUB_01;
+			if (board == 0)
+				dev->setCount++;
+			encoders++;
+			if (dev->dropEvery > 0 && (dev->setCount % dev->dropEvery) == 0 &&
+				(dev->dropBoard < 0 || dev->dropBoard == board))
+			{
+				dropped++;
+				continue;
+			}
+		}
+		dev->toHost.Push(out[i], t);
+	}
+
+	if (encoders > 0)
+	{
+		// a set went out: the clock waits for the host's four torque frames
+		dev->torqueExpected = dev->sim.torqueFrames + 4;
+		dev->torqueWaitStart = GetHighResTime();
+		dev->setIncomplete = (dropped > 0);
+	}
+}
+
+/*========================================*/
+/*       Transport                        */
+/*========================================*/
+static int loopbackOpen(int bus, int type, int index)
+{
+	assert(bus >= 0 && bus < CH_COUNT);
+
+	printf("<< CAN: Open Channel...\n");
+	initCAN(bus);
+	printf("\t- Ch.%2d loopback (OK)\n", bus);
+	printf("\t- Done\n");
+	return 0;
+}
+
+static int loopbackClose(int bus)
+{
+	assert(bus >= 0 && bus < CH_COUNT);
+
+	printf("<< CAN: Close...\n");
+	freeCAN(bus);
+	printf("\t- Done\n");
+	return 0;
+}
+
+static int loopbackSendBatch(int bus, const can_msg* msg, int count)
+{
+	assert(bus >= 0 && bus < CH_COUNT);
+
+	LoopbackChannel* dev = &canDev[bus];
+	int i;
+
+	if (!dev->opened)
+		return -1;
+
+	for (i = 0; i < count; i++)
+	{
+		if (!dev->toHand.Push(msg[i], 0.0))
+			return 1;
+	}
+	return 0;
+}
+
+static int loopbackRecvBatch(int bus, can_msg* msg, double* timestamp, int maxCount)
+{
+	assert(bus >= 0 && bus < CH_COUNT);
+
+	LoopbackChannel* dev = &canDev[bus];
+	int n;
+
+	if (!dev->opened)
+		return -1;
+
+	deliverToHand(dev);
+	for (n = 0; n < maxCount; n++)
+	{
+		if (!dev->toHost.Pop(msg[n], timestamp[n]))
+			break;
+	}
+	return n;
+}
+
+// Runs the hand and its clock until it has frames for the host.
+static int loopbackWait(int bus, int timeout_msec)
+{
+	assert(bus >= 0 && bus < CH_COUNT);
+
+	LoopbackChannel* dev = &canDev[bus];
+	double realEnd = GetHighResTime() + (timeout_msec < 0 ? 1e30 : timeout_msec*1e-3);
+	double next, hold, wake;
+	bool hostBusy;
+
+	if (!dev->opened)
+		return -1;
+
+	for (;;)
+	{
+		deliverToHand(dev);
+
+		if (!dev->toHost.Empty())
+			return 0;
+
+		// nothing to deliver, see whether the clock may move on
+		next = HandSimNextEvent(&dev->sim);
+		dev->hold.Read(hold);
+		hostBusy = (dev->sim.torqueFrames < dev->torqueExpected);
+		if (hostBusy && GetHighResTime() - dev->torqueWaitStart > TORQUE_WAIT_MAX)
+		{
+			dev->torqueExpected = dev->sim.torqueFrames; // the host skipped this set
+			hostBusy = false;
+		}
+
+		if (hostBusy && dev->setIncomplete && timeout_msec > 0)
+		{
+			// the host waits for the deadline of an incomplete set: let its timeout pass in virtual time,
+			// unless another frame (AHRS) comes first and wakes the host earlier
+			wake = dev->now + timeout_msec*1e-3;
+			if (next >= 0.0 && next < wake) wake = next;
+			if (wake > hold) wake = hold;
+			if (wake >= dev->now + timeout_msec*1e-3)
+				dev->setIncomplete = false;
+			if (wake > dev->now)
+				advanceClock(dev, wake);
+			return 1;
+		}
+
+		// the next frame, or the hold time if that comes first
+		if (next < 0.0 || next > hold)
+			next = (hold < HOLD_NONE && dev->now < hold ? hold : -1.0);
+
+		if (!hostBusy && next >= 0.0)
+		{
+			if (dev->realtime)
+			{
+				wake = dev->realBase + next;
+				if (wake > realEnd)
+				{
+					DelayMicroseconds((realEnd - GetHighResTime())*1e6);
+					return 1;
+				}
+				DelayMicroseconds((wake - GetHighResTime())*1e6);
+			}
+			advanceClock(dev, (next > dev->now ? next : dev->now));
+			continue;
+		}
+
+		if (!hostBusy && dev->now >= hold - 1e-9)
+			dev->held = true;
+
+		if (GetHighResTime() >= realEnd)
+			return 1;
+		if (next < 0.0 || dev->held)
+			IDLE(); // nothing scheduled on the bus
+		else
+			YIELD(); // the host is computing the torques
+	}
+}
+
+static int loopbackWaitTx(int bus, int timeout_msec)
+{
+	return 0; // frames are on the "bus" as soon as they are in the ring
+}
+
+/*========================================*/
+/*       Loopback control (canLoopback.h) */
+/*========================================*/
+double can_loopback_time(int ch)
+{
+	assert(ch >= 0 && ch < CH_COUNT);
+
+	double t;
+	canDev[ch].clock.Read(t);
+	return t;
+}
+
+void can_loopback_realtime(int ch, bool realtime)
+{
+	assert(ch >= 0 && ch < CH_COUNT);
+
+	LoopbackChannel* dev = &canDev[ch];
+	// keep the current virtual time when switching back to wall-clock pacing
+	dev->realBase = GetHighResTime() - can_loopback_time(ch);
+	dev->realtime = realtime;
+}
+
+bool can_loopback_run_until(int ch, double t, int timeout_msec)
+{
+	assert(ch >= 0 && ch < CH_COUNT);
+
+	LoopbackChannel* dev = &canDev[ch];
+	double end = GetHighResTime() + timeout_msec*1e-3;
+	double hold;
+
+	dev->hold.Read(hold);
+	if (hold != t)
+		can_loopback_release(ch, t);
+	for (;;)
+	{
+		RING_BARRIER();
+		if (dev->held && can_loopback_time(ch) >= t - 1e-9)
+			return true;
+		if (GetHighResTime() >= end)
+			return false;
+		YIELD();
+	}
+}
+
+void can_loopback_release(int ch, double t)
+{
+	assert(ch >= 0 && ch < CH_COUNT);
+
+	LoopbackChannel* dev = &canDev[ch];
+	dev->held = false;
+	dev->hold.Write(t);
+}
+
+void can_loopback_drop(int ch, int board, int every)
+{
+	assert(ch >= 0 && ch < CH_COUNT);
+
+	canDev[ch].dropBoard = board;
+	canDev[ch].dropEvery = every;
+}
+
+const HandSimulator* can_loopback_hand(int ch)
+{
+	assert(ch >= 0 && ch < CH_COUNT);
+
+	return &canDev[ch].sim;
+}
+
+const CanTransport canTransportLoopback = {
+	"Loopback",
+	0,
+	loopbackOpen,
+	loopbackClose,
+	NULL,
+	loopbackSendBatch,
+	loopbackRecvBatch,
+	loopbackWait,
+	loopbackWaitTx,
+	can_loopback_time
+};
+
+
+
+CANAPI_END
@@ -19,18 +19,12 @@ extern "C" {
 }
 #include "canDef.h"
 #include "canAPI.h"
+#include "canTransport.h"
 
 CANAPI_BEGIN
 
 
-#define CH_COUNT			(int)1 // number of CAN channels
-
-
-int hd[CH_COUNT], ret_c;
-long id;
-unsigned char sdata[8], rdata[8];
-unsigned int dlc, flags;
-unsigned long timestamp;
+#define CH_COUNT			MAX_BUS // number of CAN channels
 
 
 #define canMSG_MASK             0x00ff      // Used to mask the non-info bits
@@ -47,24 +41,12 @@ unsigned long timestamp;
 
 //#define _DUMP_RXFRAME (1)
 
-/* NI-CAN Status    */
-NCTYPE_STATUS Status=0; 
-
-/* NI-CAN handles */
-NCTYPE_OBJH TxHandle=0;
-
-/* NI-CAN Frame Type for Write Object */ 
-NCTYPE_CAN_DATA	Transmit;
-
-/* NI-CAN Frame Type for Write Object */ 
-NCTYPE_CAN_FRAME TxFrame;
-
-/* NI-CAN Frame Type for Read Object */ 
-NCTYPE_CAN_STRUCT RxFrame;
+/* NI-CAN handles, one Network Interface Object per channel */
+static NCTYPE_OBJH TxHandle[CH_COUNT];
 
 /* This function converts the absolute time obtained from ncReadMult into a
    string. */
-void AbsTimeToString(NCTYPE_ABS_TIME *time, char *TimeString)
+static void AbsTimeToString(NCTYPE_ABS_TIME *time, char *TimeString)
 {
 
    SYSTEMTIME	stime;
@@ -78,7 +60,7 @@ void AbsTimeToString(NCTYPE_ABS_TIME *time, char *TimeString)
 }
 
 /* Print a description of an NI-CAN error/warning. */
-void PrintStat(NCTYPE_STATUS Status, char *source) 
+static void PrintStat(int bus, NCTYPE_STATUS Status, char *source) 
 {
 	char StatusString[1024];
      
@@ -89,144 +71,52 @@ void PrintStat(NCTYPE_STATUS Status, char *source)
 
 		// On error, close object handle.
 		printf("<< CAN: Close\n");
-		ncCloseObject(TxHandle);
-		TxHandle = 0;
-		hd[0] = TxHandle;
-		//hd[1] = TxHandle;
+		ncCloseObject(TxHandle[bus]);
+		TxHandle[bus] = 0;
 		//exit(1);
 	}
 }
 
 /* Print read frame */
-void PrintRxFrame()
+static void PrintRxFrame(NCTYPE_CAN_STRUCT* RxFrame)
 {
 	char output[15];
 	char CharBuff[50];
-	AbsTimeToString(&RxFrame.Timestamp, &output[0]);
+	AbsTimeToString(&RxFrame->Timestamp, &output[0]);
 	printf("%s     ", output);
-	sprintf (&CharBuff[0], "%8.8X", RxFrame.ArbitrationId);
+	sprintf (&CharBuff[0], "%8.8X", RxFrame->ArbitrationId);
 	printf("%s     ", CharBuff);
 	sprintf (&CharBuff[0], "%s","CAN Data Frame");
 	printf("%s     ", CharBuff); 
-	sprintf (&CharBuff[0], "%1d", RxFrame.DataLength);
+	sprintf (&CharBuff[0], "%1d", RxFrame->DataLength);
 	printf("%s     ", CharBuff); 
-	for (int j=0; j<RxFrame.DataLength; j++)
+	for (int j=0; j<RxFrame->DataLength; j++)
 	{
-		sprintf (CharBuff, " %02X", RxFrame.Data[j]);
+		sprintf (CharBuff, " %02X", RxFrame->Data[j]);
 		printf("%s", CharBuff); 
 	}
 	printf("\n");
 }
 
-int canWrite(int handle,
-			 long id, 
-			 void * msg,
-			 unsigned int dlc,
-			 unsigned int /*flag*/)
-{
-	if (!handle)
-		return -1;
-
-	TxFrame.IsRemote = NC_FRMTYPE_DATA;
-	TxFrame.ArbitrationId = id;
-	TxFrame.DataLength = dlc;
-	for (int i=0; i<dlc; i++)
-		TxFrame.Data[i] = ((NCTYPE_UINT8_P)msg)[i];
-	Status = ncWrite(handle, sizeof(NCTYPE_CAN_FRAME), &TxFrame);
-	if (Status < 0)
-	{
-		PrintStat(Status, "ncWrite");
-		return Status;
-	}
-	return Status;
-}
-
-int canRead(int handle,
-			long * id,
-			void * msg,
-			unsigned int * dlc,
-			unsigned int * /*flag*/,
-			unsigned long * time)
-{
-	if (!handle)
-		return -1;
-
-	memset(&RxFrame, 0, sizeof(NCTYPE_CAN_FRAME));
-	//RxFrame.FrameType = NC_FRMTYPE_DATA;
-	RxFrame.DataLength = *dlc;
-	Status = ncRead(handle, sizeof(NCTYPE_CAN_STRUCT), &RxFrame);
-	if (Status < 0 || NC_FRMTYPE_DATA != RxFrame.FrameType)
-	{
-		PrintStat(Status, "ncRead");
-		return Status;
-	}
-	else if (Status == CanWarnOldData)
-	{
-		(*dlc) = 0;
-		return Status;
-	}
-
-	(*id) = RxFrame.ArbitrationId;
-	//(*time) = (FILETIME)(RxFrame.Timestamp);
-	(*dlc) = RxFrame.DataLength;
-	for (int i=0; i<RxFrame.DataLength; i++)
-		((NCTYPE_UINT8_P)msg)[i] = RxFrame.Data[i];
-#ifdef _DUMP_RXFRAME
-	PrintRxFrame();
-#endif
-	return Status;
-}
-
-int canReadWait(int handle,
-				long * id,
-				void * msg,
-				unsigned int * dlc,
-				unsigned int * /*flag*/,
-				unsigned long * time,
-				unsigned long timeout)
-{
-	if (!handle)
-		return -1;
-
-	NCTYPE_STATE currentState;
-	Status = ncWaitForState(handle, NC_ST_READ_AVAIL, timeout, &currentState);
-	if (Status < 0)
-	{
-		PrintStat(Status, "ncWaitForState");
-		return Status;
-	}
 
-	memset(&RxFrame, 0, sizeof(NCTYPE_CAN_FRAME));
-	RxFrame.FrameType = NC_FRMTYPE_DATA;
-	RxFrame.DataLength = *dlc;
-	Status = ncRead(handle, sizeof(NCTYPE_CAN_STRUCT), &RxFrame);
-	if (Status < 0)
-	{
-		PrintStat(Status, "ncRead");
-		return Status;
-	}
-
-	(*id) = RxFrame.ArbitrationId;
-	//(*time) = (FILETIME)(RxFrame.Timestamp);
-	(*dlc) = RxFrame.DataLength;
-	for (int i=0; i<RxFrame.DataLength; i++)
-		((NCTYPE_UINT8_P)msg)[i] = RxFrame.Data[i];
-#ifdef _DUMP_RXFRAME
-	PrintRxFrame();
-#endif
-	return Status;
-}
-
-
-int command_can_open(int ch)
+static int niOpen(int bus, int type, int index)
 {
+	NCTYPE_STATUS		Status;
 	NCTYPE_ATTRID		AttrIdList[8];
 	NCTYPE_UINT32		AttrValueList[8];
 	//NCTYPE_UINT32		Baudrate = 125000;  // BAUD_125K
 	NCTYPE_UINT32		Baudrate = NC_BAUD_1000K;
 	char				Interface[15];
 	
-	sprintf_s(Interface, "CAN%d", ch);
+	assert(bus >= 0 && bus < CH_COUNT);
+
+	if (TxHandle[bus])
+	{
+		printf("<< CAN: channel %d is already open\n", bus);
+		return -1;
+	}
+
+	sprintf_s(Interface, "CAN%d", (type == CAN_OPEN_DEFAULT ? bus : index));
 	
 	// Configure the CAN Network Interface Object	
 	AttrIdList[0] =     NC_ATTR_BAUD_RATE;   
@@ -251,212 +141,199 @@ int command_can_open(int ch)
 	Status = ncConfig(Interface, 2, AttrIdList, AttrValueList);
 	if (Status < 0) 
 	{
-		PrintStat(Status, "ncConfig");
+		PrintStat(bus, Status, "ncConfig");
 		return Status;
 	}
 	printf("   - Done\n");
     
 	// open the CAN Network Interface Object
 	printf("<< CAN: Open Channel\n");
-	Status = ncOpenObject (Interface, &TxHandle);
+	Status = ncOpenObject (Interface, &TxHandle[bus]);
 	if (Status < 0) 
 	{
-		PrintStat(Status, "ncOpenObject");
+		PrintStat(bus, Status, "ncOpenObject");
 		return Status;
 	}
-	hd[0] = TxHandle;
-	//hd[1] = TxHandle;
 	printf("   - Done\n");
-	return 1;
+	return 0;
 }
 
-int command_can_open_ex(int ch, int type, int index)
+static int niReset(int bus)
 {
-	return command_can_open(ch);
-}
+	assert(bus >= 0 && bus < CH_COUNT);
+
+	NCTYPE_STATUS Status;
 
-int command_can_reset(int ch)
-{
 	printf("<< CAN: Reset Bus\n");
 
 	// stop the CAN Network
-	Status = ncAction(TxHandle, NC_OP_STOP, 0);
+	Status = ncAction(TxHandle[bus], NC_OP_STOP, 0);
 	if (Status < 0) 
 	{
-		PrintStat(Status, "ncAction(NC_OP_STOP)");
+		PrintStat(bus, Status, "ncAction(NC_OP_STOP)");
 		return Status;
 	}
 	// start the CAN Network
-	Status = ncAction(TxHandle, NC_OP_START, 0);
+	Status = ncAction(TxHandle[bus], NC_OP_START, 0);
 	if (Status < 0) 
 	{
-		PrintStat(Status, "ncAction(NC_OP_START)");
+		PrintStat(bus, Status, "ncAction(NC_OP_START)");
 		return Status;
 	}
 
-	/*while (true)
-	{
-		memset(rdata, NULL, sizeof(rdata));
-		Status = canRead(TxHandle, &id, rdata, &dlc, &flags, &timestamp);
-		if (Status != 0) break;
-		printf("    %ld+%ld (%d)", id-id%128, id%128, dlc);
-		for(int nd=0; nd<(int)dlc; nd++) printf(" %3d ", rdata[nd]);
-		printf("\n");
-	}*/
-
-	/*int nc;
-
-	printf("<< CAN: Reset Bus\n");
-	for(nc=0; nc<CH_COUNT; nc++) {
-		ret_c = canResetBus(hd[nc]);
-		if (ret_c < 0) return ret_c;
-		printf("    Ch.%2d (OK)\n", nc, ret_c);
-	}*/
 	printf("   - Done\n");
 	Sleep(200);
-	return 1;
+	return 0;
 }
 
-int command_can_close(int ch)
+static int niClose(int bus)
 {
-	if (!TxHandle)
+	assert(bus >= 0 && bus < CH_COUNT);
+
+	NCTYPE_STATUS Status;
+
+	if (!TxHandle[bus])
 		return 0;
 
 	printf("<< CAN: Close\n");
-	Status = ncCloseObject(TxHandle);    
+	Status = ncCloseObject(TxHandle[bus]);    
 	if (Status < 0)
 	{
-		PrintStat(Status, "ncCloseObject");
+		PrintStat(bus, Status, "ncCloseObject");
 		return Status;
 	}
-	TxHandle = 0;
-	hd[0] = TxHandle;
-	//hd[1] = TxHandle;
+	TxHandle[bus] = 0;
 	printf("   - Done\n");
-	return 1;
-}
-
-int command_can_query_id(int ch)
-{
-	long Txid;
-	unsigned char data[8];
-
-	Txid = ((unsigned long)ID_CMD_QUERY_ID<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(TxHandle, Txid, data, 0, STD);
-
 	return 0;
 }
 
-int command_can_sys_init(int ch, int period_msec)
+static int niSendBatch(int bus, const can_msg* msg, int count)
 {
-	long Txid;
-	unsigned char data[8];
-
-	Txid = ((unsigned long)ID_CMD_SET_PERIOD<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	data[0] = (unsigned char)period_msec;
-	canWrite(TxHandle, Txid, data, 1, STD);
-
-	Sleep(10);
+	assert(bus >= 0 && bus < CH_COUNT);
+	assert(count <= TX_QUEUE_SIZE);
 
-	Txid = ((unsigned long)ID_CMD_SET_MODE_TASK<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(TxHandle, Txid, data, 0, STD);
+	NCTYPE_STATUS Status;
+	NCTYPE_CAN_STRUCT TxFrames[TX_QUEUE_SIZE];
+	int i, j;
 
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_QUERY_STATE_DATA<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(TxHandle, Txid, data, 0, STD);
+	if (!TxHandle[bus])
+		return -1;
 
+	for (i = 0; i < count; i++)
+	{
+		TxFrames[i].Timestamp.LowPart = 0; // transmit immediately
+		TxFrames[i].Timestamp.HighPart = 0;
+		TxFrames[i].ArbitrationId = (msg[i].STD_EXT == EXT ? (msg[i].msg_id | NC_FL_CAN_ARBID_XTD) : msg[i].msg_id);
+		TxFrames[i].FrameType = NC_FRMTYPE_DATA;
+		TxFrames[i].DataLength = msg[i].data_length;
+		for (j = 0; j < msg[i].data_length; j++)
+			TxFrames[i].Data[j] = (NCTYPE_UINT8)msg[i].data[j];
+	}
+	Status = ncWriteMult(TxHandle[bus], sizeof(NCTYPE_CAN_STRUCT)*count, TxFrames);
+	if (Status < 0)
+	{
+		PrintStat(bus, Status, "ncWriteMult");
+		return Status;
+	}
 	return 0;
 }
 
-int command_can_start(int ch)
+static int niRecvBatch(int bus, can_msg* msg, double* timestamp, int maxCount)
 {
-	long Txid;
-	unsigned char data[8];
-
-	Txid = ((unsigned long)ID_CMD_QUERY_STATE_DATA<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(TxHandle, Txid, data, 0, STD);
-
-	Sleep(10);
+	NCTYPE_STATUS Status;
+	NCTYPE_CAN_STRUCT RxFrames[RX_QUEUE_SIZE];
+	NCTYPE_UINT32 ActualDataSize = 0;
+	int count, n, i, j;
 
-	Txid = ((unsigned long)ID_CMD_SET_SYSTEM_ON<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(TxHandle, Txid, data, 0, STD);
+	assert(bus >= 0 && bus < CH_COUNT);
 
-	return 0;
-}
-
-int command_can_stop(int ch)
-{
-	long Txid;
-	unsigned char data[8];
+	if (!TxHandle[bus])
+		return -1;
 
-	Txid = ((unsigned long)ID_CMD_SET_SYSTEM_OFF<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(TxHandle, Txid, data, 0, STD);
+	// ncReadMult() returns every frame queued (up to the buffer) without blocking.
+	count = (maxCount < RX_QUEUE_SIZE ? maxCount : RX_QUEUE_SIZE);
+	Status = ncReadMult(TxHandle[bus], sizeof(NCTYPE_CAN_STRUCT)*count, RxFrames, &ActualDataSize);
+	if (Status < 0)
+	{
+		PrintStat(bus, Status, "ncReadMult");
+		return Status;
+	}
 
-	return 0;
+	count = ActualDataSize / sizeof(NCTYPE_CAN_STRUCT);
+	for (i = 0, n = 0; i < count; i++)
+	{
+		if (NC_FRMTYPE_DATA != RxFrames[i].FrameType)
+			continue;
+		msg[n].STD_EXT = ((RxFrames[i].ArbitrationId & NC_FL_CAN_ARBID_XTD) ? EXT : STD);
+		msg[n].msg_id = RxFrames[i].ArbitrationId & ~NC_FL_CAN_ARBID_XTD;
+		msg[n].data_length = RxFrames[i].DataLength;
+		for (j = 0; j < RxFrames[i].DataLength; j++)
+			msg[n].data[j] = RxFrames[i].Data[j];
+		// NCTYPE_ABS_TIME counts 100 nsec units (FILETIME)
+		timestamp[n] = ((double)RxFrames[i].Timestamp.HighPart * 4294967296.0 + (double)RxFrames[i].Timestamp.LowPart) * 1e-7;
+#ifdef _DUMP_RXFRAME
+		PrintRxFrame(&RxFrames[i]);
+#endif
+		n++;
+	}
+	return n;
 }
 
-int command_can_AHRS_set(int ch, unsigned char rate, unsigned char mask)
+static int niWait(int bus, int timeout_msec)
 {
-	long Txid;
-	unsigned char data[8];
-
-	Txid = ((unsigned long)ID_CMD_AHRS_SET<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	data[0] = (unsigned char)rate;
-	data[1] = (unsigned char)mask;
-	canWrite(TxHandle, Txid, data, 2, STD);
+	NCTYPE_STATUS Status;
+	NCTYPE_STATE currentState;
 
-	return 0;
-}
+	assert(bus >= 0 && bus < CH_COUNT);
 
-int write_current(int ch, int findex, short* pwm)
-{
-	long Txid;
-	unsigned char data[8];
+	if (!TxHandle[bus])
+		return -1;
 
-	if (findex >= 0 && findex < 4)
+	Status = ncWaitForState(TxHandle[bus], NC_ST_READ_AVAIL, (timeout_msec < 0 ? NC_DURATION_INFINITE : (unsigned long)timeout_msec), &currentState);
+	if (Status == CanErrFunctionTimeout)
+		return 1; // nothing received, the object stays open
+	if (Status < 0)
 	{
-		data[0] = (unsigned char)( (pwm[0] >> 8) & 0x00ff);
-		data[1] = (unsigned char)(pwm[0] & 0x00ff);
-
-		data[2] = (unsigned char)( (pwm[1] >> 8) & 0x00ff);
-		data[3] = (unsigned char)(pwm[1] & 0x00ff);
-
-		data[4] = (unsigned char)( (pwm[2] >> 8) & 0x00ff);
-		data[5] = (unsigned char)(pwm[2] & 0x00ff);
-
-		data[6] = (unsigned char)( (pwm[3] >> 8) & 0x00ff);
-		data[7] = (unsigned char)(pwm[3] & 0x00ff);
-
-		Txid = ((unsigned long)(ID_CMD_SET_TORQUE_1 + findex)<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-		canWrite(TxHandle, Txid, data, 8, STD);
+		PrintStat(bus, Status, "ncWaitForState");
+		return Status;
 	}
-	else
-		return -1;
-	
 	return 0;
 }
 
-int get_message(int ch, char* cmd, char* src, char* des, int* len, unsigned char* data, int blocking)
+static int niWaitTx(int bus, int timeout_msec)
 {
-	long id;
+	NCTYPE_STATUS Status;
+	NCTYPE_STATE currentState;
 
-	memset(rdata, NULL, sizeof(rdata));
-	Status = canRead(TxHandle, &id, rdata, &dlc, &flags, &timestamp);
-	if (Status != 0) return Status;
-	//printf("    %ld+%ld (%d)", id-id%128, id%128, dlc);
-	//for(int nd=0; nd<(int)dlc; nd++) printf(" %3d ", rdata[nd]);
-	//printf("\n");
+	assert(bus >= 0 && bus < CH_COUNT);
 
-	*cmd = (char)( (id >> 6) & 0x1f );
-	*des = (char)( (id >> 3) & 0x07 );
-	*src = (char)( id & 0x07);
-	*len = (int)dlc;
-	for(int nd=0; nd<(int)dlc; nd++) data[nd] = rdata[nd];
+	if (!TxHandle[bus])
+		return -1;
 
+	Status = ncWaitForState(TxHandle[bus], NC_ST_WRITE_SUCCESS, (timeout_msec < 0 ? NC_DURATION_INFINITE : (unsigned long)timeout_msec), &currentState);
+	if (Status == CanErrFunctionTimeout)
+		return 1;
+	if (Status < 0)
+	{
+		PrintStat(bus, Status, "ncWaitForState");
+		return Status;
+	}
 	return 0;
 }
 
+const CanTransport canTransportNI = {
+	"NI",
+	0, // CAN0
+	niOpen,
+	niClose,
+	niReset,
+	niSendBatch,
+	niRecvBatch,
+	niWait,
+	niWaitTx,
+	NULL
+};
+
 
 
 CANAPI_END
@@ -22,6 +22,7 @@ extern "C" {
 }
 #include "canDef.h"
 #include "canAPI.h"
+#include "canTransport.h"
 
 
 CANAPI_BEGIN
@@ -45,7 +46,7 @@ typedef unsigned long DWORD;
 /*       Global file-scope variables       */
 /*=========================================*/
 
-TPCANHandle canDev[MAX_BUS] = {
+static TPCANHandle canDev[MAX_BUS] = {
 	PCAN_NONEBUS, // Undefined/default value for a PCAN bus
 
 	PCAN_ISABUS1, // PCAN-ISA interface, channel 1
@@ -81,17 +82,13 @@ TPCANHandle canDev[MAX_BUS] = {
 	PCAN_PCCBUS2, // PCAN-PC Card interface, channel 2
 };
 
+static HANDLE rxEvent[MAX_BUS] = { NULL, }; // signaled by the driver when frames arrive
 
-/*==========================================*/
-/*       Private functions prototypes       */
-/*==========================================*/
-int canReadMsg(int bus, int *id, int *len, unsigned char *data, int blocking);
-int canSendMsg(int bus, int id, char len, unsigned char *data, int blocking);
 
 /*========================================*/
-/*       Public functions (CAN API)       */
+/*       Private functions                */
 /*========================================*/
-int initCAN(int bus){
+static int initCAN(int bus){
 	TPCANStatus Status = PCAN_ERROR_OK;
 	char strMsg[256];
 	TPCANBaudrate Baudrate = PCAN_BAUD_1M;
@@ -108,6 +105,17 @@ int initCAN(int bus){
 		return Status;
 	}
 
+	rxEvent[bus] = CreateEvent(NULL, FALSE, FALSE, NULL);
+	Status = CAN_SetValue(canDev[bus], PCAN_RECEIVE_EVENT, &rxEvent[bus], sizeof(rxEvent[bus]));
+	if (Status != PCAN_ERROR_OK)
+	{
+		CAN_GetErrorText(Status, 0, strMsg);
+		printf("initCAN(): CAN_SetValue(PCAN_RECEIVE_EVENT) failed with error %ld\n", Status);
+		printf("%s\n", strMsg);
+		CloseHandle(rxEvent[bus]);
+		rxEvent[bus] = NULL; // fall back to polling
+	}
+
 	//Status = CAN_FilterMessages(
 	//	canDev[bus],
 	//	((unsigned long)(ID_CMD_QUERY_CONTROL_DATA) <<6) | ((unsigned long)ID_DEVICE_MAIN <<3) | ((unsigned long)ID_DEVICE_SUB_01),
@@ -133,7 +141,7 @@ int initCAN(int bus){
 	return 0; // PCAN_ERROR_OK
 }
 
-int freeCAN(int bus){
+static int freeCAN(int bus){
 	TPCANStatus Status = PCAN_ERROR_OK;
 	char strMsg[256];
 
@@ -146,40 +154,16 @@ int freeCAN(int bus){
 		return Status;
 	}
 
-	return 0; // PCAN_ERROR_OK
-}
-
-int canReadMsg(int bus, int *id, int *len, unsigned char *data, int blocking){
-	TPCANMsg CANMsg;
-	TPCANTimestamp CANTimeStamp;
-	TPCANStatus Status = PCAN_ERROR_OK;
-	char strMsg[256];
-	int i;
-
-	// We execute the "Read" function of the PCANBasic                
-	//
-	Status = CAN_Read(canDev[bus], &CANMsg, &CANTimeStamp);
-	
-	if (Status != PCAN_ERROR_OK)
+	if (rxEvent[bus])
 	{
-		if (Status != PCAN_ERROR_QRCVEMPTY)
-		{
-			CAN_GetErrorText(Status, 0, strMsg);
-			printf("canReadMsg(): CAN_Read() failed with error %ld\n", Status);
-			printf("%s\n", strMsg);
-		}
-		return Status;
+		CloseHandle(rxEvent[bus]);
+		rxEvent[bus] = NULL;
 	}
 
-	*id = CANMsg.ID;
-	*len = CANMsg.LEN;
-	for(i = 0; i < CANMsg.LEN; i++)
-		data[i] = CANMsg.DATA[i];
-
-	return 0;
+	return 0; // PCAN_ERROR_OK
 }
 
-int canSendMsg(int bus, int id, char len, unsigned char *data, int blocking){
+static int canSendMsg(int bus, int id, char len, unsigned char *data, int blocking){
 	TPCANMsg CANMsg;
 	TPCANStatus Status = PCAN_ERROR_OK;
 	char strMsg[256];
@@ -204,196 +188,123 @@ int canSendMsg(int bus, int id, char len, unsigned char *data, int blocking){
 }
 
 /*========================================*/
-/*       CAN API                          */
+/*       Transport                        */
 /*========================================*/
-int command_can_open(int ch)
+static int peakOpen(int bus, int type, int index)
 {
-	assert(ch >= 0 && ch < MAX_BUS);
+	assert(bus >= 0 && bus < MAX_BUS);
 
 	DWORD ret;
 
+	// the channel number is the index into canDev[]; type and index are not used.
 	printf("<< CAN: Open Channel...\n");
-	ret = initCAN(ch);
+	ret = initCAN(bus);
 	if (ret != 0) return ret;
-	printf("\t- Ch.%2d (OK)\n", ch);
+	printf("\t- Ch.%2d (OK)\n", bus);
 	printf("\t- Done\n");
 
 	return 0;
 }
 
-int command_can_open_ex(int ch, int type, int index)
+static int peakClose(int bus)
 {
-	return command_can_open(ch);
-}
+	assert(bus >= 0 && bus < MAX_BUS);
 
-int command_can_reset(int ch)
-{
-	return -1;
-}
-
-int command_can_close(int ch)
-{
-	assert(ch >= 0 && ch < MAX_BUS);
+	DWORD ret;
 
-	TPCANStatus Status = PCAN_ERROR_OK;
-	char strMsg[256];
 	printf("<< CAN: Close...\n");
-
-	Status = CAN_Uninitialize(canDev[ch]);
-	if (Status != PCAN_ERROR_OK)
-	{
-		CAN_GetErrorText(Status, 0, strMsg);
-		printf("freeCAN(): CAN_Uninitialize() failed with error %ld\n", Status);
-		printf("%s\n", strMsg);
-		return Status;
-	}
-
+	ret = freeCAN(bus);
+	if (ret != 0) return ret;
 	printf("\t- Done\n");
-	return 0; // PCAN_ERROR_OK
-}
 
-int command_can_query_id(int ch)
-{
-	assert(ch >= 0 && ch < MAX_BUS);
-
-	long Txid;
-	unsigned char data[8];
-	int ret;
-
-	Txid = ((unsigned long)ID_CMD_QUERY_ID<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(ch, Txid, 0, data, TRUE);
-
-	return 0;
-}
-
-int command_can_sys_init(int ch, int period_msec)
-{
-	assert(ch >= 0 && ch < MAX_BUS);
-
-	long Txid;
-	unsigned char data[8];
-	int ret;
-
-	Txid = ((unsigned long)ID_CMD_SET_PERIOD<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	data[0] = (unsigned char)period_msec;
-	ret = canSendMsg(ch, Txid, 1, data, TRUE);
-
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_SET_MODE_TASK<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(ch, Txid, 0, data, TRUE);
-
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_QUERY_STATE_DATA<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(ch, Txid, 0, data, TRUE);
-
-	return 0;
-}
-
-int command_can_start(int ch)
-{
-	assert(ch >= 0 && ch < MAX_BUS);
-
-	long Txid;
-	unsigned char data[8];
-	int ret;
-
-	Txid = ((unsigned long)ID_CMD_QUERY_STATE_DATA<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(ch, Txid, 0, data, TRUE);
-
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_SET_SYSTEM_ON<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(ch, Txid, 0, data, TRUE);
-
-	return 0;
-}
-
-int command_can_stop(int ch)
-{
-	assert(ch >= 0 && ch < MAX_BUS);
-
-	long Txid;
-	unsigned char data[8];
-	int ret;
-
-	Txid = ((unsigned long)ID_CMD_SET_SYSTEM_OFF<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	ret = canSendMsg(ch, Txid, 0, data, TRUE);
-
-	return 0;
+	return 0; // PCAN_ERROR_OK
 }
 
-int command_can_AHRS_set(int ch, unsigned char rate, unsigned char mask)
+static int peakSendBatch(int bus, const can_msg* msg, int count)
 {
-	assert(ch >= 0 && ch < MAX_BUS);
+	assert(bus >= 0 && bus < MAX_BUS);
 
-	long Txid;
-	unsigned char data[8];
 	int ret;
 
-	Txid = ((unsigned long)ID_CMD_AHRS_SET<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	data[0] = (unsigned char)rate;
-	data[1] = (unsigned char)mask;
-	ret = canSendMsg(ch, Txid, 2, data, TRUE);
+	// PCAN-Basic has no multi-frame write; CAN_Write() only queues the frame.
+	for (int i = 0; i < count; i++)
+	{
+		ret = canSendMsg(bus, (int)msg[i].msg_id, msg[i].data_length, (unsigned char*)msg[i].data, TRUE);
+		if (ret != PCAN_ERROR_OK)
+			return ret;
+	}
 
 	return 0;
 }
 
-int write_current(int ch, int findex, short* pwm)
+static int peakRecvBatch(int bus, can_msg* msg, double* timestamp, int maxCount)
 {
-	assert(ch >= 0 && ch < MAX_BUS);
+	assert(bus >= 0 && bus < MAX_BUS);
 
-	long Txid;
-	unsigned char data[8];
-	int ret;
+	TPCANMsg CANMsg;
+	TPCANTimestamp CANTimeStamp;
+	TPCANStatus Status = PCAN_ERROR_OK;
+	char strMsg[256];
+	int n, i;
 
-	if (findex >= 0 && findex < 4)
+	// PCAN-Basic reads one frame per call; drain what is queued.
+	for (n = 0; n < maxCount; )
 	{
-		data[0] = (unsigned char)( (pwm[0] >> 8) & 0x00ff);
-		data[1] = (unsigned char)(pwm[0] & 0x00ff);
-
-		data[2] = (unsigned char)( (pwm[1] >> 8) & 0x00ff);
-		data[3] = (unsigned char)(pwm[1] & 0x00ff);
-
-		data[4] = (unsigned char)( (pwm[2] >> 8) & 0x00ff);
-		data[5] = (unsigned char)(pwm[2] & 0x00ff);
-
-		data[6] = (unsigned char)( (pwm[3] >> 8) & 0x00ff);
-		data[7] = (unsigned char)(pwm[3] & 0x00ff);
-
-		Txid = ((unsigned long)(ID_CMD_SET_TORQUE_1 + findex)<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-		ret = canSendMsg(ch, Txid, 8, data, TRUE);
+		Status = CAN_Read(canDev[bus], &CANMsg, &CANTimeStamp);
+		if (Status != PCAN_ERROR_OK)
+		{
+			if (Status == PCAN_ERROR_QRCVEMPTY)
+				break;
+			CAN_GetErrorText(Status, 0, strMsg);
+			printf("peakRecvBatch(): CAN_Read() failed with error %ld\n", Status);
+			printf("%s\n", strMsg);
+			return (n > 0 ? n : -1);
+		}
+		if (CANMsg.MSGTYPE & PCAN_MESSAGE_STATUS)
+			continue;
+
+		msg[n].STD_EXT = ((CANMsg.MSGTYPE & PCAN_MESSAGE_EXTENDED) ? EXT : STD);
+		msg[n].msg_id = CANMsg.ID;
+		msg[n].data_length = CANMsg.LEN;
+		for (i = 0; i < CANMsg.LEN; i++)
+			msg[n].data[i] = CANMsg.DATA[i];
+		timestamp[n] = ((double)CANTimeStamp.millis + 4294967296.0 * CANTimeStamp.millis_overflow) * 1e-3 + CANTimeStamp.micros * 1e-6;
+		n++;
 	}
-	else
-		return -1;
-	
-	return 0;
+
+	return n;
 }
 
-int get_message(int ch, char* cmd, char* src, char* des, int* len, unsigned char* data, int blocking)
+static int peakWait(int bus, int timeout_msec)
 {
-	int err;
-	unsigned long Rxid;
+	assert(bus >= 0 && bus < MAX_BUS);
 
-	err = canReadMsg(ch, (int*)&Rxid, len, data, blocking);
-	if (!err)
+	if (!rxEvent[bus])
 	{
-		/*printf("    %ld+%ld (%d)", Rxid-Rxid%128, Rxid%128, len);
-		for(int nd=0; nd<(*len); nd++) printf(" %3d ", data[nd]);
-		printf("\n");*/
-
-		*cmd = (char)( (Rxid >> 6) & 0x1f );
-		*des = (char)( (Rxid >> 3) & 0x07 );
-		*src = (char)( Rxid & 0x07);
+		// no receive event; poll at the resolution of the system timer.
+		Sleep(1);
+		return 0;
 	}
-	else
-	{
-		return err;
-	}
-	return 0;
+
+	// the receive queue is drained; sleep until the driver signals a new frame.
+	if (WaitForSingleObject(rxEvent[bus], (timeout_msec < 0 ? INFINITE : (DWORD)timeout_msec)) == WAIT_OBJECT_0)
+		return 0;
+	return 1;
 }
 
+const CanTransport canTransportPeak = {
+	"Peak",
+	18, // PCAN_USBBUS1
+	peakOpen,
+	peakClose,
+	NULL,
+	peakSendBatch,
+	peakRecvBatch,
+	peakWait,
+	NULL, // PCAN-Basic does not report the transmit queue level
+	NULL
+};
+
 
 
 CANAPI_END
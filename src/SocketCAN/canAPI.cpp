@@ -0,0 +1,446 @@
+/*======================*/
+/*       Includes       */
+/*======================*/
+//system headers
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <malloc.h>
+#include <assert.h>
+//project headers
+#include "canDef.h"
+#include "canAPI.h"
+#include "canTransport.h"
+
+
+CANAPI_BEGIN
+
+/*=====================*/
+/*       Defines       */
+/*=====================*/
+//constants
+#define CH_COUNT			MAX_BUS // number of CAN channels
+#define RX_SOCKBUF_SIZE		(64*1024)
+#define TX_POLL_NSEC		50000L // half an 8-byte frame at 1 Mbit/s
+//macros
+#define Sleep(msec) usleep((msec)*1000)
+//typedefs & structs
+typedef struct tagSocketCANChannel
+{
+	int fd;
+	bool opened;
+	bool hw_stamps; // receive stamps from the adapter clock (ts[2]), else the kernel's (ts[0])
+
+	// frames fetched from the socket by the last recvmmsg() call.
+	int rx_count;
+	int rx_next;
+	struct can_frame rx_frame[RX_QUEUE_SIZE];
+	struct timespec rx_time[RX_QUEUE_SIZE];
+
+	// recvmmsg() bookkeeping, pointing into rx_frame.
+	struct mmsghdr rx_msg[RX_QUEUE_SIZE];
+	struct iovec rx_iov[RX_QUEUE_SIZE];
+	char rx_ctrl[RX_QUEUE_SIZE][CMSG_SPACE(sizeof(struct scm_timestamping))];
+} SocketCANChannel;
+
+/*=========================================*/
+/*       Global file-scope variables       */
+/*=========================================*/
+
+static SocketCANChannel canDev[CH_COUNT];
+
+// interface name prefixes selectable by command_can_open_ex().
+static const char* szCanDevType[] = {
+	"can",
+	"vcan",
+	"slcan",
+};
+
+/*========================================*/
+/*       Private functions                */
+/*========================================*/
+static int initCAN(int bus, const char* ifname){
+	SocketCANChannel* dev = &canDev[bus];
+	struct sockaddr_can addr;
+	struct ifreq ifr;
+	struct ifreq hwifr;
+	struct hwtstamp_config hwconfig;
+	int tsflags;
+	int rcvbuf;
+	int i;
+
+	dev->fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (dev->fd < 0)
+	{
+		syslog(LOG_ERR, "initCAN(): socket() failed with error %d", errno);
+		printf("initCAN(): socket() failed with error %d\n", errno);
+		printf("%s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, IFNAMSIZ, "%s", ifname);
+	if (ioctl(dev->fd, SIOCGIFINDEX, &ifr) < 0)
+	{
+		printf("initCAN(): interface %s not found (error %d)\n", ifname, errno);
+		printf("%s\n", strerror(errno));
+		close(dev->fd);
+		return -2;
+	}
+
+	// A deeper receive buffer keeps encoder frames from being dropped
+	// while the IO thread is busy computing torques.
+	rcvbuf = RX_SOCKBUF_SIZE;
+	setsockopt(dev->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	// Receive stamps come from one clock for the whole session, since the
+	// adapter's and the kernel's cannot be mixed within an encoder set:
+	// the adapter's if it turns hardware stamping on (that needs
+	// CAP_NET_ADMIN), else the kernel's, as for vcan.
+	memset(&hwifr, 0, sizeof(hwifr));
+	memset(&hwconfig, 0, sizeof(hwconfig));
+	snprintf(hwifr.ifr_name, IFNAMSIZ, "%s", ifname);
+	hwconfig.tx_type = HWTSTAMP_TX_OFF;
+	hwconfig.rx_filter = HWTSTAMP_FILTER_ALL;
+	hwifr.ifr_data = (char*)&hwconfig;
+	dev->hw_stamps = (ioctl(dev->fd, SIOCSHWTSTAMP, &hwifr) == 0 && hwconfig.rx_filter != HWTSTAMP_FILTER_NONE);
+	if (dev->hw_stamps)
+	{
+		tsflags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+		if (setsockopt(dev->fd, SOL_SOCKET, SO_TIMESTAMPING, &tsflags, sizeof(tsflags)) < 0)
+			dev->hw_stamps = false;
+	}
+	if (!dev->hw_stamps)
+	{
+		tsflags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+		if (setsockopt(dev->fd, SOL_SOCKET, SO_TIMESTAMPING, &tsflags, sizeof(tsflags)) < 0)
+			printf("initCAN(): SO_TIMESTAMPING not supported on %s (error %d)\n", ifname, errno);
+	}
+	printf("initCAN(): %s receive timestamps on %s\n", (dev->hw_stamps ? "hardware" : "kernel"), ifname);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if (bind(dev->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		printf("initCAN(): bind() to %s failed with error %d\n", ifname, errno);
+		printf("%s\n", strerror(errno));
+		close(dev->fd);
+		return -3;
+	}
+
+	for (i = 0; i < RX_QUEUE_SIZE; i++)
+	{
+		dev->rx_iov[i].iov_base = &dev->rx_frame[i];
+		dev->rx_iov[i].iov_len = sizeof(struct can_frame);
+	}
+	dev->rx_count = 0;
+	dev->rx_next = 0;
+	dev->opened = true;
+
+	return 0;
+}
+
+static int freeCAN(int bus){
+	SocketCANChannel* dev = &canDev[bus];
+
+	if (!dev->opened)
+		return 0;
+
+	if (close(dev->fd) < 0)
+	{
+		printf("freeCAN(): close() failed with error %d\n", errno);
+		return -1;
+	}
+	dev->opened = false;
+	dev->rx_count = 0;
+	dev->rx_next = 0;
+
+	return 0;
+}
+
+/*
+ * Pulls every frame currently queued on the socket with a single recvmmsg()
+ * call. Returns the number of frames fetched, 0 if none is pending.
+ */
+static int fetchFrames(SocketCANChannel* dev){
+	struct cmsghdr* cmsg;
+	struct scm_timestamping* ts;
+	int n;
+	int i;
+
+	for (i = 0; i < RX_QUEUE_SIZE; i++)
+	{
+		memset(&dev->rx_msg[i].msg_hdr, 0, sizeof(struct msghdr));
+		dev->rx_msg[i].msg_hdr.msg_iov = &dev->rx_iov[i];
+		dev->rx_msg[i].msg_hdr.msg_iovlen = 1;
+		dev->rx_msg[i].msg_hdr.msg_control = dev->rx_ctrl[i];
+		dev->rx_msg[i].msg_hdr.msg_controllen = sizeof(dev->rx_ctrl[i]);
+	}
+
+	n = recvmmsg(dev->fd, dev->rx_msg, RX_QUEUE_SIZE, MSG_DONTWAIT, NULL);
+	if (n <= 0)
+		return n;
+
+	for (i = 0; i < n; i++)
+	{
+		dev->rx_time[i].tv_sec = 0;
+		dev->rx_time[i].tv_nsec = 0;
+		for (cmsg = CMSG_FIRSTHDR(&dev->rx_msg[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&dev->rx_msg[i].msg_hdr, cmsg))
+		{
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING)
+				continue;
+			// ts[2] holds the raw hardware stamp, ts[0] the software one;
+			// a frame the adapter did not stamp goes without one.
+			ts = (struct scm_timestamping*)CMSG_DATA(cmsg);
+			dev->rx_time[i] = ts->ts[dev->hw_stamps ? 2 : 0];
+		}
+	}
+	dev->rx_count = n;
+	dev->rx_next = 0;
+
+	return n;
+}
+
+/*========================================*/
+/*       Transport                        */
+/*========================================*/
+static int socketcanOpen(int bus, int type, int index)
+{
+	assert(bus >= 0 && bus < CH_COUNT);
+	assert(type == CAN_OPEN_DEFAULT || (type >= 0 && type < (int)(sizeof(szCanDevType)/sizeof(szCanDevType[0]))));
+
+	char ifname[IFNAMSIZ];
+	int ret;
+
+	printf("<< CAN: Open Channel...\n");
+	if (type == CAN_OPEN_DEFAULT)
+	{
+		// Use the real adapter if there is one, otherwise fall back to the
+		// virtual bus of the same index so the stack can run against vcan.
+		snprintf(ifname, sizeof(ifname), "%s%d", szCanDevType[0], bus);
+		if (if_nametoindex(ifname) == 0)
+			snprintf(ifname, sizeof(ifname), "%s%d", szCanDevType[1], bus);
+	}
+	else
+		snprintf(ifname, sizeof(ifname), "%s%d", szCanDevType[type], index);
+	ret = initCAN(bus, ifname);
+	if (ret != 0) return ret;
+	printf("\t- Ch.%2d %s (OK)\n", bus, ifname);
+	printf("\t- Done\n");
+
+	return 0;
+}
+
+static int socketcanClose(int bus)
+{
+	assert(bus >= 0 && bus < CH_COUNT);
+
+	int ret;
+
+	printf("<< CAN: Close...\n");
+	ret = freeCAN(bus);
+	if (ret != 0) return ret;
+	printf("\t- Done\n");
+
+	return 0;
+}
+
+static int socketcanSendBatch(int bus, const can_msg* msg, int count)
+{
+	assert(bus >= 0 && bus < CH_COUNT);
+	assert(count <= TX_QUEUE_SIZE);
+
+	SocketCANChannel* dev = &canDev[bus];
+	struct can_frame frame[TX_QUEUE_SIZE];
+	struct mmsghdr tx_msg[TX_QUEUE_SIZE];
+	struct iovec tx_iov[TX_QUEUE_SIZE];
+	struct pollfd pfd;
+	int sent;
+	int ret;
+	int i, j;
+
+	if (!dev->opened)
+		return -1;
+
+	memset(frame, 0, sizeof(frame));
+	memset(tx_msg, 0, sizeof(tx_msg));
+	for (i = 0; i < count; i++)
+	{
+		frame[i].can_id = (msg[i].STD_EXT == EXT ? ((msg[i].msg_id & CAN_EFF_MASK) | CAN_EFF_FLAG) : (msg[i].msg_id & CAN_SFF_MASK));
+		frame[i].can_dlc = msg[i].data_length & 0x0F;
+		for (j = 0; j < frame[i].can_dlc; j++)
+			frame[i].data[j] = msg[i].data[j];
+		tx_iov[i].iov_base = &frame[i];
+		tx_iov[i].iov_len = sizeof(struct can_frame);
+		tx_msg[i].msg_hdr.msg_iov = &tx_iov[i];
+		tx_msg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	// one sendmmsg() call hands every frame to the interface queue.
+	sent = 0;
+	while (sent < count)
+	{
+		ret = sendmmsg(dev->fd, &tx_msg[sent], count - sent, 0);
+		if (ret > 0)
+		{
+			sent += ret;
+			continue;
+		}
+		// The interface queue is full; wait a little for room.
+		if (ret < 0 && (errno == ENOBUFS || errno == EAGAIN))
+		{
+			pfd.fd = dev->fd;
+			pfd.events = POLLOUT;
+			if (poll(&pfd, 1, TX_TIMEOUT) > 0)
+				continue;
+		}
+		syslog(LOG_ERR, "socketcanSendBatch(): sendmmsg() failed with error %d", errno);
+		printf("socketcanSendBatch(): sendmmsg() failed with error %d\n", errno);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int socketcanRecvBatch(int bus, can_msg* msg, double* timestamp, int maxCount)
+{
+	assert(bus >= 0 && bus < CH_COUNT);
+
+	SocketCANChannel* dev = &canDev[bus];
+	struct can_frame* frame;
+	struct timespec* stamp;
+	int ret;
+	int n;
+
+	if (!dev->opened)
+		return -1;
+
+	if (dev->rx_next >= dev->rx_count)
+	{
+		ret = fetchFrames(dev);
+		if (ret < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return 0; // no message received
+			syslog(LOG_ERR, "socketcanRecvBatch(): recvmmsg() failed with error %d", errno);
+			printf("socketcanRecvBatch(): recvmmsg() failed with error %d\n", errno);
+			return -2;
+		}
+		if (ret == 0)
+			return 0;
+	}
+
+	for (n = 0; n < maxCount && dev->rx_next < dev->rx_count; n++)
+	{
+		stamp = &dev->rx_time[dev->rx_next];
+		if (stamp->tv_sec || stamp->tv_nsec)
+			timestamp[n] = (double)stamp->tv_sec + (double)stamp->tv_nsec * 1e-9;
+		else
+			timestamp[n] = CAN_TIMESTAMP_NONE;
+		frame = &dev->rx_frame[dev->rx_next++];
+		msg[n].STD_EXT = ((frame->can_id & CAN_EFF_FLAG) ? EXT : STD);
+		msg[n].msg_id = frame->can_id & ((frame->can_id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK);
+		msg[n].data_length = frame->can_dlc;
+		memcpy(msg[n].data, frame->data, sizeof(msg[n].data));
+	}
+
+	return n;
+}
+
+static int socketcanWait(int bus, int timeout_msec)
+{
+	assert(bus >= 0 && bus < CH_COUNT);
+
+	SocketCANChannel* dev = &canDev[bus];
+	struct pollfd pfd;
+	int ret;
+
+	if (!dev->opened)
+		return -1;
+	if (dev->rx_next < dev->rx_count)
+		return 0;
+
+	// sleep until the socket becomes readable instead of spinning.
+	pfd.fd = dev->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	ret = poll(&pfd, 1, (timeout_msec < 0 ? -1 : timeout_msec));
+	if (ret > 0)
+		return 0;
+	if (ret == 0 || errno == EINTR)
+		return 1; // timed out
+	printf("socketcanWait(): poll() failed with error %d\n", errno);
+	return -1;
+}
+
+static int socketcanWaitTx(int bus, int timeout_msec)
+{
+	assert(bus >= 0 && bus < CH_COUNT);
+
+	SocketCANChannel* dev = &canDev[bus];
+	int pending;
+	struct timespec next, deadline;
+
+	if (!dev->opened)
+		return -1;
+
+	// SIOCOUTQ counts the bytes the socket still owns; a frame is released
+	// once the driver reports it sent (loopback echo or TX-complete IRQ).
+	// Nothing signals that on the socket, so the queue is re-checked every
+	// TX_POLL_NSEC, sleeping in between instead of spinning on the CPU the
+	// RX thread may need.
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	deadline = next;
+	if (timeout_msec >= 0)
+	{
+		deadline.tv_sec += timeout_msec / 1000;
+		deadline.tv_nsec += (long)(timeout_msec % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) { deadline.tv_sec++; deadline.tv_nsec -= 1000000000L; }
+	}
+	for (;;)
+	{
+		if (ioctl(dev->fd, SIOCOUTQ, &pending) < 0)
+			return -1;
+		if (pending == 0)
+			return 0;
+		if (timeout_msec >= 0 &&
+			(next.tv_sec > deadline.tv_sec || (next.tv_sec == deadline.tv_sec && next.tv_nsec >= deadline.tv_nsec)))
+			return 1;
+		next.tv_nsec += TX_POLL_NSEC;
+		if (next.tv_nsec >= 1000000000L) { next.tv_sec++; next.tv_nsec -= 1000000000L; }
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+			;
+	}
+}
+
+const CanTransport canTransportSocketCAN = {
+	"SocketCAN",
+	0, // can0, or vcan0 if there is no can0
+	socketcanOpen,
+	socketcanClose,
+	NULL,
+	socketcanSendBatch,
+	socketcanRecvBatch,
+	socketcanWait,
+	socketcanWaitTx,
+	NULL
+};
+
+
+
+CANAPI_END
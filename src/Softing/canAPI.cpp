@@ -20,15 +20,20 @@ extern "C" {
 }
 #include "canDef.h"
 #include "canAPI.h"
+#include "canTransport.h"
 
 CANAPI_BEGIN
 
 
-#define CH_COUNT			(int)2 // number of CAN channels
+#define CH_COUNT			MAX_BUS // number of CAN channels
 
-static CAN_HANDLE hCAN[CH_COUNT] = {-1, -1}; // CAN channel handles
+// indexed by channel-1, valid while the channel is open
+static CAN_HANDLE hCAN[CH_COUNT]; // CAN channel handles
+static HANDLE hRxEvent[CH_COUNT]; // signaled by the driver when the receive FIFO gets data
+static unsigned long rxTimeLast[CH_COUNT]; // last 32-bit receive time stamp (usec)
+static double rxTimeWraps[CH_COUNT]; // accumulated time stamp overflows (usec)
 
-const char* szCanDevType[] = {
+static const char* szCanDevType[] = {
 	"",
 	"CANcard2",
 	"CAN-ACx-PCI",
@@ -42,7 +47,7 @@ const char* szCanDevType[] = {
 };
 
 // gets the device name from the device type
-char *getDeviceType(int u32DeviceType)
+static char *getDeviceType(int u32DeviceType)
 {
   static char u8Type[100];
 
@@ -100,7 +105,7 @@ char *getDeviceType(int u32DeviceType)
   return u8Type;
 }
 
-int canWrite(CAN_HANDLE handle,
+static int canWrite(CAN_HANDLE handle,
 			 unsigned long id, 
 			 void * msg,
 			 unsigned int dlc,
@@ -119,7 +124,7 @@ int canWrite(CAN_HANDLE handle,
 	return 0;
 }
 
-int command_can_open(int ch)
+static int openChannel(int ch)
 {
 	assert(ch >= 1 && ch <= CH_COUNT);
 
@@ -180,7 +185,9 @@ int command_can_open(int ch)
 	L2Config.s32Sjw = GET_FROM_SCIM;
 	L2Config.s32Tseg1 = GET_FROM_SCIM;
 	L2Config.s32Tseg2 = GET_FROM_SCIM;
-	L2Config.hEvent = (void*)-1;
+	if (hRxEvent[ch-1] == NULL)
+		hRxEvent[ch-1] = CreateEvent(NULL, FALSE, FALSE, NULL);
+	L2Config.hEvent = (hRxEvent[ch-1] != NULL ? hRxEvent[ch-1] : (void*)-1);
 	ret = CANL2_initialize_fifo_mode(hCAN[ch-1], &L2Config);
 	if (ret)
 	{
@@ -208,7 +215,7 @@ int command_can_open(int ch)
 	return 0;
 }
 
-int command_can_open_ex(int ch, int type, int index)
+static int openChannelEx(int ch, int type, int index)
 {
 	assert(ch >= 1 && ch <= CH_COUNT);
 	assert(type >= 1 && type < 9/*eCanDevType_COUNT*/);
@@ -344,7 +351,9 @@ int command_can_open_ex(int ch, int type, int index)
 	L2Config.s32Sjw = GET_FROM_SCIM;
 	L2Config.s32Tseg1 = GET_FROM_SCIM;
 	L2Config.s32Tseg2 = GET_FROM_SCIM;
-	L2Config.hEvent = (void*)-1;
+	if (hRxEvent[ch-1] == NULL)
+		hRxEvent[ch-1] = CreateEvent(NULL, FALSE, FALSE, NULL);
+	L2Config.hEvent = (hRxEvent[ch-1] != NULL ? hRxEvent[ch-1] : (void*)-1);
 	ret = CANL2_initialize_fifo_mode(hCAN[ch-1], &L2Config);
 	if (ret)
 	{
@@ -388,178 +397,115 @@ int command_can_open_ex(int ch, int type, int index)
 	return 0;
 }
 
-int command_can_reset(int ch)
+/*========================================*/
+/*       Transport                        */
+/*========================================*/
+static int softingOpen(int bus, int type, int index)
 {
-	return -1;
+	// CAN_OPEN_DEFAULT opens CAN-ACx-PCI_<bus>; otherwise type and index name the
+	// card and its channel and the channels found on the system are listed.
+	if (type == CAN_OPEN_DEFAULT)
+		return openChannel(bus);
+	return openChannelEx(bus, type, index);
 }
 
-int command_can_close(int ch)
+static int softingClose(int bus)
 {
-	INIL2_close_channel(hCAN[ch-1]);
-	hCAN[ch-1] = 0;
-	return 0;
-}
-
-int command_can_query_id(int ch)
-{
-	long Txid;
-	unsigned char data[8];
-
-	Txid = ((unsigned long)ID_CMD_QUERY_ID<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(hCAN[ch-1], Txid, data, 0, STD);
-
-	return 0;
-}
-
-int command_can_sys_init(int ch, int period_msec)
-{
-	long Txid;
-	unsigned char data[8];
-
-	Txid = ((unsigned long)ID_CMD_SET_PERIOD<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	data[0] = (unsigned char)period_msec;
-	canWrite(hCAN[ch-1], Txid, data, 1, STD);
-
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_SET_MODE_TASK<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(hCAN[ch-1], Txid, data, 0, STD);
-
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_QUERY_STATE_DATA<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(hCAN[ch-1], Txid, data, 0, STD);
+	assert(bus >= 1 && bus <= CH_COUNT);
 
+	INIL2_close_channel(hCAN[bus-1]);
+	hCAN[bus-1] = 0;
+	if (hRxEvent[bus-1] != NULL)
+	{
+		CloseHandle(hRxEvent[bus-1]);
+		hRxEvent[bus-1] = NULL;
+	}
 	return 0;
 }
 
-int command_can_start(int ch)
+static int softingSendBatch(int bus, const can_msg* msg, int count)
 {
-	long Txid;
-	unsigned char data[8];
-
-	Txid = ((unsigned long)ID_CMD_QUERY_STATE_DATA<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(hCAN[ch-1], Txid, data, 0, STD);
+	assert(bus >= 1 && bus <= CH_COUNT);
 
-	Sleep(10);
-
-	Txid = ((unsigned long)ID_CMD_SET_SYSTEM_ON<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(hCAN[ch-1], Txid, data, 0, STD);
-
-	return 0;
-}
-
-int command_can_stop(int ch)
-{
-	long Txid;
-	unsigned char data[8];
+	int ret;
 
-	Txid = ((unsigned long)ID_CMD_SET_SYSTEM_OFF<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	canWrite(hCAN[ch-1], Txid, data, 0, STD);
+	// the CANL2 API has no multi-frame write.
+	for (int i = 0; i < count; i++)
+	{
+		ret = canWrite(hCAN[bus-1], msg[i].msg_id, (void*)msg[i].data, msg[i].data_length, msg[i].STD_EXT);
+		if (ret)
+			return ret;
+	}
 
 	return 0;
 }
 
-int command_can_AHRS_set(int ch, unsigned char rate, unsigned char mask)
+static int softingRecvBatch(int bus, can_msg* msg, double* timestamp, int maxCount)
 {
-	long Txid;
-	unsigned char data[8];
+	assert(bus >= 1 && bus <= CH_COUNT);
 
-	Txid = ((unsigned long)ID_CMD_AHRS_SET<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-	data[0] = (unsigned char)rate;
-	data[1] = (unsigned char)mask;
-	canWrite(hCAN[ch-1], Txid, data, 2, STD);
-
-	return 0;
-}
-
-int write_current(int ch, int findex, short* pwm)
-{
-	long Txid;
-	unsigned char data[8];
+	int ret;
+	int n;
+	PARAM_STRUCT param;
 
-	if (findex >= 0 && findex < 4)
+	// CANL2_read_ac() returns one FIFO entry per call; drain what is queued.
+	for (n = 0; n < maxCount; )
 	{
-		data[0] = (unsigned char)( (pwm[0] >> 8) & 0x00ff);
-		data[1] = (unsigned char)(pwm[0] & 0x00ff);
-
-		data[2] = (unsigned char)( (pwm[1] >> 8) & 0x00ff);
-		data[3] = (unsigned char)(pwm[1] & 0x00ff);
-
-		data[4] = (unsigned char)( (pwm[2] >> 8) & 0x00ff);
-		data[5] = (unsigned char)(pwm[2] & 0x00ff);
-
-		data[6] = (unsigned char)( (pwm[3] >> 8) & 0x00ff);
-		data[7] = (unsigned char)(pwm[3] & 0x00ff);
+		ret = CANL2_read_ac(hCAN[bus-1], &param);
+		if (ret == CANL2_RA_NO_DATA)
+			break;
+		if (ret != CANL2_RA_DATAFRAME && ret != CANL2_RA_XTD_DATAFRAME)
+		{
+			if (ret < 0)
+				return (n > 0 ? n : ret);
+			continue; // remote frames, bus state changes, ...
+		}
 
-		Txid = ((unsigned long)(ID_CMD_SET_TORQUE_1 + findex)<<6) | ((unsigned long)ID_COMMON <<3) | ((unsigned long)ID_DEVICE_MAIN);
-		canWrite(hCAN[ch-1], Txid, data, 8, STD);
+		msg[n].msg_id = param.Ident;
+		msg[n].STD_EXT = (ret == CANL2_RA_XTD_DATAFRAME ? EXT : STD);
+		msg[n].data_length = param.DataLength;
+		for (int nd = 0; nd < 8; nd++) msg[n].data[nd] = param.RCV_data[nd];
+
+		// param.Time is the 32-bit free running 1 usec timer of the card
+		if (param.Time < rxTimeLast[bus-1])
+			rxTimeWraps[bus-1] += 4294967296.0;
+		rxTimeLast[bus-1] = param.Time;
+		timestamp[n] = (rxTimeWraps[bus-1] + (double)param.Time) * 1e-6;
+		n++;
 	}
-	else
-		return -1;
-	
-	return 0;
+
+	return n;
 }
 
-int get_message(int ch, char* cmd, char* src, char* des, int* len, unsigned char* data, int blocking)
+static int softingWait(int bus, int timeout_msec)
 {
-	int ret;
-	can_msg msg;
-	PARAM_STRUCT param;
-	
-	ret = CANL2_read_ac(hCAN[ch-1], &param);
+	assert(bus >= 1 && bus <= CH_COUNT);
 
-	switch (ret)
+	if (hRxEvent[bus-1] == NULL)
 	{
-	case CANL2_RA_XTD_DATAFRAME :
-		msg.msg_id = param.Ident;
-		msg.STD_EXT = EXT;
-		msg.data_length = param.DataLength;
-		
-		msg.data[0] = param.RCV_data[0];
-		msg.data[1] = param.RCV_data[1];
-		msg.data[2] = param.RCV_data[2];
-		msg.data[3] = param.RCV_data[3];
-		msg.data[4] = param.RCV_data[4];
-		msg.data[5] = param.RCV_data[5];
-		msg.data[6] = param.RCV_data[6];
-		msg.data[7] = param.RCV_data[7];
-
-		break;
-
-	case CANL2_RA_DATAFRAME:
-
-		msg.msg_id = param.Ident;
-		msg.STD_EXT = STD;
-		msg.data_length = param.DataLength;
-		
-		msg.data[0] = param.RCV_data[0];
-		msg.data[1] = param.RCV_data[1];
-		msg.data[2] = param.RCV_data[2];
-		msg.data[3] = param.RCV_data[3];
-		msg.data[4] = param.RCV_data[4];
-		msg.data[5] = param.RCV_data[5];
-		msg.data[6] = param.RCV_data[6];
-		msg.data[7] = param.RCV_data[7];
-
-		break;
-
-	case CANL2_RA_NO_DATA:
-		return -1;
-
-	default:
-		return -1;
+		// no receive event; poll at the resolution of the system timer.
+		Sleep(1);
+		return 0;
 	}
 
-	*cmd = (char)( (msg.msg_id >> 6) & 0x1f );
-	*des = (char)( (msg.msg_id >> 3) & 0x07 );
-	*src = (char)( msg.msg_id & 0x07 );
-	*len = (int)( msg.data_length );
-	for(int nd=0; nd<(*len); nd++) data[nd] = msg.data[nd];
-
-	return 0;
+	if (WaitForSingleObject(hRxEvent[bus-1], (timeout_msec < 0 ? INFINITE : (DWORD)timeout_msec)) == WAIT_OBJECT_0)
+		return 0;
+	return 1;
 }
 
+const CanTransport canTransportSofting = {
+	"Softing",
+	1, // channels are numbered from 1
+	softingOpen,
+	softingClose,
+	NULL,
+	softingSendBatch,
+	softingRecvBatch,
+	softingWait,
+	NULL, // the CANL2 API does not report the transmit queue level
+	NULL
+};
+
 
 
 CANAPI_END
@@ -0,0 +1,653 @@
+/*======================*/
+/*       Includes       */
+/*======================*/
+//system headers
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+//project headers
+#include "canDef.h"
+#include "canAPI.h"
+#include "canTransport.h"
+#include "canCapture.h"
+#include "../HighResTimer.h"
+#include "../SeqLock.h"
+
+
+CANAPI_BEGIN
+
+/*=====================*/
+/*       Defines       */
+/*=====================*/
+//constants
+#define CAPTURE_BUFFER      (1 << 20) // bytes of stdio buffer per capture, written out about once a second at 1 kHz
+#define SENT_SIZE           (64)      // frames the host sent that wait to be compared
+#define NOTE_QUEUE          (8)       // notes passed by the replay and not yet taken, power of two
+#define TX_WAIT_MAX         (0.5)     // sec of wall-clock time the replay waits for the host to send a captured frame
+//macros
+#ifdef _WIN32
+#define LOCK_INIT(l)        InitializeCriticalSection(l)
+#define LOCK(l)             EnterCriticalSection(l)
+#define UNLOCK(l)           LeaveCriticalSection(l)
+#define YIELD()             Sleep(0)
+#define IDLE()              Sleep(1)
+#else
+#define LOCK_INIT(l)        pthread_mutex_init((l), NULL)
+#define LOCK(l)             pthread_mutex_lock(l)
+#define UNLOCK(l)           pthread_mutex_unlock(l)
+#define YIELD()             sched_yield()
+#define IDLE()              usleep(1000)
+#endif
+//typedefs & structs
+#ifdef _WIN32
+typedef CRITICAL_SECTION CaptureLock;
+#else
+typedef pthread_mutex_t CaptureLock;
+#endif
+
+// Frames are logged by the receiving thread and by every thread that sends, so the file is locked
+typedef struct tagCaptureChannel
+{
+	FILE* volatile fp;
+	bool lockReady;
+	CaptureLock lock;
+} CaptureChannel;
+
+typedef struct tagReplayNote
+{
+	unsigned int tag;
+	int size;
+	unsigned char data[CAN_CAPTURE_NOTE_MAX];
+} ReplayNote;
+
+enum eReplayStep
+{
+	STEP_FRAME,     // next is a received frame that can be handed out
+	STEP_WAIT_HOST, // next is a frame the host has not sent yet, or the note queue is full
+	STEP_WAIT_TIME, // next is a received frame that is not due yet (realtime)
+	STEP_END        // end of the capture
+};
+
+typedef struct tagReplayChannel
+{
+	FILE* fp;            // capture loaded by can_replay_load()
+	bool opened;
+	bool realtime;
+
+	// The reader belongs to the thread that calls get_message_wait().
+	CanCaptureRecord next;
+	unsigned char note[CAN_CAPTURE_NOTE_MAX];
+	bool hasNext;
+	double now;          // capture time of the last record passed (sec)
+	double first;        // capture time of the first record
+	double realBase;     // wall-clock time of first in realtime mode
+	double txWaitStart;  // wall-clock time the host's counterpart of next was first waited for, 0: not waiting
+	SeqLock<double> clock; // now, for can_bus_time()
+
+	// frames sent by the host, any thread
+	CaptureLock lock;
+	bool lockReady;
+	can_msg sent[SENT_SIZE];
+	int sentCount;
+
+	// notes, from the reader to the thread that calls can_replay_note()
+	ReplayNote notes[NOTE_QUEUE];
+	volatile unsigned int noteHead;
+	volatile unsigned int noteTail;
+
+	CanReplayStats stats;
+	unsigned int rxTotal; // received frames in the capture
+	volatile bool done;
+} ReplayChannel;
+
+/*=========================================*/
+/*       Global file-scope variables       */
+/*=========================================*/
+
+static CaptureChannel canCapture[MAX_BUS];
+static ReplayChannel canReplay[MAX_BUS];
+
+/*========================================*/
+/*       Capture                          */
+/*========================================*/
+// Bus time of the channel, the host clock on real buses
+static double captureTime(int ch)
+{
+	double t = can_bus_time(ch);
+	return (t != CAN_TIMESTAMP_NONE ? t : GetHighResTime());
+}
+
+int can_capture_open(int ch, const char* path)
+{
+	assert(ch >= 0 && ch < MAX_BUS);
+
+	CaptureChannel* c = &canCapture[ch];
+	CanCaptureHeader header;
+	FILE* fp;
+
+	can_capture_close(ch);
+	fp = fopen(path, "wb");
+	if (!fp)
+	{
+		printf("<< CAN: cannot create capture %s\n", path);
+		return -1;
+	}
+	setvbuf(fp, NULL, _IOFBF, CAPTURE_BUFFER);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CAN_CAPTURE_MAGIC, sizeof(header.magic));
+	header.recordSize = sizeof(CanCaptureRecord);
+	header.ch = ch;
+	header.startTime = (double)time(NULL);
+	fwrite(&header, sizeof(header), 1, fp);
+
+	if (!c->lockReady)
+	{
+		LOCK_INIT(&c->lock);
+		c->lockReady = true;
+	}
+	LOCK(&c->lock);
+	c->fp = fp;
+	UNLOCK(&c->lock);
+	return 0;
+}
+
+int can_capture_close(int ch)
+{
+	assert(ch >= 0 && ch < MAX_BUS);
+
+	CaptureChannel* c = &canCapture[ch];
+	FILE* fp;
+
+	if (!c->fp)
+		return 0;
+	LOCK(&c->lock);
+	fp = c->fp;
+	c->fp = NULL;
+	UNLOCK(&c->lock);
+	return (fclose(fp) == 0 ? 0 : -1);
+}
+
+bool can_capture_active(int ch)
+{
+	assert(ch >= 0 && ch < MAX_BUS);
+
+	return (canCapture[ch].fp != NULL);
+}
+
+void can_capture_note(int ch, unsigned int tag, const void* data, int size)
+{
+	assert(ch >= 0 && ch < MAX_BUS);
+	assert(size > 0 && size <= CAN_CAPTURE_NOTE_MAX);
+
+	CaptureChannel* c = &canCapture[ch];
+	CanCaptureRecord rec;
+
+	if (!c->fp)
+		return;
+	memset(&rec, 0, sizeof(rec));
+	rec.time = captureTime(ch);
+	rec.stamp = CAN_TIMESTAMP_NONE;
+	rec.id = tag;
+	rec.len = (unsigned short)size;
+	rec.kind = CAN_CAPTURE_NOTE;
+
+	LOCK(&c->lock);
+	if (c->fp)
+	{
+		fwrite(&rec, sizeof(rec), 1, c->fp);
+		fwrite(data, size, 1, c->fp);
+	}
+	UNLOCK(&c->lock);
+}
+
+void can_capture_frames(int ch, int kind, const can_msg* msg, const double* stamp, int count)
+{
+	assert(ch >= 0 && ch < MAX_BUS);
+
+	CaptureChannel* c = &canCapture[ch];
+	CanCaptureRecord rec;
+	int i;
+
+	if (!c->fp || count <= 0)
+		return;
+	memset(&rec, 0, sizeof(rec));
+	rec.time = captureTime(ch);
+	rec.kind = (unsigned char)kind;
+
+	LOCK(&c->lock);
+	if (c->fp)
+	{
+		for (i = 0; i < count; i++)
+		{
+			rec.stamp = (stamp ? stamp[i] : CAN_TIMESTAMP_NONE);
+			rec.id = (unsigned int)msg[i].msg_id;
+			rec.len = msg[i].data_length;
+			memcpy(rec.data, msg[i].data, 8);
+			fwrite(&rec, sizeof(rec), 1, c->fp);
+		}
+	}
+	UNLOCK(&c->lock);
+}
+
+/*========================================*/
+/*       Replay reader                    */
+/*========================================*/
+static bool readHeader(FILE* fp, CanCaptureHeader* header)
+{
+	return (fread(header, sizeof(*header), 1, fp) == 1
+		&& memcmp(header->magic, CAN_CAPTURE_MAGIC, sizeof(header->magic)) == 0
+		&& header->recordSize == sizeof(CanCaptureRecord));
+}
+
+static bool readRecord(ReplayChannel* dev)
+{
+	if (fread(&dev->next, sizeof(dev->next), 1, dev->fp) != 1)
+		return false;
+	if (dev->next.kind == CAN_CAPTURE_NOTE)
+	{
+		if (dev->next.len > CAN_CAPTURE_NOTE_MAX)
+			return false; // not a capture of this version
+		if (dev->next.len > 0 && fread(dev->note, dev->next.len, 1, dev->fp) != 1)
+			return false;
+	}
+	else if (dev->next.kind != CAN_CAPTURE_RX && dev->next.kind != CAN_CAPTURE_TX)
+	{
+		return false;
+	}
+	dev->hasNext = true;
+	return true;
+}
+
+static void setClock(ReplayChannel* dev, double t)
+{
+	if (t > dev->now)
+	{
+		dev->now = t;
+		dev->clock.Write(t);
+	}
+}
+
+// Takes the host's counterpart of the captured frame dev->next from the frames it sent.
+// Frames are matched by identifier, since the host sends from more than one thread.
+static bool takeSent(ReplayChannel* dev)
+{
+	const CanCaptureRecord* rec = &dev->next;
+	bool found = false;
+	int i;
+
+	LOCK(&dev->lock);
+	for (i = 0; i < dev->sentCount; i++)
+	{
+		if (dev->sent[i].msg_id == rec->id)
+		{
+			if (dev->sent[i].data_length != rec->len || memcmp(dev->sent[i].data, rec->data, rec->len) != 0)
+				dev->stats.txDiffer++;
+			dev->stats.txFrames++;
+			dev->sentCount--;
+			memmove(&dev->sent[i], &dev->sent[i+1], (dev->sentCount - i)*sizeof(can_msg));
+			found = true;
+			break;
+		}
+	}
+	UNLOCK(&dev->lock);
+	return found;
+}
+
+// Passes sent frames and notes up to the next received frame
+static int replayStep(ReplayChannel* dev)
+{
+	for (;;)
+	{
+		if (!dev->hasNext && !readRecord(dev))
+		{
+			dev->done = true;
+			return STEP_END;
+		}
+
+		if (dev->next.kind == CAN_CAPTURE_RX)
+		{
+			if (dev->realtime && GetHighResTime() < dev->realBase + (dev->next.time - dev->first))
+				return STEP_WAIT_TIME;
+			return STEP_FRAME;
+		}
+
+		if (dev->next.kind == CAN_CAPTURE_TX)
+		{
+			if (!takeSent(dev))
+			{
+				if (dev->txWaitStart == 0.0)
+					dev->txWaitStart = GetHighResTime();
+				if (GetHighResTime() - dev->txWaitStart < TX_WAIT_MAX)
+					return STEP_WAIT_HOST;
+				dev->stats.txMissing++; // the host did not send it this time
+			}
+			dev->txWaitStart = 0.0;
+		}
+		else // CAN_CAPTURE_NOTE
+		{
+			unsigned int head = dev->noteHead;
+			if (head - dev->noteTail >= NOTE_QUEUE)
+				return STEP_WAIT_HOST;
+			ReplayNote* note = &dev->notes[head & (NOTE_QUEUE-1)];
+			note->tag = dev->next.id;
+			note->size = dev->next.len;
+			memcpy(note->data, dev->note, dev->next.len);
+			SEQLOCK_BARRIER();
+			dev->noteHead = head + 1;
+		}
+		setClock(dev, dev->next.time);
+		dev->hasNext = false;
+	}
+}
+
+/*========================================*/
+/*       Replay transport                 */
+/*========================================*/
+static int replayOpen(int bus, int type, int index)
+{
+	assert(bus >= 0 && bus < MAX_BUS);
+
+	ReplayChannel* dev = &canReplay[bus];
+
+	printf("<< CAN: Open Channel...\n");
+	if (!dev->fp)
+	{
+		printf("\t- Ch.%2d no capture loaded (--replay)\n", bus);
+		return -1;
+	}
+	dev->opened = true;
+	printf("\t- Ch.%2d replay (OK)\n", bus);
+	printf("\t- Done\n");
+	return 0;
+}
+
+static int replayClose(int bus)
+{
+	assert(bus >= 0 && bus < MAX_BUS);
+
+	ReplayChannel* dev = &canReplay[bus];
+	CanReplayStats* stats = &dev->stats;
+
+	printf("<< CAN: Close...\n");
+	dev->opened = false;
+	if (dev->fp)
+	{
+		// The threads have stopped: compare what is left of the capture (the frames
+		// sent while closing) with what the host sent, without waiting for more.
+		while (dev->hasNext || readRecord(dev))
+		{
+			if (dev->next.kind == CAN_CAPTURE_TX && !takeSent(dev))
+				stats->txMissing++;
+			dev->hasNext = false;
+		}
+		stats->txExtra += dev->sentCount;
+		dev->sentCount = 0;
+		dev->done = true;
+		fclose(dev->fp);
+		dev->fp = NULL;
+		printf("\t- Ch.%2d replayed %u frames, %u sent as captured, %u differ, %u missing, %u extra\n",
+			bus, stats->rxFrames, stats->txFrames - stats->txDiffer, stats->txDiffer, stats->txMissing, stats->txExtra);
+	}
+	printf("\t- Done\n");
+	return 0;
+}
+
+static int replaySendBatch(int bus, const can_msg* msg, int count)
+{
+	assert(bus >= 0 && bus < MAX_BUS);
+
+	ReplayChannel* dev = &canReplay[bus];
+	int i;
+
+	if (!dev->opened)
+		return -1;
+
+	LOCK(&dev->lock);
+	for (i = 0; i < count; i++)
+	{
+		if (dev->sentCount == SENT_SIZE)
+		{
+			// nothing in the capture matches the oldest one
+			memmove(&dev->sent[0], &dev->sent[1], (SENT_SIZE-1)*sizeof(can_msg));
+			dev->sentCount--;
+			dev->stats.txExtra++;
+		}
+		dev->sent[dev->sentCount++] = msg[i];
+	}
+	UNLOCK(&dev->lock);
+	return 0;
+}
+
+static int replayRecvBatch(int bus, can_msg* msg, double* timestamp, int maxCount)
+{
+	assert(bus >= 0 && bus < MAX_BUS);
+
+	ReplayChannel* dev = &canReplay[bus];
+	int n;
+
+	if (!dev->opened)
+		return -1;
+
+	for (n = 0; n < maxCount; n++)
+	{
+		// A batch holds the frames that had arrived at the same time. Passing a later frame,
+		// a sent frame or a note would move the clock past the frames the host has yet to look at.
+		if (n > 0 && (!(dev->hasNext || readRecord(dev)) || dev->next.kind != CAN_CAPTURE_RX || dev->next.time != dev->now))
+			break;
+		if (replayStep(dev) != STEP_FRAME)
+			break;
+		msg[n].STD_EXT = STD;
+		msg[n].msg_id = dev->next.id;
+		msg[n].data_length = (unsigned char)dev->next.len;
+		memcpy(msg[n].data, dev->next.data, 8);
+		// a driver without time stamps: the host took the time when it got the frame
+		timestamp[n] = (dev->next.stamp != CAN_TIMESTAMP_NONE ? dev->next.stamp : dev->next.time);
+		setClock(dev, dev->next.time);
+		dev->hasNext = false;
+		dev->stats.rxFrames++;
+	}
+	return n;
+}
+
+// Waits until the next received frame may be handed out
+static int replayWait(int bus, int timeout_msec)
+{
+	assert(bus >= 0 && bus < MAX_BUS);
+
+	ReplayChannel* dev = &canReplay[bus];
+	double realEnd = GetHighResTime() + (timeout_msec < 0 ? 1e30 : timeout_msec*1e-3);
+	double wake;
+	int step;
+
+	if (!dev->opened)
+		return -1;
+
+	for (;;)
+	{
+		step = replayStep(dev);
+		if (!dev->realtime && timeout_msec > 0 && (step == STEP_FRAME || step == STEP_WAIT_HOST))
+		{
+			// The host would sleep through timeout_msec before the next frame in the original
+			// run: let that time pass on the bus clock, so its time-outs expire as they did.
+			// While the host answers, the clock goes no further than the captured answer.
+			wake = dev->now + timeout_msec*1e-3;
+			if (wake < dev->next.time)
+			{
+				setClock(dev, wake);
+				return 1;
+			}
+			if (step == STEP_WAIT_HOST && dev->now < dev->next.time)
+			{
+				setClock(dev, dev->next.time);
+				return 1;
+			}
+		}
+		if (step == STEP_FRAME)
+			return 0;
+		if (GetHighResTime() >= realEnd)
+			return 1;
+		if (step == STEP_WAIT_HOST)
+			YIELD(); // the host is computing its answer
+		else
+			IDLE();
+	}
+}
+
+static int replayWaitTx(int bus, int timeout_msec)
+{
+	return 0; // frames are compared as soon as they are queued
+}
+
+static double replayTime(int bus)
+{
+	assert(bus >= 0 && bus < MAX_BUS);
+
+	ReplayChannel* dev = &canReplay[bus];
+	double t;
+
+	if (dev->realtime)
+		return dev->first + (GetHighResTime() - dev->realBase);
+	dev->clock.Read(t);
+	return t;
+}
+
+const CanTransport canTransportReplay = {
+	"Replay",
+	0,
+	replayOpen,
+	replayClose,
+	NULL,
+	replaySendBatch,
+	replayRecvBatch,
+	replayWait,
+	replayWaitTx,
+	replayTime
+};
+
+/*========================================*/
+/*       Replay control (canCapture.h)    */
+/*========================================*/
+int can_replay_load(int ch, const char* path, bool realtime)
+{
+	assert(ch >= 0 && ch < MAX_BUS);
+
+	ReplayChannel* dev = &canReplay[ch];
+	CanCaptureHeader header;
+	FILE* fp;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+	{
+		printf("<< CAN: cannot open capture %s\n", path);
+		return -1;
+	}
+	if (!readHeader(fp, &header))
+	{
+		printf("<< CAN: %s is not a capture of this version\n", path);
+		fclose(fp);
+		return -1;
+	}
+
+	if (dev->fp)
+		fclose(dev->fp);
+	if (!dev->lockReady)
+	{
+		LOCK_INIT(&dev->lock);
+		dev->lockReady = true;
+	}
+	dev->fp = fp;
+	dev->opened = false;
+	dev->realtime = realtime;
+	dev->hasNext = false;
+	dev->txWaitStart = 0.0;
+	dev->sentCount = 0;
+	dev->noteHead = 0;
+	dev->noteTail = 0;
+	memset(&dev->stats, 0, sizeof(dev->stats));
+	dev->done = false;
+
+	// count the received frames, so the end of the replay is known before the host closes
+	dev->rxTotal = 0;
+	while (readRecord(dev))
+	{
+		if (dev->next.kind == CAN_CAPTURE_RX)
+			dev->rxTotal++;
+	}
+	fseek(fp, sizeof(header), SEEK_SET);
+	dev->hasNext = false;
+
+	// the clock starts at the first record
+	dev->first = 0.0;
+	if (readRecord(dev))
+		dev->first = dev->next.time;
+	dev->now = dev->first;
+	dev->clock.Write(dev->first);
+	dev->realBase = GetHighResTime();
+	return 0;
+}
+
+int can_replay_channel(const char* path)
+{
+	CanCaptureHeader header;
+	FILE* fp;
+	bool ok;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return -1;
+	ok = readHeader(fp, &header);
+	fclose(fp);
+	return (ok && header.ch >= 0 && header.ch < MAX_BUS ? header.ch : -1);
+}
+
+int can_replay_note(int ch, unsigned int* tag, void* data, int maxSize, int timeout_msec)
+{
+	assert(ch >= 0 && ch < MAX_BUS);
+
+	ReplayChannel* dev = &canReplay[ch];
+	double end = GetHighResTime() + timeout_msec*1e-3;
+	unsigned int tail;
+	int size;
+
+	for (;;)
+	{
+		tail = dev->noteTail;
+		if (dev->noteHead != tail)
+		{
+			SEQLOCK_BARRIER();
+			const ReplayNote* note = &dev->notes[tail & (NOTE_QUEUE-1)];
+			*tag = note->tag;
+			size = (note->size < maxSize ? note->size : maxSize);
+			memcpy(data, note->data, size);
+			SEQLOCK_BARRIER();
+			dev->noteTail = tail + 1;
+			dev->stats.notes++;
+			return size;
+		}
+		if (dev->done || GetHighResTime() >= end)
+			return 0;
+		YIELD();
+	}
+}
+
+void can_replay_stats(int ch, CanReplayStats* stats)
+{
+	assert(ch >= 0 && ch < MAX_BUS);
+
+	ReplayChannel* dev = &canReplay[ch];
+
+	*stats = dev->stats;
+	stats->done = (dev->done || stats->rxFrames >= dev->rxTotal);
+}
+
+
+
+CANAPI_END
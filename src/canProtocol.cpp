@@ -0,0 +1,408 @@
+/*======================*/
+/*       Includes       */
+/*======================*/
+//system headers
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <strings.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
+#include <assert.h>
+//project headers
+#include "canDef.h"
+#include "canAPI.h"
+#include "canTransport.h"
+#include "canCodec.h"
+#include "canCapture.h"
+
+
+CANAPI_BEGIN
+
+/*=====================*/
+/*       Defines       */
+/*=====================*/
+//macros
+#ifndef _WIN32
+#define Sleep(msec) usleep((msec)*1000)
+#define _stricmp strcasecmp
+#endif
+//typedefs & structs
+typedef struct tagCanChannel
+{
+	const CanTransport* transport; // NULL while the channel is closed
+
+	// frames fetched by the last recv_batch() call, handed out one at a time by get_message_wait().
+	int rxCount;
+	int rxNext;
+	can_msg rxMsg[RX_QUEUE_SIZE];
+	double rxTime[RX_QUEUE_SIZE];
+} CanChannel;
+
+/*=========================================*/
+/*       Global file-scope variables       */
+/*=========================================*/
+
+// every backend compiled into this binary, the first one is the default
+static const CanTransport* const canTransports[] = {
+#ifdef PEAKCAN
+	&canTransportPeak,
+#endif
+#ifdef IXXATCAN
+	&canTransportIXXAT,
+#endif
+#ifdef ESDCAN
+	&canTransportESD,
+#endif
+#ifdef KVASERCAN
+	&canTransportKvaser,
+#endif
+#ifdef NICAN
+	&canTransportNI,
+#endif
+#ifdef SOFTINGCAN
+	&canTransportSofting,
+#endif
+#ifdef EASYSYNCCAN
+	&canTransportEasySYNC,
+#endif
+#ifdef SOCKETCAN
+	&canTransportSocketCAN,
+#endif
+#ifdef LOOPBACKCAN
+	&canTransportLoopback,
+#endif
+	&canTransportReplay,
+	NULL
+};
+
+static CanChannel canChannel[MAX_BUS];
+
+/*==========================================*/
+/*       Private functions                  */
+/*==========================================*/
+static void setTorqueFrame(can_msg* msg, int findex, const short* pwm)
+{
+	can_frame_init(msg, CAN_HOST_ID(ID_CMD_SET_TORQUE_1 + findex), 8);
+	can_pack_pwm(msg->data, pwm);
+}
+
+static int sendCommand(int ch, int cmd, const unsigned char* data, int len)
+{
+	can_msg msg;
+
+	can_frame_init(&msg, CAN_HOST_ID(cmd), len);
+	if (len > 0)
+		memcpy(msg.data, data, len);
+	return can_send_batch(ch, &msg, 1);
+}
+
+// Gives the firmware msec to take a command in. A simulated or replayed bus has
+// its own clock, moved on by the thread receiving from it, and the time passes
+// on that one. It stands still while nothing is scheduled on the bus, so a clock
+// that no longer moves ends the wait once msec of host time has passed.
+static void commandDelay(int ch, int msec)
+{
+	const CanTransport* transport = canChannel[ch].transport;
+	double last, now, end;
+	int slept;
+
+	if (!transport || !transport->time)
+	{
+		Sleep(msec);
+		return;
+	}
+
+	last = transport->time(ch);
+	end = last + msec*1e-3;
+	for (slept = 1; ; slept++)
+	{
+		Sleep(1);
+		now = transport->time(ch);
+		if (now >= end - 1e-9 || (slept >= msec && now == last))
+			return;
+		last = now;
+	}
+}
+
+/*========================================*/
+/*       Transport registry               */
+/*========================================*/
+int can_transport_count()
+{
+	return (int)(sizeof(canTransports)/sizeof(canTransports[0])) - 1;
+}
+
+const CanTransport* can_transport_get(int i)
+{
+	if (i < 0 || i >= can_transport_count())
+		return NULL;
+	return canTransports[i];
+}
+
+const CanTransport* can_transport_find(const char* name)
+{
+	for (int i = 0; canTransports[i]; i++)
+	{
+		if (_stricmp(canTransports[i]->name, name) == 0)
+			return canTransports[i];
+	}
+	return NULL;
+}
+
+const CanTransport* can_channel_transport(int ch)
+{
+	assert(ch >= 0 && ch < MAX_BUS);
+
+	return canChannel[ch].transport;
+}
+
+double can_bus_time(int ch)
+{
+	assert(ch >= 0 && ch < MAX_BUS);
+
+	const CanTransport* transport = canChannel[ch].transport;
+	if (!transport || !transport->time)
+		return CAN_TIMESTAMP_NONE;
+	return transport->time(ch);
+}
+
+/*========================================*/
+/*       CAN API                          */
+/*========================================*/
+int command_can_open_transport(int ch, const CanTransport* transport, int type, int index)
+{
+	assert(ch >= 0 && ch < MAX_BUS);
+
+	CanChannel* c = &canChannel[ch];
+	int ret;
+
+	if (!transport)
+	{
+		printf("<< CAN: no CAN driver is compiled in\n");
+		return -1;
+	}
+
+	ret = transport->open(ch, type, index);
+	if (ret != 0)
+		return ret;
+	c->rxCount = 0;
+	c->rxNext = 0;
+	c->transport = transport;
+
+	return 0;
+}
+
+int command_can_open(int ch)
+{
+	return command_can_open_transport(ch, can_transport_get(0), CAN_OPEN_DEFAULT, 0);
+}
+
+int command_can_open_ex(int ch, int type, int index)
+{
+	return command_can_open_transport(ch, can_transport_get(0), type, index);
+}
+
+int command_can_reset(int ch)
+{
+	assert(ch >= 0 && ch < MAX_BUS);
+
+	const CanTransport* transport = canChannel[ch].transport;
+	if (!transport || !transport->reset)
+		return -1;
+	return transport->reset(ch);
+}
+
+int command_can_close(int ch)
+{
+	assert(ch >= 0 && ch < MAX_BUS);
+
+	CanChannel* c = &canChannel[ch];
+	int ret;
+
+	if (!c->transport)
+		return 0;
+	can_capture_close(ch);
+	ret = c->transport->close(ch);
+	c->transport = NULL;
+	c->rxCount = 0;
+	c->rxNext = 0;
+
+	return ret;
+}
+
+int command_can_query_id(int ch)
+{
+	return sendCommand(ch, ID_CMD_QUERY_ID, NULL, 0);
+}
+
+int command_can_sys_init(int ch, int period_msec)
+{
+	unsigned char data[1];
+	int ret;
+
+	data[0] = (unsigned char)period_msec;
+	ret = sendCommand(ch, ID_CMD_SET_PERIOD, data, 1);
+	if (ret != 0) return ret;
+
+	commandDelay(ch, 10);
+
+	ret = sendCommand(ch, ID_CMD_SET_MODE_TASK, NULL, 0);
+	if (ret != 0) return ret;
+
+	commandDelay(ch, 10);
+
+	return sendCommand(ch, ID_CMD_QUERY_STATE_DATA, NULL, 0);
+}
+
+int command_can_start(int ch)
+{
+	int ret;
+
+	ret = sendCommand(ch, ID_CMD_QUERY_STATE_DATA, NULL, 0);
+	if (ret != 0) return ret;
+
+	commandDelay(ch, 10);
+
+	return sendCommand(ch, ID_CMD_SET_SYSTEM_ON, NULL, 0);
+}
+
+int command_can_stop(int ch)
+{
+	return sendCommand(ch, ID_CMD_SET_SYSTEM_OFF, NULL, 0);
+}
+
+int command_can_AHRS_set(int ch, unsigned char rate, unsigned char mask)
+{
+	unsigned char data[2];
+
+	data[0] = rate;
+	data[1] = mask;
+	return sendCommand(ch, ID_CMD_AHRS_SET, data, 2);
+}
+
+int write_current(int ch, int findex, short* pwm)
+{
+	can_msg msg;
+
+	if (findex < 0 || findex >= 4)
+		return -1;
+
+	setTorqueFrame(&msg, findex, pwm);
+	return can_send_batch(ch, &msg, 1);
+}
+
+int write_current_all(int ch, const short* pwm)
+{
+	can_msg msg[4];
+	int findex;
+
+	for (findex = 0; findex < 4; findex++)
+		setTorqueFrame(&msg[findex], findex, &pwm[4*findex]);
+
+	return can_send_batch(ch, msg, 4);
+}
+
+int can_send_batch(int ch, const can_msg* msg, int count)
+{
+	assert(ch >= 0 && ch < MAX_BUS);
+	assert(count <= TX_QUEUE_SIZE);
+
+	const CanTransport* transport = canChannel[ch].transport;
+	int ret;
+
+	if (!transport)
+		return -1;
+	ret = transport->send_batch(ch, msg, count);
+	if (ret == 0)
+		can_capture_frames(ch, CAN_CAPTURE_TX, msg, NULL, count);
+	return ret;
+}
+
+int can_wait_tx(int ch, int timeout_msec)
+{
+	assert(ch >= 0 && ch < MAX_BUS);
+
+	const CanTransport* transport = canChannel[ch].transport;
+	if (!transport || !transport->wait_tx)
+		return -1;
+	return transport->wait_tx(ch, timeout_msec);
+}
+
+int get_message(int ch, char* cmd, char* src, char* des, int* len, unsigned char* data, int blocking)
+{
+	return get_message_wait(ch, cmd, src, des, len, data, (blocking ? CAN_WAIT_INFINITE : 0), NULL);
+}
+
+// Next received frame of the channel; only an empty queue calls the driver.
+// 0: *msg and *timestamp set, 1: no frame within timeout_msec, <0: driver error
+static int nextFrame(int ch, int timeout_msec, const can_msg** msg, double* timestamp)
+{
+	assert(ch >= 0 && ch < MAX_BUS);
+
+	CanChannel* c = &canChannel[ch];
+	int ret;
+
+	if (!c->transport)
+		return -1;
+
+	if (c->rxNext >= c->rxCount)
+	{
+		// one driver call takes every frame already queued; only an empty queue sleeps.
+		ret = c->transport->recv_batch(ch, c->rxMsg, c->rxTime, RX_QUEUE_SIZE);
+		if (ret == 0 && timeout_msec != 0)
+		{
+			ret = c->transport->wait(ch, timeout_msec);
+			if (ret == 0)
+				ret = c->transport->recv_batch(ch, c->rxMsg, c->rxTime, RX_QUEUE_SIZE);
+			else if (ret > 0)
+				return 1; // timed out
+		}
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			return 1; // no message received
+		can_capture_frames(ch, CAN_CAPTURE_RX, c->rxMsg, c->rxTime, ret);
+		c->rxCount = ret;
+		c->rxNext = 0;
+	}
+
+	*msg = &c->rxMsg[c->rxNext];
+	if (timestamp)
+		*timestamp = c->rxTime[c->rxNext];
+	c->rxNext++;
+
+	return 0;
+}
+
+int get_message_wait(int ch, char* cmd, char* src, char* des, int* len, unsigned char* data, int timeout_msec, double* timestamp)
+{
+	const can_msg* msg;
+	int ret = nextFrame(ch, timeout_msec, &msg, timestamp);
+
+	if (ret != 0)
+		return ret;
+	*cmd = (char)can_id_cmd(msg->msg_id);
+	*des = (char)can_id_des(msg->msg_id);
+	*src = (char)can_id_src(msg->msg_id);
+	*len = msg->data_length;
+	memcpy(data, msg->data, msg->data_length);
+	return 0;
+}
+
+int get_frame_wait(int ch, CanFrameInfo* frame, int timeout_msec, double* timestamp)
+{
+	const can_msg* msg;
+	int ret = nextFrame(ch, timeout_msec, &msg, timestamp);
+
+	if (ret != 0)
+		return ret;
+	can_decode(msg, frame);
+	return 0;
+}
+
+
+
+CANAPI_END
@@ -5,11 +5,71 @@
 
 #pragma once
 
+#ifdef _WIN32
+
 #include "targetver.h"
 
 #include <stdio.h>
 #include <tchar.h>
 
+#else // Linux (SocketCAN)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <termios.h>
+#include <sys/select.h>
+
+// Minimal subset of the Win32/CRT console API used by the application.
+typedef char TCHAR;
+typedef char _TCHAR;
+#define _T(x)			x
+#define _tcsicmp		strcasecmp
+#define _tstof			atof
+#define _tstoi			atoi
+#define _tmain			main
+#define MAX_PATH		PATH_MAX
+#define Sleep(msec)		usleep((msec)*1000)
+
+inline int _kbhit()
+{
+	struct termios oldt, newt;
+	struct timeval tv = {0, 0};
+	fd_set fds;
+	int ret;
+
+	tcgetattr(STDIN_FILENO, &oldt);
+	newt = oldt;
+	newt.c_lflag &= ~(ICANON | ECHO);
+	tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+	FD_ZERO(&fds);
+	FD_SET(STDIN_FILENO, &fds);
+	ret = select(STDIN_FILENO+1, &fds, NULL, NULL, &tv);
+	tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+	return (ret > 0);
+}
+
+inline int _getch()
+{
+	struct termios oldt, newt;
+	int c;
+
+	tcgetattr(STDIN_FILENO, &oldt);
+	newt = oldt;
+	newt.c_lflag &= ~(ICANON | ECHO);
+	tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+	c = getchar();
+	tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+	return c;
+}
+
+#endif // _WIN32
+
 
 
 // TODO: reference additional headers your program requires here